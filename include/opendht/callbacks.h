@@ -17,6 +17,7 @@
 namespace dht {
 
 struct Node;
+class StorageBackend;
 
 /**
  * Current status of a DHT node.
@@ -40,6 +41,8 @@ struct OPENDHT_PUBLIC NodeStats
     unsigned table_depth {0};
     unsigned searches {0};
     unsigned node_cache_size {0};
+    /** Percentiles of the round trip time of nodes in the routing table, in microseconds */
+    unsigned rtt_p50 {0}, rtt_p90 {0}, rtt_p99 {0};
     unsigned getKnownNodes() const { return good_nodes + dubious_nodes; }
     unsigned long getNetworkSizeEstimation() const { return 8 * std::exp2(table_depth); }
     std::string toString() const;
@@ -53,7 +56,16 @@ struct OPENDHT_PUBLIC NodeStats
     explicit NodeStats(const Json::Value& v);
 #endif
 
-    MSGPACK_DEFINE_MAP(good_nodes, dubious_nodes, cached_nodes, incoming_nodes, table_depth, searches, node_cache_size)
+    MSGPACK_DEFINE_MAP(good_nodes,
+                       dubious_nodes,
+                       cached_nodes,
+                       incoming_nodes,
+                       table_depth,
+                       searches,
+                       node_cache_size,
+                       rtt_p50,
+                       rtt_p90,
+                       rtt_p99)
 };
 
 struct OPENDHT_PUBLIC NodeInfo
@@ -69,6 +81,27 @@ struct OPENDHT_PUBLIC NodeInfo
     size_t local_storage_size {0};
     in_port_t bound4 {0};
     in_port_t bound6 {0};
+    /** Received packets waiting to be processed */
+    size_t rx_queue_depth {0};
+    /** Highest number of packets waiting to be processed */
+    size_t rx_queue_max {0};
+    /** Received packets dropped because the queue was full or they waited too long */
+    uint64_t rx_queue_dropped {0};
+    /** Process-wide hits and misses of the packed value cache */
+    uint64_t packed_cache_hits {0};
+    uint64_t packed_cache_misses {0};
+    /** Received values waiting to be checked or delivered, with SecureDhtConfig::async_checks */
+    size_t check_queue_depth {0};
+    /** Highest number of values waiting to be checked or delivered */
+    size_t check_queue_max {0};
+    /** Values checked before being delivered, with SecureDhtConfig::async_checks */
+    uint64_t checked_values {0};
+    /** Mean and highest delay between receiving and delivering checked values, in microseconds */
+    uint64_t check_latency_mean {0};
+    uint64_t check_latency_max {0};
+    /** Process-wide hits and misses of the signature cache */
+    uint64_t signature_cache_hits {0};
+    uint64_t signature_cache_misses {0};
 
 #ifdef OPENDHT_JSONCPP
     /**
@@ -89,7 +122,19 @@ struct OPENDHT_PUBLIC NodeInfo
                        local_storage_values,
                        local_storage_size,
                        bound4,
-                       bound6)
+                       bound6,
+                       rx_queue_depth,
+                       rx_queue_max,
+                       rx_queue_dropped,
+                       packed_cache_hits,
+                       packed_cache_misses,
+                       check_queue_depth,
+                       check_queue_max,
+                       checked_values,
+                       check_latency_mean,
+                       check_latency_max,
+                       signature_cache_hits,
+                       signature_cache_misses)
 };
 
 /**
@@ -116,6 +161,18 @@ struct OPENDHT_PUBLIC Config
     /** If set, the dht will load its state from this file on start and save its state in this file on shutdown */
     std::string persist_path {};
 
+    /**
+     * If non-0 with persist_path, the state is also saved periodically: changes
+     * are appended to the state file between full snapshots.
+     */
+    std::chrono::seconds persist_period {0};
+
+    /**
+     * If set, stored values are recorded in this backend and loaded from it on start.
+     * Values are still held in memory: the storage is bounded by max_store_size.
+     */
+    std::shared_ptr<StorageBackend> storage_backend {};
+
     /** If non-0, overrides the default global rate-limit. -1 means no limit. */
     ssize_t max_req_per_sec {0};
 
@@ -143,6 +200,19 @@ struct OPENDHT_PUBLIC Config
 
     /* Client mode, node will not be used by other nodes to store data. */
     bool client_mode {false};
+
+    /**
+     * If greater than 1, batches of received packets are decoded by up to
+     * this many threads (the DHT thread and threads of the computation pool).
+     * Packets are still processed in order by the DHT thread.
+     */
+    unsigned decode_threads {1};
+
+    /**
+     * Set by DhtRunner on the cores of a sharded node (1 for the first one),
+     * to tag transaction ids with the core that sent the request.
+     */
+    unsigned shard {0};
 };
 
 /**
@@ -158,6 +228,24 @@ struct OPENDHT_PUBLIC SecureDhtConfig
      * for use by the certificate store, putEncrypted and putSigned
      */
     bool cert_cache_all {false};
+
+    /** Maximum number of certificates and public keys of other nodes kept in cache */
+    size_t key_cache_size {4096};
+
+    /**
+     * Check signatures and decrypt received values in batches on the
+     * computation thread pool, instead of the thread of the node.
+     * Values are delivered to callbacks in the order they were received,
+     * by periodic(). A callback returning false stops the operation after
+     * values already received are checked.
+     */
+    bool async_checks {false};
+
+    /**
+     * Maximum number of values checked at once on the thread pool.
+     * Values waiting beyond this number are checked on the thread of the node.
+     */
+    size_t max_pending_checks {1024};
 };
 
 enum class OPENDHT_PUBLIC PushNotificationResult : uint8_t {
@@ -183,6 +271,7 @@ using QueryCallback = std::function<bool(const std::vector<std::shared_ptr<Field
 using GetCallback = std::function<bool(const std::vector<std::shared_ptr<Value>>& values)>;
 using ValueCallback = std::function<bool(const std::vector<std::shared_ptr<Value>>& values, bool expired)>;
 using GetCallbackSimple = std::function<bool(std::shared_ptr<Value> value)>;
+using GetManyCallback = std::function<bool(const InfoHash& key, const std::vector<std::shared_ptr<Value>>& values)>;
 using ShutdownCallback = std::function<void()>;
 using IdentityAnnouncedCb = std::function<void(bool)>;
 using PublicAddressChangedCb = std::function<void(std::vector<SockAddr>)>;
@@ -208,6 +297,12 @@ OPENDHT_PUBLIC ShutdownCallback bindShutdownCb(ShutdownCallbackRaw shutdown_cb_r
 OPENDHT_PUBLIC DoneCallback bindDoneCb(DoneCallbackSimple donecb);
 OPENDHT_PUBLIC DoneCallback bindDoneCb(DoneCallbackRaw raw_cb, void* user_data);
 OPENDHT_PUBLIC DoneCallbackSimple bindDoneCbSimple(DoneCallbackSimpleRaw raw_cb, void* user_data);
+/**
+ * Returns a done callback to be called count times (count > 0), that calls
+ * donecb once, after the last call: successful if every call was, with the
+ * nodes given by all calls.
+ */
+OPENDHT_PUBLIC DoneCallback aggregateDoneCb(size_t count, DoneCallback donecb);
 OPENDHT_PUBLIC Value::Filter bindFilterRaw(FilterRaw raw_filter, void* user_data);
 
 } // namespace dht
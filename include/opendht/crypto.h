@@ -112,6 +112,12 @@ struct OPENDHT_PUBLIC PublicKey
         return checkSignature(data.data(), data.size(), signature.data(), signature.size());
     }
 
+    /**
+     * Encrypt data that only the private key can decrypt.
+     * For RSA keys, data is encrypted with RSA, or with AES-GCM and an RSA
+     * encrypted key. For Ed25519 keys, data is sealed with AES-GCM and an
+     * ephemeral X25519 key exchange, much faster to decrypt.
+     */
     Blob encrypt(const uint8_t* data, size_t data_len) const;
     inline Blob encrypt(const Blob& data) const { return encrypt(data.data(), data.size()); }
     inline Blob encrypt(std::string_view data) const { return encrypt((const uint8_t*) data.data(), data.size()); }
@@ -132,6 +138,8 @@ struct OPENDHT_PUBLIC PublicKey
 
     void msgpack_unpack(const msgpack::object& o);
 
+    /** Algorithm of the key, that also selects the algorithm of signatures */
+    gnutls_pk_algorithm_t getAlgorithm() const;
     gnutls_digest_algorithm_t getPreferredDigest() const;
 
     gnutls_pubkey_t pk {nullptr};
@@ -189,7 +197,8 @@ struct OPENDHT_PUBLIC PrivateKey
     inline Blob sign(const Blob& dat) const { return sign(dat.data(), dat.size()); }
 
     /**
-     * Try to decrypt the provided cypher text.
+     * Try to decrypt the provided cypher text, using the format of
+     * PublicKey::encrypt for the type of the key.
      * In case of failure a CryptoException is thrown.
      * @returns the decrypted data.
      */
@@ -205,6 +214,11 @@ struct OPENDHT_PUBLIC PrivateKey
      */
     static PrivateKey generate(unsigned key_length = 4096, gnutls_pk_algorithm_t algo = GNUTLS_PK_RSA);
     static PrivateKey generateEC();
+    /**
+     * Generate a new Ed25519 key pair, for fast signatures of 64 bytes
+     * and fast decryption.
+     */
+    static PrivateKey generateEd25519();
 
     gnutls_privkey_t key {};
     gnutls_x509_privkey_t x509_key {};
@@ -736,6 +750,14 @@ OPENDHT_PUBLIC Identity generateIdentity(const std::string& name = "dhtnode",
 OPENDHT_PUBLIC Identity generateEcIdentity(const std::string& name, const Identity& ca, bool is_ca);
 OPENDHT_PUBLIC Identity generateEcIdentity(const std::string& name = "dhtnode", const Identity& ca = {});
 
+/**
+ * Generate an Ed25519 key pair and a certificate.
+ * Values signed by or encrypted to Ed25519 identities are smaller and much
+ * faster to process than with RSA.
+ */
+OPENDHT_PUBLIC Identity generateEd25519Identity(const std::string& name, const Identity& ca, bool is_ca);
+OPENDHT_PUBLIC Identity generateEd25519Identity(const std::string& name = "dhtnode", const Identity& ca = {});
+
 OPENDHT_PUBLIC void saveIdentity(const Identity& id, const std::string& path, const std::string& privkey_password = {});
 OPENDHT_PUBLIC Identity loadIdentity(const std::string& path, const std::string& privkey_password = {});
 
@@ -751,6 +773,48 @@ OPENDHT_PUBLIC Blob hash(const Blob& data, size_t hash_length = 512 / 8);
 
 OPENDHT_PUBLIC void hash(const uint8_t* data, size_t data_length, uint8_t* hash, size_t hash_length);
 
+struct CacheStats
+{
+    uint64_t hits {0};
+    uint64_t misses {0};
+    size_t size {0};
+};
+
+/** Default number of entries of the signature cache */
+constexpr size_t SIGNATURE_CACHE_SIZE {8192};
+/** Number of independently locked shards of the signature cache */
+constexpr size_t SIGNATURE_CACHE_SHARDS {16};
+/** Default number of entries of the public key cache */
+constexpr size_t PUBLIC_KEY_CACHE_SIZE {1024};
+
+/**
+ * Valid signatures checked by PublicKey::checkSignature are remembered in a
+ * process-wide LRU cache, keyed by a SHA-256 of the public key ID, the
+ * signature and the signed data. Checking the same content again, even from
+ * other Value or PublicKey instances, doesn't verify the signature again.
+ * Invalid signatures are never cached.
+ *
+ * The cache is split in SIGNATURE_CACHE_SHARDS shards selected by key, each
+ * with its own lock and an even part of the size, rounded up.
+ *
+ * Set the maximum number of entries of the cache, 0 disables it.
+ */
+OPENDHT_PUBLIC void setSignatureCacheSize(size_t size);
+OPENDHT_PUBLIC CacheStats getSignatureCacheStats();
+
+/**
+ * Public key imported from serialized data (PEM or DER).
+ * Keys are shared with previous imports of the same data, from a
+ * process-wide LRU cache: they must not be modified.
+ * Throws CryptoException if the data is not a valid key.
+ */
+OPENDHT_PUBLIC std::shared_ptr<PublicKey> importPublicKey(const uint8_t* data, size_t size);
+OPENDHT_PUBLIC std::shared_ptr<PublicKey> importPublicKey(const msgpack::object& o);
+
+/** Set the maximum number of entries of the public key cache, 0 disables it. */
+OPENDHT_PUBLIC void setPublicKeyCacheSize(size_t size);
+OPENDHT_PUBLIC CacheStats getPublicKeyCacheStats();
+
 /**
  * Generates an encryption key from a text password,
  * making the key longer to bruteforce.
@@ -10,13 +10,17 @@
 #include "routing_table.h"
 #include "callbacks.h"
 #include "dht_interface.h"
+#include "storage_backend.h"
 
 #include <string>
 #include <array>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
+#include <future>
 #include <memory>
+#include <unordered_set>
 
 #ifdef _WIN32
 #include <iso646.h>
@@ -112,6 +116,7 @@ public:
     {
         return periodic(buf, buflen, SockAddr(from, fromlen), now);
     }
+    time_point periodic(const std::vector<net::ReceivedPacket>& packets, const time_point& now) override;
 
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
@@ -277,7 +282,15 @@ public:
     std::vector<ValuesExport> exportValues() const override;
     void importValues(const std::vector<ValuesExport>&) override;
 
+    /**
+     * Save the routing state and stored values, writing the values of one key
+     * at a time.
+     */
     void saveState(const std::string& path) const;
+    /**
+     * Load the routing state, then import stored values progressively from
+     * the scheduler, so that the node serves requests in the meantime.
+     */
     void loadState(const std::string& path);
 
     NodeStats getNodesStats(sa_family_t af) const override;
@@ -318,6 +331,18 @@ public:
 
     std::pair<size_t, size_t> getLocalStoreSize() const override;
 
+    struct ReplyCacheStats
+    {
+        size_t hits {0};
+        size_t misses {0};
+        size_t entries {0};
+    };
+    /**
+     * Returns the number of 'get' requests answered with a cached encoded
+     * reply, the number of replies encoded, and the number of cached replies.
+     */
+    ReplyCacheStats getReplyCacheStats() const { return {reply_cache_hits, reply_cache_misses, reply_cache_size}; }
+
     std::vector<SockAddr> getPublicAddress(sa_family_t family = 0) override;
 
     PushNotificationResult pushNotificationReceived(const std::map<std::string, std::string>&) override
@@ -367,8 +392,21 @@ private:
 
     static constexpr std::chrono::seconds BOOTSTRAP_PERIOD {10};
 
+    /* Values expiring in the same slice of time are expired together */
+    static constexpr std::chrono::seconds EXPIRATION_SLICE {1};
+
     static constexpr size_t TOKEN_SIZE {32};
 
+    /* Periodic saves of the state append changes, up to this many times between full snapshots */
+    static constexpr unsigned MAX_STATE_DELTAS {16};
+    /* State records imported at once while loading the state */
+    static constexpr size_t STATE_IMPORT_BATCH {256};
+
+    /* Encoded replies to 'get' requests are reused for this long, unless the storage or routing table changes */
+    static constexpr duration REPLY_CACHE_TTL {std::chrono::seconds(1)};
+    static constexpr size_t REPLY_CACHE_MAX {1024};
+    static constexpr size_t REPLY_CACHE_MAX_PER_KEY {4};
+
     // internal structures
     struct SearchNode;
     struct Get;
@@ -413,14 +451,23 @@ private:
     Sp<Scheduler::Job> bootstrapJob {};
     bool bootstrap_pending {false};
 
-    std::map<InfoHash, Storage> store;
-    std::map<SockAddr, StorageBucket, SockAddr::ipCmp> store_quota;
+    /* node based: values and quota buckets keep pointers to keys and buckets */
+    std::unordered_map<InfoHash, Storage> store;
+    std::unordered_map<SockAddr, StorageBucket, SockAddr::ipHash, SockAddr::ipEqual> store_quota;
     std::unique_ptr<StorageBucket> local_store_quota;
     size_t total_values {0};
     size_t total_store_size {0};
     size_t max_store_keys {MAX_HASHES};
     size_t max_store_size {STORAGE_LIMIT_DEFAULT};
     size_t max_local_store_size {STORAGE_LIMIT_UNLIMITED};
+    /* Keys of storages with values expiring in each slice, by end of slice */
+    std::map<time_point, std::vector<InfoHash>> storage_expirations;
+    /* Persistent copy of the store */
+    std::shared_ptr<StorageBackend> storage_backend;
+    bool loading_storage {false};
+    /* Maintenance of the backend running in the background, and changes recorded after it */
+    std::future<void> storage_task {};
+    std::vector<std::function<void(StorageBackend&)>> storage_pending {};
 
     size_t max_searches {MAX_SEARCHES};
     size_t search_id {0};
@@ -438,6 +485,32 @@ private:
     net::NetworkEngine network_engine;
 
     std::string persistPath;
+    duration persist_period {};
+    Sp<Scheduler::Job> persist_job {};
+    /* Changes since the last periodic save */
+    std::unordered_set<InfoHash> persist_changed {};
+    std::unordered_map<InfoHash, std::vector<Value::Id>> persist_removed {};
+    unsigned persist_deltas {MAX_STATE_DELTAS};
+    /* Periodic save written in the background */
+    std::future<void> persist_task {};
+    struct StateLoader;
+    std::shared_ptr<StateLoader> state_loader {};
+    bool importing_state {false};
+
+    /* Encoded replies to recent 'get' requests, by key */
+    struct CachedReply
+    {
+        sa_family_t af;
+        want_t want;
+        Blob query;
+        time_point time;
+        Sp<const net::EncodedReply> reply;
+    };
+    std::unordered_map<InfoHash, std::vector<CachedReply>> reply_cache {};
+    size_t reply_cache_size {0};
+    size_t reply_cache_hits {0};
+    size_t reply_cache_misses {0};
+    time_point reply_cache_sweep {time_point::min()};
 
     // are we a bootstrap node ?
     // note: Any running node can be used as a bootstrap node.
@@ -471,6 +544,50 @@ private:
     void expireStore();
     void expireStorage(InfoHash h);
     void expireStore(decltype(store)::iterator);
+    void scheduleStorageExpiration(const InfoHash& id, time_point expiration);
+    void expireStorageSlice(time_point slice);
+    void loadStorageBackend();
+    bool storageRemove(const InfoHash& id, Storage& st, Value::Id vid);
+
+    // State persistence
+    struct ImportStats
+    {
+        unsigned imported {0};
+        unsigned ignored {0};
+        size_t size {0};
+    };
+    void importValues(const InfoHash& key, const msgpack::object& values, ImportStats& stats);
+    /** Import a batch of records of the state being loaded, scheduling the next one */
+    void importState();
+    /** Import up to max_records records of the state being loaded. Returns true if some remain. */
+    bool importStateRecords(size_t max_records);
+    void importStateRecord(const msgpack::object& record, ImportStats& stats);
+    /** Record a live change of a value while the state is imported, making its records stale */
+    void stateValueChanged(const InfoHash& key, Value::Id vid);
+    bool isStateRecordStale(const InfoHash& key, Value::Id vid) const;
+    void finishStateImport();
+    void persistState();
+    bool persistingState() const
+    {
+        return persist_period > duration::zero() and not persistPath.empty() and not importing_state;
+    }
+    /** Record the removal of a value, for the state and the storage backend */
+    void persistRemoval(const InfoHash& id, Value::Id vid);
+    /**
+     * Record a change in the storage backend, if any.
+     * Queued while the backend is maintained in the background: op must not capture references.
+     */
+    void persistStorage(std::function<void(StorageBackend&)>&& op);
+    void applyStorage(const std::function<void(StorageBackend&)>& op);
+    /**
+     * Apply the changes queued during maintenance, if it is over or if wait is true.
+     * Returns false if the maintenance is still running.
+     */
+    bool flushStorage(bool wait);
+    /** Reclaim space and sync the backend from an I/O thread */
+    void maintainStorage();
+    /** Apply the queued changes once the maintenance is over */
+    void pollStorage();
 
     void storageRemoved(const InfoHash& id, Storage& st, const std::vector<Sp<Value>>& values, size_t totalSize);
     void storageChanged(const InfoHash& id, Storage& st, const Sp<Value>&, bool newValue);
@@ -501,6 +618,11 @@ private:
     }
 
     void expireBuckets(RoutingTable&);
+
+    /* Cache of encoded replies to 'get' requests */
+    void cacheReply(const InfoHash& id, CachedReply&& reply);
+    void invalidateReplies(const InfoHash& id);
+    void clearReplyCache();
     void sendCachedPing(Bucket& b);
     bool bucketMaintenance(RoutingTable&);
     void dumpBucket(const Bucket& b, std::ostream& out) const;
@@ -5,7 +5,9 @@
 #include "infohash.h"
 #include "logger.h"
 #include "node_export.h"
+#include "network_utils.h"
 
+#include <algorithm>
 #include <queue>
 
 namespace dht {
@@ -81,6 +83,19 @@ public:
     virtual time_point periodic(
         const uint8_t* buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now)
         = 0;
+    /**
+     * Process a batch of received packets, that implementations may decode
+     * in parallel, then run the jobs due by now.
+     */
+    virtual time_point periodic(const std::vector<net::ReceivedPacket>& packets, const time_point& now)
+    {
+        if (packets.empty())
+            return periodic(nullptr, 0, SockAddr {}, now);
+        time_point next;
+        for (const auto& pkt : packets)
+            next = periodic(pkt.data.data(), pkt.data.size(), pkt.from, now);
+        return next;
+    }
 
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
@@ -159,6 +174,50 @@ public:
                      bool permanent = false)
         = 0;
 
+    /**
+     * Announce several values, with a single done callback called once every
+     * announce completed. It succeeds if every announce did.
+     */
+    virtual void putMany(std::vector<std::pair<InfoHash, Sp<Value>>> values,
+                         DoneCallback cb = {},
+                         time_point created = time_point::max(),
+                         bool permanent = false)
+    {
+        if (values.empty()) {
+            if (cb)
+                cb(true, {});
+            return;
+        }
+        auto done = aggregateDoneCb(values.size(), std::move(cb));
+        for (auto& v : values)
+            put(v.first, std::move(v.second), done, created, permanent);
+    }
+
+    /**
+     * Get values at several keys, with a single done callback called once
+     * every search completed. The get callback returning false stops the
+     * operation at the key of the values.
+     */
+    virtual void getMany(
+        std::vector<InfoHash> keys, GetManyCallback cb, DoneCallback donecb = {}, Value::Filter f = {}, Where w = {})
+    {
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        if (keys.empty()) {
+            if (donecb)
+                donecb(true, {});
+            return;
+        }
+        auto done = aggregateDoneCb(keys.size(), std::move(donecb));
+        auto gcb = std::make_shared<GetManyCallback>(std::move(cb));
+        for (const auto& key : keys)
+            get(key,
+                GetCallback([gcb, key](const std::vector<Sp<Value>>& values) { return (*gcb)(key, values); }),
+                done,
+                Value::Filter(f),
+                Where(w));
+    }
+
     /**
      * Get data currently being put at the given hash.
      */
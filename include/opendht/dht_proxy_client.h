@@ -218,6 +218,7 @@ public:
      */
     PushNotificationResult pushNotificationReceived(const std::map<std::string, std::string>& notification) override;
 
+    using DhtInterface::periodic;
     time_point periodic(const uint8_t*, size_t, SockAddr, const time_point& now) override;
     time_point periodic(
         const uint8_t* buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now) override
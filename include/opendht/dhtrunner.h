@@ -17,6 +17,7 @@
 #include <condition_variable>
 #include <future>
 #include <exception>
+#include <map>
 #include <queue>
 #include <chrono>
 
@@ -24,6 +25,7 @@ namespace dht {
 
 struct Node;
 class SecureDht;
+class ShardedDht;
 class PeerDiscovery;
 struct SecureDhtConfig;
 
@@ -53,6 +55,15 @@ public:
         std::shared_ptr<dht::crypto::Certificate> server_ca;
         dht::crypto::Identity client_identity;
         SockAddr bind4 {}, bind6 {};
+        /** Options for the default UDP socket (ignored if Context::sock is provided) */
+        net::SocketConfig socket_config {};
+        /**
+         * If greater than 1, the node runs this many DHT cores (at most 255),
+         * each on its own thread and responsible for a part of the keyspace.
+         * Storage limits are divided between the cores.
+         * Not supported with a storage backend.
+         */
+        unsigned shards {1};
     };
 
     struct Context
@@ -150,6 +161,32 @@ public:
         return p->get_future();
     }
 
+    /**
+     * Get values at several keys, queued as a single operation of the DHT
+     * thread. donecb is called once, after every search completed.
+     */
+    void getMany(
+        std::vector<InfoHash> keys, GetManyCallback cb, DoneCallback donecb = {}, Value::Filter f = {}, Where w = {});
+    std::future<std::map<InfoHash, std::vector<std::shared_ptr<Value>>>> getMany(std::vector<InfoHash> keys,
+                                                                                 Value::Filter f = {},
+                                                                                 Where w = {})
+    {
+        using Result = std::map<InfoHash, std::vector<std::shared_ptr<Value>>>;
+        auto p = std::make_shared<std::promise<Result>>();
+        auto values = std::make_shared<Result>();
+        getMany(
+            std::move(keys),
+            [=](const InfoHash& key, const std::vector<std::shared_ptr<Value>>& vlist) {
+                auto& v = (*values)[key];
+                v.insert(v.end(), vlist.begin(), vlist.end());
+                return true;
+            },
+            [=](bool, const std::vector<std::shared_ptr<Node>>&) { p->set_value(std::move(*values)); },
+            std::move(f),
+            std::move(w));
+        return p->get_future();
+    }
+
     void query(const InfoHash& hash, QueryCallback cb, DoneCallback done_cb = {}, Query q = {});
     void query(const InfoHash& hash, QueryCallback cb, DoneCallbackSimple done_cb = {}, Query q = {})
     {
@@ -270,6 +307,22 @@ public:
              time_point created = time_point::max(),
              bool permanent = false);
 
+    /**
+     * Announce several values, queued as a single operation of the DHT
+     * thread. cb is called once, after every announce completed.
+     */
+    void putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values,
+                 DoneCallback cb = {},
+                 time_point created = time_point::max(),
+                 bool permanent = false);
+    void putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values,
+                 DoneCallbackSimple cb,
+                 time_point created = time_point::max(),
+                 bool permanent = false)
+    {
+        putMany(std::move(values), bindDoneCb(cb), created, permanent);
+    }
+
     void cancelPut(const InfoHash& h, Value::Id id);
     void cancelPut(const InfoHash& h, const std::shared_ptr<Value>& value);
 
@@ -563,9 +616,12 @@ private:
     void opEnded();
     DoneCallback bindOpDoneCallback(DoneCallback&& cb);
     DoneCallbackSimple bindOpDoneCallback(DoneCallbackSimple&& cb);
+    void getRxStats(NodeInfo& info) const;
 
     /** DHT instance */
     std::unique_ptr<SecureDht> dht_;
+    /** Cores of dht_, if sharded */
+    ShardedDht* sharded_ {nullptr};
 
     /** true if we are currently using a proxy */
     std::atomic_bool use_proxy {false};
@@ -582,9 +638,15 @@ private:
     mutable std::mutex dht_mtx;
     std::thread dht_thread {};
     std::condition_variable cv {};
-    std::mutex sock_mtx;
-    net::PacketList rcv {};
-    decltype(rcv) rcv_free {};
+    /* held by the DHT thread while checking for jobs and waiting on cv */
+    std::mutex wake_mtx;
+    /* true while the DHT thread is waiting on cv */
+    std::atomic_bool parked {false};
+    net::PacketRing rcv {};
+    std::atomic_size_t rcv_max {0};
+    std::atomic<uint64_t> rcv_dropped {0};
+    /* Packets handled by the DHT thread in one batch */
+    std::vector<net::ReceivedPacket> rcv_batch {};
 
     std::queue<std::function<void(SecureDht&)>> pending_ops_prio {};
     std::queue<std::function<void(SecureDht&)>> pending_ops {};
@@ -0,0 +1,244 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace dht {
+
+/**
+ * Hash map with open addressing and linear probing, storing its entries in a
+ * single array. Lookups of small keys touch one or two cache lines and
+ * inserting or erasing doesn't allocate, except when the table grows.
+ *
+ * Unlike std::map and std::unordered_map, inserting may move every entry:
+ * iterators and references are invalidated by insertion, and by erase() for
+ * other entries than the erased one.
+ */
+template<typename Key, typename T, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class FlatHashMap
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>;
+    using size_type = size_t;
+
+private:
+    using Slot = std::optional<value_type>;
+
+    template<typename Slots, typename Value>
+    class Iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = FlatHashMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value*;
+        using reference = Value&;
+
+        Iterator() = default;
+        Iterator(Slots* slots, size_t i)
+            : slots_(slots)
+            , i_(i)
+        {
+            skip();
+        }
+        template<typename S, typename V>
+        Iterator(const Iterator<S, V>& o)
+            : slots_(o.slots_)
+            , i_(o.i_)
+        {}
+
+        reference operator*() const { return *(*slots_)[i_]; }
+        pointer operator->() const { return &*(*slots_)[i_]; }
+        Iterator& operator++()
+        {
+            ++i_;
+            skip();
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            auto ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const Iterator& o) const { return i_ == o.i_; }
+        bool operator!=(const Iterator& o) const { return i_ != o.i_; }
+
+    private:
+        friend class FlatHashMap;
+        template<typename S, typename V>
+        friend class Iterator;
+
+        void skip()
+        {
+            while (i_ < slots_->size() and not(*slots_)[i_])
+                ++i_;
+        }
+
+        Slots* slots_ {nullptr};
+        size_t i_ {0};
+    };
+
+public:
+    using iterator = Iterator<std::vector<Slot>, value_type>;
+    using const_iterator = Iterator<const std::vector<Slot>, const value_type>;
+
+    FlatHashMap() = default;
+    explicit FlatHashMap(size_t capacity) { reserve(capacity); }
+    FlatHashMap(const FlatHashMap&) = default;
+    FlatHashMap& operator=(const FlatHashMap&) = default;
+    FlatHashMap(FlatHashMap&& o) noexcept
+        : slots_(std::move(o.slots_))
+        , size_(std::exchange(o.size_, 0))
+        , bits_(std::exchange(o.bits_, 0))
+    {
+        o.slots_.clear();
+    }
+    FlatHashMap& operator=(FlatHashMap&& o) noexcept
+    {
+        slots_ = std::move(o.slots_);
+        size_ = std::exchange(o.size_, 0);
+        bits_ = std::exchange(o.bits_, 0);
+        o.slots_.clear();
+        return *this;
+    }
+
+    iterator begin() { return {&slots_, 0}; }
+    iterator end() { return {&slots_, slots_.size()}; }
+    const_iterator begin() const { return {&slots_, 0}; }
+    const_iterator end() const { return {&slots_, slots_.size()}; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t capacity() const { return slots_.size(); }
+
+    void clear()
+    {
+        for (auto& s : slots_)
+            s.reset();
+        size_ = 0;
+    }
+
+    /** Make room for n entries without growing */
+    void reserve(size_t n)
+    {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity * MAX_LOAD_NUM < n * MAX_LOAD_DEN)
+            capacity *= 2;
+        if (capacity > slots_.size())
+            rehash(capacity);
+    }
+
+    iterator find(const Key& key) { return {&slots_, findIndex(key)}; }
+    const_iterator find(const Key& key) const { return {&slots_, findIndex(key)}; }
+    size_t count(const Key& key) const { return findIndex(key) != slots_.size(); }
+
+    /** Insert an entry built from args if key is not present */
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> emplace(K&& key, Args&&... args)
+    {
+        if (auto i = findIndex(key); i != slots_.size())
+            return {iterator(&slots_, i), false};
+        if ((size_ + 1) * MAX_LOAD_DEN > slots_.size() * MAX_LOAD_NUM)
+            rehash(std::max(MIN_CAPACITY, slots_.size() * 2));
+        auto i = probe(key);
+        slots_[i].emplace(std::piecewise_construct,
+                          std::forward_as_tuple(std::forward<K>(key)),
+                          std::forward_as_tuple(std::forward<Args>(args)...));
+        size_++;
+        return {iterator(&slots_, i), true};
+    }
+
+    T& operator[](const Key& key) { return emplace(key).first->second; }
+
+    size_t erase(const Key& key)
+    {
+        auto i = findIndex(key);
+        if (i == slots_.size())
+            return 0;
+        eraseIndex(i);
+        return 1;
+    }
+    /** Erase the entry at it. Other entries may move, so this doesn't return an iterator. */
+    void erase(const_iterator it) { eraseIndex(it.i_); }
+
+private:
+    static constexpr size_t MIN_CAPACITY {8};
+    static constexpr size_t MAX_LOAD_NUM {3};
+    static constexpr size_t MAX_LOAD_DEN {4};
+
+    /** Home slot of a key: Fibonacci hashing spreads sequential or low entropy hashes */
+    size_t home(const Key& key) const
+    {
+        uint64_t h = (uint64_t) Hash {}(key) * 0x9E3779B97F4A7C15ull;
+        return (size_t) (h >> (64 - bits_));
+    }
+
+    /** Index of key, or slots_.size() if not found */
+    size_t findIndex(const Key& key) const
+    {
+        if (size_ == 0)
+            return slots_.size();
+        const size_t mask = slots_.size() - 1;
+        for (size_t i = home(key);; i = (i + 1) & mask) {
+            const auto& s = slots_[i];
+            if (not s)
+                return slots_.size();
+            if (KeyEqual {}(s->first, key))
+                return i;
+        }
+    }
+
+    /** First free slot for key, that must not be present */
+    size_t probe(const Key& key) const
+    {
+        const size_t mask = slots_.size() - 1;
+        size_t i = home(key);
+        while (slots_[i])
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    void eraseIndex(size_t i)
+    {
+        const size_t mask = slots_.size() - 1;
+        slots_[i].reset();
+        size_--;
+        // Shift back following entries of the probe sequence, so that lookups never need tombstones
+        for (size_t j = (i + 1) & mask; slots_[j]; j = (j + 1) & mask) {
+            size_t k = home(slots_[j]->first);
+            if (((j - k) & mask) >= ((j - i) & mask)) {
+                slots_[i].emplace(std::move(*slots_[j]));
+                slots_[j].reset();
+                i = j;
+            }
+        }
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<Slot> old(capacity);
+        old.swap(slots_);
+        bits_ = 0;
+        while (((size_t) 1 << bits_) < capacity)
+            bits_++;
+        for (auto& s : old)
+            if (s)
+                slots_[probe(s->first)].emplace(std::move(*s));
+    }
+
+    std::vector<Slot> slots_ {};
+    size_t size_ {0};
+    unsigned bits_ {0};
+};
+
+} // namespace dht
@@ -32,11 +32,108 @@ typedef uint16_t in_port_t;
 
 #include <cstring>
 #include <cstddef>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OPENDHT_HASH_SSE2 1
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace dht {
 
 using byte = uint8_t;
 
+namespace detail {
+
+/** True during constant evaluation, where vector instructions can't be used */
+constexpr bool
+isConstantEvaluated() noexcept
+{
+#if defined(__cpp_lib_is_constant_evaluated)
+    return std::is_constant_evaluated();
+#elif (defined(__clang__) && __clang_major__ >= 9) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 9) \
+    || (defined(_MSC_VER) && _MSC_VER >= 1925)
+    return __builtin_is_constant_evaluated();
+#else
+    return true;
+#endif
+}
+
+/** Index of the lowest set bit of a non-zero value */
+inline unsigned
+lowestBit(uint32_t v)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return i;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+/** Index of the first byte differing between a and b, or n if they are equal */
+inline size_t
+firstDiff(const uint8_t* a, const uint8_t* b, size_t n)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 32 <= n; i += 32) {
+        auto eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i)),
+                                    _mm256_loadu_si256((const __m256i*) (b + i)));
+        if (auto ne = ~(uint32_t) _mm256_movemask_epi8(eq))
+            return i + lowestBit(ne);
+    }
+#endif
+#ifdef OPENDHT_HASH_SSE2
+    for (; i + 16 <= n; i += 16) {
+        auto eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i)));
+        if (auto ne = ~(uint32_t) _mm_movemask_epi8(eq) & 0xFFFF)
+            return i + lowestBit(ne);
+    }
+#endif
+    for (; i + sizeof(uint32_t) <= n; i += sizeof(uint32_t)) {
+        uint32_t x, y;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+            break;
+    }
+    for (; i < n; i++)
+        if (a[i] != b[i])
+            return i;
+    return n;
+}
+
+/** Random seed of std::hash<Hash>, chosen once per process */
+OPENDHT_PUBLIC extern const uint64_t hashSeed;
+
+/** splitmix64 finalizer */
+constexpr uint64_t
+mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Hash of integers chosen by remote peers, such as value ids.
+ * Mixed with hashSeed, unlike std::hash, so that collisions can't be chosen.
+ */
+struct SeededHash
+{
+    size_t operator()(uint64_t v) const noexcept { return (size_t) mix64(v ^ hashSeed); }
+};
+
+} // namespace detail
+
 namespace crypto {
 OPENDHT_PUBLIC void hash(const uint8_t* data, size_t data_length, uint8_t* hash, size_t hash_length);
 }
@@ -162,9 +259,13 @@ public:
     static constexpr inline unsigned commonBits(const Hash& id1, const Hash& id2)
     {
         unsigned i = 0;
-        for (; i < N; i++) {
-            if (id1.data_[i] != id2.data_[i])
-                break;
+        if (not detail::isConstantEvaluated()) {
+            i = detail::firstDiff(id1.data(), id2.data(), N);
+        } else {
+            for (; i < N; i++) {
+                if (id1.data_[i] != id2.data_[i])
+                    break;
+            }
         }
 
         if (i == N)
@@ -184,6 +285,15 @@ public:
     /** Determine whether id1 or id2 is closer to this */
     constexpr int xorCmp(const Hash& id1, const Hash& id2) const
     {
+        if (not detail::isConstantEvaluated()) {
+            // only the first byte where id1 and id2 differ matters
+            auto i = detail::firstDiff(id1.data(), id2.data(), N);
+            if (i == N)
+                return 0;
+            uint8_t xor1 = id1.data_[i] ^ data_[i];
+            uint8_t xor2 = id2.data_[i] ^ data_[i];
+            return (xor1 < xor2) ? -1 : 1;
+        }
         for (unsigned i = 0; i < N; i++) {
             if (id1.data_[i] == id2.data_[i])
                 continue;
@@ -385,15 +495,72 @@ private:
 
 inline constexpr HexMap hex_map {};
 
+namespace detail {
+
+#ifdef OPENDHT_HASH_SSE2
+/** Hex digits of 16 nibbles */
+inline __m128i
+hexDigits(__m128i nibbles)
+{
+    // '0' + n, plus the gap between '9' and 'a' for n > 9
+    auto digits = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+    auto letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(digits, letters);
+}
+#endif
+#ifdef __AVX2__
+inline __m256i
+hexDigits(__m256i nibbles)
+{
+    auto digits = _mm256_add_epi8(nibbles, _mm256_set1_epi8('0'));
+    auto letters = _mm256_and_si256(_mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9)),
+                                    _mm256_set1_epi8('a' - '0' - 10));
+    return _mm256_add_epi8(digits, letters);
+}
+#endif
+
+/** Write the 2*size lowercase hex digits of data to out */
+inline void
+hexEncode(const uint8_t* data, size_t size, char* out)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 32 <= size; i += 32) {
+        auto v = _mm256_loadu_si256((const __m256i*) (data + i));
+        auto mask = _mm256_set1_epi8(0x0F);
+        auto hi = hexDigits(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        auto lo = hexDigits(_mm256_and_si256(v, mask));
+        // unpacking interleaves each 128 bits lane separately
+        auto a = _mm256_unpacklo_epi8(hi, lo);
+        auto b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*) (out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*) (out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+#endif
+#ifdef OPENDHT_HASH_SSE2
+    for (; i + 16 <= size; i += 16) {
+        auto v = _mm_loadu_si128((const __m128i*) (data + i));
+        auto mask = _mm_set1_epi8(0x0F);
+        auto hi = hexDigits(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        auto lo = hexDigits(_mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i*) (out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*) (out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (out += 2 * i; i < size; i++, out += 2) {
+        const auto& m = hex_map[data[i]];
+        out[0] = m[0];
+        out[1] = m[1];
+    }
+}
+
+} // namespace detail
+
 inline std::string
 toHex(const uint8_t* data, size_t size)
 {
     std::string ret(size * 2, '\0');
-    for (size_t i = 0; i < size; i++) {
-        auto b = ret.data() + i * 2;
-        const auto& m = hex_map[data[i]];
-        *((uint16_t*) b) = *((uint16_t*) &m);
-    }
+    detail::hexEncode(data, size, ret.data());
     return ret;
 }
 
@@ -421,11 +588,7 @@ const char*
 Hash<N>::to_c_str() const
 {
     alignas(std::max_align_t) thread_local std::array<char, N * 2 + 1> buf;
-    for (size_t i = 0; i < N; i++) {
-        auto b = buf.data() + i * 2;
-        const auto& m = hex_map[data_[i]];
-        *((uint16_t*) b) = *((uint16_t*) &m);
-    }
+    detail::hexEncode(data_.data(), N, buf.data());
     buf[N * 2] = '\0';
     return buf.data();
 }
@@ -439,6 +602,28 @@ Hash<N>::toString() const
 
 } // namespace dht
 
+namespace std {
+/**
+ * Keys of a node's storage are chosen by remote peers: every byte is mixed
+ * with a random seed so that collisions can't be chosen.
+ */
+template<size_t N>
+struct hash<dht::Hash<N>>
+{
+    size_t operator()(const dht::Hash<N>& h) const noexcept
+    {
+        uint64_t x = dht::detail::hashSeed;
+        for (size_t i = 0; i < N; i += sizeof(uint64_t)) {
+            uint64_t w = 0;
+            std::memcpy(&w, h.data() + i, std::min(sizeof(w), N - i));
+            x = (x ^ w) * 0x9E3779B97F4A7C15ull;
+            x ^= x >> 32;
+        }
+        return (size_t) dht::detail::mix64(x);
+    }
+};
+} // namespace std
+
 template<size_t N>
 struct fmt::formatter<dht::Hash<N>> : formatter<string_view>
 {
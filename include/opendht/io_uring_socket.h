@@ -0,0 +1,63 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "network_utils.h"
+
+#include <memory>
+
+namespace dht {
+namespace net {
+
+/**
+ * UDP socket backed by Linux io_uring.
+ * Datagrams are received with multishot recvmsg requests into a ring of
+ * provided buffers, handed to the received packets without copy, and sent as
+ * batches of sendmsg requests, so that a single system call serves many
+ * packets. Requires Linux 6.0 or later.
+ *
+ * The constructor throws DhtException if io_uring is not available,
+ * so that the caller can fall back to UdpSocket.
+ */
+class OPENDHT_PUBLIC IoUringUdpSocket : public DatagramSocket
+{
+public:
+    IoUringUdpSocket(const SockAddr& bind4,
+                     const SockAddr& bind6,
+                     const std::shared_ptr<Logger>& l = {},
+                     const SocketConfig& config = {});
+    ~IoUringUdpSocket();
+
+    /**
+     * Queue a datagram. Errors are reported asynchronously in getStats().tx_errors.
+     * Returns ESHUTDOWN once the socket is stopped.
+     */
+    int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override;
+
+    void flush() override;
+
+    SocketStats getStats() const override;
+
+    const SockAddr& getBoundRef(sa_family_t family = AF_UNSPEC) const override
+    {
+        return (family == AF_INET6) ? bound6 : bound4;
+    }
+
+    bool hasIPv4() const override { return s4 != -1; }
+    bool hasIPv6() const override { return s6 != -1; }
+
+    void stop() override;
+
+private:
+    class Impl;
+
+    std::shared_ptr<Logger> logger;
+    const SocketConfig config_;
+    int s4 {-1};
+    int s6 {-1};
+    SockAddr bound4, bound6;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace net
+} // namespace dht
@@ -0,0 +1,117 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "flat_hash_map.h"
+
+#include <functional>
+#include <list>
+#include <utility>
+
+namespace dht {
+
+/**
+ * Cache holding at most a given number of entries, evicting the least
+ * recently used ones. Entries are linked in the order of their use and
+ * indexed by a FlatHashMap: finding, inserting and evicting take constant
+ * time.
+ *
+ * Not thread-safe.
+ */
+template<typename Key, typename T, typename Hash = std::hash<Key>>
+class LruCache
+{
+public:
+    explicit LruCache(size_t capacity)
+        : capacity_(capacity)
+    {}
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+    size_t capacity() const { return capacity_; }
+
+    /** Change the maximum number of entries, evicting the least recently used ones */
+    void setCapacity(size_t capacity)
+    {
+        capacity_ = capacity;
+        shrink();
+    }
+
+    /** Entry of key marked as the most recently used, or nullptr */
+    T* get(const Key& key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->second;
+    }
+
+    /** Entry of key, without changing the order of use */
+    const T* peek(const Key& key) const
+    {
+        auto it = index_.find(key);
+        return it == index_.end() ? nullptr : &it->second->second;
+    }
+
+    bool contains(const Key& key) const { return index_.count(key); }
+
+    /**
+     * Insert or replace the entry of key as the most recently used.
+     * Returns nullptr if the capacity of the cache is 0.
+     */
+    T* put(const Key& key, T value)
+    {
+        if (auto v = get(key)) {
+            *v = std::move(value);
+            return v;
+        }
+        if (capacity_ == 0)
+            return nullptr;
+        entries_.emplace_front(key, std::move(value));
+        index_.emplace(key, entries_.begin());
+        shrink();
+        return &entries_.front().second;
+    }
+
+    bool erase(const Key& key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return false;
+        entries_.erase(it->second);
+        index_.erase(it);
+        return true;
+    }
+
+    void clear()
+    {
+        index_.clear();
+        entries_.clear();
+    }
+
+    /** Call cb for every entry, from the most recently used */
+    template<typename Callback>
+    void forEach(Callback&& cb) const
+    {
+        for (const auto& e : entries_)
+            cb(e.first, e.second);
+    }
+
+private:
+    using Entries = std::list<std::pair<Key, T>>;
+
+    void shrink()
+    {
+        while (entries_.size() > capacity_) {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+    size_t capacity_;
+    Entries entries_ {};
+    FlatHashMap<Key, typename Entries::iterator, Hash> index_ {};
+};
+
+} // namespace dht
@@ -10,6 +10,7 @@
 #include "utils.h"
 #include "rng.h"
 #include "rate_limiter.h"
+#include "flat_hash_map.h"
 #include "logger.h"
 #include "network_utils.h"
 
@@ -37,6 +38,10 @@ struct NetworkConfig
     ssize_t max_req_per_sec {0};
     ssize_t max_peer_req_per_sec {0};
     bool is_client {false};
+    /* Threads decoding batches of received packets, including the calling one */
+    unsigned decode_threads {1};
+    /* Shard of the node, carried by transaction ids (see Node::getNewTid()) */
+    unsigned shard {0};
 };
 
 class DhtProtocolException : public DhtException
@@ -78,6 +83,20 @@ private:
 
 struct ParsedMessage;
 
+/**
+ * Encoded part of a reply to a 'get' request that doesn't depend on the
+ * requester: closest nodes and values. The node id, the address of the
+ * requester, the token and the transaction id are added when sending.
+ */
+struct EncodedReply
+{
+    /* packed entries of the reply map */
+    Blob body {};
+    unsigned entries {0};
+    /* values too large for the reply, sent in separate packets */
+    std::vector<Blob> parts {};
+};
+
 /**
  * Answer for a request.
  */
@@ -91,10 +110,30 @@ struct RequestAnswer
     std::vector<Sp<FieldValueIndex>> fields {};
     std::vector<Sp<Node>> nodes4 {};
     std::vector<Sp<Node>> nodes6 {};
+    /* when set, sent instead of nodes and values */
+    Sp<const EncodedReply> reply {};
     RequestAnswer() {}
     RequestAnswer(ParsedMessage&& msg);
 };
 
+/**
+ * Fields of a received message used to dispatch it (see NetworkEngine::peekMessage()).
+ */
+struct MessageHeader
+{
+    /* true for requests, false for replies, errors, updates of listened values and value data */
+    bool request {false};
+    /* true for data of values sent in parts, following a message with the same tid */
+    bool value_data {false};
+    /* true if values of the message are sent in parts after it */
+    bool value_parts {false};
+    Tid tid {0};
+    /* id of the sender, if given */
+    InfoHash id {};
+    /* key or node id targeted by a request, or zero */
+    InfoHash target {};
+};
+
 /*!
  * @class   NetworkEngine
  * @brief   An abstraction of communication protocol on the network.
@@ -214,6 +253,15 @@ public:
 
     net::DatagramSocket* getSocket() const { return dht_socket.get(); };
 
+    /**
+     * Send datagrams queued by the socket, if any.
+     */
+    void flush()
+    {
+        if (dht_socket)
+            dht_socket->flush();
+    }
+
     void clear();
 
     /**
@@ -255,6 +303,23 @@ public:
                              const std::vector<Value::Id>& values,
                              int version);
 
+    /**
+     * Encodes the closest nodes and values of a reply to a 'get' request, so
+     * that it can be sent to several requesters.
+     *
+     * @param af      The address family of the requester.
+     * @param want    Wether to send ipv4 and/or ipv6 nodes.
+     * @param nodes4  The ipv4 closest nodes, sorted by distance to id.
+     * @param nodes6  The ipv6 closest nodes, sorted by distance to id.
+     */
+    Sp<const EncodedReply> encodeReply(sa_family_t af,
+                                       const InfoHash& id,
+                                       want_t want,
+                                       std::vector<Sp<Node>>& nodes4,
+                                       std::vector<Sp<Node>>& nodes6,
+                                       const std::vector<Sp<Value>>& values,
+                                       const Query& query);
+
     bool isRunning(sa_family_t af) const;
     inline want_t want() const { return dht_socket->hasIPv4() and dht_socket->hasIPv6() ? (WANT4 | WANT6) : -1; }
 
@@ -287,7 +352,7 @@ public:
      */
     Sp<Request> sendPing(SockAddr&& sa, RequestCb&& on_done, RequestExpiredCb&& on_expired)
     {
-        return sendPing(std::make_shared<Node>(InfoHash::zero(), std::move(sa), rd),
+        return sendPing(std::make_shared<Node>(InfoHash::zero(), std::move(sa), rd, false, config.shard),
                         std::forward<RequestCb>(on_done),
                         std::forward<RequestExpiredCb>(on_expired));
     }
@@ -436,6 +501,22 @@ public:
      */
     void processMessage(const uint8_t* buf, size_t buflen, SockAddr addr);
 
+    /**
+     * Parses a batch of received packets, in parallel with up to
+     * NetworkConfig::decode_threads threads, then processes them in order.
+     * Packets are referenced by the parsed messages: they must not be
+     * modified before this returns.
+     */
+    void processMessages(const std::vector<ReceivedPacket>& packets);
+
+    /**
+     * Reads the header of a message without parsing the rest of it, nor
+     * allocating. Thread-safe.
+     *
+     * @return false if buf doesn't hold a message.
+     */
+    static bool peekMessage(const uint8_t* buf, size_t buflen, MessageHeader& header);
+
     Sp<Node> insertNode(const InfoHash& id, const SockAddr& addr)
     {
         auto n = cache.getNode(id, addr, scheduler.time(), 0);
@@ -451,7 +532,14 @@ public:
         return stats;
     }
 
+    /* The maximum number of nodes that we snub.  There is probably little
+        reason to increase this value. */
+    static constexpr unsigned BLACKLISTED_MAX {10};
+    /* Time after which a blacklisted node is accepted again */
+    static constexpr std::chrono::minutes BLACKLIST_EXPIRATION {30};
+
     void blacklistNode(const Sp<Node>& n);
+    size_t getBlacklistSize() const { return blacklist.size(); }
 
     std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, sa_family_t sa_f, size_t count)
     {
@@ -482,14 +570,26 @@ private:
     static constexpr std::chrono::seconds RX_MAX_PACKET_TIME {10};
     /* Max. time between packet fragments */
     static constexpr std::chrono::seconds RX_TIMEOUT {3};
-    /* The maximum number of nodes that we snub.  There is probably little
-        reason to increase this value. */
-    static constexpr unsigned BLACKLISTED_MAX {10};
 
     static constexpr size_t MTU {1280};
     static constexpr size_t MAX_PACKET_VALUE_SIZE {600};
     static constexpr size_t MAX_MESSAGE_VALUE_SIZE {56 * 1024};
 
+    /* Packets decoded in a row by a thread */
+    static constexpr size_t DECODE_CHUNK {16};
+    /* Smaller batches are decoded by the calling thread only */
+    static constexpr size_t PARALLEL_DECODE_MIN {2 * DECODE_CHUNK};
+
+    /** Parse a message referencing buf, returns null if it is invalid. Thread-safe. */
+    std::unique_ptr<ParsedMessage> parseMessage(const uint8_t* buf, size_t buflen) const;
+    /**
+     * Parse packets from accepted senders with the calling thread and up to
+     * decode_threads - 1 threads of the pool. Messages of rejected packets are null.
+     */
+    void decodeMessages(const std::vector<ReceivedPacket>& packets, std::vector<std::unique_ptr<ParsedMessage>>& msgs);
+    /** Returns false if packets from this address must be ignored */
+    bool acceptFrom(const SockAddr& from) const;
+    void processMessage(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& from);
     void process(std::unique_ptr<ParsedMessage>&&, const SockAddr& from);
 
     bool rateLimit(const SockAddr& addr);
@@ -542,6 +642,11 @@ private:
                          const std::vector<Sp<Value>>& st,
                          const Query& query,
                          const Blob& token);
+    EncodedReply packNodesValues(const Blob& nodes,
+                                 const Blob& nodes6,
+                                 const std::vector<Sp<Value>>& st,
+                                 const Query& query) const;
+    void sendReply(const SockAddr& addr, Tid tid, const EncodedReply& reply, const Blob& token);
     Blob bufferNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<Node>>& nodes);
 
     std::pair<Blob, Blob> bufferNodes(
@@ -565,18 +670,16 @@ private:
     NodeCache cache;
 
     // global limiting should be triggered by at least 8 different IPs
-    using IpLimiter = RateLimiter;
-    using IpLimiterMap = std::map<SockAddr, IpLimiter, SockAddr::ipCmp>;
-    IpLimiterMap address_rate_limiter;
+    IpRateLimiter address_rate_limiter;
     RateLimiter rate_limiter;
-    ssize_t limiter_maintenance {0};
 
     // requests handling
-    std::map<Tid, Sp<Request>> requests {};
-    std::map<Tid, PartialMessage> partial_messages;
+    FlatHashMap<Tid, Sp<Request>> requests {};
+    FlatHashMap<Tid, PartialMessage> partial_messages;
 
     MessageStats in_stats {}, out_stats {};
-    std::set<SockAddr> blacklist {};
+    /* blacklisted addresses, with the time they were blacklisted */
+    FlatHashMap<SockAddr, time_point> blacklist {};
 
     Scheduler& scheduler;
 
@@ -7,6 +7,7 @@
 #include "sockaddr.h"
 #include "utils.h"
 #include "logger.h"
+#include "flat_hash_map.h"
 
 #ifdef _WIN32
 #include <ws2tcpip.h>
@@ -22,6 +23,9 @@
 #include <atomic>
 #include <mutex>
 #include <list>
+#include <vector>
+#include <memory>
+#include <algorithm>
 
 namespace dht {
 namespace net {
@@ -29,22 +33,313 @@ namespace net {
 static const constexpr in_port_t DHT_DEFAULT_PORT = 4222;
 static const constexpr size_t RX_QUEUE_MAX_SIZE = 1024 * 64;
 static const constexpr std::chrono::milliseconds RX_QUEUE_MAX_DELAY(650);
+/* Capacity of the ring of received packets waiting to be processed */
+static const constexpr size_t RX_RING_SIZE = 1024 * 16;
+/* Max. number of datagrams received or sent with a single system call */
+static const constexpr size_t RX_BATCH_SIZE = 32;
+static const constexpr size_t TX_BATCH_SIZE = 64;
+/* Size of pooled receive buffers, holding most datagrams. Larger ones are moved to a buffer of their own. */
+static const constexpr size_t PACKET_BUFFER_SIZE = 4 * 1024;
+/* Max. size of a received datagram */
+static const constexpr size_t MAX_DATAGRAM_SIZE = 64 * 1024;
 
-int bindSocket(const SockAddr& addr, SockAddr& bound);
+/**
+ * Open a non-blocking UDP socket bound to addr.
+ * If reusePort is true, SO_REUSEPORT is set before binding so that
+ * other sockets can bind the same address.
+ */
+int bindSocket(const SockAddr& addr, SockAddr& bound, bool reusePort = false);
 
 bool setNonblocking(int fd, bool nonblocking = true);
 
 #ifdef _WIN32
 void udpPipe(int fds[2]);
 #endif
+class PacketPool;
+
+/**
+ * Receive buffer, either taken from a PacketPool or allocated on its own.
+ * The buffer is given back to its pool when cleared or destroyed.
+ */
+class OPENDHT_PUBLIC PacketBuffer
+{
+public:
+    PacketBuffer() {}
+    PacketBuffer(PacketBuffer&& o) noexcept
+        : pool_(std::move(o.pool_))
+        , owned_(std::move(o.owned_))
+        , data_(o.data_)
+        , offset_(o.offset_)
+        , size_(o.size_)
+        , capacity_(o.capacity_)
+    {
+        o.data_ = nullptr;
+        o.offset_ = 0;
+        o.size_ = 0;
+        o.capacity_ = 0;
+    }
+    PacketBuffer& operator=(PacketBuffer&& o) noexcept
+    {
+        if (this != &o) {
+            clear();
+            pool_ = std::move(o.pool_);
+            owned_ = std::move(o.owned_);
+            std::swap(data_, o.data_);
+            std::swap(offset_, o.offset_);
+            std::swap(size_, o.size_);
+            std::swap(capacity_, o.capacity_);
+        }
+        return *this;
+    }
+    ~PacketBuffer() { clear(); }
+
+    uint8_t* data() { return data_ + offset_; }
+    const uint8_t* data() const { return data_ + offset_; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_ - offset_; }
+    bool empty() const { return size_ == 0; }
+    explicit operator bool() const { return data_; }
+
+    /** Set the size of the data written in the buffer (at most capacity()) */
+    void resize(size_t size) { size_ = std::min(size, capacity()); }
+
+    /**
+     * Make the buffer start at offset, for data received after a header,
+     * and set its size (at most capacity() - offset).
+     */
+    void slice(size_t offset, size_t size)
+    {
+        offset_ += std::min(offset, capacity());
+        resize(size);
+    }
+
+    /** Copy data in the buffer, allocating a larger one if needed */
+    void assign(const uint8_t* begin, const uint8_t* end);
+
+    /** Copy data after the first size() bytes, moving them to a larger buffer if needed */
+    void append(const uint8_t* begin, const uint8_t* end);
+
+    /** Release the buffer */
+    void clear();
+
+private:
+    friend class PacketPool;
+    PacketBuffer(std::shared_ptr<PacketPool> pool, uint8_t* data, size_t capacity)
+        : pool_(std::move(pool))
+        , data_(data)
+        , capacity_(capacity)
+    {}
+
+    std::shared_ptr<PacketPool> pool_;
+    std::unique_ptr<uint8_t[]> owned_;
+    uint8_t* data_ {nullptr};
+    size_t offset_ {0};
+    size_t size_ {0};
+    size_t capacity_ {0};
+};
+
+/**
+ * Fixed-size receive buffers, allocated by slabs and recycled.
+ * Sockets receive datagrams directly in these buffers, that are parsed in place.
+ * Buffers are acquired and released from any thread without locking,
+ * except to allocate a new slab.
+ * Must be created with std::make_shared.
+ */
+class OPENDHT_PUBLIC PacketPool : public std::enable_shared_from_this<PacketPool>
+{
+public:
+    static constexpr size_t SLAB_BUFFERS {256};
+
+    PacketPool(size_t buffer_size = PACKET_BUFFER_SIZE, size_t max_buffers = RX_QUEUE_MAX_SIZE);
+    ~PacketPool();
+
+    /**
+     * Get a buffer of bufferSize() bytes.
+     * Returns an empty PacketBuffer if max_buffers are in use.
+     */
+    PacketBuffer acquire();
+
+    size_t bufferSize() const { return buffer_size_; }
+
+    /** Number of buffers currently in use */
+    size_t inUse() const { return in_use_.load(std::memory_order_relaxed); }
+
+private:
+    friend class PacketBuffer;
+    void release(uint8_t* buffer);
+
+    class FreeList;
+
+    const size_t buffer_size_;
+    const size_t max_buffers_;
+    /* held to add a slab */
+    std::mutex lock_;
+    std::vector<std::unique_ptr<uint8_t[]>> slabs_;
+    const std::unique_ptr<FreeList> free_;
+    std::atomic<size_t> in_use_ {0};
+};
+
 struct ReceivedPacket
 {
-    Blob data;
+    PacketBuffer data;
     SockAddr from;
     time_point received;
 };
 using PacketList = std::list<ReceivedPacket>;
 
+/**
+ * Bounded lock-free queue of received packets, from the socket receive
+ * thread(s) to a single consumer thread.
+ * Packets are exchanged with the slots, so that buffers and addresses are
+ * moved without allocation. Producers never block: push() fails when full.
+ */
+class PacketRing
+{
+public:
+    /** Capacity is rounded up to a power of two */
+    explicit PacketRing(size_t capacity = RX_RING_SIZE)
+        : capacity_(roundCapacity(capacity))
+        , slots_(new Slot[capacity_])
+    {
+        for (size_t i = 0; i < capacity_; i++)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * Move pkt in the ring. pkt is left with the (empty) content of the slot.
+     * @return false if the ring is full, pkt is then unchanged.
+     */
+    bool push(ReceivedPacket& pkt)
+    {
+        auto pos = tail_.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots_[pos & (capacity_ - 1)];
+            auto seq = slot->seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        swap(slot->pkt, pkt);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Move the oldest packet to pkt, that receives the previous content of pkt.
+     * Must only be called by the consumer thread.
+     * @return false if the ring is empty.
+     */
+    bool pop(ReceivedPacket& pkt)
+    {
+        auto pos = head_.load(std::memory_order_relaxed);
+        auto& slot = slots_[pos & (capacity_ - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        swap(slot.pkt, pkt);
+        slot.seq.store(pos + capacity_, std::memory_order_release);
+        head_.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    /** Approximate number of packets in the ring */
+    size_t size() const
+    {
+        auto head = head_.load(std::memory_order_acquire);
+        auto tail = tail_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        ReceivedPacket pkt;
+    };
+
+    static size_t roundCapacity(size_t capacity)
+    {
+        size_t c = 2;
+        while (c < capacity)
+            c <<= 1;
+        return c;
+    }
+    static void swap(ReceivedPacket& a, ReceivedPacket& b)
+    {
+        std::swap(a.data, b.data);
+        std::swap(a.from, b.from);
+        std::swap(a.received, b.received);
+    }
+
+    const size_t capacity_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<size_t> head_ {0};
+    alignas(64) std::atomic<size_t> tail_ {0};
+};
+
+/**
+ * UDP socket configuration.
+ */
+struct SocketConfig
+{
+    /** Max. number of datagrams drained from the kernel per wakeup (recvmmsg) */
+    size_t rx_batch_size {RX_BATCH_SIZE};
+    /**
+     * If true, outgoing datagrams are queued by sendTo() and sent
+     * together (sendmmsg) when flush() is called.
+     * An unreachable destination is then reported by the next sendTo() to it,
+     * and sendTo() returns EAGAIN while the socket buffer is full.
+     */
+    bool tx_batch {false};
+    /**
+     * Number of sockets bound with SO_REUSEPORT for each address family,
+     * each serviced by its own receive thread.
+     * The kernel distributes incoming flows among them.
+     */
+    unsigned reuseport_sockets {1};
+    /** If true, receive thread i is pinned to CPU (i % number of CPUs) */
+    bool pin_rx_threads {false};
+};
+
+/**
+ * Socket counters. Batch sizes can be derived from packets / batches.
+ */
+struct SocketStats
+{
+    uint64_t rx_packets {0};
+    uint64_t rx_batches {0};
+    uint64_t rx_batch_max {0};
+    /** Datagrams dropped because no buffer was available or they didn't fit in one */
+    uint64_t rx_dropped {0};
+    /** Times receiving paused because all the receive buffers were in use (io_uring) */
+    uint64_t rx_buffers_exhausted {0};
+    uint64_t tx_packets {0};
+    uint64_t tx_batches {0};
+    uint64_t tx_batch_max {0};
+    uint64_t tx_errors {0};
+
+    /** Counters of a single receiving socket */
+    struct RxSocket
+    {
+        sa_family_t family {AF_UNSPEC};
+        unsigned index {0};
+        uint64_t packets {0};
+        /** Datagrams dropped by the kernel because the socket buffer was full */
+        uint64_t drops {0};
+    };
+    std::vector<RxSocket> sockets;
+};
+
 class OPENDHT_PUBLIC DatagramSocket
 {
 public:
@@ -56,6 +351,13 @@ public:
 
     virtual int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) = 0;
 
+    /**
+     * Send datagrams queued by sendTo(), if the implementation queues them.
+     */
+    virtual void flush() {}
+
+    virtual SocketStats getStats() const { return {}; }
+
     inline void setOnReceive(OnReceive&& cb)
     {
         std::lock_guard lk(lock);
@@ -87,16 +389,19 @@ public:
     virtual void stop() = 0;
 
 protected:
-    PacketList getNewPacket()
+    PacketList getNewPacket() { return getNewPackets(1); }
+
+    PacketList getNewPackets(size_t n)
     {
         PacketList pkts;
-        if (toRecycle_.empty()) {
-            pkts.emplace_back();
-        } else {
-            auto begIt = toRecycle_.begin();
-            auto begItNext = std::next(begIt);
-            pkts.splice(pkts.end(), toRecycle_, begIt, begItNext);
+        std::lock_guard lk(recycleLock_);
+        auto recycled = std::min(n, toRecycle_.size());
+        if (recycled) {
+            auto endIt = std::next(toRecycle_.begin(), recycled);
+            pkts.splice(pkts.end(), toRecycle_, toRecycle_.begin(), endIt);
         }
+        for (; recycled < n; recycled++)
+            pkts.emplace_back();
         return pkts;
     }
 
@@ -105,16 +410,23 @@ protected:
         std::lock_guard lk(lock);
         if (rx_callback) {
             auto r = rx_callback(std::move(packets));
-            if (not r.empty() and toRecycle_.size() < RX_QUEUE_MAX_SIZE)
-                toRecycle_.splice(toRecycle_.end(), std::move(r));
+            if (not r.empty()) {
+                std::lock_guard lkr(recycleLock_);
+                if (toRecycle_.size() < RX_QUEUE_MAX_SIZE)
+                    toRecycle_.splice(toRecycle_.end(), std::move(r));
+            }
         }
     }
 
 protected:
     mutable std::mutex lock;
+    /* buffers for received datagrams */
+    const std::shared_ptr<PacketPool> packetPool_ {std::make_shared<PacketPool>()};
 
 private:
     OnReceive rx_callback;
+    /* packets can be requested by several receive threads */
+    std::mutex recycleLock_;
     PacketList toRecycle_;
 };
 
@@ -122,11 +434,18 @@ class OPENDHT_PUBLIC UdpSocket : public DatagramSocket
 {
 public:
     UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l = {});
-    UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::shared_ptr<Logger>& l = {});
+    UdpSocket(const SockAddr& bind4,
+              const SockAddr& bind6,
+              const std::shared_ptr<Logger>& l = {},
+              const SocketConfig& config = {});
     ~UdpSocket();
 
     int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override;
 
+    void flush() override;
+
+    SocketStats getStats() const override;
+
     const SockAddr& getBoundRef(sa_family_t family = AF_UNSPEC) const override
     {
         return (family == AF_INET6) ? bound6 : bound4;
@@ -146,15 +465,58 @@ public:
     void stop() override;
 
 private:
+    struct PendingPacket
+    {
+        bool replied;
+        SockAddr dest;
+        Blob data;
+    };
+    /* Max. number of unreachable destinations remembered until sent to again */
+    static constexpr size_t TX_FAILED_MAX {1024};
+
+    struct RxSocketCounters
+    {
+        std::atomic<uint64_t> packets {0};
+        std::atomic<uint64_t> drops {0};
+    };
+
     std::shared_ptr<Logger> logger;
+    const SocketConfig config_;
+    /* sockets s4 and s6 are used to send, and are part of the receiving sockets */
     int s4 {-1};
     int s6 {-1};
     int stopfd {-1};
     SockAddr bound4, bound6;
-    std::thread rcv_thread {};
+    /* one thread per pair of IPv4/IPv6 receiving sockets */
+    std::vector<std::thread> rcv_threads {};
     std::atomic_bool running {false};
+    /* counters of receiving socket i of each family, at 2*i (IPv4) and 2*i+1 (IPv6) */
+    std::vector<RxSocketCounters> rx_sockets;
+
+    /* outgoing datagrams queued until flush(), entries are reused */
+    std::mutex tx_lock;
+    std::vector<PendingPacket> tx_queue;
+    size_t tx_pending {0};
+    /* error of the last datagram queued for an unreachable destination */
+    FlatHashMap<SockAddr, int> tx_failed;
+
+    std::atomic<uint64_t> rx_packets {0}, rx_batches {0}, rx_batch_max {0}, rx_dropped {0};
+    std::atomic<uint64_t> tx_packets {0}, tx_batches {0}, tx_batch_max {0}, tx_errors {0};
 
     void openSockets(const SockAddr& bind4, const SockAddr& bind6);
+    void joinThreads();
+    void receiveLoop(unsigned index,
+                     int stop_readfd,
+                     int ls4,
+                     int ls6,
+                     std::shared_ptr<std::atomic_uint> threads);
+    int sendNow(int s, const SockAddr& dest, const uint8_t* data, size_t size, bool replied);
+    void flushLocked();
+    bool onSendError(int err, size_t& i, bool& reopened);
+    void countBatch(std::atomic<uint64_t>& packets,
+                    std::atomic<uint64_t>& batches,
+                    std::atomic<uint64_t>& batch_max,
+                    uint64_t n);
 };
 
 } // namespace net
@@ -6,6 +6,7 @@
 #include "utils.h"
 #include "sockaddr.h"
 #include "node_export.h"
+#include "flat_hash_map.h"
 
 #include <list>
 #include <map>
@@ -34,8 +35,12 @@ struct Node
 {
     const InfoHash id;
 
-    Node(const InfoHash& id, const SockAddr& addr, std::mt19937_64& rd, bool client = false);
-    Node(const InfoHash& id, SockAddr&& addr, std::mt19937_64& rd, bool client = false);
+    /**
+     * @param shard  If non-0, stored in the high bits of the transaction ids
+     *               (see getNewTid()), so that replies reach the same shard.
+     */
+    Node(const InfoHash& id, const SockAddr& addr, std::mt19937_64& rd, bool client = false, unsigned shard = 0);
+    Node(const InfoHash& id, SockAddr&& addr, std::mt19937_64& rd, bool client = false, unsigned shard = 0);
     Node(const InfoHash& id, const sockaddr* sa, socklen_t salen, std::mt19937_64& rd)
         : Node(id, SockAddr(sa, salen), rd)
     {}
@@ -88,6 +93,17 @@ struct Node
 
     void setExpired();
 
+    /**
+     * Updates the round trip time estimate with a new measure, as in RFC 6298.
+     * Measures of retransmitted requests are ambiguous and should be ignored.
+     */
+    void rttSample(duration rtt);
+    /** Smoothed round trip time, or zero if no measure is known */
+    duration getSrtt() const { return srtt_; }
+    duration getRttVar() const { return rttvar_; }
+    /** Time to wait for a reply before sending a request again, MAX_RESPONSE_TIME if unknown */
+    duration getRto() const;
+
     /**
      * Opens a socket on which a node will be able allowed to write for further
      * additionnal updates following the response to a previous request.
@@ -119,15 +135,21 @@ struct Node
 
     /**
      * Generates a new request id, skipping the invalid id.
+     * The high bits of the ids hold the shard of the node, if any.
      *
      * @return the new id.
      */
     Tid getNewTid()
     {
         ++transaction_id;
+        if (tid_shard_)
+            transaction_id = (transaction_id & TID_COUNTER_MASK) | tid_shard_;
         return transaction_id ? transaction_id : ++transaction_id;
     }
 
+    /** Shard of the node that generated tid, or 0 */
+    static unsigned getTidShard(Tid tid) { return tid >> TID_SHARD_SHIFT; }
+
     std::string toString() const;
 
     OPENDHT_PUBLIC friend std::ostream& operator<<(std::ostream& s, const Node& h);
@@ -140,7 +162,17 @@ struct Node
     /* Time for a request to timeout */
     static constexpr const std::chrono::seconds MAX_RESPONSE_TIME {1};
 
+    /* Bounds of the time waited before retrying a request */
+    static constexpr const std::chrono::milliseconds MIN_RTO {250};
+    static constexpr const std::chrono::seconds MAX_RTO {3};
+
+    /* Max. number of shards of a node */
+    static constexpr const unsigned MAX_SHARDS {255};
+
 private:
+    static constexpr const unsigned TID_SHARD_SHIFT {24};
+    static constexpr const Tid TID_COUNTER_MASK {(Tid(1) << TID_SHARD_SHIFT) - 1};
+
     /* Number of times we accept authentication errors from this node. */
     static const constexpr unsigned MAX_AUTH_ERRORS {3};
 
@@ -150,11 +182,14 @@ private:
     time_point reply_time {time_point::min()}; /* time of last correct reply received */
     unsigned auth_errors {0};
     bool expired_ {false};
+    duration srtt_ {0};   /* smoothed round trip time */
+    duration rttvar_ {0}; /* round trip time variation */
     Tid transaction_id;
+    Tid tid_shard_ {0};
     using TransactionDist = std::uniform_int_distribution<decltype(transaction_id)>;
 
-    std::map<Tid, Sp<net::Request>> requests_ {};
-    std::map<Tid, Sp<Socket>> sockets_;
+    FlatHashMap<Tid, Sp<net::Request>> requests_ {};
+    FlatHashMap<Tid, Sp<Socket>> sockets_;
 };
 
 } // namespace dht
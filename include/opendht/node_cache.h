@@ -25,8 +25,10 @@ struct NodeCache
      */
     void clearBadNodes(sa_family_t family = 0);
 
-    NodeCache(std::mt19937_64& r)
-        : rd(r) {};
+    /** Nodes are created for the given shard (see Node::getNewTid()) */
+    NodeCache(std::mt19937_64& r, unsigned shard = 0)
+        : rd(r)
+        , shard(shard) {};
     ~NodeCache();
 
 private:
@@ -34,8 +36,13 @@ private:
     {
     public:
         Sp<Node> getNode(const InfoHash& id);
-        Sp<Node> getNode(
-            const InfoHash& id, const SockAddr&, time_point now, bool confirmed, bool client, std::mt19937_64& rd);
+        Sp<Node> getNode(const InfoHash& id,
+                         const SockAddr&,
+                         time_point now,
+                         bool confirmed,
+                         bool client,
+                         std::mt19937_64& rd,
+                         unsigned shard);
         std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, size_t count) const;
         void clearBadNodes();
         void setExpired();
@@ -51,6 +58,7 @@ private:
     NodeMap cache_4;
     NodeMap cache_6;
     std::mt19937_64& rd;
+    const unsigned shard;
 };
 
 } // namespace dht
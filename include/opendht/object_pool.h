@@ -0,0 +1,87 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace dht {
+
+/**
+ * Stateless allocator recycling single objects through a bounded per-thread
+ * free list, so that short-lived objects allocated at a high rate (like
+ * requests, with std::allocate_shared) don't go through the global heap.
+ * Objects may be released by another thread than the one that allocated them.
+ */
+template<typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+    /* maximum number of free blocks kept per thread */
+    static constexpr size_t CAPACITY {256};
+
+    PoolAllocator() noexcept = default;
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept
+    {}
+
+    T* allocate(size_t n)
+    {
+        auto& list = freeList();
+        if (n == 1 and list.count)
+            return static_cast<T*>(list.blocks[--list.count]);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        auto& list = freeList();
+        if (n == 1 and not list.closed and list.count < CAPACITY) {
+            static thread_local Release release;
+            list.blocks[list.count++] = p;
+        } else
+            ::operator delete(p);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept
+    {
+        return true;
+    }
+    template<typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept
+    {
+        return false;
+    }
+
+private:
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned types are not supported");
+
+    /* Trivially destructible, so that it stays usable while other thread_local objects are destroyed */
+    struct FreeList
+    {
+        void* blocks[CAPACITY];
+        size_t count;
+        bool closed;
+    };
+    static FreeList& freeList() noexcept
+    {
+        static thread_local FreeList list {};
+        return list;
+    }
+    /* Frees the blocks kept by the thread when it exits */
+    struct Release
+    {
+        ~Release()
+        {
+            auto& list = freeList();
+            while (list.count)
+                ::operator delete(list.blocks[--list.count]);
+            list.closed = true;
+        }
+    };
+};
+
+} // namespace dht
@@ -3,42 +3,206 @@
 #pragma once
 
 #include "utils.h"
-#include <queue>
+#include "sockaddr.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <vector>
 
 namespace dht {
 
+/**
+ * Token bucket rate limiter using constant memory.
+ * Allows bursts of up to quota requests, and quota requests per period on average.
+ */
 class RateLimiter
 {
 public:
     RateLimiter(size_t quota, const duration& period = std::chrono::seconds(1))
-        : quota_(quota)
-        , period_(period)
-    {}
+        : period_(std::max<rep>(period.count(), 1))
+        , quota_(quota)
+    {
+        // Each request costs period_, the bucket holds quota * period_
+        if (quota_ == std::numeric_limits<size_t>::max() or quota_ > (size_t) (MAX_LEVEL / period_))
+            capacity_ = -1;
+        else
+            capacity_ = quota_ * period_;
+    }
 
-    /** Clear outdated records and return current quota usage */
+    /** Refill the bucket and return current quota usage */
     size_t maintain(const time_point& now)
     {
-        auto limit = now - period_;
-        while (not records.empty() and records.front() < limit)
-            records.pop();
-        return records.size();
+        if (level_) {
+            auto elapsed = (now - last_).count();
+            if (elapsed >= period_)
+                level_ = 0;
+            else if (elapsed > 0)
+                level_ = std::max<rep>(level_ - elapsed * (rep) quota_, 0);
+        }
+        if (now > last_)
+            last_ = now;
+        return (level_ + period_ - 1) / period_;
     }
-    /** Return false if quota is reached, insert record and return true otherwise. */
+    /** Return false if quota is reached, consume quota and return true otherwise. */
     bool limit(const time_point& now)
     {
-        if (quota_ == std::numeric_limits<size_t>::max())
+        if (capacity_ < 0)
             return true;
-        if (maintain(now) >= quota_)
+        maintain(now);
+        if (level_ + period_ > capacity_)
             return false;
-        records.emplace(now);
+        level_ += period_;
         return true;
     }
-    bool empty() const { return records.empty(); }
+    bool empty() const { return level_ == 0; }
+
+private:
+    using rep = duration::rep;
+    static constexpr rep MAX_LEVEL {std::numeric_limits<rep>::max() / 2};
+
+    rep period_;
+    size_t quota_;
+    /* bucket size, negative if unlimited */
+    rep capacity_;
+    /* used quota, in period_ units per request */
+    rep level_ {0};
+    time_point last_ {time_point::min()};
+};
+
+/**
+ * Rate limiters per IP address, only considering the first 64 bits in IPv6.
+ * Limiters are stored in a hash table of bounded size, split in independently
+ * locked shards. When a shard is full, its least recently used limiter is
+ * evicted. Idle limiters are dropped as the table is used.
+ */
+class IpRateLimiter
+{
+public:
+    static constexpr size_t MAX_SIZE {64 * 1024};
+    static constexpr unsigned SHARDS {16};
+
+    IpRateLimiter(size_t quota,
+                  size_t max_size = MAX_SIZE,
+                  const duration& period = std::chrono::seconds(1),
+                  unsigned shards = SHARDS)
+        : quota_(quota)
+        , period_(period)
+        , shard_size_(std::max<size_t>(1, max_size / std::max(1u, shards)))
+        , seed_(std::random_device {}())
+    {
+        shards_.reserve(std::max(1u, shards));
+        for (unsigned i = 0; i < std::max(1u, shards); i++)
+            shards_.emplace_back(std::make_unique<Shard>());
+    }
+
+    /** Return false if the quota of addr is reached, consume quota and return true otherwise. */
+    bool limit(const SockAddr& addr, const time_point& now)
+    {
+        auto key = makeKey(addr);
+        auto h = KeyHash {seed_}(key);
+        auto& shard = *shards_[h % shards_.size()];
+        std::lock_guard lk(shard.lock);
+        auto& lru = shard.lru;
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+        } else if (lru.size() >= shard_size_) {
+            // reuse the least recently used entry
+            shard.index.erase(lru.back().first);
+            lru.splice(lru.begin(), lru, std::prev(lru.end()));
+            lru.front() = {key, RateLimiter(quota_, period_)};
+            shard.index.emplace(key, lru.begin());
+        } else {
+            lru.emplace_front(key, RateLimiter(quota_, period_));
+            shard.index.emplace(key, lru.begin());
+        }
+        bool ret = lru.front().second.limit(now);
+
+        // drop the least recently used limiter if it is idle
+        if (lru.size() > 1 and lru.back().second.maintain(now) == 0) {
+            shard.index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return ret;
+    }
+
+    /** Drop idle limiters and return the number of limiters */
+    size_t maintain(const time_point& now)
+    {
+        size_t ret = 0;
+        for (auto& shard : shards_) {
+            std::lock_guard lk(shard->lock);
+            for (auto it = shard->lru.begin(); it != shard->lru.end();) {
+                if (it->second.maintain(now) == 0) {
+                    shard->index.erase(it->first);
+                    it = shard->lru.erase(it);
+                } else
+                    ++it;
+            }
+            ret += shard->lru.size();
+        }
+        return ret;
+    }
+
+    size_t size() const
+    {
+        size_t ret = 0;
+        for (const auto& shard : shards_) {
+            std::lock_guard lk(shard->lock);
+            ret += shard->lru.size();
+        }
+        return ret;
+    }
 
 private:
+    struct Key
+    {
+        sa_family_t family;
+        uint64_t ip;
+        bool operator==(const Key& o) const { return family == o.family and ip == o.ip; }
+    };
+    struct KeyHash
+    {
+        uint64_t seed;
+        size_t operator()(const Key& k) const
+        {
+            // splitmix64 finalizer, with a random seed so that collisions can't be chosen
+            uint64_t x = k.ip ^ seed ^ ((uint64_t) k.family << 56);
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+            return (size_t) (x ^ (x >> 31));
+        }
+    };
+    static Key makeKey(const SockAddr& addr)
+    {
+        Key k {addr.getFamily(), 0};
+        if (k.family == AF_INET)
+            std::memcpy(&k.ip, &addr.getIPv4().sin_addr, sizeof(in_addr));
+        else if (k.family == AF_INET6)
+            std::memcpy(&k.ip, &addr.getIPv6().sin6_addr, sizeof(k.ip));
+        return k;
+    }
+
+    struct Shard
+    {
+        mutable std::mutex lock;
+        /* most recently used first */
+        std::list<std::pair<Key, RateLimiter>> lru;
+        std::unordered_map<Key, std::list<std::pair<Key, RateLimiter>>::iterator, KeyHash> index;
+
+        Shard()
+            : index(0, KeyHash {std::random_device {}()})
+        {}
+    };
+
     const size_t quota_;
     const duration period_;
-    std::queue<time_point> records {};
+    const size_t shard_size_;
+    const uint64_t seed_;
+    std::vector<std::unique_ptr<Shard>> shards_;
 };
 
 } // namespace dht
@@ -4,6 +4,8 @@
 
 #include "node.h"
 
+#include <vector>
+
 namespace dht {
 
 static constexpr unsigned TARGET_NODES {8};
@@ -25,7 +27,7 @@ struct Bucket
     sa_family_t af {0};
     InfoHash first {};
     time_point time {time_point::min()}; /* time of last reply in this bucket */
-    std::list<Sp<Node>> nodes {};
+    std::vector<Sp<Node>> nodes {};
     Sp<Node> cached; /* the address of a likely candidate */
 
     /** Return a random node in a bucket. */
@@ -40,10 +42,15 @@ struct Bucket
     }
 };
 
-class RoutingTable : public std::list<Bucket>
+/**
+ * Buckets of a routing table, sorted by the first id of their range and stored
+ * contiguously, so that the bucket of an id is found by binary search.
+ * Splitting a bucket invalidates iterators.
+ */
+class RoutingTable : public std::vector<Bucket>
 {
 public:
-    using std::list<Bucket>::list;
+    using std::vector<Bucket>::vector;
 
     time_point grow_time {time_point::min()};
     bool is_client {false};
@@ -87,7 +94,7 @@ public:
     unsigned depth(const RoutingTable::const_iterator& bucket) const;
 
     /**
-     * Split a bucket in two equal parts.
+     * Split a bucket in two equal parts. Iterators are invalidated.
      */
     bool split(const RoutingTable::iterator& b);
 };
@@ -3,9 +3,12 @@
 #pragma once
 
 #include "utils.h"
+#include "object_pool.h"
 
+#include <algorithm>
+#include <array>
 #include <functional>
-#include <map>
+#include <vector>
 
 namespace dht {
 
@@ -14,6 +17,14 @@ namespace dht {
  * @brief   Job scheduler
  * @details
  * Maintains the timings upon which to execute a job.
+ *
+ * Jobs are stored in a hierarchical timing wheel of millisecond ticks: each
+ * level has 64 slots, each slot of a level spanning the whole previous level.
+ * Jobs are linked in the list of their slot so that adding and cancelling a
+ * job take constant time. When the current time reaches a slot of an upper
+ * level, its jobs are spread in the lower levels.
+ * Jobs due at the same tick run in the order of their time, then of their
+ * scheduling.
  */
 class Scheduler
 {
@@ -27,8 +38,32 @@ public:
         std::function<void()> do_;
         const time_point t_;
         void cancel() { do_ = {}; }
+
+    private:
+        friend class Scheduler;
+        Job* prev_ {nullptr};
+        Job* next_ {nullptr};
+        /* Reference held by the scheduler while the job is in a slot */
+        Sp<Job> self_ {};
+        uint64_t seq_ {0};
+        unsigned slot_ {NO_SLOT};
     };
 
+    Scheduler() = default;
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    ~Scheduler()
+    {
+        for (auto& slot : slots_) {
+            while (auto job = slot.head) {
+                slot.head = job->next_;
+                job->slot_ = NO_SLOT;
+                job->next_ = job->prev_ = nullptr;
+                job->self_.reset();
+            }
+        }
+    }
+
     /**
      * Adds another job to the queue.
      *
@@ -39,9 +74,12 @@ public:
      */
     Sp<Scheduler::Job> add(time_point t, std::function<void()>&& job_func)
     {
-        auto job = std::make_shared<Job>(std::move(job_func), t);
-        if (t != time_point::max())
-            timers.emplace(std::move(t), job);
+        auto job = std::allocate_shared<Job>(PoolAllocator<Job>(), std::move(job_func), t);
+        if (t != time_point::max()) {
+            job->seq_ = seq_++;
+            job->self_ = job;
+            link(*job);
+        }
         return job;
     }
 
@@ -66,12 +104,10 @@ public:
     {
         if (job) {
             job->cancel();
-            for (auto r = timers.equal_range(job->t_); r.first != r.second; ++r.first) {
-                if (r.first->second == job) {
-                    timers.erase(r.first);
-                    job.reset();
-                    return true;
-                }
+            if (job->slot_ != NO_SLOT) {
+                unlink(*job);
+                job.reset();
+                return true;
             }
         }
         return false;
@@ -84,26 +120,58 @@ public:
      */
     time_point run()
     {
-        while (not timers.empty()) {
-            auto timer = timers.begin();
+        const auto nowTick = toTick(now);
+        for (;;) {
+            auto s = nextSlot();
+            if (s == NO_SLOT)
+                break;
+            auto next = slotTick(s);
+            if (s >= SLOTS) {
+                // reached an upper level slot: spread its jobs in the lower levels
+                if (next > nowTick)
+                    break;
+                cur_ = next;
+                cascade(s);
+                continue;
+            }
             /*
              * Running jobs scheduled before "now" prevents run+rescheduling
              * loops before this method ends. It is garanteed by the fact that a
              * job will at least be scheduled for "now" and not before.
              */
-            if (timer->first > now)
+            if (next > nowTick and next != cur_)
                 break;
-
-            auto job = std::move(timer->second);
-            timers.erase(timer);
-
-            if (job->do_)
-                job->do_();
+            cur_ = std::max(cur_, next);
+            if (not runSlot(s))
+                break;
+        }
+        // Nothing is due before now: jobs scheduled from now on don't need to be cascaded
+        if (nowTick > cur_) {
+            auto s = nextSlot();
+            if (s == NO_SLOT or slotTick(s) > nowTick)
+                cur_ = nowTick;
         }
         return getNextJobTime();
     }
 
-    inline time_point getNextJobTime() const { return timers.empty() ? time_point::max() : timers.begin()->first; }
+    /**
+     * Time of the next job to run. If it is in an upper level of the wheel,
+     * returns a lower bound, reached before the job needs to run.
+     */
+    time_point getNextJobTime() const
+    {
+        auto s = nextSlot();
+        if (s == NO_SLOT)
+            return time_point::max();
+        const auto& slot = slots_[s];
+        if (s < SLOTS) {
+            auto t = time_point::max();
+            for (auto job = slot.head; job; job = job->next_)
+                t = std::min(t, job->t_);
+            return t;
+        }
+        return std::max(slot.min, fromTick(slotTick(s)));
+    }
 
     /**
      * Accessors for the common time reference used for synchronizing
@@ -114,8 +182,153 @@ public:
     inline void syncTime(const time_point& n) { now = n; }
 
 private:
+    using Tick = uint64_t;
+    static constexpr unsigned BITS {6};
+    static constexpr unsigned SLOTS {1u << BITS};
+    static constexpr Tick MASK {SLOTS - 1};
+    static constexpr unsigned LEVELS {(64 + BITS - 1) / BITS};
+    static constexpr unsigned NO_SLOT {LEVELS * SLOTS};
+
+    struct Slot
+    {
+        Job* head {nullptr};
+        Job* tail {nullptr};
+        /* lower bound of the time of jobs in the slot */
+        time_point min {time_point::max()};
+    };
+
+    static Tick toTick(time_point t)
+    {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+        return ms > 0 ? (Tick) ms : 0;
+    }
+    static time_point fromTick(Tick t) { return time_point(std::chrono::milliseconds(t)); }
+
+    static unsigned firstBit(uint64_t v)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(v);
+#else
+        unsigned i = 0;
+        while (not(v & 1)) {
+            v >>= 1;
+            i++;
+        }
+        return i;
+#endif
+    }
+
+    /** Slot of the job, relative to the current tick */
+    unsigned slotFor(Tick t) const
+    {
+        t = std::max(t, cur_);
+        unsigned level = 0;
+        for (auto diff = (t ^ cur_) >> BITS; diff; diff >>= BITS)
+            level++;
+        return level * SLOTS + ((t >> (level * BITS)) & MASK);
+    }
+
+    /** First tick of a slot, relative to the current tick */
+    Tick slotTick(unsigned s) const
+    {
+        unsigned level = s / SLOTS;
+        unsigned shift = level * BITS;
+        Tick base = shift + BITS >= 64 ? 0 : (cur_ >> (shift + BITS)) << (shift + BITS);
+        return base | ((Tick) (s % SLOTS) << shift);
+    }
+
+    /** Earliest non-empty slot, or NO_SLOT */
+    unsigned nextSlot() const
+    {
+        for (unsigned level = 0; level < LEVELS; level++) {
+            if (auto used = occupied_[level]) {
+                // at upper levels, the slot of the current tick is always empty
+                auto from = (cur_ >> (level * BITS)) & MASK;
+                if (auto m = used & (~(uint64_t) 0 << from))
+                    return level * SLOTS + firstBit(m);
+            }
+        }
+        return NO_SLOT;
+    }
+
+    void link(Job& job)
+    {
+        auto s = slotFor(toTick(job.t_));
+        auto& slot = slots_[s];
+        job.slot_ = s;
+        job.next_ = nullptr;
+        job.prev_ = slot.tail;
+        if (slot.tail)
+            slot.tail->next_ = &job;
+        else {
+            slot.head = &job;
+            occupied_[s / SLOTS] |= (uint64_t) 1 << (s % SLOTS);
+        }
+        slot.tail = &job;
+        slot.min = std::min(slot.min, job.t_);
+    }
+
+    /** Remove the job from its slot, releasing the reference of the scheduler */
+    Sp<Job> unlink(Job& job)
+    {
+        auto& slot = slots_[job.slot_];
+        (job.prev_ ? job.prev_->next_ : slot.head) = job.next_;
+        (job.next_ ? job.next_->prev_ : slot.tail) = job.prev_;
+        if (not slot.head) {
+            occupied_[job.slot_ / SLOTS] &= ~((uint64_t) 1 << (job.slot_ % SLOTS));
+            slot.min = time_point::max();
+        }
+        job.slot_ = NO_SLOT;
+        job.prev_ = job.next_ = nullptr;
+        return std::move(job.self_);
+    }
+
+    void cascade(unsigned s)
+    {
+        auto& slot = slots_[s];
+        auto job = slot.head;
+        slot.head = slot.tail = nullptr;
+        slot.min = time_point::max();
+        occupied_[s / SLOTS] &= ~((uint64_t) 1 << (s % SLOTS));
+        while (job) {
+            auto next = job->next_;
+            link(*job);
+            job = next;
+        }
+    }
+
+    /** Runs the jobs of a first level slot due by now. Returns false if none is due. */
+    bool runSlot(unsigned s)
+    {
+        due_.clear();
+        for (auto job = slots_[s].head; job; job = job->next_)
+            if (job->t_ <= now)
+                due_.emplace_back(job->self_);
+        if (due_.empty())
+            return false;
+        std::sort(due_.begin(), due_.end(), [](const Sp<Job>& a, const Sp<Job>& b) {
+            return a->t_ < b->t_ or (a->t_ == b->t_ and a->seq_ < b->seq_);
+        });
+        auto jobs = std::move(due_);
+        for (auto& job : jobs) {
+            // jobs may be cancelled by previous ones
+            if (job->slot_ == NO_SLOT)
+                continue;
+            unlink(*job);
+            if (job->do_)
+                job->do_();
+        }
+        jobs.clear();
+        due_ = std::move(jobs);
+        return true;
+    }
+
     time_point now {clock::now()};
-    std::multimap<time_point, Sp<Job>> timers {}; /* the jobs ordered by time */
+    Tick cur_ {toTick(now)};
+    uint64_t seq_ {0};
+    std::array<uint64_t, LEVELS> occupied_ {};
+    std::array<Slot, LEVELS * SLOTS> slots_ {};
+    std::vector<Sp<Job>> due_ {};
 };
 
 } // namespace dht
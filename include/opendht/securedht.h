@@ -4,11 +4,15 @@
 
 #include "dht.h"
 #include "crypto.h"
+#include "lru_cache.h"
 
+#include <deque>
 #include <map>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <unordered_set>
 
 namespace dht {
 
@@ -176,7 +180,8 @@ public:
     /**
      * SecureDht to Dht proxy
      */
-    void shutdown(ShutdownCallback cb, bool stop = false) override { dht_->shutdown(cb, stop); }
+    /** Also fails the done callbacks of gets waiting for their values to be checked */
+    void shutdown(ShutdownCallback cb, bool stop = false) override;
     void dumpTables() const override { dht_->dumpTables(); }
     inline const InfoHash& getNodeId() const override { return dht_->getNodeId(); }
 
@@ -207,6 +212,18 @@ public:
             info.bound4 = sock->getBoundRef(AF_INET).getPort();
             info.bound6 = sock->getBoundRef(AF_INET6).getPort();
         }
+        auto packed = Value::getPackedCacheStats();
+        info.packed_cache_hits = packed.hits;
+        info.packed_cache_misses = packed.misses;
+        info.check_queue_depth = checkQueued_;
+        info.check_queue_max = checkQueueMax_;
+        info.checked_values = checkedValues_;
+        if (checkedValues_)
+            info.check_latency_mean = checkLatencyTotal_ / checkedValues_;
+        info.check_latency_max = checkLatencyMax_;
+        auto signatures = crypto::getSignatureCacheStats();
+        info.signature_cache_hits = signatures.hits;
+        info.signature_cache_misses = signatures.misses;
         return info;
     }
 
@@ -220,13 +237,27 @@ public:
     std::vector<SockAddr> getPublicAddress(sa_family_t family = 0) override { return dht_->getPublicAddress(family); }
     time_point periodic(const uint8_t* buf, size_t buflen, SockAddr sa, const time_point& now) override
     {
-        return dht_->periodic(buf, buflen, std::move(sa), now);
+        auto wakeup = dht_->periodic(buf, buflen, std::move(sa), now);
+        return std::min(wakeup, deliverChecked());
     }
     time_point periodic(
         const uint8_t* buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now) override
     {
-        return dht_->periodic(buf, buflen, from, fromlen, now);
+        auto wakeup = dht_->periodic(buf, buflen, from, fromlen, now);
+        return std::min(wakeup, deliverChecked());
     }
+    time_point periodic(const std::vector<net::ReceivedPacket>& packets, const time_point& now) override
+    {
+        auto wakeup = dht_->periodic(packets, now);
+        return std::min(wakeup, deliverChecked());
+    }
+
+    /**
+     * With Config::async_checks, set a callback called from the thread pool
+     * when checked values are ready to be delivered by periodic().
+     * Without it, periodic() asks to be called again shortly while values are checked.
+     */
+    void setOnChecksDone(std::function<void()> cb);
     NodeStatus updateStatus(sa_family_t af) override { return dht_->updateStatus(af); }
     NodeStatus getStatus(sa_family_t af) const override { return dht_->getStatus(af); }
     NodeStatus getStatus() const override { return dht_->getStatus(); }
@@ -297,7 +328,7 @@ public:
     {
         return listen(key, bindGetCb(cb), f, w);
     }
-    bool cancelListen(const InfoHash& h, size_t token) override { return dht_->cancelListen(h, token); }
+    bool cancelListen(const InfoHash& h, size_t token) override;
     void connectivityChanged(sa_family_t af) override { dht_->connectivityChanged(af); }
     void connectivityChanged() override { dht_->connectivityChanged(); }
 
@@ -335,13 +366,42 @@ private:
     SecureDht(const SecureDht&) = delete;
     SecureDht& operator=(const SecureDht&) = delete;
 
+    /* Values received by a callback, delivered in order once checked */
+    struct PendingCheck;
+    /* State shared with the thread pool */
+    struct CheckState;
+
+    /* Values are checked on the thread pool by batches of this size */
+    static constexpr size_t CHECK_BATCH {16};
+    /* Delay between calls to periodic() while values are checked, without a callback */
+    static constexpr duration CHECK_POLL_PERIOD {std::chrono::milliseconds(5)};
+
     Sp<Value> checkValue(const Sp<Value>& v);
-    ValueCallback getCallbackFilter(const ValueCallback&, Value::Filter&&);
-    GetCallback getCallbackFilter(const GetCallback&, Value::Filter&&);
+    /* fresh: the value was not checked before, its owner can be cached */
+    Sp<Value> checkValue(const Sp<Value>& v, bool fresh);
+    void enqueueCheck(const std::vector<Sp<Value>>& values,
+                      std::function<void(std::vector<Sp<Value>>&&)>&& deliver,
+                      std::function<void()>&& abort = {});
+    void submitChecks();
+    /* Deliver values checked so far, returns when periodic() must be called again */
+    time_point deliverChecked();
+    /* Drop checks waiting to be delivered */
+    void abortChecks();
+    /* Flag stopping the delivery of checked values to a listen callback */
+    Sp<bool> newListenStop();
+
+    ValueCallback getCallbackFilter(const ValueCallback&, Value::Filter&&, Sp<bool> stopped = {});
+    GetCallback getCallbackFilter(const GetCallback&, Value::Filter&&, Sp<bool> stopped = {});
 
     Sp<crypto::Certificate> registerCertificate(const InfoHash& node, const Blob& cert);
     Sp<crypto::Certificate> registerCertificate(const PkId& node, const Blob& cert);
 
+    struct KnownKey;
+    /* Cache entry for a key, nullptr if the cache is disabled */
+    KnownKey* cacheKey(const PkId& id, const InfoHash& shortId);
+    void cachePublicKey(const Sp<crypto::PublicKey>& pk);
+    const KnownKey* findKey(const InfoHash& node) const;
+
     Sp<crypto::PrivateKey> key_ {};
     Sp<crypto::Certificate> certificate_ {};
 
@@ -349,14 +409,40 @@ private:
     CertificateStoreQuery localQueryMethod_ {};
     CertificateStoreQueryLegacy localQueryMethodLegacy_ {};
 
-    // our certificate cache
-    std::map<InfoHash, Sp<crypto::Certificate>> nodesCertificates_ {};
-    std::map<InfoHash, Sp<crypto::PublicKey>> nodesPubKeys_ {};
-    std::map<PkId, Sp<crypto::Certificate>> nodesCertificatesLong_ {};
-    std::map<PkId, Sp<crypto::PublicKey>> nodesPubKeysLong_ {};
+    // our certificate cache, by public key long id
+    struct KnownKey
+    {
+        Sp<crypto::Certificate> certificate;
+        Sp<crypto::PublicKey> publicKey;
+    };
+    mutable LruCache<PkId, KnownKey> knownKeys_;
+    /* long ids of known keys by short id, possibly evicted from knownKeys_ */
+    mutable FlatHashMap<InfoHash, PkId> knownKeyIds_ {};
 
     std::atomic_bool forward_all_ {false};
     bool enableCache_ {false};
+
+    // values being checked on the thread pool, and waiting to be delivered
+    const bool asyncChecks_ {false};
+    const size_t maxPendingChecks_;
+    Sp<CheckState> checkState_;
+    std::deque<Sp<PendingCheck>> checks_ {};
+    /* index of the first check not submitted to the thread pool */
+    size_t nextCheck_ {0};
+    /* values submitted to the thread pool, or waiting to be */
+    size_t checksRunning_ {0};
+    size_t checksWaiting_ {0};
+    /* values checked in the background for a callback, not delivered yet */
+    std::unordered_set<const Value*> checking_ {};
+    bool delivering_ {false};
+    /* stop flags of listens, by token */
+    std::map<size_t, Sp<bool>> listenStopped_ {};
+
+    size_t checkQueued_ {0};
+    size_t checkQueueMax_ {0};
+    uint64_t checkedValues_ {0};
+    uint64_t checkLatencyTotal_ {0};
+    uint64_t checkLatencyMax_ {0};
 };
 
 const ValueType CERTIFICATE_TYPE = {8,
@@ -33,6 +33,7 @@ typedef uint16_t in_port_t;
 
 #include <cstring>
 #include <cstddef>
+#include <algorithm>
 
 namespace dht {
 
@@ -283,23 +284,35 @@ public:
         {
             if (a.len != b.len)
                 return a.len < b.len;
-            socklen_t start, len;
-            switch (a.getFamily()) {
-            case AF_INET:
-                start = offsetof(sockaddr_in, sin_addr);
-                len = sizeof(in_addr);
-                break;
-            case AF_INET6:
-                start = offsetof(sockaddr_in6, sin6_addr);
-                // don't consider more than 64 bits (IPv6)
-                len = 8;
-                break;
-            default:
-                start = 0;
-                len = a.len;
-                break;
+            auto ip = a.ipRange();
+            return std::memcmp((uint8_t*) a.get() + ip.first, (uint8_t*) b.get() + ip.first, ip.second) < 0;
+        }
+    };
+    /** Hash and equality considering the same bytes as ipCmp, for unordered containers */
+    struct ipHash
+    {
+        size_t operator()(const SockAddr& a) const noexcept
+        {
+            auto ip = a.ipRange();
+            const auto* data = (const uint8_t*) a.get() + ip.first;
+            uint64_t h = a.len;
+            for (socklen_t i = 0; i < ip.second; i += sizeof(uint64_t)) {
+                uint64_t w = 0;
+                std::memcpy(&w, data + i, std::min<size_t>(sizeof(w), ip.second - i));
+                h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+                h ^= h >> 32;
             }
-            return std::memcmp((uint8_t*) a.get() + start, (uint8_t*) b.get() + start, len) < 0;
+            return (size_t) h;
+        }
+    };
+    struct ipEqual
+    {
+        bool operator()(const SockAddr& a, const SockAddr& b) const
+        {
+            if (a.len != b.len)
+                return false;
+            auto ip = a.ipRange();
+            return std::memcmp((uint8_t*) a.get() + ip.first, (uint8_t*) b.get() + ip.first, ip.second) == 0;
         }
     };
     friend std::ostream& operator<<(std::ostream& s, const SockAddr& h)
@@ -309,6 +322,20 @@ public:
     }
 
 private:
+    /** Offset and length of the bytes identifying the IP address */
+    std::pair<socklen_t, socklen_t> ipRange() const
+    {
+        switch (getFamily()) {
+        case AF_INET:
+            return {offsetof(sockaddr_in, sin_addr), sizeof(in_addr)};
+        case AF_INET6:
+            // don't consider more than 64 bits (IPv6)
+            return {offsetof(sockaddr_in6, sin6_addr), 8};
+        default:
+            return {0, len};
+        }
+    }
+
     struct free_delete
     {
         void operator()(void* p) { ::free(p); }
@@ -332,6 +359,27 @@ private:
 
 } // namespace dht
 
+namespace std {
+/** Hash of the whole address, consistent with SockAddr::equals() */
+template<>
+struct hash<dht::SockAddr>
+{
+    size_t operator()(const dht::SockAddr& addr) const noexcept
+    {
+        const auto* data = (const uint8_t*) addr.get();
+        const size_t len = addr.getLength();
+        uint64_t h = len;
+        for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+            uint64_t w = 0;
+            std::memcpy(&w, data + i, std::min(sizeof(w), len - i));
+            h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 32;
+        }
+        return (size_t) h;
+    }
+};
+} // namespace std
+
 #if FMT_VERSION >= 90000
 template<>
 struct fmt::formatter<dht::SockAddr> : ostream_formatter
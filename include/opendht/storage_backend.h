@@ -0,0 +1,160 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "infohash.h"
+#include "sockaddr.h"
+#include "value.h"
+#include "utils.h"
+#include "flat_hash_map.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace dht {
+
+/**
+ * Persistent storage of the values stored by a node.
+ *
+ * The node keeps serving its values from memory: it records changes of its
+ * storage in the backend, and loads values back from it when starting.
+ * A backend makes the storage persistent, it doesn't extend it: every value
+ * is also held in memory, within Config::max_store_size.
+ * Values expire by themselves: the node doesn't record expirations.
+ * Backends are used by one thread at a time: the thread of the node, or an
+ * I/O thread calling maintain() and sync() while the node queues changes.
+ */
+class OPENDHT_PUBLIC StorageBackend
+{
+public:
+    struct StoredValue
+    {
+        InfoHash key;
+        Value::Id id;
+        /** Packed value, valid during the callback */
+        const uint8_t* data;
+        size_t size;
+        time_point created;
+        time_point expiration;
+        /** Address of the node that stored the value, unset for local values */
+        SockAddr from;
+    };
+
+    virtual ~StorageBackend() = default;
+
+    /** Record a new value, or replace the value with the same id */
+    virtual void put(const InfoHash& key,
+                     const Value& value,
+                     time_point created,
+                     time_point expiration,
+                     const SockAddr& from)
+        = 0;
+    /** Record a new expiration time of a value */
+    virtual void refresh(const InfoHash& key, Value::Id id, time_point expiration) = 0;
+    /** Record the removal of a value */
+    virtual void erase(const InfoHash& key, Value::Id id) = 0;
+
+    /** Call cb for every value not expired at now */
+    virtual void load(time_point now, const std::function<void(const StoredValue&)>& cb) = 0;
+
+    /** Reclaim the space used by values expired at now or removed */
+    virtual void maintain(time_point /*now*/) {}
+    /** Make recorded changes durable */
+    virtual void sync() {}
+};
+
+/**
+ * Storage backend keeping values in an append-only log file.
+ *
+ * Every change is appended to the log as a record. An in-memory hash index
+ * locates the last record of each value, that is read from a memory mapping
+ * of the log, reserved larger than the file to avoid remapping it. When
+ * removed and expired values use most of the log, live values are copied in
+ * a new log replacing the previous one.
+ *
+ * Records are written by blocks of 64 KiB, or when synced. A record being
+ * written when the process stopped is discarded on opening.
+ * After a failed write, the log is cut at the last complete record and the
+ * records are written again later, so that no record follows a partial one.
+ */
+class OPENDHT_PUBLIC LogStorageBackend : public StorageBackend
+{
+public:
+    /* Logs are compacted once they hold at least this many bytes of removed or expired values */
+    static constexpr size_t COMPACT_MIN_SIZE {1024 * 1024};
+
+    explicit LogStorageBackend(std::string path, size_t compact_min_size = COMPACT_MIN_SIZE);
+    ~LogStorageBackend();
+    LogStorageBackend(const LogStorageBackend&) = delete;
+    LogStorageBackend& operator=(const LogStorageBackend&) = delete;
+
+    void put(const InfoHash& key,
+             const Value& value,
+             time_point created,
+             time_point expiration,
+             const SockAddr& from) override;
+    void refresh(const InfoHash& key, Value::Id id, time_point expiration) override;
+    void erase(const InfoHash& key, Value::Id id) override;
+    void load(time_point now, const std::function<void(const StoredValue&)>& cb) override;
+    void maintain(time_point now) override;
+    void sync() override;
+
+    /** Packed value of id at key, empty if not found */
+    Blob get(const InfoHash& key, Value::Id id);
+
+    /** Copy live values in a new log */
+    void compact(time_point now);
+
+    size_t valueCount() const { return index_.size(); }
+    /** Size of the log file */
+    size_t size() const { return size_; }
+    /** Bytes of the log used by removed, replaced or expired values */
+    size_t deadSize() const { return dead_; }
+
+private:
+    struct ValueKey
+    {
+        InfoHash key;
+        Value::Id id;
+        bool operator==(const ValueKey& o) const { return id == o.id and key == o.key; }
+    };
+    struct ValueKeyHash
+    {
+        size_t operator()(const ValueKey& k) const
+        {
+            return std::hash<InfoHash> {}(k.key) ^ detail::SeededHash {}(k.id);
+        }
+    };
+    struct Location
+    {
+        /* offset and size of the put record */
+        uint64_t offset;
+        uint32_t size;
+        /* system time in milliseconds, possibly refreshed */
+        int64_t expiration;
+    };
+    class MappedFile;
+
+    void open();
+    void replay();
+    void append(const uint8_t* record, size_t size);
+    /** Write the appended records if they hold at least min_size bytes */
+    void writePending(size_t min_size = 0);
+    const uint8_t* map(uint64_t offset, size_t size);
+    void forEach(time_point now, const std::function<void(const ValueKey&, const Location&, const uint8_t*)>& cb);
+
+    const std::string path_;
+    const size_t compact_min_size_;
+    std::FILE* file_ {nullptr};
+    std::unique_ptr<MappedFile> map_;
+    FlatHashMap<ValueKey, Location, ValueKeyHash> index_;
+    size_t size_ {0};
+    /* bytes of the log in the file, followed by the pending records */
+    size_t written_ {0};
+    std::vector<uint8_t> pending_;
+    size_t dead_ {0};
+    std::vector<uint8_t> buffer_;
+};
+
+} // namespace dht
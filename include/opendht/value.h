@@ -18,6 +18,7 @@
 #include <algorithm>
 #include <functional>
 #include <memory>
+#include <atomic>
 #include <chrono>
 #include <set>
 
@@ -376,7 +377,7 @@ struct OPENDHT_PUBLIC Value
      * Check that the value is signed and that the signature matches.
      * If true, the owner field will contain the signer public key.
      */
-    inline bool checkSignature() const { return isSigned() and owner->checkSignature(getToSign(), signature); }
+    inline bool checkSignature() const { return isSigned() and owner->checkSignature(*getToSignRef(), signature); }
 
     inline std::shared_ptr<crypto::PublicKey> getOwner() const { return owner; }
 
@@ -453,6 +454,9 @@ struct OPENDHT_PUBLIC Value
         , cypher(std::move(o.cypher))
         , priority(o.priority)
         , pushType(std::move(o.pushType))
+        , immutable_(o.immutable_.load())
+        , packed_(std::move(o.packed_))
+        , packedToSign_(std::move(o.packedToSign_))
     {}
 
     template<typename Type>
@@ -478,20 +482,27 @@ struct OPENDHT_PUBLIC Value
     inline bool operator==(const Value& o) const { return id == o.id and contentEquals(o); }
     inline bool operator!=(const Value& o) const { return !(*this == o); }
 
-    inline void setRecipient(const InfoHash& r) { recipient = r; }
+    inline void setRecipient(const InfoHash& r)
+    {
+        recipient = r;
+        invalidatePacked();
+    }
 
-    inline void setCypher(Blob&& c) { cypher = std::move(c); }
+    inline void setCypher(Blob&& c)
+    {
+        cypher = std::move(c);
+        invalidatePacked();
+    }
 
     /**
      * Pack part of the data to be signed (must always be done the same way)
      */
-    inline Blob getToSign() const
-    {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        msgpack_pack_to_sign(pk);
-        return {buffer.data(), buffer.data() + buffer.size()};
-    }
+    inline Blob getToSign() const { return *getToSignRef(); }
+
+    /**
+     * Part of the data to be signed, packed once if the value is immutable.
+     */
+    std::shared_ptr<const Blob> getToSignRef() const;
 
     /**
      * Pack part of the data to be encrypted
@@ -621,13 +632,32 @@ struct OPENDHT_PUBLIC Value
 
     void msgpack_unpack(const msgpack::object& o);
     void msgpack_unpack_body(const msgpack::object& o);
-    Blob getPacked() const
+    Blob getPacked() const { return *getPackedRef(); }
+
+    /**
+     * Packed value, as written by msgpack_pack().
+     * For immutable values, computed once and shared, so that values sent
+     * many times are only serialized once.
+     */
+    std::shared_ptr<const Blob> getPackedRef() const;
+
+    /**
+     * Mark the value as not modified anymore, so that its packed encodings
+     * are cached. Set by the node on values it stores for other nodes.
+     */
+    void setImmutable() { immutable_ = true; }
+    bool isImmutable() const { return immutable_; }
+
+    /** Drop the cached packed encodings, called by the modifying methods of Value */
+    void invalidatePacked();
+
+    struct PackedCacheStats
     {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        pk.pack(*this);
-        return {buffer.data(), buffer.data() + buffer.size()};
-    }
+        uint64_t hits {0};
+        uint64_t misses {0};
+    };
+    /** Process-wide usage of the packed encoding caches */
+    static PackedCacheStats getPackedCacheStats();
 
     void msgpack_unpack_fields(const std::set<Value::Field>& fields, const msgpack::object& o, unsigned offset);
 
@@ -696,6 +726,11 @@ private:
     bool signatureValid {false};
     bool decrypted {false};
     Sp<Value> decryptedValue {};
+
+    /* Cache for packed encodings of immutable values, guarded by a lock of value.cpp */
+    std::atomic_bool immutable_ {false};
+    mutable std::shared_ptr<const Blob> packed_ {};
+    mutable std::shared_ptr<const Blob> packedToSign_ {};
 };
 
 using ValuesExport = std::pair<InfoHash, Blob>;
@@ -7,6 +7,8 @@
 
 #include "callbacks.h"
 
+#include <algorithm>
+
 namespace dht {
 
 GetCallbackSimple
@@ -62,6 +64,29 @@ bindDoneCb(DoneCallbackSimple donecb)
     return std::bind(std::move(donecb), _1);
 }
 
+DoneCallback
+aggregateDoneCb(size_t count, DoneCallback donecb)
+{
+    struct Result
+    {
+        size_t remaining;
+        bool ok {true};
+        std::vector<std::shared_ptr<Node>> nodes {};
+        DoneCallback cb;
+    };
+    auto res = std::make_shared<Result>(Result {count, true, {}, std::move(donecb)});
+    return [res](bool ok, const std::vector<std::shared_ptr<Node>>& nodes) {
+        res->ok = res->ok and ok;
+        res->nodes.insert(res->nodes.end(), nodes.begin(), nodes.end());
+        if (--res->remaining)
+            return;
+        std::sort(res->nodes.begin(), res->nodes.end());
+        res->nodes.erase(std::unique(res->nodes.begin(), res->nodes.end()), res->nodes.end());
+        if (auto cb = std::move(res->cb))
+            cb(res->ok, res->nodes);
+    };
+}
+
 DoneCallback
 bindDoneCb(DoneCallbackRaw raw_cb, void* user_data)
 {
@@ -93,6 +118,9 @@ NodeStats::toString() const
         ss << "Routing table depth: " << table_depth << std::endl;
         ss << "Network size estimation: " << getNetworkSizeEstimation() << " nodes" << std::endl;
     }
+    if (rtt_p50)
+        ss << "Round trip time: " << rtt_p50 / 1000. << " ms median, " << rtt_p90 / 1000. << " ms p90, "
+           << rtt_p99 / 1000. << " ms p99" << std::endl;
     return ss.str();
 }
 
@@ -111,6 +139,11 @@ NodeStats::toJson() const
         val["table_depth"] = static_cast<Json::LargestUInt>(table_depth);
         val["network_size_estimation"] = static_cast<Json::LargestUInt>(getNetworkSizeEstimation());
     }
+    if (rtt_p50) {
+        val["rtt_p50"] = static_cast<Json::LargestUInt>(rtt_p50);
+        val["rtt_p90"] = static_cast<Json::LargestUInt>(rtt_p90);
+        val["rtt_p99"] = static_cast<Json::LargestUInt>(rtt_p99);
+    }
     return val;
 }
 
@@ -124,6 +157,11 @@ NodeStats::NodeStats(const Json::Value& val)
         incoming_nodes = static_cast<unsigned>(val["incoming"].asLargestUInt());
     if (val.isMember("table_depth"))
         table_depth = static_cast<unsigned>(val["table_depth"].asLargestUInt());
+    if (val.isMember("rtt_p50")) {
+        rtt_p50 = static_cast<unsigned>(val["rtt_p50"].asLargestUInt());
+        rtt_p90 = static_cast<unsigned>(val["rtt_p90"].asLargestUInt());
+        rtt_p99 = static_cast<unsigned>(val["rtt_p99"].asLargestUInt());
+    }
 }
 
 /**
@@ -145,6 +183,18 @@ NodeInfo::toJson() const
     val["local_storage_size"] = Json::Value::LargestUInt(local_storage_size);
     val["port_ipv4"] = Json::Value::LargestUInt(bound4);
     val["port_ipv6"] = Json::Value::LargestUInt(bound6);
+    val["rx_queue_depth"] = Json::Value::LargestUInt(rx_queue_depth);
+    val["rx_queue_max"] = Json::Value::LargestUInt(rx_queue_max);
+    val["rx_queue_dropped"] = Json::Value::LargestUInt(rx_queue_dropped);
+    val["packed_cache_hits"] = Json::Value::LargestUInt(packed_cache_hits);
+    val["packed_cache_misses"] = Json::Value::LargestUInt(packed_cache_misses);
+    val["check_queue_depth"] = Json::Value::LargestUInt(check_queue_depth);
+    val["check_queue_max"] = Json::Value::LargestUInt(check_queue_max);
+    val["checked_values"] = Json::Value::LargestUInt(checked_values);
+    val["check_latency_mean"] = Json::Value::LargestUInt(check_latency_mean);
+    val["check_latency_max"] = Json::Value::LargestUInt(check_latency_max);
+    val["signature_cache_hits"] = Json::Value::LargestUInt(signature_cache_hits);
+    val["signature_cache_misses"] = Json::Value::LargestUInt(signature_cache_misses);
     return val;
 }
 
@@ -162,6 +212,18 @@ NodeInfo::NodeInfo(const Json::Value& v)
     local_storage_size = v["local_storage_size"].asLargestUInt();
     bound4 = v["port_ipv4"].asLargestUInt();
     bound6 = v["port_ipv6"].asLargestUInt();
+    rx_queue_depth = v["rx_queue_depth"].asLargestUInt();
+    rx_queue_max = v["rx_queue_max"].asLargestUInt();
+    rx_queue_dropped = v["rx_queue_dropped"].asLargestUInt();
+    packed_cache_hits = v["packed_cache_hits"].asLargestUInt();
+    packed_cache_misses = v["packed_cache_misses"].asLargestUInt();
+    check_queue_depth = v["check_queue_depth"].asLargestUInt();
+    check_queue_max = v["check_queue_max"].asLargestUInt();
+    checked_values = v["checked_values"].asLargestUInt();
+    check_latency_mean = v["check_latency_mean"].asLargestUInt();
+    check_latency_max = v["check_latency_max"].asLargestUInt();
+    signature_cache_hits = v["signature_cache_hits"].asLargestUInt();
+    signature_cache_misses = v["signature_cache_misses"].asLargestUInt();
 }
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "crypto.h"
 #include "rng.h"
+#include "lru_cache.h"
 
 extern "C" {
 #include <gnutls/gnutls.h>
@@ -11,11 +12,13 @@ extern "C" {
 #include <nettle/gcm.h>
 #include <nettle/aes.h>
 #include <nettle/hmac.h>
+#include <nettle/curve25519.h>
 #include <gnutls/crypto.h>
 
 #include <argon2.h>
 }
 
+#include <array>
 #include <random>
 #include <sstream>
 #include <fstream>
@@ -350,6 +353,25 @@ PrivateKey::operator=(PrivateKey&& o) noexcept
     return *this;
 }
 
+/**
+ * Signature algorithm of data signed by keys of algorithm algo.
+ * The digest is SHA-512, Ed25519 using its own.
+ */
+static gnutls_sign_algorithm_t
+signatureAlgorithm(int algo)
+{
+    switch (algo) {
+    case GNUTLS_PK_ECDSA:
+        return GNUTLS_SIGN_ECDSA_SHA512;
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    case GNUTLS_PK_EDDSA_ED25519:
+        return GNUTLS_SIGN_EDDSA_ED25519;
+#endif
+    default:
+        return GNUTLS_SIGN_RSA_SHA512;
+    }
+}
+
 Blob
 PrivateKey::sign(const uint8_t* data, size_t data_length) const
 {
@@ -359,13 +381,212 @@ PrivateKey::sign(const uint8_t* data, size_t data_length) const
         throw CryptoException("Unable to sign data: too large.");
     gnutls_datum_t sig {nullptr, 0};
     const gnutls_datum_t dat {(unsigned char*) data, (unsigned) data_length};
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    auto algo = signatureAlgorithm(gnutls_privkey_get_pk_algorithm(key, nullptr));
+    if (gnutls_privkey_sign_data2(key, algo, 0, &dat, &sig) != GNUTLS_E_SUCCESS)
+        throw CryptoException("Unable to sign data.");
+#else
     if (gnutls_privkey_sign_data(key, GNUTLS_DIG_SHA512, 0, &dat, &sig) != GNUTLS_E_SUCCESS)
         throw CryptoException("Unable to sign data.");
+#endif
     Blob ret(sig.data, sig.data + sig.size);
     gnutls_free(sig.data);
     return ret;
 }
 
+/*
+ * Sealed boxes: data encrypted to an Ed25519 key, using the X25519 key of the
+ * same secret (RFC 7748 birational map, as done by libsodium).
+ * Layout: ephemeral X25519 public key, then the AES-256-GCM encrypted data
+ * with a key derived from the shared secret and both public keys.
+ */
+static constexpr size_t SEALED_KEY_SIZE {CURVE25519_SIZE};
+
+namespace {
+
+/* Integers modulo 2^255-19 in 16 limbs of 16 bits, as in TweetNaCl */
+using Fe = std::array<int64_t, 16>;
+
+void
+feCarry(Fe& o)
+{
+    for (int i = 0; i < 16; i++) {
+        o[i] += 1 << 16;
+        int64_t c = o[i] >> 16;
+        o[(i + 1) % 16] += c - 1 + (i == 15 ? 37 * (c - 1) : 0);
+        o[i] -= c * (1 << 16);
+    }
+}
+
+Fe
+feMul(const Fe& a, const Fe& b)
+{
+    std::array<int64_t, 31> t {};
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 16; j++)
+            t[i + j] += a[i] * b[j];
+    Fe o;
+    for (int i = 0; i < 16; i++)
+        o[i] = t[i] + (i < 15 ? 38 * t[i + 16] : 0);
+    feCarry(o);
+    feCarry(o);
+    return o;
+}
+
+/* a^(2^n) */
+Fe
+feSquare(Fe a, unsigned n = 1)
+{
+    while (n--)
+        a = feMul(a, a);
+    return a;
+}
+
+/* a^(p-2), with the addition chain of ref10 */
+Fe
+feInvert(const Fe& a)
+{
+    auto a2 = feSquare(a);
+    auto a9 = feMul(feSquare(a2, 2), a);
+    auto a11 = feMul(a9, a2);
+    auto a5_0 = feMul(feSquare(a11), a9);
+    auto a10_0 = feMul(feSquare(a5_0, 5), a5_0);
+    auto a20_0 = feMul(feSquare(a10_0, 10), a10_0);
+    auto a40_0 = feMul(feSquare(a20_0, 20), a20_0);
+    auto a50_0 = feMul(feSquare(a40_0, 10), a10_0);
+    auto a100_0 = feMul(feSquare(a50_0, 50), a50_0);
+    auto a200_0 = feMul(feSquare(a100_0, 100), a100_0);
+    auto a250_0 = feMul(feSquare(a200_0, 50), a50_0);
+    return feMul(feSquare(a250_0, 5), a11);
+}
+
+void
+fePack(uint8_t* out, const Fe& n)
+{
+    Fe t = n;
+    feCarry(t);
+    feCarry(t);
+    feCarry(t);
+    for (int j = 0; j < 2; j++) {
+        // subtract p if t >= p
+        Fe m;
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        m[14] &= 0xffff;
+        if (not((m[15] >> 16) & 1))
+            t = m;
+    }
+    for (int i = 0; i < 16; i++) {
+        out[2 * i] = t[i] & 0xff;
+        out[2 * i + 1] = (t[i] >> 8) & 0xff;
+    }
+}
+
+/* X25519 public key of an Ed25519 public key: u = (1 + y) / (1 - y) */
+std::array<uint8_t, SEALED_KEY_SIZE>
+montgomeryKey(const uint8_t* edwards)
+{
+    Fe y, one {1}, num, den;
+    for (int i = 0; i < 16; i++)
+        y[i] = edwards[2 * i] | ((int64_t) edwards[2 * i + 1] << 8);
+    y[15] &= 0x7fff;
+    for (int i = 0; i < 16; i++) {
+        num[i] = one[i] + y[i];
+        den[i] = one[i] - y[i];
+    }
+    std::array<uint8_t, SEALED_KEY_SIZE> ret;
+    fePack(ret.data(), feMul(num, feInvert(den)));
+    return ret;
+}
+
+/* X25519 secret key of an Ed25519 private key: the clamped hash of its seed */
+std::array<uint8_t, SEALED_KEY_SIZE>
+montgomerySecret(const uint8_t* seed)
+{
+    std::array<uint8_t, SHA512_DIGEST_SIZE> h;
+    struct sha512_ctx ctx;
+    sha512_init(&ctx);
+    sha512_update(&ctx, SEALED_KEY_SIZE, seed);
+    sha512_digest(&ctx, h.size(), h.data());
+    std::array<uint8_t, SEALED_KEY_SIZE> ret;
+    std::copy_n(h.begin(), ret.size(), ret.begin());
+    ret[0] &= 248;
+    ret[31] &= 127;
+    ret[31] |= 64;
+    return ret;
+}
+
+/* Raw Ed25519 public key of pk, or seed of key if set */
+Blob
+exportEd25519(gnutls_pubkey_t pk, gnutls_privkey_t key)
+{
+    gnutls_ecc_curve_t curve;
+    gnutls_datum_t x {nullptr, 0}, k {nullptr, 0};
+    int err = key ? gnutls_privkey_export_ecc_raw(key, &curve, &x, nullptr, &k)
+                  : gnutls_pubkey_export_ecc_raw(pk, &curve, &x, nullptr);
+    if (err != GNUTLS_E_SUCCESS)
+        throw CryptoException(std::string("Unable to export Ed25519 key: ") + gnutls_strerror(err));
+    const auto& raw = key ? k : x;
+    Blob ret(raw.data, raw.data + raw.size);
+    gnutls_free(x.data);
+    gnutls_free(k.data);
+    if (ret.size() != SEALED_KEY_SIZE)
+        throw CryptoException("Unexpected Ed25519 key size");
+    return ret;
+}
+
+/* AES key of a sealed box */
+Blob
+sealedKey(const uint8_t* shared, const uint8_t* ephemeral, const uint8_t* recipient)
+{
+    // low order points give a null secret
+    if (std::all_of(shared, shared + SEALED_KEY_SIZE, [](uint8_t b) { return b == 0; }))
+        throw DecryptError("Invalid X25519 key");
+    Blob key(SHA256_DIGEST_SIZE);
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, SEALED_KEY_SIZE, shared);
+    sha256_update(&ctx, SEALED_KEY_SIZE, ephemeral);
+    sha256_update(&ctx, SEALED_KEY_SIZE, recipient);
+    sha256_digest(&ctx, key.size(), key.data());
+    return key;
+}
+
+Blob
+sealEd25519(gnutls_pubkey_t pk, const uint8_t* data, size_t data_len)
+{
+    auto recipient = montgomeryKey(exportEd25519(pk, nullptr).data());
+    std::array<uint8_t, SEALED_KEY_SIZE> secret, shared;
+    if (gnutls_rnd(GNUTLS_RND_KEY, secret.data(), secret.size()) != GNUTLS_E_SUCCESS)
+        throw CryptoException("Unable to generate ephemeral key");
+    Blob ret(SEALED_KEY_SIZE);
+    curve25519_mul_g(ret.data(), secret.data());
+    curve25519_mul(shared.data(), secret.data(), recipient.data());
+    auto encrypted = aesEncrypt(data, data_len, sealedKey(shared.data(), ret.data(), recipient.data()));
+    ret.insert(ret.end(), encrypted.begin(), encrypted.end());
+    return ret;
+}
+
+Blob
+openEd25519(gnutls_privkey_t key, const uint8_t* cypher, size_t cypher_len)
+{
+    if (cypher_len <= SEALED_KEY_SIZE)
+        throw DecryptError("Unexpected cipher length");
+    auto secret = montgomerySecret(exportEd25519(nullptr, key).data());
+    std::array<uint8_t, SEALED_KEY_SIZE> recipient, shared;
+    curve25519_mul_g(recipient.data(), secret.data());
+    curve25519_mul(shared.data(), secret.data(), cypher);
+    return aesDecrypt(cypher + SEALED_KEY_SIZE,
+                      cypher_len - SEALED_KEY_SIZE,
+                      sealedKey(shared.data(), cypher, recipient.data()));
+}
+
+} // namespace
+
 Blob
 PrivateKey::decryptBloc(const uint8_t* src, size_t src_size) const
 {
@@ -389,12 +610,16 @@ PrivateKey::decrypt(const uint8_t* cypher, size_t cypher_len) const
     int algo = gnutls_privkey_get_pk_algorithm(key, &key_len);
     if (algo < 0)
         throw CryptoException("Unable to read public key length.");
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    if (algo == GNUTLS_PK_EDDSA_ED25519)
+        return openEd25519(key, cypher, cypher_len);
+#endif
     if (algo != GNUTLS_PK_RSA
 #if GNUTLS_VERSION_NUMBER >= 0x030804
         && algo != GNUTLS_PK_RSA_OAEP
 #endif
     )
-        throw CryptoException("Must be an RSA key");
+        throw CryptoException("Must be an RSA or Ed25519 key");
 
     unsigned cypher_block_sz = key_len / 8;
     if (cypher_len < cypher_block_sz)
@@ -544,15 +769,182 @@ PublicKey::msgpack_unpack(const msgpack::object& o)
     }
 }
 
+struct BlobHash
+{
+    size_t operator()(const Blob& b) const
+    {
+        return std::hash<std::string_view> {}(std::string_view((const char*) b.data(), b.size()));
+    }
+};
+
+/* Keys imported from their serialized data */
+struct PublicKeyCache
+{
+    std::mutex lock;
+    LruCache<Blob, std::shared_ptr<PublicKey>, BlobHash> entries {PUBLIC_KEY_CACHE_SIZE};
+    uint64_t hits {0};
+    uint64_t misses {0};
+};
+
+static PublicKeyCache&
+publicKeyCache()
+{
+    static PublicKeyCache cache;
+    return cache;
+}
+
+std::shared_ptr<PublicKey>
+importPublicKey(const uint8_t* data, size_t size)
+{
+    auto& cache = publicKeyCache();
+    Blob packed(data, data + size);
+    {
+        std::lock_guard lk(cache.lock);
+        if (auto pk = cache.entries.get(packed)) {
+            cache.hits++;
+            return *pk;
+        }
+        cache.misses++;
+    }
+    auto pk = std::make_shared<PublicKey>(data, size);
+    std::lock_guard lk(cache.lock);
+    // keep the key imported first by concurrent threads
+    if (auto cached = cache.entries.peek(packed))
+        return *cached;
+    cache.entries.put(packed, pk);
+    return pk;
+}
+
+std::shared_ptr<PublicKey>
+importPublicKey(const msgpack::object& o)
+{
+    if (o.type == msgpack::type::BIN)
+        return importPublicKey((const uint8_t*) o.via.bin.ptr, o.via.bin.size);
+    Blob dat = unpackBlob(o);
+    return importPublicKey(dat.data(), dat.size());
+}
+
+void
+setPublicKeyCacheSize(size_t size)
+{
+    auto& cache = publicKeyCache();
+    std::lock_guard lk(cache.lock);
+    cache.entries.setCapacity(size);
+}
+
+CacheStats
+getPublicKeyCacheStats()
+{
+    auto& cache = publicKeyCache();
+    std::lock_guard lk(cache.lock);
+    return {cache.hits, cache.misses, cache.entries.size()};
+}
+
+/* Keys of verified signatures, sharded by key so that concurrent checks rarely share a lock */
+struct SignatureCache
+{
+    struct Shard
+    {
+        std::mutex lock;
+        LruCache<PkId, bool> entries {shardCapacity(SIGNATURE_CACHE_SIZE)};
+        uint64_t hits {0};
+        uint64_t misses {0};
+    };
+    std::array<Shard, SIGNATURE_CACHE_SHARDS> shards;
+    std::atomic_bool enabled {true};
+
+    /* The capacity is split evenly between shards, rounded up */
+    static constexpr size_t shardCapacity(size_t size)
+    {
+        return (size + SIGNATURE_CACHE_SHARDS - 1) / SIGNATURE_CACHE_SHARDS;
+    }
+
+    /* Keys are SHA-256 digests: their first bytes are evenly distributed */
+    Shard& shard(const PkId& key) { return shards[key[0] % SIGNATURE_CACHE_SHARDS]; }
+};
+
+static SignatureCache&
+signatureCache()
+{
+    static SignatureCache cache;
+    return cache;
+}
+
+static PkId
+signatureKey(const PkId& keyId, const uint8_t* data, size_t data_len, const uint8_t* signature, size_t signature_len)
+{
+    gnutls_hash_hd_t h;
+    if (auto err = gnutls_hash_init(&h, GNUTLS_DIG_SHA256))
+        throw CryptoException(std::string("Unable to compute hash: ") + gnutls_strerror(err));
+    // the length of the signature delimits it from the data
+    uint8_t len[4] = {(uint8_t) (signature_len >> 24),
+                      (uint8_t) (signature_len >> 16),
+                      (uint8_t) (signature_len >> 8),
+                      (uint8_t) signature_len};
+    gnutls_hash(h, keyId.data(), keyId.size());
+    gnutls_hash(h, len, sizeof(len));
+    gnutls_hash(h, signature, signature_len);
+    gnutls_hash(h, data, data_len);
+    PkId ret;
+    gnutls_hash_deinit(h, ret.data());
+    return ret;
+}
+
+void
+setSignatureCacheSize(size_t size)
+{
+    auto& cache = signatureCache();
+    for (auto& shard : cache.shards) {
+        std::lock_guard lk(shard.lock);
+        shard.entries.setCapacity(SignatureCache::shardCapacity(size));
+    }
+    cache.enabled = size != 0;
+}
+
+CacheStats
+getSignatureCacheStats()
+{
+    CacheStats stats;
+    for (auto& shard : signatureCache().shards) {
+        std::lock_guard lk(shard.lock);
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.size += shard.entries.size();
+    }
+    return stats;
+}
+
 bool
 PublicKey::checkSignature(const uint8_t* data, size_t data_len, const uint8_t* signature, size_t signature_len) const
 {
     if (!pk)
         return false;
+    auto& cache = signatureCache();
+    auto cached = cache.enabled.load(std::memory_order_relaxed);
+    PkId key;
+    if (cached) {
+        key = signatureKey(getLongId(), data, data_len, signature, signature_len);
+        auto& shard = cache.shard(key);
+        std::lock_guard lk(shard.lock);
+        if (shard.entries.get(key)) {
+            shard.hits++;
+            return true;
+        }
+        shard.misses++;
+    }
+
     const gnutls_datum_t sig {(uint8_t*) signature, (unsigned) signature_len};
     const gnutls_datum_t dat {(uint8_t*) data, (unsigned) data_len};
-    int rc = gnutls_pubkey_verify_data2(pk, GNUTLS_SIGN_RSA_SHA512, 0, &dat, &sig);
-    return rc >= 0;
+    int rc = gnutls_pubkey_verify_data2(pk, signatureAlgorithm(getAlgorithm()), 0, &dat, &sig);
+    if (rc < 0)
+        return false;
+
+    if (cached) {
+        auto& shard = cache.shard(key);
+        std::lock_guard lk(shard.lock);
+        shard.entries.put(key, true);
+    }
+    return true;
 }
 
 void
@@ -598,9 +990,14 @@ PublicKey::encrypt(const uint8_t* data, size_t data_len) const
         }
         max_block_sz = key_len / 8 - 2 * hash_size - 2 - label.size;
     }
+#endif
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    else if (algo == GNUTLS_PK_EDDSA_ED25519) {
+        return sealEd25519(pk, data, data_len);
+    }
 #endif
     else {
-        throw CryptoException("Must be an RSA key");
+        throw CryptoException("Must be an RSA or Ed25519 key");
     }
 
     const unsigned cypher_block_sz = key_len / 8;
@@ -665,6 +1062,13 @@ PublicKey::getLongId() const
     return cachedLongId_;
 }
 
+gnutls_pk_algorithm_t
+PublicKey::getAlgorithm() const
+{
+    int algo = pk ? gnutls_pubkey_get_pk_algorithm(pk, nullptr) : GNUTLS_PK_UNKNOWN;
+    return algo < 0 ? GNUTLS_PK_UNKNOWN : (gnutls_pk_algorithm_t) algo;
+}
+
 gnutls_digest_algorithm_t
 PublicKey::getPreferredDigest() const
 {
@@ -1263,6 +1667,24 @@ PrivateKey::generateEC()
     return PrivateKey {key};
 }
 
+PrivateKey
+PrivateKey::generateEd25519()
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    gnutls_x509_privkey_t key;
+    if (gnutls_x509_privkey_init(&key) != GNUTLS_E_SUCCESS)
+        throw CryptoException("Unable to initialize private key.");
+    int err = gnutls_x509_privkey_generate(key, GNUTLS_PK_EDDSA_ED25519, 256, 0);
+    if (err != GNUTLS_E_SUCCESS) {
+        gnutls_x509_privkey_deinit(key);
+        throw CryptoException(std::string("Unable to generate Ed25519 key pair: ") + gnutls_strerror(err));
+    }
+    return PrivateKey {key};
+#else
+    throw CryptoException("Ed25519 keys require GnuTLS 3.6 or later");
+#endif
+}
+
 Identity
 generateIdentity(const std::string& name, const Identity& ca, unsigned key_length, bool is_ca)
 {
@@ -1291,6 +1713,20 @@ generateEcIdentity(const std::string& name, const Identity& ca)
     return generateEcIdentity(name, ca, !ca.first || !ca.second);
 }
 
+Identity
+generateEd25519Identity(const std::string& name, const Identity& ca, bool is_ca)
+{
+    auto key = std::make_shared<PrivateKey>(PrivateKey::generateEd25519());
+    auto cert = std::make_shared<Certificate>(Certificate::generate(*key, name, ca, is_ca));
+    return {std::move(key), std::move(cert)};
+}
+
+Identity
+generateEd25519Identity(const std::string& name, const Identity& ca)
+{
+    return generateEd25519Identity(name, ca, !ca.first || !ca.second);
+}
+
 void
 saveIdentity(const Identity& id, const std::string& path, const std::string& privkey_password)
 {
@@ -6,10 +6,12 @@
 #include "search.h"
 #include "storage.h"
 #include "request.h"
+#include "thread_pool.h"
 
 #include <msgpack.hpp>
 
 #include <algorithm>
+#include <cstdio>
 #include <random>
 #include <sstream>
 #include <fstream>
@@ -23,6 +25,12 @@ using namespace std::placeholders;
 constexpr std::chrono::minutes Dht::MAX_STORAGE_MAINTENANCE_EXPIRE_TIME;
 constexpr std::chrono::minutes Dht::SEARCH_EXPIRE_TIME;
 constexpr std::chrono::seconds Dht::BOOTSTRAP_PERIOD;
+constexpr std::chrono::seconds Dht::EXPIRATION_SLICE;
+constexpr unsigned Dht::MAX_STATE_DELTAS;
+constexpr size_t Dht::STATE_IMPORT_BATCH;
+constexpr duration Dht::REPLY_CACHE_TTL;
+constexpr size_t Dht::REPLY_CACHE_MAX;
+constexpr size_t Dht::REPLY_CACHE_MAX_PER_KEY;
 constexpr duration Dht::LISTEN_EXPIRE_TIME;
 constexpr duration Dht::LISTEN_EXPIRE_TIME_PUBLIC;
 constexpr duration Dht::REANNOUNCE_MARGIN;
@@ -69,8 +77,12 @@ Dht::Kad::getStatus(time_point now) const
 void
 Dht::shutdown(ShutdownCallback cb, bool stop)
 {
-    if (not persistPath.empty())
+    if (not persistPath.empty()) {
+        finishStateImport();
         saveState(persistPath);
+    }
+    if (storage_backend and flushStorage(true))
+        applyStorage([](StorageBackend& backend) { backend.sync(); });
 
     if (stop) {
         for (auto dht : {&dht4, &dht6}) {
@@ -107,8 +119,13 @@ Dht::shutdown(ShutdownCallback cb, bool stop)
         }
     };
 
+    // announcing may insert in the store, invalidating iterators but not references
+    std::vector<decltype(store)::value_type*> storages;
+    storages.reserve(store.size());
     for (auto& str : store)
-        *remaining += maintainStorage(str, true, str_donecb);
+        storages.emplace_back(&str);
+    for (auto str : storages)
+        *remaining += maintainStorage(*str, true, str_donecb);
 
     if (logger_)
         logger_->warn("Shutting down node: after storage, {} ops", *remaining);
@@ -245,7 +262,11 @@ Dht::onNewNode(const Sp<Node>& node, int confirm)
     const auto& now = scheduler.time();
     auto& b = buckets(node->getFamily());
     auto wasEmpty = confirm < 2 && b.grow_time < now - std::chrono::minutes(5);
-    if (b.onNewNode(node, confirm, now, myid, network_engine) or confirm) {
+    auto changed = b.onNewNode(node, confirm, now, myid, network_engine);
+    // replies only list good nodes
+    if (changed and node->isGood(now))
+        clearReplyCache();
+    if (changed or confirm) {
         trySearchInsert(node);
         if (wasEmpty) {
             scheduler.edit(nextNodesConfirmation, now + std::chrono::seconds(1));
@@ -260,19 +281,77 @@ void
 Dht::expireBuckets(RoutingTable& list)
 {
     for (auto& b : list) {
-        bool changed = false;
-        b.nodes.remove_if([&changed](const Sp<Node>& n) {
-            if (n->isExpired()) {
-                changed = true;
-                return true;
-            }
-            return false;
+        auto expired = std::remove_if(b.nodes.begin(), b.nodes.end(), [](const Sp<Node>& n) {
+            return n->isExpired();
         });
-        if (changed)
+        bool changed = expired != b.nodes.end();
+        b.nodes.erase(expired, b.nodes.end());
+        if (changed) {
+            clearReplyCache();
             sendCachedPing(b);
+        }
+    }
+}
+
+void
+Dht::cacheReply(const InfoHash& id, CachedReply&& reply)
+{
+    const auto now = reply.time;
+    if (reply_cache_size >= REPLY_CACHE_MAX) {
+        if (now < reply_cache_sweep)
+            return;
+        // drop expired replies, at most once per TTL
+        reply_cache_sweep = now + REPLY_CACHE_TTL;
+        for (auto it = reply_cache.begin(); it != reply_cache.end();) {
+            auto& replies = it->second;
+            auto n = replies.size();
+            replies.erase(std::remove_if(replies.begin(),
+                                         replies.end(),
+                                         [&](const CachedReply& r) { return r.time + REPLY_CACHE_TTL <= now; }),
+                          replies.end());
+            reply_cache_size -= n - replies.size();
+            if (replies.empty())
+                it = reply_cache.erase(it);
+            else
+                ++it;
+        }
+        if (reply_cache_size >= REPLY_CACHE_MAX)
+            return;
+    }
+    auto& replies = reply_cache[id];
+    // replace the reply to the same request, or the oldest one
+    auto r = std::find_if(replies.begin(), replies.end(), [&](const CachedReply& c) {
+        return c.af == reply.af and c.want == reply.want and c.query == reply.query;
+    });
+    if (r == replies.end() and replies.size() >= REPLY_CACHE_MAX_PER_KEY)
+        r = std::min_element(replies.begin(), replies.end(), [](const CachedReply& a, const CachedReply& b) {
+            return a.time < b.time;
+        });
+    if (r != replies.end())
+        *r = std::move(reply);
+    else {
+        replies.emplace_back(std::move(reply));
+        reply_cache_size++;
     }
 }
 
+void
+Dht::invalidateReplies(const InfoHash& id)
+{
+    auto it = reply_cache.find(id);
+    if (it != reply_cache.end()) {
+        reply_cache_size -= it->second.size();
+        reply_cache.erase(it);
+    }
+}
+
+void
+Dht::clearReplyCache()
+{
+    reply_cache.clear();
+    reply_cache_size = 0;
+}
+
 void
 Dht::expireSearches()
 {
@@ -411,10 +490,17 @@ Dht::searchSendGetValues(Sp<Search> sr, SearchNode* pn, bool update)
         if (pn and pn->canGet(now, up, query)) {
             n = pn;
         } else {
+            // Among the closest candidates sharing as many bits with the target, prefer the fastest
+            unsigned bits = 0;
             for (auto& sn : sr->nodes) {
-                if (sn->canGet(now, up, query)) {
-                    n = sn.get();
+                if (n and InfoHash::commonBits(sr->id, sn->node->id) != bits)
                     break;
+                if (sn->canGet(now, up, query)) {
+                    if (not n) {
+                        n = sn.get();
+                        bits = InfoHash::commonBits(sr->id, n->node->id);
+                    } else if (sn->node->getRto() < n->node->getRto())
+                        n = sn.get();
                 }
             }
         }
@@ -987,21 +1073,25 @@ Dht::listen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where where)
 
     auto query = std::make_shared<Query>(Select {}, std::move(where));
     auto filter = Value::Filter::chain(std::move(f), query->where.getFilter());
-    auto st = store.find(id);
-    if (st == store.end() && store.size() < max_store_keys)
-        st = store.emplace(id, scheduler.time() + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME).first;
+    // callbacks may insert in the store, invalidating iterators but not references
+    Storage* st = nullptr;
+    auto sti = store.find(id);
+    if (sti != store.end())
+        st = &sti->second;
+    else if (store.size() < max_store_keys)
+        st = &store.emplace(id, scheduler.time() + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME).first->second;
 
     size_t tokenlocal = 0;
-    if (st != store.end()) {
-        tokenlocal = st->second.listen(gcb, filter, query);
+    if (st) {
+        tokenlocal = st->listen(gcb, filter, query);
         if (tokenlocal == 0)
             return 0;
     }
 
     auto token4 = Dht::listenTo(id, AF_INET, gcb, filter, query);
     auto token6 = token4 == 0 ? 0 : Dht::listenTo(id, AF_INET6, gcb, filter, query);
-    if (token6 == 0 && st != store.end()) {
-        st->second.cancelListen(tokenlocal);
+    if (token6 == 0 && st) {
+        st->cancelListen(tokenlocal);
         return 0;
     }
 
@@ -1073,8 +1163,10 @@ Dht::put(const InfoHash& id, Sp<Value> val, DoneCallback callback, time_point cr
             callback(false, {});
         return;
     }
-    if (val->id == Value::INVALID_ID)
+    if (val->id == Value::INVALID_ID) {
         val->id = std::uniform_int_distribution<Value::Id> {1}(rd);
+        val->invalidatePacked();
+    }
     scheduler.syncTime();
     const auto& now = scheduler.time();
     created = std::min(now, created);
@@ -1355,10 +1447,8 @@ Dht::cancelPut(const InfoHash& id, const Value::Id& vid)
     canceled |= sr_cancel_put(dht6.searches);
     if (canceled) {
         auto st = store.find(id);
-        if (st != store.end()) {
-            if (auto value = st->second.remove(id, vid))
-                storageRemoved(id, st->second, {value}, value->size());
-        }
+        if (st != store.end())
+            storageRemove(id, st->second, vid);
     }
     return canceled;
 }
@@ -1368,6 +1458,9 @@ Dht::cancelPut(const InfoHash& id, const Value::Id& vid)
 void
 Dht::storageChanged(const InfoHash& id, Storage& st, const Sp<Value>& v, bool newValue)
 {
+    invalidateReplies(id);
+    if (persistingState())
+        persist_changed.emplace(id);
     if (newValue) {
         if (not st.local_listeners.empty()) {
             if (logger_)
@@ -1447,9 +1540,11 @@ Dht::storageStore(const InfoHash& id,
 
     StorageBucket* store_bucket {nullptr};
     bool is_local = !sa;
-    if (sa)
+    if (sa) {
+        // values of other nodes are never modified, their encodings can be cached
+        value->setImmutable();
         store_bucket = &store_quota.try_emplace(sa, sa).first->second;
-    else
+    } else
         store_bucket = local_store_quota.get();
 
     // Reject new local values if local storage limit is exceeded
@@ -1463,14 +1558,15 @@ Dht::storageStore(const InfoHash& id,
         return false;
     }
 
-    auto store = st->second.store(id, value, created, expiration, store_bucket);
+    stateValueChanged(id, value->id);
+    auto store = st->second.store(st->first, value, created, expiration, store_bucket);
     if (auto vs = store.first) {
+        persistStorage([id, value = vs->data, created = vs->created, expiration = vs->expiration, sa](
+                           StorageBackend& backend) { backend.put(id, *value, created, expiration, sa); });
         total_store_size += store.second.size_diff;
         total_values += store.second.values_diff;
-        scheduler.cancel(vs->expiration_job);
-        if (not permanent) {
-            vs->expiration_job = scheduler.add(expiration, std::bind(&Dht::expireStorage, this, id));
-        }
+        if (not permanent)
+            scheduleStorageExpiration(st->first, expiration);
         if (total_store_size - local_store_quota->size() > max_store_size) {
             auto value = vs->data;
             auto value_diff = store.second.values_diff;
@@ -1521,7 +1617,7 @@ Dht::expireStore(decltype(store)::iterator i)
 {
     const auto& id = i->first;
     auto& st = i->second;
-    auto stats = st.expire(id, scheduler.time());
+    auto stats = st.expire(scheduler.time());
     if (not stats.expired_values.empty()) {
         storageRemoved(id, st, stats.expired_values, -stats.size_diff);
     }
@@ -1535,9 +1631,161 @@ Dht::expireStorage(InfoHash h)
         expireStore(i);
 }
 
+/**
+ * Values are not expired individually: storages with values expiring in a
+ * slice of time are expired together, by a single job at the end of the slice.
+ * Values refreshed or removed before are left in their slice, expiring a
+ * storage being harmless.
+ */
+void
+Dht::scheduleStorageExpiration(const InfoHash& id, time_point expiration)
+{
+    if (expiration == time_point::max())
+        return;
+    auto slices = (expiration.time_since_epoch() + EXPIRATION_SLICE - duration(1)) / EXPIRATION_SLICE;
+    auto slice = time_point(slices * EXPIRATION_SLICE);
+    auto s = storage_expirations.try_emplace(slice);
+    auto& keys = s.first->second;
+    if (s.second)
+        scheduler.add(slice, std::bind(&Dht::expireStorageSlice, this, slice));
+    if (keys.empty() or keys.back() != id)
+        keys.emplace_back(id);
+}
+
+void
+Dht::expireStorageSlice(time_point slice)
+{
+    auto s = storage_expirations.find(slice);
+    if (s == storage_expirations.end())
+        return;
+    auto keys = std::move(s->second);
+    storage_expirations.erase(s);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    for (const auto& id : keys)
+        expireStorage(id);
+}
+
+bool
+Dht::storageRemove(const InfoHash& id, Storage& st, Value::Id vid)
+{
+    stateValueChanged(id, vid);
+    auto value = st.remove(vid);
+    if (not value)
+        return false;
+    persistRemoval(id, vid);
+    storageRemoved(id, st, {value}, value->size());
+    return true;
+}
+
+void
+Dht::persistRemoval(const InfoHash& id, Value::Id vid)
+{
+    persistStorage([id, vid](StorageBackend& backend) { backend.erase(id, vid); });
+    if (persistingState())
+        persist_removed[id].emplace_back(vid);
+}
+
+void
+Dht::loadStorageBackend()
+{
+    if (not storage_backend)
+        return;
+    size_t loaded = 0, ignored = 0;
+    loading_storage = true;
+    try {
+        storage_backend->load(scheduler.time(), [&](const StorageBackend::StoredValue& v) {
+            try {
+                msgpack::unpacked msg;
+                msgpack::unpack(msg, (const char*) v.data, v.size);
+                auto value = std::make_shared<Value>(msg.get());
+                value->setImmutable();
+                if (storageStore(v.key, value, v.created, v.from, false, v.expiration))
+                    loaded++;
+                else
+                    ignored++;
+            } catch (const std::exception&) {
+                ignored++;
+            }
+        });
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->error("Error loading stored values: {}", e.what());
+    }
+    loading_storage = false;
+    if (logger_)
+        logger_->debug("Loaded {} stored values, ignored {}", loaded, ignored);
+}
+
+void
+Dht::persistStorage(std::function<void(StorageBackend&)>&& op)
+{
+    if (not storage_backend or loading_storage)
+        return;
+    if (not flushStorage(false))
+        storage_pending.emplace_back(std::move(op));
+    else
+        applyStorage(op);
+}
+
+void
+Dht::applyStorage(const std::function<void(StorageBackend&)>& op)
+{
+    try {
+        op(*storage_backend);
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->error("Storage backend error: {}", e.what());
+    }
+}
+
+bool
+Dht::flushStorage(bool wait)
+{
+    if (storage_task.valid()) {
+        if (not wait and storage_task.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+        storage_task.get();
+    }
+    auto pending = std::move(storage_pending);
+    storage_pending.clear();
+    for (const auto& op : pending)
+        applyStorage(op);
+    return true;
+}
+
+void
+Dht::maintainStorage()
+{
+    if (not storage_backend or not flushStorage(false))
+        return;
+    // compaction and fsync don't block the node: changes are queued meanwhile
+    auto done = std::make_shared<std::promise<void>>();
+    storage_task = done->get_future();
+    ThreadPool::io().run([backend = storage_backend, now = scheduler.time(), logger = logger_, done] {
+        try {
+            backend->maintain(now);
+            backend->sync();
+        } catch (const std::exception& e) {
+            if (logger)
+                logger->error("Storage backend error: {}", e.what());
+        }
+        done->set_value();
+    });
+    pollStorage();
+}
+
+void
+Dht::pollStorage()
+{
+    if (not flushStorage(false))
+        scheduler.add(scheduler.time() + std::chrono::seconds(1), std::bind(&Dht::pollStorage, this));
+}
+
 void
 Dht::storageRemoved(const InfoHash& id, Storage& st, const std::vector<Sp<Value>>& values, size_t totalSize)
 {
+    invalidateReplies(id);
     if (logger_)
         logger_->debug("[store {}] Discarded {} values ({} bytes)", id.to_view(), values.size(), totalSize);
 
@@ -1608,10 +1856,8 @@ Dht::expireStore()
                                       exp_value.first.to_view(),
                                       exp_value.second);
 
-                    if (auto value = storage->second.remove(exp_value.first, exp_value.second)) {
-                        storageRemoved(storage->first, storage->second, {value}, value->size());
+                    if (storageRemove(storage->first, storage->second, exp_value.second))
                         break;
-                    }
                 }
             }
         } else {
@@ -1638,6 +1884,7 @@ Dht::connectivityChanged(sa_family_t af)
     auto& dht = this->dht(af);
     dht.buckets.connectivityChanged(now);
     dht.reported_addr.clear();
+    clearReplyCache();
     network_engine.connectivityChanged(af);
     startBootstrap(); // will only happen if disconnected
 }
@@ -1707,8 +1954,11 @@ NodeStats
 Dht::Kad::getNodesStats(time_point now, const InfoHash& myid) const
 {
     NodeStats stats {};
+    std::vector<duration> rtts;
     for (const auto& b : buckets) {
         for (auto& n : b.nodes) {
+            if (not n->isExpired() and n->getSrtt() != duration::zero())
+                rtts.emplace_back(n->getSrtt());
             if (n->isGood(now)) {
                 stats.good_nodes++;
                 if (n->isIncoming())
@@ -1721,6 +1971,16 @@ Dht::Kad::getNodesStats(time_point now, const InfoHash& myid) const
     }
     stats.table_depth = buckets.depth(buckets.findBucket(myid));
     stats.searches = searches.size();
+    if (not rtts.empty()) {
+        auto percentile = [&](unsigned p) {
+            auto nth = rtts.begin() + (rtts.size() - 1) * p / 100;
+            std::nth_element(rtts.begin(), nth, rtts.end());
+            return (unsigned) std::chrono::duration_cast<std::chrono::microseconds>(*nth).count();
+        };
+        stats.rtt_p50 = percentile(50);
+        stats.rtt_p90 = percentile(90);
+        stats.rtt_p99 = percentile(99);
+    }
     return stats;
 }
 
@@ -1969,6 +2229,10 @@ Dht::getSearchLog(const InfoHash& id, sa_family_t af) const
 
 Dht::~Dht()
 {
+    if (persist_task.valid())
+        persist_task.wait();
+    if (storage_backend)
+        flushStorage(true);
     for (auto& s : dht4.searches)
         s.second->clear();
     for (auto& s : dht6.searches)
@@ -1984,6 +2248,8 @@ fromDhtConfig(const Config& config)
     netConf.max_peer_req_per_sec = config.max_peer_req_per_sec ? config.max_peer_req_per_sec
                                                                : netConf.max_req_per_sec / 8;
     netConf.is_client = config.client_mode;
+    netConf.decode_threads = std::max(config.decode_threads, 1u);
+    netConf.shard = config.shard;
     return netConf;
 }
 
@@ -2000,6 +2266,7 @@ Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock,
     , max_store_keys(config.max_store_keys ? (int) config.max_store_keys : MAX_HASHES)
     , max_store_size(config.max_store_size ? (size_t) config.max_store_size : STORAGE_LIMIT_DEFAULT)
     , max_local_store_size(config.max_local_store_size ? (size_t) config.max_local_store_size : STORAGE_LIMIT_UNLIMITED)
+    , storage_backend(config.storage_backend)
     , max_searches(config.max_searches ? (int) config.max_searches : MAX_SEARCHES)
     , network_engine(myid,
                      fromDhtConfig(config),
@@ -2017,6 +2284,7 @@ Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock,
                      std::bind(&Dht::onAnnounce, this, _1, _2, _3, _4, _5),
                      std::bind(&Dht::onRefresh, this, _1, _2, _3, _4))
     , persistPath(config.persist_path)
+    , persist_period(config.persist_period)
     , is_bootstrap(config.is_bootstrap)
     , maintain_storage(config.maintain_storage)
     , public_stable(config.public_stable)
@@ -2043,8 +2311,12 @@ Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock,
     secret = std::uniform_int_distribution<uint64_t> {}(rd);
     rotateSecrets();
 
-    if (not persistPath.empty())
+    if (not persistPath.empty()) {
         loadState(persistPath);
+        if (persist_period > duration::zero())
+            persist_job = scheduler.add(scheduler.time() + persist_period, std::bind(&Dht::persistState, this));
+    }
+    loadStorageBackend();
 
     expire();
 
@@ -2199,7 +2471,9 @@ Dht::maintainStorage(decltype(store)::value_type& storage, bool force, const Don
     if (not want4 and not want6) {
         if (logger_)
             logger_->debug("Discarding storage values {}", storage.first.to_view());
-        auto diff = storage.second.clear(storage.first);
+        for (const auto& v : storage.second.getValues())
+            persistRemoval(storage.first, v.data->id);
+        auto diff = storage.second.clear();
         total_store_size += diff.size_diff;
         total_values += diff.values_diff;
     }
@@ -2219,7 +2493,19 @@ Dht::periodic(const uint8_t* buf, size_t buflen, SockAddr from, const time_point
                 logger_->warn("Unable to process message: {}", e.what());
         }
     }
-    return scheduler.run();
+    auto next = scheduler.run();
+    network_engine.flush();
+    return next;
+}
+
+time_point
+Dht::periodic(const std::vector<net::ReceivedPacket>& packets, const time_point& now)
+{
+    scheduler.syncTime(now);
+    network_engine.processMessages(packets);
+    auto next = scheduler.run();
+    network_engine.flush();
+    return next;
 }
 
 void
@@ -2232,6 +2518,7 @@ Dht::expire()
     expireBuckets(dht6.buckets);
     expireStore();
     expireSearches();
+    maintainStorage();
     scheduler.add(expire_stuff_time, std::bind(&Dht::expire, this));
 }
 
@@ -2350,33 +2637,95 @@ Dht::confirmNodes()
     scheduler.edit(nextNodesConfirmation, confirm_nodes_time);
 }
 
+namespace {
+
+/*
+ * Stored value in a snapshot of the storage. Immutable values are shared with
+ * the snapshot. Other values, that the node can still edit, are packed when
+ * the snapshot is taken.
+ */
+struct SnapshotValue
+{
+    time_point created;
+    time_point expiration;
+    Sp<Value> data;
+    std::shared_ptr<const Blob> packed;
+    SockAddr from;
+};
+using Snapshot = std::vector<std::pair<InfoHash, std::vector<SnapshotValue>>>;
+
+/* Records following the header of a state file */
+enum class StateRecord : unsigned { Values = 0, Removed = 1 };
+
+std::vector<SnapshotValue>
+snapshotValues(const Storage& st)
+{
+    std::vector<SnapshotValue> ret;
+    ret.reserve(st.valueCount());
+    for (const auto& v : st.getValues()) {
+        auto immutable = v.data->isImmutable();
+        ret.emplace_back(SnapshotValue {v.created,
+                                        v.expiration,
+                                        immutable ? v.data : Sp<Value> {},
+                                        immutable ? std::shared_ptr<const Blob> {} : v.data->getPackedRef(),
+                                        v.store_bucket ? v.store_bucket->getAddr() : SockAddr {}});
+    }
+    return ret;
+}
+
+/** Pack values as an array of [created, value, address, expiration] */
+template<typename Stream>
+void
+packValues(Stream& s, const std::vector<SnapshotValue>& vals)
+{
+    msgpack::packer<Stream> pk(&s);
+    pk.pack_array(vals.size());
+    for (const auto& v : vals) {
+        pk.pack_array(4);
+        pk.pack(v.created.time_since_epoch().count());
+        auto packed = v.packed ? v.packed : v.data->getPackedRef();
+        s.write((const char*) packed->data(), packed->size());
+        if (v.from) {
+            pk.pack_bin(v.from.getLength());
+            pk.pack_bin_body(reinterpret_cast<const char*>(v.from.get()), v.from.getLength());
+        } else {
+            pk.pack_bin(0);
+        }
+        pk.pack(v.expiration.time_since_epoch().count());
+    }
+}
+
+void
+packStateValues(std::ostream& out, const InfoHash& key, const std::vector<SnapshotValue>& vals)
+{
+    msgpack::packer<std::ostream> pk(&out);
+    pk.pack_array(3);
+    pk.pack((unsigned) StateRecord::Values);
+    pk.pack(key);
+    packValues(out, vals);
+}
+
+void
+packStateRemoved(std::ostream& out, const InfoHash& key, const std::vector<Value::Id>& ids)
+{
+    msgpack::packer<std::ostream> pk(&out);
+    pk.pack_array(3);
+    pk.pack((unsigned) StateRecord::Removed);
+    pk.pack(key);
+    pk.pack(ids);
+}
+
+} // namespace
+
 std::vector<ValuesExport>
 Dht::exportValues() const
 {
     std::vector<ValuesExport> e {};
     e.reserve(store.size());
     for (const auto& h : store) {
-        ValuesExport ve;
-        ve.first = h.first;
-
         msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        const auto& vals = h.second.getValues();
-        pk.pack_array(vals.size());
-        for (const auto& v : vals) {
-            pk.pack_array(4);
-            pk.pack(v.created.time_since_epoch().count());
-            v.data->msgpack_pack(pk);
-            if (const auto& store_addr = v.store_bucket ? v.store_bucket->getAddr() : SockAddr {}) {
-                pk.pack_bin(store_addr.getLength());
-                pk.pack_bin_body(reinterpret_cast<const char*>(store_addr.get()), store_addr.getLength());
-            } else {
-                pk.pack_bin(0);
-            }
-            pk.pack(v.expiration.time_since_epoch().count());
-        }
-        ve.second = {buffer.data(), buffer.data() + buffer.size()};
-        e.push_back(std::move(ve));
+        packValues(buffer, snapshotValues(h.second));
+        e.emplace_back(h.first, Blob {buffer.data(), buffer.data() + buffer.size()});
     }
     return e;
 }
@@ -2384,74 +2733,77 @@ Dht::exportValues() const
 void
 Dht::importValues(const std::vector<ValuesExport>& import)
 {
-    const auto& now = scheduler.time();
-
-    unsigned imported = 0, ignored = 0;
-    size_t imported_size = 0;
+    ImportStats stats;
     for (const auto& value : import) {
         if (value.second.empty()) {
-            ignored++;
+            stats.ignored++;
             continue;
         }
-
         try {
             msgpack::unpacked msg;
             msgpack::unpack(msg, (const char*) value.second.data(), value.second.size());
-            auto valarr = msg.get();
-            if (valarr.type != msgpack::type::ARRAY)
-                throw msgpack::type_error();
-            for (unsigned i = 0; i < valarr.via.array.size; i++) {
-                auto& valel = valarr.via.array.ptr[i];
-                if (valel.type != msgpack::type::ARRAY or valel.via.array.size < 2)
-                    throw msgpack::type_error();
-                time_point val_time;
-                time_point expiration = time_point::min();
-                Value tmp_val;
-                SockAddr store_addr;
-                try {
-                    val_time = time_point {
-                        time_point::duration {valel.via.array.ptr[0].as<time_point::duration::rep>()}};
-                    tmp_val.msgpack_unpack(valel.via.array.ptr[1]);
-                    if (valel.via.array.size >= 3) {
-                        auto addr_blob = valel.via.array.ptr[2].as<Blob>();
-                        if (not addr_blob.empty()) {
-                            store_addr = SockAddr(reinterpret_cast<const sockaddr*>(addr_blob.data()),
-                                                  static_cast<socklen_t>(addr_blob.size()));
-                        }
-                    }
-                    if (valel.via.array.size >= 4) {
-                        expiration = time_point {
-                            time_point::duration {valel.via.array.ptr[3].as<time_point::duration::rep>()}};
-                    }
-                } catch (const std::exception&) {
-                    if (logger_)
-                        logger_->error("Error reading value at {}", value.first.to_view());
-                    ignored++;
-                    continue;
-                }
-                val_time = std::min(val_time, now);
-                auto val_size = tmp_val.size();
-                if (storageStore(value.first,
-                                 std::make_shared<Value>(std::move(tmp_val)),
-                                 val_time,
-                                 store_addr,
-                                 false,
-                                 expiration)) {
-                    imported++;
-                    imported_size += val_size;
-                } else {
-                    ignored++;
+            importValues(value.first, msg.get(), stats);
+        } catch (const std::exception&) {
+            stats.ignored++;
+            if (logger_)
+                logger_->error("Error reading values at {}", value.first.to_view());
+        }
+    }
+    if (logger_)
+        logger_->debug("Imported {} values, {}, ignored {}",
+                       stats.imported,
+                       dht::printByteCount(stats.size),
+                       stats.ignored);
+}
+
+void
+Dht::importValues(const InfoHash& key, const msgpack::object& valarr, ImportStats& stats)
+{
+    const auto& now = scheduler.time();
+    if (valarr.type != msgpack::type::ARRAY)
+        throw msgpack::type_error();
+    for (unsigned i = 0; i < valarr.via.array.size; i++) {
+        auto& valel = valarr.via.array.ptr[i];
+        if (valel.type != msgpack::type::ARRAY or valel.via.array.size < 2)
+            throw msgpack::type_error();
+        time_point val_time;
+        time_point expiration = time_point::min();
+        Value tmp_val;
+        SockAddr store_addr;
+        try {
+            val_time = time_point {time_point::duration {valel.via.array.ptr[0].as<time_point::duration::rep>()}};
+            tmp_val.msgpack_unpack(valel.via.array.ptr[1]);
+            if (valel.via.array.size >= 3) {
+                auto addr_blob = valel.via.array.ptr[2].as<Blob>();
+                if (not addr_blob.empty()) {
+                    store_addr = SockAddr(reinterpret_cast<const sockaddr*>(addr_blob.data()),
+                                          static_cast<socklen_t>(addr_blob.size()));
                 }
             }
+            if (valel.via.array.size >= 4) {
+                expiration = time_point {time_point::duration {valel.via.array.ptr[3].as<time_point::duration::rep>()}};
+            }
         } catch (const std::exception&) {
-            ignored++;
             if (logger_)
-                logger_->error("Error reading values at {}", value.first.to_view());
+                logger_->error("Error reading value at {}", key.to_view());
+            stats.ignored++;
+            continue;
+        }
+        if (importing_state and isStateRecordStale(key, tmp_val.id)) {
+            stats.ignored++;
             continue;
         }
+        val_time = std::min(val_time, now);
+        auto val_size = tmp_val.size();
+        auto value = std::make_shared<Value>(std::move(tmp_val));
+        value->setImmutable();
+        if (storageStore(key, value, val_time, store_addr, false, expiration)) {
+            stats.imported++;
+            stats.size += val_size;
+        } else {
+            stats.ignored++;
+        }
     }
-    if (logger_)
-        logger_->debug("Imported {} values, {}, ignored {}", imported, dht::printByteCount(imported_size), ignored);
 }
 
 std::vector<NodeExport>
@@ -2586,7 +2938,7 @@ Dht::onFindNode(Sp<Node> node, const InfoHash& target, want_t want)
 }
 
 net::RequestAnswer
-Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t, const Query& query)
+Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t want, const Query& query)
 {
     if (not hash) {
         if (logger_)
@@ -2595,9 +2947,25 @@ Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t, const Query& query
                                          net::DhtProtocolException::GET_NO_INFOHASH};
     }
     const auto& now = scheduler.time();
+    const auto af = node->getFamily();
     net::RequestAnswer answer {};
-    auto st = store.find(hash);
     answer.ntoken = makeToken(node->getAddr(), false);
+
+    // reuse the reply to the same request for a popular key
+    auto packedQuery = packMsg(query);
+    auto cached = reply_cache.find(hash);
+    if (cached != reply_cache.end()) {
+        for (const auto& r : cached->second) {
+            if (r.af == af and r.want == want and r.time + REPLY_CACHE_TTL > now and r.query == packedQuery) {
+                reply_cache_hits++;
+                answer.reply = r.reply;
+                return answer;
+            }
+        }
+    }
+    reply_cache_misses++;
+
+    auto st = store.find(hash);
     answer.nodes4 = dht4.buckets.findClosestNodes(hash, now, TARGET_NODES);
     answer.nodes6 = dht6.buckets.findClosestNodes(hash, now, TARGET_NODES);
     if (st != store.end() && not st->second.empty()) {
@@ -2605,6 +2973,8 @@ Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t, const Query& query
         if (logger_)
             logger_->debug("[node {}] Sending {} values", node->toString(), answer.values.size());
     }
+    answer.reply = network_engine.encodeReply(af, hash, want, answer.nodes4, answer.nodes6, answer.values, query);
+    cacheReply(hash, {af, want, std::move(packedQuery), now, answer.reply});
     return answer;
 }
 
@@ -2851,13 +3221,15 @@ Dht::storageRefresh(const InfoHash& id, Value::Id vid)
             }
         }
 
-        auto expiration = s->second.refresh(id, now, vid, types);
+        auto expiration = s->second.refresh(now, vid, types);
         if (expiration.first) {
-            scheduler.cancel(expiration.first->expiration_job);
-            if (expiration.second != time_point::max()) {
-                expiration.first->expiration_job = scheduler.add(expiration.second,
-                                                                 std::bind(&Dht::expireStorage, this, id));
-            }
+            stateValueChanged(id, vid);
+            scheduleStorageExpiration(s->first, expiration.second);
+            persistStorage([id, vid, expiration = expiration.second](StorageBackend& backend) {
+                backend.refresh(id, vid, expiration);
+            });
+            if (persistingState())
+                persist_changed.emplace(id);
         }
         return true;
     }
@@ -2875,23 +3247,126 @@ Dht::onAnnounceDone(const Sp<Node>& node, net::RequestAnswer& answer, Sp<Search>
 
 struct DhtState
 {
-    unsigned v {1};
+    unsigned v {2};
     InfoHash id;
     std::vector<NodeExport> nodes;
+    /* values of version 1, later versions store them in the following records */
     std::vector<ValuesExport> values;
 
     MSGPACK_DEFINE_MAP(v, id, nodes, values)
 };
 
+namespace {
+
+/** Write a whole state, replacing the file at path once complete */
+void
+writeState(const std::string& path, const DhtState& header, const Snapshot& snapshot)
+{
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        msgpack::pack(file, header);
+        for (const auto& s : snapshot)
+            packStateValues(file, s.first, s.second);
+        file.flush();
+        if (not file)
+            throw std::runtime_error("can't write " + tmp);
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("can't replace " + path);
+}
+
+/** Append the changes since the last save to the state file at path */
+void
+appendState(const std::string& path,
+            const Snapshot& changed,
+            const std::unordered_map<InfoHash, std::vector<Value::Id>>& removed)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::app);
+    // values removed then stored again are in the following records
+    for (const auto& r : removed)
+        packStateRemoved(file, r.first, r.second);
+    for (const auto& s : changed)
+        packStateValues(file, s.first, s.second);
+    file.flush();
+    if (not file)
+        throw std::runtime_error("can't write " + path);
+}
+
+} // namespace
+
+/* Reads the records of a state file by chunks */
+struct Dht::StateLoader
+{
+    static constexpr size_t CHUNK_SIZE {64 * 1024};
+
+    explicit StateLoader(const std::string& path)
+        : file(path, std::ios::binary)
+    {}
+
+    /** Read the next record, returns false at the end of the file */
+    bool next(msgpack::object_handle& oh)
+    {
+        while (not pac.next(oh)) {
+            // a record being appended when the process stopped is ignored
+            if (not file)
+                return false;
+            pac.reserve_buffer(CHUNK_SIZE);
+            file.read(pac.buffer(), CHUNK_SIZE);
+            auto n = file.gcount();
+            if (n <= 0)
+                return false;
+            pac.buffer_consumed(n);
+        }
+        return true;
+    }
+
+    std::ifstream file;
+    msgpack::unpacker pac;
+    ImportStats stats {};
+    Sp<Scheduler::Job> job {};
+    /* Values stored, refreshed or removed since the load began, newer than their records */
+    std::unordered_map<InfoHash, std::unordered_set<Value::Id>> changed {};
+};
+
+void
+Dht::stateValueChanged(const InfoHash& key, Value::Id vid)
+{
+    if (state_loader and not importing_state)
+        state_loader->changed[key].emplace(vid);
+}
+
+bool
+Dht::isStateRecordStale(const InfoHash& key, Value::Id vid) const
+{
+    if (not state_loader)
+        return false;
+    auto c = state_loader->changed.find(key);
+    return c != state_loader->changed.end() and c->second.count(vid);
+}
+
 void
 Dht::saveState(const std::string& path) const
 {
+    if (persist_task.valid())
+        persist_task.wait();
     DhtState state;
     state.id = myid;
     state.nodes = exportNodes();
-    state.values = exportValues();
-    std::ofstream file(path);
-    msgpack::pack(file, state);
+    Snapshot snapshot;
+    snapshot.reserve(store.size());
+    for (const auto& st : store)
+        if (not st.second.empty())
+            snapshot.emplace_back(st.first, snapshotValues(st.second));
+    try {
+        writeState(path, state, snapshot);
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->error("Error saving state to {}: {}", path, e.what());
+    }
 }
 
 void
@@ -2899,39 +3374,166 @@ Dht::loadState(const std::string& path)
 {
     if (logger_)
         logger_->debug("Importing state from {}", path);
+    auto loader = std::make_shared<StateLoader>(path);
+    if (not loader->file.is_open())
+        return;
     try {
-        // Import nodes from binary file
-        msgpack::unpacker pac;
-        {
-            // Read whole file
-            std::ifstream file(path, std::ios::binary | std::ios::ate);
-            if (!file.is_open()) {
-                return;
-            }
-            auto size = file.tellg();
-            file.seekg(0, std::ios::beg);
-            pac.reserve_buffer(size);
-            file.read(pac.buffer(), size);
-            pac.buffer_consumed(size);
-        }
-        // Import nodes
         msgpack::object_handle oh;
-        if (pac.next(oh)) {
-            auto state = oh.get().as<DhtState>();
-            if (logger_)
-                logger_->debug("Importing {} nodes", state.nodes.size());
-            if (state.id)
-                myid = state.id;
-            std::vector<Sp<Node>> tmpNodes;
-            tmpNodes.reserve(state.nodes.size());
-            for (const auto& node : state.nodes)
-                tmpNodes.emplace_back(network_engine.insertNode(node.id, node.addr));
-            importValues(state.values);
-        }
+        if (not loader->next(oh))
+            return;
+        auto state = oh.get().as<DhtState>();
+        if (logger_)
+            logger_->debug("Importing {} nodes", state.nodes.size());
+        if (state.id)
+            myid = state.id;
+        std::vector<Sp<Node>> tmpNodes;
+        tmpNodes.reserve(state.nodes.size());
+        for (const auto& node : state.nodes)
+            tmpNodes.emplace_back(network_engine.insertNode(node.id, node.addr));
+        loading_storage = true;
+        importValues(state.values);
+        loading_storage = false;
     } catch (const std::exception& e) {
         if (logger_)
             logger_->warn("Error importing state from {}: {}", path, e.what());
+        return;
     }
+    // values are imported by batches, letting the node run meanwhile
+    state_loader = std::move(loader);
+    importState();
+}
+
+void
+Dht::importState()
+{
+    if (importStateRecords(STATE_IMPORT_BATCH))
+        state_loader->job = scheduler.add(scheduler.time() + duration(1), std::bind(&Dht::importState, this));
+}
+
+bool
+Dht::importStateRecords(size_t max_records)
+{
+    if (not state_loader)
+        return false;
+    // imported values are already in the storage backend, if any
+    importing_state = true;
+    loading_storage = true;
+    size_t n = 0;
+    try {
+        msgpack::object_handle oh;
+        while (n < max_records and state_loader->next(oh)) {
+            importStateRecord(oh.get(), state_loader->stats);
+            n++;
+        }
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->warn("Error importing state: {}", e.what());
+        n = 0;
+    }
+    importing_state = false;
+    loading_storage = false;
+    if (n and n == max_records)
+        return true;
+    const auto& stats = state_loader->stats;
+    if (logger_)
+        logger_->debug("Imported {} values, {}, ignored {}",
+                       stats.imported,
+                       dht::printByteCount(stats.size),
+                       stats.ignored);
+    state_loader.reset();
+    return false;
+}
+
+void
+Dht::importStateRecord(const msgpack::object& record, ImportStats& stats)
+{
+    if (record.type != msgpack::type::ARRAY or record.via.array.size < 3)
+        throw msgpack::type_error();
+    auto type = record.via.array.ptr[0].as<unsigned>();
+    auto key = record.via.array.ptr[1].as<InfoHash>();
+    const auto& body = record.via.array.ptr[2];
+    if (type == (unsigned) StateRecord::Values) {
+        importValues(key, body, stats);
+    } else if (type == (unsigned) StateRecord::Removed) {
+        auto st = store.find(key);
+        if (st == store.end())
+            return;
+        for (auto vid : body.as<std::vector<Value::Id>>()) {
+            if (isStateRecordStale(key, vid))
+                state_loader->stats.ignored++;
+            else
+                storageRemove(key, st->second, vid);
+        }
+    }
+}
+
+void
+Dht::finishStateImport()
+{
+    if (not state_loader)
+        return;
+    scheduler.cancel(state_loader->job);
+    while (importStateRecords(STATE_IMPORT_BATCH)) {}
+}
+
+void
+Dht::persistState()
+{
+    finishStateImport();
+    scheduler.edit(persist_job, scheduler.time() + persist_period);
+    // the previous save is still being written
+    if (persist_task.valid() and persist_task.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+
+    bool full = persist_deltas >= MAX_STATE_DELTAS;
+    if (not full and persist_changed.empty() and persist_removed.empty())
+        return;
+
+    // the snapshot is written while the node keeps running
+    DhtState header;
+    Snapshot snapshot;
+    if (full) {
+        header.id = myid;
+        header.nodes = exportNodes();
+        snapshot.reserve(store.size());
+        for (const auto& st : store)
+            if (not st.second.empty())
+                snapshot.emplace_back(st.first, snapshotValues(st.second));
+        persist_removed.clear();
+        persist_deltas = 0;
+    } else {
+        snapshot.reserve(persist_changed.size());
+        for (const auto& key : persist_changed) {
+            auto st = store.find(key);
+            if (st != store.end() and not st->second.empty())
+                snapshot.emplace_back(key, snapshotValues(st->second));
+        }
+        persist_deltas++;
+    }
+    persist_changed.clear();
+    auto removed = std::move(persist_removed);
+    persist_removed.clear();
+
+    auto done = std::make_shared<std::promise<void>>();
+    persist_task = done->get_future();
+    ThreadPool::io().run([path = persistPath,
+                          full,
+                          header = std::move(header),
+                          snapshot = std::move(snapshot),
+                          removed = std::move(removed),
+                          logger = logger_,
+                          done] {
+        try {
+            if (full)
+                writeState(path, header, snapshot);
+            else
+                appendState(path, snapshot, removed);
+        } catch (const std::exception& e) {
+            if (logger)
+                logger->error("Error saving state to {}: {}", path, e.what());
+        }
+        done->set_value();
+    });
 }
 
 } // namespace dht
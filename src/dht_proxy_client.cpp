@@ -534,6 +534,7 @@ DhtProxyClient::doPut(const InfoHash& key, Sp<Value> val, DoneCallbackSimple cb,
                                            &err)) {
                         auto id = dht::Value(parsedValue).id;
                         val->id = id;
+                        val->invalidatePacked();
                         if (permanent) {
                             std::lock_guard lock(searchLock_);
                             auto& search = searches_[key];
@@ -7,6 +7,7 @@
 
 #include "dhtrunner.h"
 #include "securedht.h"
+#include "sharded_dht.h"
 #include "network_utils.h"
 #ifdef OPENDHT_PEER_DISCOVERY
 #include "peer_discovery.h"
@@ -136,45 +137,76 @@ DhtRunner::run(const Config& config, Context&& context)
 
         if (config.proxy_server.empty()) {
             if (not context.sock) {
-                context.sock.reset(new net::UdpSocket(local4, local6, context.logger));
+                context.sock.reset(new net::UdpSocket(local4, local6, context.logger, config.socket_config));
             }
-            context.sock->setOnReceive([&](net::PacketList&& pkts) {
-                net::PacketList ret;
-                {
-                    std::lock_guard lck(sock_mtx);
-                    rcv.splice(rcv.end(), std::move(pkts));
-                    size_t dropped = 0;
-                    while (rcv.size() > net::RX_QUEUE_MAX_SIZE) {
-                        rcv.pop_front();
-                        dropped++;
-                    }
-                    if (dropped and logger_) {
-                        logger_->w("[runner %p] dropped %zu packets: queue is full!", fmt::ptr(this), dropped);
-                    }
-                    ret = std::move(rcv_free);
-                }
-                cv.notify_all();
-                return ret;
-            });
             if (not state_path.empty()) {
                 std::ofstream outConfig(state_path);
                 outConfig << context.sock->getBoundRef(AF_INET).getPort() << std::endl;
                 outConfig << context.sock->getBoundRef(AF_INET6).getPort() << std::endl;
             }
-            auto dht = std::make_unique<Dht>(std::move(context.sock),
-                                             SecureDht::getConfig(config.dht_config),
-                                             context.logger,
-                                             std::move(context.rng));
+            std::unique_ptr<DhtInterface> dht;
+            if (config.shards > 1) {
+                auto sharded = std::make_unique<ShardedDht>(
+                    std::move(context.sock),
+                    SecureDht::getConfig(config.dht_config),
+                    config.shards,
+                    [this, threaded = config.threaded] {
+                        if (threaded) {
+                            std::lock_guard lck(storage_mtx);
+                            pending_ops_prio.emplace([](SecureDht&) {});
+                            cv.notify_all();
+                        }
+                    },
+                    context.logger,
+                    std::move(context.rng));
+                sharded_ = sharded.get();
+                dht = std::move(sharded);
+            } else {
+                context.sock->setOnReceive([this](net::PacketList&& pkts) {
+                    size_t dropped = 0;
+                    for (auto& pkt : pkts) {
+                        if (not rcv.push(pkt))
+                            dropped++;
+                        pkt.data.clear();
+                    }
+                    auto depth = rcv.size();
+                    auto max = rcv_max.load(std::memory_order_relaxed);
+                    while (depth > max and not rcv_max.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {}
+                    if (dropped) {
+                        rcv_dropped += dropped;
+                        if (logger_)
+                            logger_->w("[runner %p] dropped %zu packets: queue is full!", fmt::ptr(this), dropped);
+                    }
+                    // Only wake up the DHT thread if it is waiting
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (parked.load(std::memory_order_relaxed)) {
+                        { std::lock_guard lk(wake_mtx); }
+                        cv.notify_all();
+                    }
+                    // list nodes are recycled by the socket
+                    return std::move(pkts);
+                });
+                dht = std::make_unique<Dht>(std::move(context.sock),
+                                            SecureDht::getConfig(config.dht_config),
+                                            context.logger,
+                                            std::move(context.rng));
+            }
             dht_ = std::make_unique<SecureDht>(std::move(dht),
                                                config.dht_config,
                                                std::move(context.identityAnnouncedCb),
                                                context.logger);
+            dht_->setOnChecksDone([this] {
+                std::lock_guard lck(storage_mtx);
+                pending_ops_prio.emplace([](SecureDht&) {});
+                cv.notify_all();
+            });
         } else {
             enableProxy(true);
         }
     } catch (const std::exception& e) {
         config_ = {};
         identityAnnouncedCb_ = {};
+        sharded_ = nullptr;
         dht_.reset();
         running = State::Idle;
         throw;
@@ -197,17 +229,19 @@ DhtRunner::run(const Config& config, Context&& context)
         return;
     dht_thread = std::thread([this]() {
         while (running != State::Idle) {
-            std::unique_lock lk(dht_mtx);
-            time_point wakeup = loop_();
+            time_point wakeup;
+            {
+                std::lock_guard lk(dht_mtx);
+                wakeup = loop_();
+            }
 
             auto hasJobToDo = [this]() {
+                parked = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
                 if (running == State::Idle)
                     return true;
-                {
-                    std::lock_guard lck(sock_mtx);
-                    if (not rcv.empty())
-                        return true;
-                }
+                if (not rcv.empty())
+                    return true;
                 {
                     std::lock_guard lck(storage_mtx);
                     if (not pending_ops_prio.empty())
@@ -219,10 +253,12 @@ DhtRunner::run(const Config& config, Context&& context)
                 }
                 return false;
             };
+            std::unique_lock lk(wake_mtx);
             if (wakeup == time_point::max())
                 cv.wait(lk, hasJobToDo);
             else
                 cv.wait_until(lk, wakeup, hasJobToDo);
+            parked = false;
         }
     });
 
@@ -362,6 +398,7 @@ DhtRunner::join()
         std::lock_guard lck(dht_mtx);
         if (running.exchange(State::Idle) == State::Idle)
             return;
+        { std::lock_guard lk(wake_mtx); }
         cv.notify_all();
 #ifdef OPENDHT_PEER_DISCOVERY
         if (peerDiscovery_)
@@ -576,6 +613,7 @@ DhtRunner::getNodeInfo() const
     if (dht_)
         info = dht_->getNodeInfo();
     info.ongoing_ops = ongoing_ops;
+    getRxStats(info);
     return info;
 }
 
@@ -588,12 +626,28 @@ DhtRunner::getNodeInfo(std::function<void(std::shared_ptr<NodeInfo>)> cb)
         auto sinfo = std::make_shared<NodeInfo>();
         *sinfo = dht.getNodeInfo();
         sinfo->ongoing_ops = ongoing_ops;
+        getRxStats(*sinfo);
         cb(std::move(sinfo));
         opEnded();
     });
     cv.notify_all();
 }
 
+void
+DhtRunner::getRxStats(NodeInfo& info) const
+{
+    if (sharded_) {
+        auto stats = sharded_->getRxStats();
+        info.rx_queue_depth = stats.depth;
+        info.rx_queue_max = stats.max;
+        info.rx_queue_dropped = stats.dropped;
+        return;
+    }
+    info.rx_queue_depth = rcv.size();
+    info.rx_queue_max = rcv_max;
+    info.rx_queue_dropped = rcv_dropped;
+}
+
 std::vector<unsigned>
 DhtRunner::getNodeMessageStats(bool in) const
 {
@@ -704,49 +758,30 @@ DhtRunner::loop_()
     }
 
     time_point wakeup {};
-    decltype(rcv) received {};
-    decltype(rcv) received_treated {};
-    {
-        std::lock_guard lck(sock_mtx);
-        // move to stack
-        received = std::move(rcv);
-    }
-
-    // Discard old packets
     size_t dropped {0};
-    if (not received.empty()) {
-        auto limit = clock::now() - net::RX_QUEUE_MAX_DELAY;
-        auto it = received.begin();
-        while (it != received.end() and it->received < limit) {
-            it->data.clear();
-            ++it;
-            dropped++;
-        }
-        received_treated.splice(received_treated.end(), received, received.begin(), it);
-    }
 
-    // Handle packets
-    if (not received.empty()) {
-        for (auto& pkt : received) {
-            auto now = clock::now();
-            if (now - pkt.received > net::RX_QUEUE_MAX_DELAY)
+    // Handle packets received so far as a batch, old packets are discarded
+    if (auto count = rcv.size()) {
+        auto now = clock::now();
+        rcv_batch.resize(count);
+        size_t n = 0;
+        for (size_t i = 0; i < count and rcv.pop(rcv_batch[n]); i++) {
+            if (now - rcv_batch[n].received > net::RX_QUEUE_MAX_DELAY) {
+                rcv_batch[n].data.clear();
                 dropped++;
-            else
-                wakeup = dht_->periodic(pkt.data.data(), pkt.data.size(), std::move(pkt.from), now);
-            pkt.data.clear();
+            } else
+                n++;
         }
-        received_treated.splice(received_treated.end(), std::move(received));
+        rcv_batch.resize(n);
+        wakeup = dht_->periodic(rcv_batch, now);
+        for (auto& pkt : rcv_batch)
+            pkt.data.clear();
+        rcv_dropped += dropped;
     } else {
         // Or just run the scheduler
         wakeup = dht_->periodic(nullptr, 0, nullptr, 0, clock::now());
     }
 
-    if (not received_treated.empty()) {
-        std::lock_guard lck(sock_mtx);
-        if (rcv_free.size() < net::RX_QUEUE_MAX_SIZE)
-            rcv_free.splice(rcv_free.end(), std::move(received_treated));
-    }
-
     if (dropped && logger_)
         logger_->e("[runner %p] Dropped %zu packets with high delay.", fmt::ptr(this), dropped);
 
@@ -785,6 +820,23 @@ DhtRunner::get(const std::string& key, GetCallback vcb, DoneCallbackSimple dcb,
 {
     get(InfoHash::get(key), std::move(vcb), std::move(dcb), std::move(f), std::move(w));
 }
+void
+DhtRunner::getMany(std::vector<InfoHash> keys, GetManyCallback cb, DoneCallback donecb, Value::Filter f, Where w)
+{
+    std::unique_lock lck(storage_mtx);
+    if (running != State::Running) {
+        lck.unlock();
+        if (donecb)
+            donecb(false, {});
+        return;
+    }
+    ongoing_ops++;
+    pending_ops.emplace([=, keys = std::move(keys)](SecureDht& dht) mutable {
+        dht.getMany(std::move(keys), std::move(cb), bindOpDoneCallback(std::move(donecb)), std::move(f), std::move(w));
+    });
+    cv.notify_all();
+}
+
 void
 DhtRunner::query(const InfoHash& hash, QueryCallback cb, DoneCallback done_cb, Query q)
 {
@@ -893,6 +945,26 @@ DhtRunner::put(const std::string& key, Value&& value, DoneCallbackSimple cb, tim
     put(InfoHash::get(key), std::forward<Value>(value), std::move(cb), created, permanent);
 }
 
+void
+DhtRunner::putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values,
+                   DoneCallback cb,
+                   time_point created,
+                   bool permanent)
+{
+    std::unique_lock lck(storage_mtx);
+    if (running != State::Running) {
+        lck.unlock();
+        if (cb)
+            cb(false, {});
+        return;
+    }
+    ongoing_ops++;
+    pending_ops.emplace([=, values = std::move(values), cb = std::move(cb)](SecureDht& dht) mutable {
+        dht.putMany(std::move(values), bindOpDoneCallback(std::move(cb)), created, permanent);
+    });
+    cv.notify_all();
+}
+
 void
 DhtRunner::cancelPut(const InfoHash& h, Value::Id id)
 {
@@ -1160,6 +1232,7 @@ void
 DhtRunner::resetDht()
 {
     peerDiscovery_.reset();
+    sharded_ = nullptr;
     dht_.reset();
 }
 
@@ -1206,7 +1279,13 @@ DhtRunner::enableProxy(bool proxify)
             config_.push_topic,
             config_.push_platform,
             logger_);
+        sharded_ = nullptr;
         dht_ = std::make_unique<SecureDht>(std::move(dht_via_proxy), config_.dht_config, identityAnnouncedCb_, logger_);
+        dht_->setOnChecksDone([this] {
+            std::lock_guard lck(storage_mtx);
+            pending_ops_prio.emplace([](SecureDht&) {});
+            cv.notify_all();
+        });
     }
     use_proxy = proxify;
 #else
@@ -0,0 +1,28 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "infohash.h"
+
+#include <chrono>
+#include <random>
+
+namespace dht {
+namespace detail {
+
+static uint64_t
+makeHashSeed() noexcept
+{
+    try {
+        std::random_device rdev;
+        return ((uint64_t) rdev() << 32) ^ rdev();
+    } catch (const std::exception&) {
+        // no entropy source available
+        return (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count()
+               ^ (uint64_t) (uintptr_t) &hashSeed;
+    }
+}
+
+const uint64_t hashSeed {makeHashSeed()};
+
+} // namespace detail
+} // namespace dht
@@ -0,0 +1,672 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "io_uring_socket.h"
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+#include <array>
+#include <cstring>
+
+namespace dht {
+namespace net {
+
+namespace {
+
+constexpr unsigned QUEUE_DEPTH {256};
+#ifdef SO_RXQ_OVFL
+constexpr size_t RX_CONTROL_SIZE {CMSG_SPACE(sizeof(uint32_t))};
+#else
+constexpr size_t RX_CONTROL_SIZE {0};
+#endif
+/*
+ * Provided receive buffers, taken from a PacketPool. The count must be a power of two.
+ * A buffer holds the recvmsg header, the source address, the control data and a whole datagram.
+ */
+constexpr unsigned RX_BUFFER_COUNT {256};
+constexpr size_t RX_BUFFER_SIZE {sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + RX_CONTROL_SIZE
+                                 + MAX_DATAGRAM_SIZE};
+/*
+ * Max. number of receive buffers, in the ring or held by packets. Only the pages
+ * written by the kernel are committed to memory: small datagrams use a few KiB.
+ */
+constexpr size_t RX_BUFFER_MAX {16 * RX_BUFFER_COUNT};
+constexpr int RX_BUFFER_GROUP {0};
+/* Delay between attempts to replace the buffers handed to packets when the pool is exhausted */
+constexpr long long RX_REFILL_DELAY_NS {10 * 1000 * 1000};
+/* Delay before receiving again after a receive error */
+constexpr long long RX_RETRY_DELAY_NS {500 * 1000 * 1000};
+/* Max. number of send buffers kept for reuse */
+constexpr size_t TX_SPARE_MAX {QUEUE_DEPTH};
+
+enum class Op : uint32_t { Receive4 = 1, Receive6, Wake, Send };
+
+uint64_t
+makeUserData(Op op, uint32_t index = 0)
+{
+    return ((uint64_t) op << 32) | index;
+}
+
+int
+sendFlags(bool replied)
+{
+    int flags = MSG_NOSIGNAL;
+    if (replied)
+        flags |= MSG_CONFIRM;
+    return flags;
+}
+
+bool
+ringSupportsSocketOps(io_uring& ring)
+{
+    auto probe = io_uring_get_probe_ring(&ring);
+    if (not probe)
+        return false;
+    bool supported = io_uring_opcode_supported(probe, IORING_OP_RECVMSG)
+                     and io_uring_opcode_supported(probe, IORING_OP_SENDMSG)
+                     and io_uring_opcode_supported(probe, IORING_OP_READ);
+    io_uring_free_probe(probe);
+    return supported;
+}
+
+void
+countMax(std::atomic<uint64_t>& max, uint64_t n)
+{
+    auto m = max.load(std::memory_order_relaxed);
+    while (n > m and not max.compare_exchange_weak(m, n, std::memory_order_relaxed)) {}
+}
+
+} // namespace
+
+/**
+ * Owns the ring. All submissions and completions are handled by a single
+ * thread; sendTo() only queues datagrams and wakes it through an eventfd.
+ */
+class IoUringUdpSocket::Impl
+{
+public:
+    explicit Impl(IoUringUdpSocket& sock);
+    ~Impl();
+
+    bool queue(int s, const SockAddr& dest, const uint8_t* data, size_t size, bool replied);
+    void flush();
+    void stop();
+    SocketStats getStats() const;
+
+private:
+    struct PendingPacket
+    {
+        int sock;
+        bool replied;
+        sockaddr_storage dest;
+        socklen_t dest_len;
+        Blob data;
+    };
+    /* A sendmsg request: must stay in place until its completion */
+    struct TxSlot
+    {
+        msghdr msg;
+        iovec iov;
+        sockaddr_storage dest;
+        Blob data;
+    };
+
+    IoUringUdpSocket& sock_;
+    io_uring ring_;
+    io_uring_buf_ring* buffers_ {nullptr};
+    /* Provided buffers by buffer id, handed to the received packets */
+    const std::shared_ptr<PacketPool> rx_pool_ {std::make_shared<PacketPool>(RX_BUFFER_SIZE, RX_BUFFER_MAX)};
+    std::vector<PacketBuffer> rx_buffers_;
+    /* buffer ids left empty because the pool was exhausted */
+    std::vector<unsigned> rx_missing_;
+    /* receive requests to submit again when buffers are available */
+    std::array<bool, 2> rx_rearm_ {};
+    /* receive requests ended by an error, submitted again at rx_retry_at_ */
+    std::array<bool, 2> rx_retry_ {};
+    time_point rx_retry_at_ {};
+    /* last SO_RXQ_OVFL counter of each socket */
+    std::array<uint32_t, 2> rx_overflow_ {};
+    /* recvmsg layout of the provided buffers */
+    msghdr rx_msg_ {};
+    int wakefd_ {-1};
+    uint64_t wake_value_ {0};
+    std::atomic_bool running_ {true};
+    std::thread thread_;
+
+    std::mutex tx_lock_;
+    std::vector<PendingPacket> pending_;
+    /* sent buffers, reused by queue() */
+    std::vector<Blob> tx_spare_;
+    /* only accessed by the ring thread */
+    std::vector<PendingPacket> sending_;
+    std::vector<std::unique_ptr<TxSlot>> slots_;
+    std::vector<uint32_t> free_slots_;
+
+    std::atomic<uint64_t> rx_packets {0}, rx_batches {0}, rx_batch_max {0}, rx_dropped {0}, rx_exhausted {0};
+    std::atomic<uint64_t> tx_packets {0}, tx_batches {0}, tx_batch_max {0}, tx_errors {0};
+    std::array<std::atomic<uint64_t>, 2> rx_socket_packets {}, rx_socket_drops {};
+
+    void closeRing();
+    bool receiveRejected();
+    void recycleBuffer(unsigned bid);
+    void refillBuffers();
+    io_uring_sqe* getSqe();
+    void wake();
+    void armReceive(Op op);
+    void armWake();
+    void readOverflow(io_uring_recvmsg_out* out, size_t i);
+    void onReceive(const io_uring_cqe& cqe, Op op, PacketList& pkts);
+    void onSent(const io_uring_cqe& cqe);
+    void submitPending();
+    void run();
+};
+
+IoUringUdpSocket::Impl::Impl(IoUringUdpSocket& sock)
+    : sock_(sock)
+{
+    int rc = io_uring_queue_init(QUEUE_DEPTH, &ring_, 0);
+    if (rc < 0)
+        throw DhtException(std::string("Can't initialize io_uring: ") + strerror(-rc));
+    if (not ringSupportsSocketOps(ring_)) {
+        closeRing();
+        throw DhtException("io_uring socket operations are not supported by this kernel");
+    }
+    buffers_ = io_uring_setup_buf_ring(&ring_, RX_BUFFER_COUNT, RX_BUFFER_GROUP, 0, &rc);
+    if (not buffers_) {
+        closeRing();
+        throw DhtException(std::string("Can't register io_uring buffers: ") + strerror(-rc));
+    }
+    wakefd_ = eventfd(0, EFD_CLOEXEC);
+    if (wakefd_ < 0) {
+        rc = errno;
+        closeRing();
+        throw DhtException(std::string("Can't open eventfd: ") + strerror(rc));
+    }
+
+    rx_buffers_.resize(RX_BUFFER_COUNT);
+    for (unsigned i = 0; i < RX_BUFFER_COUNT; i++)
+        recycleBuffer(i);
+    rx_msg_.msg_namelen = sizeof(sockaddr_storage);
+    rx_msg_.msg_controllen = RX_CONTROL_SIZE;
+
+    armReceive(Op::Receive4);
+    armReceive(Op::Receive6);
+    armWake();
+    io_uring_submit(&ring_);
+    if (receiveRejected()) {
+        closeRing();
+        throw DhtException("io_uring multishot recvmsg is not supported by this kernel");
+    }
+
+    thread_ = std::thread(&Impl::run, this);
+}
+
+IoUringUdpSocket::Impl::~Impl()
+{
+    stop();
+    if (thread_.joinable())
+        thread_.join();
+    closeRing();
+}
+
+void
+IoUringUdpSocket::Impl::closeRing()
+{
+    if (buffers_)
+        io_uring_free_buf_ring(&ring_, buffers_, RX_BUFFER_COUNT, RX_BUFFER_GROUP);
+    io_uring_queue_exit(&ring_);
+    if (wakefd_ != -1)
+        close(wakefd_);
+}
+
+/* Multishot recvmsg requires Linux 6.0: older kernels fail the request when submitted */
+bool
+IoUringUdpSocket::Impl::receiveRejected()
+{
+    unsigned head;
+    io_uring_cqe* cqe;
+    io_uring_for_each_cqe(&ring_, head, cqe)
+    {
+        auto op = (Op) (cqe->user_data >> 32);
+        if ((op == Op::Receive4 or op == Op::Receive6) and cqe->res == -EINVAL)
+            return true;
+    }
+    // Other completions are left for run()
+    return false;
+}
+
+void
+IoUringUdpSocket::Impl::stop()
+{
+    if (running_.exchange(false)) {
+        {
+            std::lock_guard lk(tx_lock_);
+            pending_.clear();
+        }
+        wake();
+    }
+}
+
+void
+IoUringUdpSocket::Impl::wake()
+{
+    uint64_t one = 1;
+    if (write(wakefd_, &one, sizeof(one)) < 0 and sock_.logger)
+        sock_.logger->e("Can't wake io_uring thread: %s", strerror(errno));
+}
+
+bool
+IoUringUdpSocket::Impl::queue(int s, const SockAddr& dest, const uint8_t* data, size_t size, bool replied)
+{
+    size_t pending;
+    {
+        std::lock_guard lk(tx_lock_);
+        if (not running_)
+            return false;
+        auto& p = pending_.emplace_back();
+        p.sock = s;
+        p.replied = replied;
+        p.dest_len = dest.getLength();
+        memcpy(&p.dest, dest.get(), p.dest_len);
+        if (not tx_spare_.empty()) {
+            p.data = std::move(tx_spare_.back());
+            tx_spare_.pop_back();
+        }
+        p.data.assign(data, data + size);
+        pending = pending_.size();
+    }
+    // The ring thread drains the whole queue when woken up
+    if (sock_.config_.tx_batch ? pending == TX_BATCH_SIZE : pending == 1)
+        wake();
+    return true;
+}
+
+void
+IoUringUdpSocket::Impl::flush()
+{
+    bool pending;
+    {
+        std::lock_guard lk(tx_lock_);
+        pending = not pending_.empty();
+    }
+    if (pending)
+        wake();
+}
+
+io_uring_sqe*
+IoUringUdpSocket::Impl::getSqe()
+{
+    auto sqe = io_uring_get_sqe(&ring_);
+    while (not sqe) {
+        io_uring_submit(&ring_);
+        sqe = io_uring_get_sqe(&ring_);
+    }
+    return sqe;
+}
+
+/* Give a buffer back to the kernel, or a new one if the previous one was handed to a packet */
+void
+IoUringUdpSocket::Impl::recycleBuffer(unsigned bid)
+{
+    auto& buf = rx_buffers_[bid];
+    if (not buf) {
+        buf = rx_pool_->acquire();
+        if (not buf) {
+            rx_missing_.emplace_back(bid);
+            return;
+        }
+    }
+    io_uring_buf_ring_add(buffers_, buf.data(), buf.capacity(), bid, io_uring_buf_ring_mask(RX_BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(buffers_, 1);
+}
+
+void
+IoUringUdpSocket::Impl::refillBuffers()
+{
+    if (rx_missing_.empty())
+        return;
+    std::vector<unsigned> missing;
+    missing.swap(rx_missing_);
+    for (auto bid : missing)
+        recycleBuffer(bid);
+}
+
+void
+IoUringUdpSocket::Impl::armReceive(Op op)
+{
+    int s = op == Op::Receive4 ? sock_.s4 : sock_.s6;
+    if (s == -1)
+        return;
+    auto sqe = getSqe();
+    io_uring_prep_recvmsg_multishot(sqe, s, &rx_msg_, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RX_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, makeUserData(op));
+    rx_rearm_[op == Op::Receive4 ? 0 : 1] = false;
+}
+
+void
+IoUringUdpSocket::Impl::armWake()
+{
+    auto sqe = getSqe();
+    io_uring_prep_read(sqe, wakefd_, &wake_value_, sizeof(wake_value_), 0);
+    io_uring_sqe_set_data64(sqe, makeUserData(Op::Wake));
+}
+
+/* Count the datagrams dropped by the kernel, reported by SO_RXQ_OVFL */
+void
+IoUringUdpSocket::Impl::readOverflow([[maybe_unused]] io_uring_recvmsg_out* out, [[maybe_unused]] size_t i)
+{
+#ifdef SO_RXQ_OVFL
+    for (auto cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &rx_msg_); cmsg;
+         cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &rx_msg_, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t count;
+            memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+            rx_socket_drops[i] += (uint32_t) (count - rx_overflow_[i]);
+            rx_overflow_[i] = count;
+        }
+    }
+#endif
+}
+
+void
+IoUringUdpSocket::Impl::onReceive(const io_uring_cqe& cqe, Op op, PacketList& pkts)
+{
+    size_t i = op == Op::Receive4 ? 0 : 1;
+    if (cqe.res < 0) {
+        // Datagrams wait in the socket buffer until the request is submitted again
+        if (cqe.res == -ENOBUFS) {
+            rx_exhausted++;
+        } else if (cqe.res != -ECANCELED and running_) {
+            if (sock_.logger)
+                sock_.logger->e("Error receiving packet: %s", strerror(-cqe.res));
+            if (not(cqe.flags & IORING_CQE_F_MORE)) {
+                // don't spin on a persistent error
+                rx_retry_[i] = true;
+                rx_retry_at_ = clock::now() + std::chrono::nanoseconds(RX_RETRY_DELAY_NS);
+            }
+            return;
+        }
+    } else if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        auto& buf = rx_buffers_[bid];
+        auto out = io_uring_recvmsg_validate(buf.data(), cqe.res, &rx_msg_);
+        if (out)
+            readOverflow(out, i);
+        if (out and not (out->flags & MSG_TRUNC)) {
+            auto payload = (const uint8_t*) io_uring_recvmsg_payload(out, &rx_msg_);
+            auto length = io_uring_recvmsg_payload_length(out, cqe.res, &rx_msg_);
+            if (length) {
+                auto pkt = sock_.getNewPacket();
+                auto& p = pkt.front();
+                p.from = SockAddr((const sockaddr*) io_uring_recvmsg_name(out),
+                                  std::min<socklen_t>(out->namelen, rx_msg_.msg_namelen));
+                p.received = clock::now();
+                // The packet takes the buffer, replaced in the ring by recycleBuffer()
+                auto offset = payload - buf.data();
+                p.data = std::move(buf);
+                p.data.slice(offset, length);
+                pkts.splice(pkts.end(), std::move(pkt));
+                rx_socket_packets[i]++;
+            }
+        } else {
+            // invalid header, or datagram larger than MAX_DATAGRAM_SIZE
+            rx_dropped++;
+        }
+        recycleBuffer(bid);
+    }
+    // A multishot request stops when buffers are exhausted
+    if (not(cqe.flags & IORING_CQE_F_MORE) and running_ and cqe.res != -ECANCELED)
+        rx_rearm_[i] = true;
+}
+
+void
+IoUringUdpSocket::Impl::onSent(const io_uring_cqe& cqe)
+{
+    auto index = (uint32_t) cqe.user_data;
+    if (cqe.res < 0) {
+        tx_errors++;
+        if (sock_.logger)
+            sock_.logger->d("Can't send message: %s", strerror(-cqe.res));
+    } else {
+        tx_packets++;
+    }
+    slots_[index]->data.clear();
+    free_slots_.emplace_back(index);
+}
+
+void
+IoUringUdpSocket::Impl::submitPending()
+{
+    {
+        std::lock_guard lk(tx_lock_);
+        if (pending_.empty())
+            return;
+        std::swap(pending_, sending_);
+    }
+    for (auto& p : sending_) {
+        uint32_t index;
+        if (free_slots_.empty()) {
+            index = slots_.size();
+            slots_.emplace_back(std::make_unique<TxSlot>());
+        } else {
+            index = free_slots_.back();
+            free_slots_.pop_back();
+        }
+        auto& slot = *slots_[index];
+        slot.data.swap(p.data);
+        memcpy(&slot.dest, &p.dest, p.dest_len);
+        slot.iov.iov_base = slot.data.data();
+        slot.iov.iov_len = slot.data.size();
+        slot.msg = {};
+        slot.msg.msg_name = &slot.dest;
+        slot.msg.msg_namelen = p.dest_len;
+        slot.msg.msg_iov = &slot.iov;
+        slot.msg.msg_iovlen = 1;
+        auto sqe = getSqe();
+        io_uring_prep_sendmsg(sqe, p.sock, &slot.msg, sendFlags(p.replied));
+        io_uring_sqe_set_data64(sqe, makeUserData(Op::Send, index));
+    }
+    tx_batches++;
+    countMax(tx_batch_max, sending_.size());
+    {
+        // keep the buffers of sent packets, swapped with the slots
+        std::lock_guard lk(tx_lock_);
+        for (auto& p : sending_) {
+            if (tx_spare_.size() >= TX_SPARE_MAX)
+                break;
+            if (p.data.capacity())
+                tx_spare_.emplace_back(std::move(p.data));
+        }
+    }
+    sending_.clear();
+}
+
+void
+IoUringUdpSocket::Impl::run()
+{
+    PacketList pkts;
+    while (running_) {
+        int rc;
+        if (rx_missing_.empty() and not rx_retry_[0] and not rx_retry_[1]) {
+            rc = io_uring_submit_and_wait(&ring_, 1);
+        } else {
+            // buffers released by the packet consumer don't wake the ring
+            __kernel_timespec ts {0, rx_missing_.empty() ? RX_RETRY_DELAY_NS : RX_REFILL_DELAY_NS};
+            io_uring_cqe* cqe;
+            rc = io_uring_submit_and_wait_timeout(&ring_, &cqe, 1, &ts, nullptr);
+        }
+        if (rc < 0 and rc != -EINTR and rc != -EAGAIN and rc != -ETIME) {
+            if (sock_.logger)
+                sock_.logger->e("io_uring error: %s", strerror(-rc));
+            break;
+        }
+
+        bool woken = false;
+        unsigned head, count = 0;
+        io_uring_cqe* cqe;
+        io_uring_for_each_cqe(&ring_, head, cqe)
+        {
+            count++;
+            auto op = (Op) (cqe->user_data >> 32);
+            switch (op) {
+            case Op::Receive4:
+            case Op::Receive6:
+                onReceive(*cqe, op, pkts);
+                break;
+            case Op::Wake:
+                woken = true;
+                break;
+            case Op::Send:
+                onSent(*cqe);
+                break;
+            }
+        }
+        io_uring_cq_advance(&ring_, count);
+
+        if (not pkts.empty()) {
+            auto n = pkts.size();
+            rx_packets += n;
+            rx_batches++;
+            countMax(rx_batch_max, n);
+            sock_.onReceived(std::move(pkts));
+            pkts.clear();
+        }
+        if (not running_)
+            break;
+        if (woken)
+            armWake();
+        refillBuffers();
+        if ((rx_retry_[0] or rx_retry_[1]) and clock::now() >= rx_retry_at_) {
+            for (size_t i = 0; i < 2; i++) {
+                rx_rearm_[i] = rx_rearm_[i] or rx_retry_[i];
+                rx_retry_[i] = false;
+            }
+        }
+        if (rx_missing_.size() < RX_BUFFER_COUNT) {
+            if (rx_rearm_[0])
+                armReceive(Op::Receive4);
+            if (rx_rearm_[1])
+                armReceive(Op::Receive6);
+        }
+        submitPending();
+    }
+}
+
+SocketStats
+IoUringUdpSocket::Impl::getStats() const
+{
+    SocketStats stats;
+    stats.rx_packets = rx_packets;
+    stats.rx_batches = rx_batches;
+    stats.rx_batch_max = rx_batch_max;
+    stats.rx_dropped = rx_dropped;
+    stats.rx_buffers_exhausted = rx_exhausted;
+    stats.tx_packets = tx_packets;
+    stats.tx_batches = tx_batches;
+    stats.tx_batch_max = tx_batch_max;
+    stats.tx_errors = tx_errors;
+    stats.sockets.resize(2);
+    for (size_t i = 0; i < 2; i++) {
+        auto& s = stats.sockets[i];
+        s.family = i ? AF_INET6 : AF_INET;
+        s.packets = rx_socket_packets[i];
+        s.drops = rx_socket_drops[i];
+    }
+    return stats;
+}
+
+IoUringUdpSocket::IoUringUdpSocket(const SockAddr& bind4,
+                                   const SockAddr& bind6,
+                                   const std::shared_ptr<Logger>& l,
+                                   const SocketConfig& config)
+    : logger(l)
+    , config_(config)
+{
+    if (bind4) {
+        try {
+            s4 = bindSocket(bind4, bound4);
+        } catch (const DhtException& e) {
+            if (logger)
+                logger->e("Can't bind inet socket: %s", e.what());
+        }
+    }
+    if (bind6) {
+        if (bind6.getPort() == 0) {
+            // Attempt to use the same port as IPv4 with IPv6
+            if (auto p4 = bound4.getPort()) {
+                auto b6 = bind6;
+                b6.setPort(p4);
+                try {
+                    s6 = bindSocket(b6, bound6);
+                } catch (const DhtException& e) {
+                    if (logger)
+                        logger->d("Can't bind inet6 socket on IPv4 port: %s", e.what());
+                }
+            }
+        }
+        if (s6 == -1) {
+            try {
+                s6 = bindSocket(bind6, bound6);
+            } catch (const DhtException& e) {
+                if (logger)
+                    logger->e("Can't bind inet6 socket: %s", e.what());
+            }
+        }
+    }
+    if (s4 == -1 and s6 == -1)
+        throw DhtException("Can't bind socket");
+
+    try {
+        impl_ = std::make_unique<Impl>(*this);
+    } catch (...) {
+        if (s4 != -1)
+            close(s4);
+        if (s6 != -1)
+            close(s6);
+        throw;
+    }
+}
+
+IoUringUdpSocket::~IoUringUdpSocket()
+{
+    impl_.reset();
+    if (s4 != -1)
+        close(s4);
+    if (s6 != -1)
+        close(s6);
+}
+
+int
+IoUringUdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied)
+{
+    if (not dest)
+        return EFAULT;
+    int s = dest.getFamily() == AF_INET ? s4 : (dest.getFamily() == AF_INET6 ? s6 : -1);
+    if (s < 0)
+        return EAFNOSUPPORT;
+    return impl_->queue(s, dest, data, size, replied) ? 0 : ESHUTDOWN;
+}
+
+void
+IoUringUdpSocket::flush()
+{
+    impl_->flush();
+}
+
+SocketStats
+IoUringUdpSocket::getStats() const
+{
+    return impl_->getStats();
+}
+
+void
+IoUringUdpSocket::stop()
+{
+    impl_->stop();
+}
+
+} // namespace net
+} // namespace dht
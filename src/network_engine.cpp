@@ -6,9 +6,14 @@
 #include "default_types.h"
 #include "logger.h"
 #include "parsed_message.h"
+#include "object_pool.h"
+#include "thread_pool.h"
 
 #include <msgpack.hpp>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string_view>
 
 namespace dht {
@@ -26,6 +31,9 @@ const std::string DhtProtocolException::STORAGE_NOT_FOUND {"Access operation for
 constexpr std::chrono::seconds NetworkEngine::UDP_REPLY_TIME;
 constexpr std::chrono::seconds NetworkEngine::RX_MAX_PACKET_TIME;
 constexpr std::chrono::seconds NetworkEngine::RX_TIMEOUT;
+constexpr std::chrono::minutes NetworkEngine::BLACKLIST_EXPIRATION;
+constexpr size_t NetworkEngine::DECODE_CHUNK;
+constexpr size_t NetworkEngine::PARALLEL_DECODE_MIN;
 
 /* OpenDHT User Agent (UA) */
 constexpr std::string_view OPENDHT_UA {"o2"};
@@ -34,6 +42,14 @@ static constexpr uint8_t v4prefix[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xF
 
 constexpr unsigned SEND_NODES {8};
 
+/* Requests are allocated and released at a high rate: recycle their memory */
+template<typename... Args>
+static Sp<Request>
+makeRequest(Args&&... args)
+{
+    return std::allocate_shared<Request>(PoolAllocator<Request>(), std::forward<Args>(args)...);
+}
+
 struct NetworkEngine::PartialMessage
 {
     SockAddr from;
@@ -48,7 +64,7 @@ serializeValues(const std::vector<Sp<Value>>& st)
     std::vector<Blob> svals;
     svals.reserve(st.size());
     for (const auto& v : st)
-        svals.emplace_back(packMsg(v));
+        svals.emplace_back(v->getPacked());
     return svals;
 }
 
@@ -98,7 +114,8 @@ NetworkEngine::NetworkEngine(InfoHash& myid,
     , dht_socket(std::move(sock))
     , logger_(log)
     , rd(rand)
-    , cache(rd)
+    , cache(rd, config.shard)
+    , address_rate_limiter(config.max_peer_req_per_sec)
     , rate_limiter(config.max_req_per_sec)
     , scheduler(scheduler)
 {}
@@ -186,7 +203,7 @@ NetworkEngine::tellListenerRefreshed(const Sp<Node>& n,
         pk.pack(KEY_TID);
         pk.pack(tid);
 
-        auto req = std::make_shared<Request>(
+        auto req = makeRequest(
             MessageType::UpdateValue,
             tid,
             n,
@@ -257,7 +274,7 @@ NetworkEngine::tellListenerExpired(const Sp<Node>& n,
         pk.pack(KEY_TID);
         pk.pack(tid);
 
-        auto req = std::make_shared<Request>(
+        auto req = makeRequest(
             MessageType::UpdateValue,
             tid,
             n,
@@ -293,7 +310,9 @@ NetworkEngine::isRunning(sa_family_t af) const
 void
 NetworkEngine::clear()
 {
-    for (auto& request : requests) {
+    // Expiring nodes may send new requests: don't iterate the table while it can be modified
+    auto reqs = std::move(requests);
+    for (auto& request : reqs) {
         request.second->cancel();
         request.second->node->setExpired();
     }
@@ -323,6 +342,14 @@ NetworkEngine::requestStep(Sp<Request> sreq)
         if (not node.id)
             requests.erase(req.tid);
         return;
+    } else if (req.attempt_count >= Request::MAX_ATTEMPT_COUNT) {
+        // no more attempts, but a reply is still accepted until the request expires
+        std::weak_ptr<Request> wreq = sreq;
+        scheduler.add(req.expiration(), [this, wreq] {
+            if (auto req = wreq.lock())
+                requestStep(req);
+        });
+        return;
     } else if (req.attempt_count == 1) {
         if (req.on_expired)
             req.on_expired(req, false);
@@ -337,8 +364,10 @@ NetworkEngine::requestStep(Sp<Request> sreq)
         req.last_try = now;
         if (err != EAGAIN) {
             ++req.attempt_count;
-            req.attempt_duration += req.attempt_duration
-                                    + uniform_duration_distribution<>(0ms, ((duration) Node::MAX_RESPONSE_TIME) / 4)(rd);
+            // exponential backoff from the node retransmission timeout, with jitter
+            if (req.attempt_count > 1)
+                req.attempt_duration = std::min(req.attempt_duration * 2, (duration) Node::MAX_RTO)
+                                       + uniform_duration_distribution<>(0ms, node.getRto() / 4)(rd);
             if (not req.parts.empty()) {
                 sendValueParts(req.tid, req.parts, node.getAddr());
             }
@@ -362,6 +391,7 @@ NetworkEngine::sendRequest(const Sp<Request>& request)
     if (not node.id)
         requests.emplace(request->tid, request);
     request->start = scheduler.time();
+    request->attempt_duration = node.getRto();
     node.requested(request);
     requestStep(request);
 }
@@ -372,21 +402,8 @@ NetworkEngine::rateLimit(const SockAddr& addr)
 {
     const auto& now = scheduler.time();
 
-    // occasional IP limiter maintenance (a few times every second at max rate)
-    if (limiter_maintenance++ == config.max_peer_req_per_sec) {
-        for (auto it = address_rate_limiter.begin(); it != address_rate_limiter.end();) {
-            if (it->second.maintain(now) == 0)
-                address_rate_limiter.erase(it++);
-            else
-                ++it;
-        }
-        limiter_maintenance = 0;
-    }
-
     // invoke per IP, then global rate limiter
-    return (config.max_peer_req_per_sec < 0
-            or address_rate_limiter.emplace(addr, config.max_peer_req_per_sec).first->second.limit(now))
-           and rate_limiter.limit(now);
+    return (config.max_peer_req_per_sec < 0 or address_rate_limiter.limit(addr, now)) and rate_limiter.limit(now);
 }
 
 bool
@@ -419,43 +436,397 @@ void
 NetworkEngine::blacklistNode(const Sp<Node>& n)
 {
     n->setExpired();
-    blacklist.emplace(n->getAddr());
+    const auto& now = scheduler.time();
+    std::vector<SockAddr> expired;
+    for (const auto& b : blacklist)
+        if (b.second + BLACKLIST_EXPIRATION <= now)
+            expired.emplace_back(b.first);
+    for (const auto& addr : expired)
+        blacklist.erase(addr);
+    if (blacklist.size() >= BLACKLISTED_MAX and not blacklist.count(n->getAddr())) {
+        auto oldest = std::min_element(blacklist.begin(), blacklist.end(), [](const auto& a, const auto& b) {
+            return a.second < b.second;
+        });
+        blacklist.erase(oldest);
+    }
+    blacklist[n->getAddr()] = now;
 }
 
 bool
 NetworkEngine::isNodeBlacklisted(const SockAddr& addr) const
 {
-    return blacklist.find(addr) != blacklist.end();
+    // expired entries are only removed by blacklistNode(), so that lookups don't modify the blacklist
+    auto b = blacklist.find(addr);
+    return b != blacklist.end() and b->second + BLACKLIST_EXPIRATION > scheduler.time();
 }
 
-void
-NetworkEngine::processMessage(const uint8_t* buf, size_t buflen, SockAddr f)
+bool
+NetworkEngine::acceptFrom(const SockAddr& from) const
 {
-    auto from = f.getMappedIPv4();
     if (isMartian(from)) {
         if (logger_)
             logger_->warn("Received packet from martian node {}", from.toString());
-        return;
+        return false;
     }
 
     if (isNodeBlacklisted(from)) {
         if (logger_)
             logger_->warn("Received packet from blacklisted node {}", from.toString());
-        return;
+        return false;
     }
+    return true;
+}
 
+std::unique_ptr<ParsedMessage>
+NetworkEngine::parseMessage(const uint8_t* buf, size_t buflen) const
+{
     auto msg = std::make_unique<ParsedMessage>();
     try {
-        msgpack::unpacked msg_res = msgpack::unpack((const char*) buf, buflen);
-        msg->msgpack_unpack(msg_res.get());
+        // msg references buf until own() is called
+        msg->unpack(buf, buflen);
     } catch (const std::exception& e) {
         if (logger_)
             logger_->warn("Unable to parse message of size {}: {}", buflen, e.what());
         // if (logger_)
         //     logger_->DBG.logPrintable(buf, buflen);
+        return {};
+    }
+    return msg;
+}
+
+namespace {
+
+/**
+ * Reads msgpack data without building objects, to peek at a few fields.
+ * Methods return false if the data is truncated or invalid.
+ */
+class MsgpackReader
+{
+public:
+    struct Object
+    {
+        enum class Type { Uint, Raw, Array, Map, Other };
+        Type type {Type::Other};
+        /* value of unsigned integers, number of items of arrays and maps */
+        uint64_t value {0};
+        /* data of strings and binaries */
+        std::string_view raw {};
+    };
+
+    MsgpackReader(const uint8_t* buf, size_t buflen)
+        : cur_(buf)
+        , end_(buf + buflen)
+    {}
+
+    /** Read the header of the next object, and the data of strings and binaries */
+    bool read(Object& o);
+
+    /** Skip the items of an array or map just read */
+    bool skip(const Object& o, unsigned depth = 0);
+
+private:
+    static constexpr unsigned MAX_DEPTH {32};
+
+    bool take(uint64_t n, const uint8_t*& data)
+    {
+        if ((uint64_t) (end_ - cur_) < n)
+            return false;
+        data = cur_;
+        cur_ += n;
+        return true;
+    }
+    bool readUint(size_t n, uint64_t& v)
+    {
+        const uint8_t* data;
+        if (not take(n, data))
+            return false;
+        v = 0;
+        for (size_t i = 0; i < n; i++)
+            v = (v << 8) | data[i];
+        return true;
+    }
+
+    const uint8_t* cur_;
+    const uint8_t* const end_;
+};
+
+bool
+MsgpackReader::read(Object& o)
+{
+    using Type = Object::Type;
+    const uint8_t* data;
+    if (not take(1, data))
+        return false;
+    auto c = *data;
+    o = {};
+    auto raw = [&](uint64_t size) {
+        if (not take(size, data))
+            return false;
+        o.type = Type::Raw;
+        o.raw = {(const char*) data, (size_t) size};
+        return true;
+    };
+    auto items = [&](Type type, uint64_t size) {
+        o.type = type;
+        o.value = size;
+        return true;
+    };
+    uint64_t size;
+    if (c <= 0x7f) {
+        o.type = Type::Uint;
+        o.value = c;
+        return true;
+    } else if (c <= 0x8f)
+        return items(Type::Map, c & 0x0f);
+    else if (c <= 0x9f)
+        return items(Type::Array, c & 0x0f);
+    else if (c <= 0xbf)
+        return raw(c & 0x1f);
+    else if (c >= 0xe0) // negative fixint
+        return true;
+
+    switch (c) {
+    case 0xc0: // nil
+    case 0xc2: // false
+    case 0xc3: // true
+        return true;
+    case 0xc4: // bin
+    case 0xd9: // str
+        return readUint(1, size) and raw(size);
+    case 0xc5:
+    case 0xda:
+        return readUint(2, size) and raw(size);
+    case 0xc6:
+    case 0xdb:
+        return readUint(4, size) and raw(size);
+    case 0xc7: // ext: size, type and data
+        return readUint(1, size) and take(size + 1, data);
+    case 0xc8:
+        return readUint(2, size) and take(size + 1, data);
+    case 0xc9:
+        return readUint(4, size) and take(size + 1, data);
+    case 0xca: // float
+        return take(4, data);
+    case 0xcb:
+        return take(8, data);
+    case 0xcc: // uint
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+        o.type = Type::Uint;
+        return readUint(size_t(1) << (c - 0xcc), o.value);
+    case 0xd0: // int
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+        return take(size_t(1) << (c - 0xd0), data);
+    case 0xd4: // fixext: type and data
+    case 0xd5:
+    case 0xd6:
+    case 0xd7:
+    case 0xd8:
+        return take(1 + (size_t(1) << (c - 0xd4)), data);
+    case 0xdc:
+        return readUint(2, size) and items(Type::Array, size);
+    case 0xdd:
+        return readUint(4, size) and items(Type::Array, size);
+    case 0xde:
+        return readUint(2, size) and items(Type::Map, size);
+    case 0xdf:
+        return readUint(4, size) and items(Type::Map, size);
+    default: // 0xc1 is never used
+        return false;
+    }
+}
+
+bool
+MsgpackReader::skip(const Object& o, unsigned depth)
+{
+    if (o.type != Object::Type::Array and o.type != Object::Type::Map)
+        return true;
+    if (depth == MAX_DEPTH)
+        return false;
+    auto count = o.type == Object::Type::Map ? 2 * o.value : o.value;
+    Object item;
+    for (uint64_t i = 0; i < count; i++)
+        if (not read(item) or not skip(item, depth + 1))
+            return false;
+    return true;
+}
+
+} // namespace
+
+bool
+NetworkEngine::peekMessage(const uint8_t* buf, size_t buflen, MessageHeader& header)
+{
+    using Type = MsgpackReader::Object::Type;
+    MsgpackReader reader(buf, buflen);
+    MsgpackReader::Object msg, key, val;
+    if (not reader.read(msg) or msg.type != Type::Map)
+        return false;
+
+    header = {};
+    InfoHash h, target;
+    auto readHash = [](const MsgpackReader::Object& o, InfoHash& hash) {
+        if (o.type == Type::Raw and o.raw.size() == HASH_LEN)
+            hash = InfoHash((const uint8_t*) o.raw.data(), o.raw.size());
+    };
+    // id, target and value sizes of the arguments of a request, or of a reply
+    auto readBody = [&](const MsgpackReader::Object& body) {
+        if (body.type != Type::Map)
+            return reader.skip(body);
+        MsgpackReader::Object item;
+        for (uint64_t i = 0; i < body.value; i++) {
+            if (not reader.read(key) or not reader.skip(key) or not reader.read(val))
+                return false;
+            auto k = key.type == Type::Raw ? key.raw : std::string_view {};
+            if (k == KEY_REQ_VALUES and val.type == Type::Array) {
+                // values sent in parts are replaced by their size
+                for (uint64_t v = 0; v < val.value; v++) {
+                    if (not reader.read(item) or not reader.skip(item))
+                        return false;
+                    if (item.type == Type::Uint)
+                        header.value_parts = true;
+                }
+                continue;
+            }
+            if (k == KEY_REQ_ID)
+                readHash(val, header.id);
+            else if (k == KEY_REQ_H)
+                readHash(val, h);
+            else if (k == KEY_REQ_TARGET)
+                readHash(val, target);
+            if (not reader.skip(val))
+                return false;
+        }
+        return true;
+    };
+
+    bool error = false, reply = false, data = false, update = false;
+    for (uint64_t i = 0; i < msg.value; i++) {
+        if (not reader.read(key) or not reader.skip(key) or not reader.read(val))
+            return false;
+        auto k = key.type == Type::Raw ? key.raw : std::string_view {};
+        if (k == KEY_A or k == KEY_R or k == KEY_U) {
+            reply |= k == KEY_R;
+            update |= k == KEY_U;
+            if (not readBody(val))
+                return false;
+            continue;
+        }
+        if (k == KEY_TID) {
+            if (val.type == Type::Uint)
+                header.tid = (Tid) val.value;
+            else if (val.type == Type::Raw and val.raw.size() == sizeof(Tid)) {
+                uint32_t tid;
+                std::memcpy(&tid, val.raw.data(), sizeof(tid));
+                header.tid = ntohl(tid);
+            }
+        } else if (k == KEY_E)
+            error = true;
+        else if (k == KEY_V)
+            data = true;
+        if (not reader.skip(val))
+            return false;
+    }
+    // same precedence as ParsedMessage::parse()
+    header.value_data = data and not error and not reply;
+    header.request = not error and not reply and not data and not update;
+    header.target = h ? h : target;
+    return true;
+}
+
+void
+NetworkEngine::processMessage(const uint8_t* buf, size_t buflen, SockAddr f)
+{
+    auto from = f.getMappedIPv4();
+    if (not acceptFrom(from))
+        return;
+    if (auto msg = parseMessage(buf, buflen))
+        processMessage(std::move(msg), from);
+}
+
+void
+NetworkEngine::processMessages(const std::vector<ReceivedPacket>& packets)
+{
+    if (config.decode_threads < 2 or packets.size() < PARALLEL_DECODE_MIN) {
+        for (const auto& pkt : packets) {
+            try {
+                processMessage(pkt.data.data(), pkt.data.size(), pkt.from);
+            } catch (const std::exception& e) {
+                if (logger_)
+                    logger_->warn("Unable to process message: {}", e.what());
+            }
+        }
         return;
     }
 
+    std::vector<std::unique_ptr<ParsedMessage>> msgs(packets.size());
+    decodeMessages(packets, msgs);
+    // Processing keeps the order of reception, that partial messages rely on
+    for (size_t i = 0; i < packets.size(); i++) {
+        if (not msgs[i])
+            continue;
+        auto from = SockAddr(packets[i].from).getMappedIPv4();
+        try {
+            processMessage(std::move(msgs[i]), from);
+        } catch (const std::exception& e) {
+            if (logger_)
+                logger_->warn("Unable to process message: {}", e.what());
+        }
+    }
+}
+
+void
+NetworkEngine::decodeMessages(const std::vector<ReceivedPacket>& packets,
+                              std::vector<std::unique_ptr<ParsedMessage>>& msgs)
+{
+    struct Batch
+    {
+        explicit Batch(size_t c)
+            : chunks(c)
+        {}
+        const size_t chunks;
+        std::atomic<size_t> next {0};
+        std::mutex lock {};
+        std::condition_variable cv {};
+        size_t done {0};
+    };
+    auto batch = std::make_shared<Batch>((packets.size() + DECODE_CHUNK - 1) / DECODE_CHUNK);
+
+    // Chunks are taken by whichever thread is available: the calling thread
+    // never waits for a task still queued in the pool, only for chunks being
+    // decoded. Tasks starting after every chunk was taken do nothing.
+    // The blacklist is only modified by the calling thread, blocked here.
+    auto decode = [this, batch, &packets, &msgs] {
+        size_t decoded = 0;
+        for (size_t c; (c = batch->next.fetch_add(1, std::memory_order_relaxed)) < batch->chunks; decoded++) {
+            auto end = std::min(packets.size(), (c + 1) * DECODE_CHUNK);
+            for (auto i = c * DECODE_CHUNK; i < end; i++) {
+                // packets from rejected senders are not parsed
+                if (acceptFrom(SockAddr(packets[i].from).getMappedIPv4()))
+                    msgs[i] = parseMessage(packets[i].data.data(), packets[i].data.size());
+            }
+        }
+        if (decoded) {
+            std::lock_guard lk(batch->lock);
+            batch->done += decoded;
+            if (batch->done == batch->chunks)
+                batch->cv.notify_all();
+        }
+    };
+    auto helpers = std::min<size_t>(config.decode_threads, batch->chunks) - 1;
+    for (size_t t = 0; t < helpers; t++)
+        ThreadPool::computation().run(decode);
+    decode();
+
+    std::unique_lock lk(batch->lock);
+    batch->cv.wait(lk, [&] { return batch->done == batch->chunks; });
+}
+
+void
+NetworkEngine::processMessage(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& from)
+{
     if (msg->network != config.network) {
         if (logger_)
             logger_->debug("Received message from other config.network {}", msg->network);
@@ -485,14 +856,16 @@ NetworkEngine::processMessage(const uint8_t* buf, size_t buflen, SockAddr f)
             pmsg_it->second.last_part = now;
             // check data completion
             if (pmsg_it->second.msg->complete()) {
+                // erase first: processing may modify the table
+                auto full = std::move(pmsg_it->second.msg);
+                partial_messages.erase(pmsg_it);
                 try {
                     // process the full message
-                    process(std::move(pmsg_it->second.msg), from);
+                    process(std::move(full), from);
                 } catch (const std::exception& e) {
                     if (logger_)
                         logger_->warn("Error while processing partial message: {}", e.what());
                 }
-                partial_messages.erase(pmsg_it);
             } else
                 scheduler.add(now + RX_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, msg->tid));
         }
@@ -527,6 +900,7 @@ NetworkEngine::processMessage(const uint8_t* buf, size_t buflen, SockAddr f)
         auto k = msg->tid;
         auto& pmsg = partial_messages[k];
         if (not pmsg.msg) {
+            msg->own();
             pmsg.from = from;
             pmsg.msg = std::move(msg);
             pmsg.start = now;
@@ -618,6 +992,9 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                     r.node->authSuccess();
                 }
                 r.reply_time = scheduler.time();
+                // Karn's algorithm: replies to retransmitted requests don't tell which attempt they answer
+                if (r.attempt_count == 1)
+                    r.node->rttSample(r.reply_time - r.last_try);
                 try {
                     deserializeNodes(*msg, from);
                     r.setDone(std::move(*msg));
@@ -669,6 +1046,10 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                 //     node->toString().c_str(), msg->info_hash.toString().c_str());
                 ++in_stats.get;
                 RequestAnswer answer = onGetValues(node, msg->info_hash, msg->want, msg->query);
+                if (answer.reply) {
+                    sendReply(from, msg->tid, *answer.reply, answer.ntoken);
+                    break;
+                }
                 auto nnodes = bufferNodes(from.getFamily(), msg->info_hash, msg->want, answer.nodes4, answer.nodes6);
                 sendNodesValues(from, msg->tid, nnodes.first, nnodes.second, answer.values, msg->query, answer.ntoken);
                 break;
@@ -779,7 +1160,7 @@ NetworkEngine::sendPing(const Sp<Node>& node, RequestCb&& on_done, RequestExpire
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::Ping,
         tid,
         node,
@@ -869,7 +1250,7 @@ NetworkEngine::sendFindNode(
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::FindNode,
         tid,
         n,
@@ -940,7 +1321,7 @@ NetworkEngine::sendGetValues(const Sp<Node>& n,
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::GetValues,
         tid,
         n,
@@ -1025,28 +1406,32 @@ NetworkEngine::packValueHeader(msgpack::sbuffer& buffer,
                                std::vector<Sp<Value>>::const_iterator b,
                                std::vector<Sp<Value>>::const_iterator e) const
 {
-    std::vector<Blob> svals;
+    // values keep their packed encoding, shared by all replies
+    std::vector<std::shared_ptr<const Blob>> packed;
     size_t total_size = 0;
 
-    svals.reserve(std::distance(b, e));
+    packed.reserve(std::distance(b, e));
     for (; b != e; ++b) {
-        svals.emplace_back(packMsg(*b));
-        total_size += svals.back().size();
+        packed.emplace_back((*b)->getPackedRef());
+        total_size += packed.back()->size();
     }
 
+    std::vector<Blob> svals;
     msgpack::packer<msgpack::sbuffer> pk(&buffer);
     pk.pack(KEY_REQ_VALUES);
-    pk.pack_array(svals.size());
+    pk.pack_array(packed.size());
     // try to put everything in a single UDP packet
-    if (svals.size() < 50 && total_size < MAX_PACKET_VALUE_SIZE) {
-        for (const auto& b : svals)
-            buffer.write((const char*) b.data(), b.size());
+    if (packed.size() < 50 && total_size < MAX_PACKET_VALUE_SIZE) {
+        for (const auto& b : packed)
+            buffer.write((const char*) b->data(), b->size());
         // if (logger_)
         //     logger_->d("sending %lu bytes of values", total_size);
-        svals.clear();
     } else {
-        for (const auto& b : svals)
-            pk.pack(b.size());
+        svals.reserve(packed.size());
+        for (const auto& b : packed) {
+            pk.pack(b->size());
+            svals.emplace_back(*b);
+        }
     }
     return svals;
 }
@@ -1100,34 +1485,33 @@ NetworkEngine::sendNodesValues(const SockAddr& addr,
                                const Query& query,
                                const Blob& token)
 {
+    sendReply(addr, tid, packNodesValues(nodes, nodes6, st, query), token);
+}
+
+EncodedReply
+NetworkEngine::packNodesValues(const Blob& nodes,
+                               const Blob& nodes6,
+                               const std::vector<Sp<Value>>& st,
+                               const Query& query) const
+{
+    EncodedReply reply;
     msgpack::sbuffer buffer;
     msgpack::packer<msgpack::sbuffer> pk(&buffer);
-    pk.pack_map(4 + (config.network ? 1 : 0) + (config.is_client ? 1 : 0));
-
-    pk.pack(KEY_R);
-    pk.pack_map(2 + (not st.empty() ? 1 : 0) + (nodes.size() > 0 ? 1 : 0) + (nodes6.size() > 0 ? 1 : 0)
-                + (not token.empty() ? 1 : 0));
-    pk.pack(KEY_REQ_ID);
-    pk.pack(myid);
-    insertAddr(pk, addr);
     if (nodes.size() > 0) {
         pk.pack(KEY_REQ_NODES4);
         pk.pack_bin(nodes.size());
         pk.pack_bin_body((const char*) nodes.data(), nodes.size());
+        reply.entries++;
     }
     if (nodes6.size() > 0) {
         pk.pack(KEY_REQ_NODES6);
         pk.pack_bin(nodes6.size());
         pk.pack_bin_body((const char*) nodes6.data(), nodes6.size());
+        reply.entries++;
     }
-    if (not token.empty()) {
-        pk.pack(KEY_REQ_TOKEN);
-        packToken(pk, token);
-    }
-    std::vector<Blob> svals {};
     if (not st.empty()) { /* pack complete values */
         if (query.select.empty()) {
-            svals = packValueHeader(buffer, st);
+            reply.parts = packValueHeader(buffer, st);
         } else { /* pack fields */
             auto fields = query.select.getSelection();
             pk.pack(KEY_REQ_FIELDS);
@@ -1141,7 +1525,42 @@ NetworkEngine::sendNodesValues(const SockAddr& addr,
             // DHT_LOG_DBG("sending closest nodes (%d+%d nodes.), %u value headers containing %u fields",
             //         nodes.size(), nodes6.size(), st.size(), fields.size());
         }
+        reply.entries++;
+    }
+    reply.body.assign((const uint8_t*) buffer.data(), (const uint8_t*) buffer.data() + buffer.size());
+    return reply;
+}
+
+Sp<const EncodedReply>
+NetworkEngine::encodeReply(sa_family_t af,
+                           const InfoHash& id,
+                           want_t want,
+                           std::vector<Sp<Node>>& nodes4,
+                           std::vector<Sp<Node>>& nodes6,
+                           const std::vector<Sp<Value>>& values,
+                           const Query& query)
+{
+    auto nnodes = bufferNodes(af, id, want, nodes4, nodes6);
+    return std::make_shared<const EncodedReply>(packNodesValues(nnodes.first, nnodes.second, values, query));
+}
+
+void
+NetworkEngine::sendReply(const SockAddr& addr, Tid tid, const EncodedReply& reply, const Blob& token)
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_map(4 + (config.network ? 1 : 0) + (config.is_client ? 1 : 0));
+
+    pk.pack(KEY_R);
+    pk.pack_map(2 + reply.entries + (not token.empty() ? 1 : 0));
+    pk.pack(KEY_REQ_ID);
+    pk.pack(myid);
+    insertAddr(pk, addr);
+    if (not token.empty()) {
+        pk.pack(KEY_REQ_TOKEN);
+        packToken(pk, token);
     }
+    buffer.write((const char*) reply.body.data(), reply.body.size());
 
     pk.pack(KEY_TID);
     pk.pack(tid);
@@ -1162,8 +1581,8 @@ NetworkEngine::sendNodesValues(const SockAddr& addr,
     send(addr, buffer.data(), buffer.size());
 
     // send parts
-    if (not svals.empty())
-        sendValueParts(tid, svals, addr);
+    if (not reply.parts.empty())
+        sendValueParts(tid, reply.parts, addr);
 }
 
 Blob
@@ -1265,7 +1684,7 @@ NetworkEngine::sendListen(const Sp<Node>& n,
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::Listen,
         tid,
         n,
@@ -1362,7 +1781,7 @@ NetworkEngine::sendAnnounceValue(const Sp<Node>& n,
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::AnnounceValue,
         tid,
         n,
@@ -1463,7 +1882,7 @@ NetworkEngine::sendUpdateValues(const Sp<Node>& n,
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::UpdateValue,
         tid,
         n,
@@ -1518,7 +1937,7 @@ NetworkEngine::sendRefreshValue(const Sp<Node>& n,
         pk.pack(config.is_client);
     }
 
-    auto req = std::make_shared<Request>(
+    auto req = makeRequest(
         MessageType::Refresh,
         tid,
         n,
@@ -17,16 +17,375 @@
 #define _poll(fds, nfds, timeout) poll(fds, nfds, timeout)
 #endif
 
-// number of file descriptors to poll in openSockets()
+#ifdef __linux__
+#include <sys/uio.h>
+#include <sched.h>
+#define HAVE_MMSG 1
+#ifdef SO_RXQ_OVFL
+#define HAVE_RXQ_OVFL 1
+#endif
+#endif
+
+// number of file descriptors to poll in receiveLoop()
 #define NUM_FDS 3
 
 #include <iostream>
+#include <array>
 
 namespace dht {
 namespace net {
 
+namespace {
+
 int
-bindSocket(const SockAddr& addr, SockAddr& bound)
+sendFlags([[maybe_unused]] bool replied)
+{
+    int flags = 0;
+#ifdef MSG_CONFIRM
+    if (replied)
+        flags |= MSG_CONFIRM;
+#endif
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    return flags;
+}
+
+unsigned
+rxSocketCount(const SocketConfig& config)
+{
+#ifdef SO_REUSEPORT
+    return std::max(1u, config.reuseport_sockets);
+#else
+    return 1;
+#endif
+}
+
+bool
+pinCurrentThread([[maybe_unused]] unsigned index)
+{
+#ifdef __linux__
+    auto ncpu = std::thread::hardware_concurrency();
+    if (ncpu == 0)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Receive state of a rx thread.
+ * Up to `size()` datagrams are read with a single recvmmsg() call when available,
+ * directly into the pooled buffers of the provided packets.
+ * The end of datagrams larger than a pooled buffer is received in an overflow
+ * area, only committed to memory when written to by the kernel.
+ */
+class RxBatch
+{
+public:
+#ifdef HAVE_RXQ_OVFL
+    static constexpr size_t CONTROL_SIZE {CMSG_SPACE(sizeof(uint32_t))};
+#endif
+
+    explicit RxBatch(size_t n)
+        : from_(n)
+        , lengths_(n)
+        , from_lengths_(n)
+        , truncated_(n)
+#ifdef HAVE_MMSG
+        , overflow_(new uint8_t[n * MAX_DATAGRAM_SIZE])
+        , iov_(2 * n)
+        , msgs_(n)
+#else
+        , overflow_(new uint8_t[MAX_DATAGRAM_SIZE])
+#endif
+#ifdef HAVE_RXQ_OVFL
+        , control_(n * CONTROL_SIZE)
+#endif
+    {
+#ifdef HAVE_MMSG
+        for (size_t i = 0; i < n; i++) {
+            msgs_[i].msg_hdr.msg_iov = &iov_[2 * i];
+            msgs_[i].msg_hdr.msg_iovlen = 2;
+            msgs_[i].msg_hdr.msg_name = &from_[i];
+            iov_[2 * i + 1].iov_base = overflow_.get() + i * MAX_DATAGRAM_SIZE;
+            iov_[2 * i + 1].iov_len = MAX_DATAGRAM_SIZE;
+        }
+#endif
+    }
+
+    size_t size() const { return from_.size(); }
+
+    /**
+     * Read pending datagrams from socket s into the buffers of
+     * the first `count` packets of pkts (at most size()).
+     * @return the number of received datagrams, or -1 (errno is set).
+     */
+    int receive(int s, PacketList& pkts, size_t count)
+    {
+        drop_count_ = 0;
+        count = std::min(count, size());
+#ifdef HAVE_MMSG
+        auto pkt = pkts.begin();
+        for (size_t i = 0; i < count; i++, ++pkt) {
+            iov_[2 * i].iov_base = pkt->data.data();
+            iov_[2 * i].iov_len = pkt->data.capacity();
+            auto& m = msgs_[i];
+            m.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+#ifdef HAVE_RXQ_OVFL
+            m.msg_hdr.msg_control = control_.data() + i * CONTROL_SIZE;
+            m.msg_hdr.msg_controllen = CONTROL_SIZE;
+#else
+            m.msg_hdr.msg_control = nullptr;
+            m.msg_hdr.msg_controllen = 0;
+#endif
+            m.msg_hdr.msg_flags = 0;
+        }
+        int n = recvmmsg(s, msgs_.data(), count, 0, nullptr);
+        for (int i = 0; i < n; i++) {
+            lengths_[i] = msgs_[i].msg_len;
+            from_lengths_[i] = msgs_[i].msg_hdr.msg_namelen;
+            truncated_[i] = msgs_[i].msg_hdr.msg_flags & MSG_TRUNC;
+#ifdef HAVE_RXQ_OVFL
+            auto& hdr = msgs_[i].msg_hdr;
+            for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SO_RXQ_OVFL)
+                    memcpy(&drop_count_, CMSG_DATA(cmsg), sizeof(drop_count_));
+            }
+#endif
+        }
+        return n;
+#else
+        if (count == 0)
+            return 0;
+        from_lengths_[0] = sizeof(sockaddr_storage);
+        int rc = recvfrom(s, (char*) overflow_.get(), MAX_DATAGRAM_SIZE, 0, (sockaddr*) &from_[0], &from_lengths_[0]);
+        if (rc < 0)
+            return rc;
+        lengths_[0] = rc;
+        truncated_[0] = false;
+        return 1;
+#endif
+    }
+
+    size_t length(size_t i) const { return lengths_[i]; }
+    bool truncated(size_t i) const { return truncated_[i]; }
+
+    /* Set data, the buffer given for datagram i, to the received datagram */
+    void read(size_t i, PacketBuffer& data) const
+    {
+#ifdef HAVE_MMSG
+        auto head = std::min(lengths_[i], data.capacity());
+        data.resize(head);
+        if (lengths_[i] > head) {
+            auto overflow = overflow_.get() + i * MAX_DATAGRAM_SIZE;
+            data.append(overflow, overflow + (lengths_[i] - head));
+        }
+#else
+        data.assign(overflow_.get(), overflow_.get() + lengths_[i]);
+#endif
+    }
+    SockAddr from(size_t i) const { return {from_[i], from_lengths_[i]}; }
+
+    /**
+     * Number of datagrams dropped by the kernel since the socket was opened,
+     * as reported with the last receive() call, or 0 if unknown.
+     */
+    uint32_t dropCount() const { return drop_count_; }
+
+private:
+    std::vector<sockaddr_storage> from_;
+    std::vector<size_t> lengths_;
+    std::vector<socklen_t> from_lengths_;
+    std::vector<uint8_t> truncated_;
+    std::unique_ptr<uint8_t[]> overflow_;
+#ifdef HAVE_MMSG
+    /* pooled buffer and overflow area of each datagram */
+    std::vector<iovec> iov_;
+    std::vector<mmsghdr> msgs_;
+#endif
+#ifdef HAVE_RXQ_OVFL
+    std::vector<uint8_t> control_;
+#endif
+    uint32_t drop_count_ {0};
+};
+
+} // namespace
+
+void
+PacketBuffer::assign(const uint8_t* begin, const uint8_t* end)
+{
+    size_t size = end - begin;
+    offset_ = 0;
+    if (size > capacity_) {
+        clear();
+        owned_.reset(new uint8_t[size]);
+        data_ = owned_.get();
+        capacity_ = size;
+    }
+    std::copy(begin, end, data_);
+    size_ = size;
+}
+
+void
+PacketBuffer::append(const uint8_t* begin, const uint8_t* end)
+{
+    size_t size = end - begin;
+    if (size_ + size > capacity()) {
+        std::unique_ptr<uint8_t[]> owned(new uint8_t[size_ + size]);
+        std::copy_n(data(), size_, owned.get());
+        auto head = size_;
+        clear();
+        owned_ = std::move(owned);
+        data_ = owned_.get();
+        capacity_ = head + size;
+        size_ = head;
+    }
+    std::copy(begin, end, data() + size_);
+    size_ += size;
+}
+
+void
+PacketBuffer::clear()
+{
+    if (pool_) {
+        pool_->release(data_);
+        pool_.reset();
+    }
+    owned_.reset();
+    data_ = nullptr;
+    offset_ = 0;
+    size_ = 0;
+    capacity_ = 0;
+}
+
+/**
+ * Bounded lock-free queue of free buffers, for any number of threads
+ * acquiring and releasing them. Large enough for every buffer of the pool.
+ */
+class PacketPool::FreeList
+{
+public:
+    /** Capacity is rounded up to a power of two */
+    explicit FreeList(size_t capacity)
+        : mask_(roundCapacity(capacity) - 1)
+        , cells_(new Cell[mask_ + 1])
+    {
+        for (size_t i = 0; i <= mask_; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * The queue is never full, but a cell can still be taken by a thread
+     * popping it: push() then waits for it.
+     */
+    void push(uint8_t* buffer)
+    {
+        auto pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = cells_[pos & mask_];
+            auto diff = (intptr_t) cell.seq.load(std::memory_order_acquire) - (intptr_t) pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.buffer = buffer;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return;
+                }
+            } else {
+                if (diff < 0)
+                    std::this_thread::yield();
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(uint8_t*& buffer)
+    {
+        auto pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = cells_[pos & mask_];
+            auto diff = (intptr_t) cell.seq.load(std::memory_order_acquire) - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    buffer = cell.buffer;
+                    cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else {
+                if (diff < 0) {
+                    // empty, unless a buffer is being pushed in this cell
+                    if (tail_.load(std::memory_order_acquire) == pos)
+                        return false;
+                    std::this_thread::yield();
+                }
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        uint8_t* buffer;
+    };
+
+    static size_t roundCapacity(size_t capacity)
+    {
+        size_t c = 2;
+        while (c < capacity)
+            c <<= 1;
+        return c;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> head_ {0};
+    alignas(64) std::atomic<size_t> tail_ {0};
+};
+
+PacketPool::PacketPool(size_t buffer_size, size_t max_buffers)
+    : buffer_size_(buffer_size)
+    , max_buffers_(max_buffers)
+    , free_(std::make_unique<FreeList>((max_buffers + SLAB_BUFFERS - 1) / SLAB_BUFFERS * SLAB_BUFFERS))
+{}
+
+PacketPool::~PacketPool() = default;
+
+PacketBuffer
+PacketPool::acquire()
+{
+    uint8_t* buffer;
+    if (not free_->pop(buffer)) {
+        std::lock_guard lk(lock_);
+        // another thread may have added a slab meanwhile
+        if (not free_->pop(buffer)) {
+            if (slabs_.size() * SLAB_BUFFERS >= max_buffers_)
+                return {};
+            // Memory is only committed when written to
+            auto& slab = slabs_.emplace_back(new uint8_t[SLAB_BUFFERS * buffer_size_]);
+            for (size_t i = 1; i < SLAB_BUFFERS; i++)
+                free_->push(slab.get() + i * buffer_size_);
+            buffer = slab.get();
+        }
+    }
+    in_use_.fetch_add(1, std::memory_order_relaxed);
+    return {shared_from_this(), buffer, buffer_size_};
+}
+
+void
+PacketPool::release(uint8_t* buffer)
+{
+    in_use_.fetch_sub(1, std::memory_order_relaxed);
+    free_->push(buffer);
+}
+
+int
+bindSocket(const SockAddr& addr, SockAddr& bound, [[maybe_unused]] bool reusePort)
 {
     bool is_ipv6 = addr.getFamily() == AF_INET6;
     int sock = socket(is_ipv6 ? PF_INET6 : PF_INET, SOCK_DGRAM, 0);
@@ -38,6 +397,13 @@ bindSocket(const SockAddr& addr, SockAddr& bound)
 #endif
     if (is_ipv6)
         setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char*) &set, sizeof(set));
+#ifdef SO_REUSEPORT
+    if (reusePort)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*) &set, sizeof(set));
+#endif
+#ifdef HAVE_RXQ_OVFL
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, (const char*) &set, sizeof(set));
+#endif
     net::setNonblocking(sock);
     int rc = bind(sock, addr.get(), addr.getLength());
     if (rc < 0) {
@@ -100,6 +466,7 @@ udpPipe(int fds[2])
 
 UdpSocket::UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l)
     : logger(l)
+    , rx_sockets(2 * rxSocketCount(config_))
 {
     SockAddr bind4;
     bind4.setFamily(AF_INET);
@@ -111,8 +478,13 @@ UdpSocket::UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l)
     openSockets(bind4, bind6);
 }
 
-UdpSocket::UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::shared_ptr<Logger>& l)
+UdpSocket::UdpSocket(const SockAddr& bind4,
+                     const SockAddr& bind6,
+                     const std::shared_ptr<Logger>& l,
+                     const SocketConfig& config)
     : logger(l)
+    , config_(config)
+    , rx_sockets(2 * rxSocketCount(config_))
 {
     std::lock_guard lk(lock);
     openSockets(bind4, bind6);
@@ -121,12 +493,20 @@ UdpSocket::UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::sh
 UdpSocket::~UdpSocket()
 {
     stop();
-    if (rcv_thread.joinable())
-        rcv_thread.join();
+    joinThreads();
+}
+
+void
+UdpSocket::joinThreads()
+{
+    for (auto& t : rcv_threads)
+        if (t.joinable())
+            t.join();
+    rcv_threads.clear();
 }
 
 int
-UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, [[maybe_unused]] bool replied)
+UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied)
 {
     if (not dest)
         return EFAULT;
@@ -147,17 +527,43 @@ UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, [[mayb
     if (s < 0)
         return EAFNOSUPPORT;
 
-    int flags = 0;
-#ifdef MSG_CONFIRM
-    if (replied)
-        flags |= MSG_CONFIRM;
-#endif
-#ifdef MSG_NOSIGNAL
-    flags |= MSG_NOSIGNAL;
-#endif
+    if (config_.tx_batch) {
+        std::lock_guard lk(tx_lock);
+        // unreachable destinations are reported by the next datagram sent to them
+        if (not tx_failed.empty()) {
+            auto it = tx_failed.find(dest);
+            if (it != tx_failed.end()) {
+                int err = it->second;
+                tx_failed.erase(it);
+                return err;
+            }
+        }
+        if (tx_pending >= TX_BATCH_SIZE) {
+            flushLocked();
+            // datagrams are left when the socket buffer is full
+            if (tx_pending >= TX_BATCH_SIZE)
+                return EAGAIN;
+        }
+        if (tx_pending == tx_queue.size())
+            tx_queue.emplace_back();
+        auto& pkt = tx_queue[tx_pending++];
+        pkt.replied = replied;
+        pkt.dest = dest;
+        pkt.data.assign(data, data + size);
+        if (tx_pending >= TX_BATCH_SIZE)
+            flushLocked();
+        return 0;
+    }
 
-    if (sendto(s, (const char*) data, size, flags, dest.get(), dest.getLength()) == -1) {
+    return sendNow(s, dest, data, size, replied);
+}
+
+int
+UdpSocket::sendNow(int s, const SockAddr& dest, const uint8_t* data, size_t size, bool replied)
+{
+    if (sendto(s, (const char*) data, size, sendFlags(replied), dest.get(), dest.getLength()) == -1) {
         int err = errno;
+        tx_errors++;
         if (logger)
             logger->d("Can't send message to %s: %s", dest.toString().c_str(), strerror(err));
         if (err == EPIPE || err == ENOTCONN || err == ECONNRESET) {
@@ -168,15 +574,154 @@ UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, [[mayb
         }
         return err;
     }
+    countBatch(tx_packets, tx_batches, tx_batch_max, 1);
     return 0;
 }
 
+void
+UdpSocket::flush()
+{
+    std::lock_guard lk(tx_lock);
+    flushLocked();
+}
+
+void
+UdpSocket::flushLocked()
+{
+    if (tx_pending == 0)
+        return;
+    auto familySocket = [&](const SockAddr& dest) {
+        return dest.getFamily() == AF_INET ? s4 : s6;
+    };
+    bool reopened = false;
+    size_t i = 0;
+#ifdef HAVE_MMSG
+    std::array<mmsghdr, TX_BATCH_SIZE> msgs;
+    std::array<iovec, TX_BATCH_SIZE> iov;
+    while (i < tx_pending) {
+        // consecutive datagrams for the same socket and flags are sent together
+        const auto& first = tx_queue[i];
+        size_t n = 0;
+        for (; i + n < tx_pending and n < TX_BATCH_SIZE; n++) {
+            auto& pkt = tx_queue[i + n];
+            if (pkt.dest.getFamily() != first.dest.getFamily() or pkt.replied != first.replied)
+                break;
+            iov[n].iov_base = pkt.data.data();
+            iov[n].iov_len = pkt.data.size();
+            msgs[n] = {};
+            msgs[n].msg_hdr.msg_name = const_cast<sockaddr*>(pkt.dest.get());
+            msgs[n].msg_hdr.msg_namelen = pkt.dest.getLength();
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+        int rc = sendmmsg(familySocket(first.dest), msgs.data(), n, sendFlags(first.replied));
+        if (rc > 0) {
+            countBatch(tx_packets, tx_batches, tx_batch_max, rc);
+            i += rc;
+        } else if (not onSendError(rc < 0 ? errno : EAGAIN, i, reopened)) {
+            break;
+        }
+    }
+#else
+    size_t sent = 0;
+    while (i < tx_pending) {
+        const auto& pkt = tx_queue[i];
+        if (sendto(familySocket(pkt.dest),
+                   (const char*) pkt.data.data(),
+                   pkt.data.size(),
+                   sendFlags(pkt.replied),
+                   pkt.dest.get(),
+                   pkt.dest.getLength())
+            == -1) {
+            if (not onSendError(errno, i, reopened))
+                break;
+        } else {
+            sent++;
+            i++;
+        }
+    }
+    if (sent)
+        countBatch(tx_packets, tx_batches, tx_batch_max, sent);
+#endif
+    // keep buffers allocated for the next batch, after the datagrams left to send
+    for (size_t j = 0; j < i; j++)
+        tx_queue[j].data.clear();
+    std::rotate(tx_queue.begin(), tx_queue.begin() + i, tx_queue.begin() + tx_pending);
+    tx_pending -= i;
+}
+
+/**
+ * Handle the error of sending datagram i of the queue, as sendNow() does.
+ * Returns false to stop sending, leaving datagrams from i for the next flush.
+ */
+bool
+UdpSocket::onSendError(int err, size_t& i, bool& reopened)
+{
+    if (err == EINTR)
+        return true;
+    if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS)
+        return false;
+    const auto& pkt = tx_queue[i];
+    tx_errors++;
+    if (logger)
+        logger->d("Can't send message to %s: %s", pkt.dest.toString().c_str(), strerror(err));
+    if ((err == EPIPE || err == ENOTCONN || err == ECONNRESET) and not reopened) {
+        // send again on new sockets
+        reopened = true;
+        std::lock_guard lk(lock);
+        auto bind4 = std::move(bound4), bind6 = std::move(bound6);
+        openSockets(bind4, bind6);
+        return true;
+    }
+    if (err == ENETUNREACH || err == EHOSTUNREACH || err == EPERM) {
+        if (tx_failed.size() >= TX_FAILED_MAX)
+            tx_failed.clear();
+        tx_failed[pkt.dest] = err;
+    }
+    i++;
+    return true;
+}
+
+void
+UdpSocket::countBatch(std::atomic<uint64_t>& packets,
+                      std::atomic<uint64_t>& batches,
+                      std::atomic<uint64_t>& batch_max,
+                      uint64_t n)
+{
+    packets += n;
+    batches++;
+    auto max = batch_max.load(std::memory_order_relaxed);
+    while (n > max and not batch_max.compare_exchange_weak(max, n, std::memory_order_relaxed)) {}
+}
+
+SocketStats
+UdpSocket::getStats() const
+{
+    SocketStats stats;
+    stats.rx_packets = rx_packets;
+    stats.rx_batches = rx_batches;
+    stats.rx_batch_max = rx_batch_max;
+    stats.rx_dropped = rx_dropped;
+    stats.tx_packets = tx_packets;
+    stats.tx_batches = tx_batches;
+    stats.tx_batch_max = tx_batch_max;
+    stats.tx_errors = tx_errors;
+    stats.sockets.resize(rx_sockets.size());
+    for (size_t i = 0; i < rx_sockets.size(); i++) {
+        auto& sock = stats.sockets[i];
+        sock.family = (i % 2) ? AF_INET6 : AF_INET;
+        sock.index = i / 2;
+        sock.packets = rx_sockets[i].packets;
+        sock.drops = rx_sockets[i].drops;
+    }
+    return stats;
+}
+
 void
 UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
 {
     stop();
-    if (rcv_thread.joinable())
-        rcv_thread.join();
+    joinThreads();
 
     int stopfds[2];
 #ifndef _WIN32
@@ -193,10 +738,13 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
     s4 = -1;
     s6 = -1;
 
+    const unsigned count = rx_sockets.size() / 2;
+    const bool reuse = count > 1;
+
     bound4 = {};
     if (bind4) {
         try {
-            s4 = bindSocket(bind4, bound4);
+            s4 = bindSocket(bind4, bound4, reuse);
         } catch (const DhtException& e) {
             if (logger)
                 logger->e("Can't bind inet socket: %s", e.what());
@@ -212,7 +760,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                 auto b6 = bind6;
                 b6.setPort(p4);
                 try {
-                    s6 = bindSocket(b6, bound6);
+                    s6 = bindSocket(b6, bound6, reuse);
                 } catch (const DhtException& e) {
                     if (logger)
                         logger->e("Can't bind inet6 socket: %s", e.what());
@@ -221,7 +769,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
         }
         if (s6 == -1) {
             try {
-                s6 = bindSocket(bind6, bound6);
+                s6 = bindSocket(bind6, bound6, reuse);
             } catch (const DhtException& e) {
                 if (logger)
                     logger->e("Can't bind inet6 socket: %s", e.what());
@@ -234,118 +782,230 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
         throw DhtException("Can't bind socket");
     }
 
-    running = true;
-    rcv_thread = std::thread([this, stop_readfd, ls4 = s4, ls6 = s6]() mutable {
-        struct pollfd fds[NUM_FDS];
-        for (int i = 0; i < NUM_FDS; i++)
-            fds[i].events = POLLIN;
-        constexpr size_t stop_readfd_index = 0, ls4_index = 1, ls6_index = 2;
+    // Additional sockets share the bound addresses of the first ones
+    struct RxGroup
+    {
+        unsigned index;
+        int ls4;
+        int ls6;
+    };
+    std::vector<RxGroup> groups {{0, s4, s6}};
+    for (unsigned i = 1; i < count; i++) {
+        RxGroup g {i, -1, -1};
+        SockAddr bound;
         try {
-            while (running) {
-                // ls4 and ls6 can be negative, but this doesn't require any special handling
-                // because poll() will simply ignore them (and set revents to 0) in that case
-                fds[stop_readfd_index].fd = stop_readfd;
-                fds[ls4_index].fd = ls4;
-                fds[ls6_index].fd = ls6;
-
-                int rc = _poll(fds, NUM_FDS, -1);
-                if (rc < 0) {
-                    if (errno != EINTR) {
+            if (s4 != -1)
+                g.ls4 = bindSocket(bound4, bound, true);
+            if (s6 != -1)
+                g.ls6 = bindSocket(bound6, bound, true);
+        } catch (const DhtException& e) {
+            if (logger)
+                logger->e("Can't bind reuseport socket %u: %s", i, e.what());
+        }
+        if (g.ls4 != -1 or g.ls6 != -1)
+            groups.emplace_back(g);
+    }
+
+    running = true;
+    auto threads = std::make_shared<std::atomic_uint>(groups.size());
+    for (const auto& g : groups)
+        rcv_threads.emplace_back(&UdpSocket::receiveLoop, this, g.index, stop_readfd, g.ls4, g.ls6, threads);
+}
+
+void
+UdpSocket::receiveLoop(unsigned index, int stop_readfd, int ls4, int ls6, std::shared_ptr<std::atomic_uint> threads)
+{
+    if (config_.pin_rx_threads and not pinCurrentThread(index)) {
+        if (logger)
+            logger->w("Can't pin rx thread %u", index);
+    }
+
+    struct pollfd fds[NUM_FDS];
+    for (int i = 0; i < NUM_FDS; i++)
+        fds[i].events = POLLIN;
+    constexpr size_t stop_readfd_index = 0, ls4_index = 1, ls6_index = 2;
+
+    const bool reuse = rx_sockets.size() > 2;
+    auto& counters4 = rx_sockets[2 * index];
+    auto& counters6 = rx_sockets[2 * index + 1];
+    // last kernel drop count seen on each socket
+    uint32_t drops4 = 0, drops6 = 0;
+
+    RxBatch rx(std::max<size_t>(1, config_.rx_batch_size));
+    // Packets with a buffer, ready to receive datagrams
+    PacketList ready;
+    // Read a batch of datagrams from s and hand them over at once.
+    // Returns 0 or the error code.
+    auto receive = [&](int s, RxSocketCounters& counters, uint32_t& drops) -> int {
+        if (ready.size() < rx.size())
+            ready.splice(ready.end(), getNewPackets(rx.size() - ready.size()));
+        size_t available = 0;
+        for (auto& pkt : ready) {
+            if (not pkt.data and not(pkt.data = packetPool_->acquire()))
+                break;
+            available++;
+        }
+        int n;
+        if (available) {
+            n = rx.receive(s, ready, available);
+        } else {
+            // No buffer available: drop the datagram
+            char c;
+            n = recv(s, &c, sizeof(c), 0);
+            if (n >= 0) {
+                rx_dropped++;
+                return 0;
+            }
+        }
+        if (n < 0) {
+            int err = errno;
+            return (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) ? 0 : err;
+        }
+        if (auto d = rx.dropCount()) {
+            counters.drops += (uint32_t) (d - drops);
+            drops = d;
+        }
+        PacketList pkts;
+        auto now = clock::now();
+        auto pkt = ready.begin();
+        for (int i = 0; i < n; i++) {
+            auto cur = pkt++;
+            if (rx.truncated(i)) {
+                rx_dropped++;
+                continue;
+            }
+            if (not rx.length(i))
+                continue;
+            rx.read(i, cur->data);
+            cur->from = rx.from(i);
+            cur->received = now;
+            pkts.splice(pkts.end(), ready, cur);
+        }
+        auto count = pkts.size();
+        if (count == 0)
+            return 0;
+        counters.packets += count;
+        countBatch(rx_packets, rx_batches, rx_batch_max, count);
+        onReceived(std::move(pkts));
+        return 0;
+    };
+
+    try {
+        while (running) {
+            // ls4 and ls6 can be negative, but this doesn't require any special handling
+            // because poll() will simply ignore them (and set revents to 0) in that case
+            fds[stop_readfd_index].fd = stop_readfd;
+            fds[ls4_index].fd = ls4;
+            fds[ls6_index].fd = ls6;
+
+            int rc = _poll(fds, NUM_FDS, -1);
+            if (rc < 0) {
+                if (errno != EINTR) {
+                    if (logger)
+                        logger->e("Poll error: %s", strerror(errno));
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                }
+            }
+
+            // The stop byte is left in the pipe so that every rx thread wakes up
+            if (not running)
+                break;
+
+            if (rc > 0) {
+                if (fds[stop_readfd_index].revents & POLLIN) {
+                    char buf[16];
+                    if (recv(stop_readfd, buf, sizeof(buf), 0) < 0) {
                         if (logger)
-                            logger->e("Poll error: %s", strerror(errno));
-                        std::this_thread::sleep_for(std::chrono::seconds(1));
+                            logger->e("Got stop packet error: %s", strerror(errno));
+                        break;
                     }
+                    continue;
                 }
 
-                if (not running)
-                    break;
-
-                if (rc > 0) {
-                    std::array<uint8_t, 1024 * 64> buf;
-                    sockaddr_storage from;
-                    socklen_t from_len = sizeof(from);
+                int err = 0;
+                if (fds[ls4_index].revents & POLLIN)
+                    err = receive(ls4, counters4, drops4);
+                if (not err and (fds[ls6_index].revents & POLLIN))
+                    err = receive(ls6, counters6, drops6);
 
-                    if (fds[stop_readfd_index].revents & POLLIN) {
-                        if (recv(stop_readfd, (char*) buf.data(), buf.size(), 0) < 0) {
-                            if (logger)
-                                logger->e("Got stop packet error: %s", strerror(errno));
+                if (err) {
+                    if (logger)
+                        logger->e("Error receiving packet: %s", strerror(err));
+                    if (err == EPIPE || err == ENOTCONN || err == ECONNRESET) {
+                        if (not running)
                             break;
-                        }
-                    } else if (fds[ls4_index].revents & POLLIN)
-                        rc = recvfrom(ls4, (char*) buf.data(), buf.size(), 0, (sockaddr*) &from, &from_len);
-                    else if (fds[ls6_index].revents & POLLIN)
-                        rc = recvfrom(ls6, (char*) buf.data(), buf.size(), 0, (sockaddr*) &from, &from_len);
-                    else
-                        continue;
-
-                    if (rc > 0) {
-                        auto pkts = getNewPacket();
-                        auto& pkt = pkts.front();
-                        pkt.data.insert(pkt.data.end(), buf.begin(), buf.begin() + rc);
-                        pkt.from = {from, from_len};
-                        pkt.received = clock::now();
-                        onReceived(std::move(pkts));
-                    } else if (rc == -1) {
-                        int err = errno;
-                        if (logger)
-                            logger->e("Error receiving packet: %s", strerror(err));
-                        if (err == EPIPE || err == ENOTCONN || err == ECONNRESET) {
+                        std::unique_lock lk(lock, std::try_to_lock);
+                        if (lk.owns_lock()) {
                             if (not running)
                                 break;
-                            std::unique_lock lk(lock, std::try_to_lock);
-                            if (lk.owns_lock()) {
-                                if (not running)
-                                    break;
-                                if (ls4 >= 0) {
-                                    close(ls4);
-                                    try {
-                                        ls4 = bindSocket(bound4, bound4);
-                                    } catch (const DhtException& e) {
-                                        if (logger)
-                                            logger->e("Can't bind inet socket: %s", e.what());
-                                    }
+                            if (ls4 >= 0) {
+                                close(ls4);
+                                ls4 = -1;
+                                drops4 = 0;
+                                SockAddr bound;
+                                try {
+                                    ls4 = bindSocket(bound4, bound, reuse);
+                                    if (index == 0)
+                                        bound4 = bound;
+                                } catch (const DhtException& e) {
+                                    if (logger)
+                                        logger->e("Can't bind inet socket: %s", e.what());
                                 }
-                                if (ls6 >= 0) {
-                                    close(ls6);
-                                    try {
-                                        ls6 = bindSocket(bound6, bound6);
-                                    } catch (const DhtException& e) {
-                                        if (logger)
-                                            logger->e("Can't bind inet6 socket: %s", e.what());
-                                    }
+                            }
+                            if (ls6 >= 0) {
+                                close(ls6);
+                                ls6 = -1;
+                                drops6 = 0;
+                                SockAddr bound;
+                                try {
+                                    ls6 = bindSocket(bound6, bound, reuse);
+                                    if (index == 0)
+                                        bound6 = bound;
+                                } catch (const DhtException& e) {
+                                    if (logger)
+                                        logger->e("Can't bind inet6 socket: %s", e.what());
                                 }
-                                if (ls4 < 0 && ls6 < 0)
-                                    break;
+                            }
+                            if (ls4 < 0 && ls6 < 0)
+                                break;
+                            if (index == 0) {
                                 s4 = ls4;
                                 s6 = ls6;
-                            } else {
-                                break;
                             }
+                        } else {
+                            break;
                         }
                     }
                 }
             }
-        } catch (const std::exception& e) {
-            if (logger)
-                logger->e("Error in UdpSocket rx thread: %s", e.what());
         }
-        if (ls4 >= 0)
-            close(ls4);
-        if (ls6 >= 0)
-            close(ls6);
+    } catch (const std::exception& e) {
+        if (logger)
+            logger->e("Error in UdpSocket rx thread: %s", e.what());
+    }
+    if (ls4 >= 0)
+        close(ls4);
+    if (ls6 >= 0)
+        close(ls6);
+    // the last thread to exit closes the stop pipe
+    bool last = --(*threads) == 0;
+    if (last) {
         if (stop_readfd != -1)
             close(stop_readfd);
         if (stopfd != -1)
             close(stopfd);
-        std::unique_lock lk(lock, std::try_to_lock);
-        if (lk.owns_lock()) {
+    }
+    std::unique_lock lk(lock, std::try_to_lock);
+    if (lk.owns_lock()) {
+        if (index == 0) {
             s4 = -1;
             s6 = -1;
             bound4 = {};
             bound6 = {};
-            stopfd = -1;
         }
-    });
+        if (last)
+            stopfd = -1;
+    }
 }
 
 void
@@ -5,6 +5,7 @@
 #include "request.h"
 #include "rng.h"
 
+#include <algorithm>
 #include <sstream>
 
 namespace dht {
@@ -12,20 +13,25 @@ namespace dht {
 constexpr std::chrono::minutes Node::NODE_EXPIRE_TIME;
 constexpr std::chrono::minutes Node::NODE_GOOD_TIME;
 constexpr std::chrono::seconds Node::MAX_RESPONSE_TIME;
+constexpr std::chrono::milliseconds Node::MIN_RTO;
+constexpr std::chrono::seconds Node::MAX_RTO;
+constexpr unsigned Node::MAX_SHARDS;
 
-Node::Node(const InfoHash& id, const SockAddr& addr, std::mt19937_64& rd, bool client)
+Node::Node(const InfoHash& id, const SockAddr& addr, std::mt19937_64& rd, bool client, unsigned shard)
     : id(id)
     , addr(addr)
     , is_client(client)
+    , tid_shard_(Tid(std::min(shard, MAX_SHARDS)) << TID_SHARD_SHIFT)
     , sockets_()
 {
     transaction_id = std::uniform_int_distribution<Tid> {1}(rd);
 }
 
-Node::Node(const InfoHash& id, SockAddr&& addr, std::mt19937_64& rd, bool client)
+Node::Node(const InfoHash& id, SockAddr&& addr, std::mt19937_64& rd, bool client, unsigned shard)
     : id(id)
     , addr(std::move(addr))
     , is_client(client)
+    , tid_shard_(Tid(std::min(shard, MAX_SHARDS)) << TID_SHARD_SHIFT)
     , sockets_()
 {
     transaction_id = std::uniform_int_distribution<Tid> {1}(rd);
@@ -73,8 +79,9 @@ Node::requested(const Sp<net::Request>& req)
     if (not e.second and req != e.first->second) {
         // Should not happen !
         // Try to handle this scenario as well as we can
-        e.first->second->setExpired();
+        auto old = std::move(e.first->second);
         e.first->second = req;
+        old->setExpired();
     }
 }
 
@@ -111,21 +118,44 @@ void
 Node::setExpired()
 {
     expired_ = true;
-    for (auto r : requests_) {
+    // callbacks may add requests to the table
+    auto requests = std::move(requests_);
+    for (const auto& r : requests) {
         r.second->setExpired();
     }
     requests_.clear();
     sockets_.clear();
 }
 
+void
+Node::rttSample(duration rtt)
+{
+    rtt = std::max(rtt, duration::zero());
+    if (srtt_ == duration::zero()) {
+        srtt_ = std::max(rtt, duration(1));
+        rttvar_ = rtt / 2;
+    } else {
+        // alpha = 1/8, beta = 1/4
+        auto delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+        rttvar_ = (3 * rttvar_ + delta) / 4;
+        srtt_ = std::max((7 * srtt_ + rtt) / 8, duration(1));
+    }
+}
+
+duration
+Node::getRto() const
+{
+    if (srtt_ == duration::zero())
+        return MAX_RESPONSE_TIME;
+    return std::clamp(srtt_ + 4 * rttvar_, (duration) MIN_RTO, (duration) MAX_RTO);
+}
+
 Tid
 Node::openSocket(SocketCb&& cb)
 {
-    if (++transaction_id == 0)
-        transaction_id = 1;
-
-    sockets_[transaction_id] = std::make_shared<Socket>(std::move(cb));
-    return transaction_id;
+    auto tid = getNewTid();
+    sockets_[tid] = std::make_shared<Socket>(std::move(cb));
+    return tid;
 }
 
 Sp<Socket>
@@ -24,8 +24,8 @@ Sp<Node>
 NodeCache::getNode(const InfoHash& id, const SockAddr& addr, time_point now, bool confirm, bool client)
 {
     if (not id)
-        return std::make_shared<Node>(id, addr, rd, client);
-    return cache(addr.getFamily()).getNode(id, addr, now, confirm, client, rd);
+        return std::make_shared<Node>(id, addr, rd, client, shard);
+    return cache(addr.getFamily()).getNode(id, addr, now, confirm, client, rd, shard);
 }
 
 std::vector<Sp<Node>>
@@ -93,13 +93,18 @@ NodeCache::NodeMap::getNode(const InfoHash& id)
 }
 
 Sp<Node>
-NodeCache::NodeMap::getNode(
-    const InfoHash& id, const SockAddr& addr, time_point now, bool confirm, bool client, std::mt19937_64& rd)
+NodeCache::NodeMap::getNode(const InfoHash& id,
+                            const SockAddr& addr,
+                            time_point now,
+                            bool confirm,
+                            bool client,
+                            std::mt19937_64& rd,
+                            unsigned shard)
 {
     auto& nref = (*this)[id];
     auto node = nref.lock();
     if (not node) {
-        node = std::make_shared<Node>(id, addr, rd, client);
+        node = std::make_shared<Node>(id, addr, rd, client, shard);
         nref = node;
         if (cleanup_counter++ == CLEANUP_FREQ) {
             cleanup();
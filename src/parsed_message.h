@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <string_view>
 
 using namespace std::literals;
@@ -68,6 +69,66 @@ unpackTid(const msgpack::object& o)
     }
 }
 
+/**
+ * Bytes of a received message, referenced in place in the packet buffer.
+ * Bytes that can't be referenced (array-encoded blobs) or that must outlive
+ * the packet (see ParsedMessage::own()) are held in a shared immutable copy.
+ */
+class BlobRef
+{
+public:
+    BlobRef() = default;
+    /** Reference data, that must outlive this object or be owned with own() */
+    BlobRef(const uint8_t* data, size_t size)
+        : data_(data)
+        , size_(size)
+    {}
+    BlobRef(const Blob& b)
+        : BlobRef(b.data(), b.size())
+    {}
+    BlobRef(Blob&& b)
+        : owned_(std::make_shared<const Blob>(std::move(b)))
+        , data_(owned_->data())
+        , size_(owned_->size())
+    {}
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const uint8_t* begin() const { return data_; }
+    const uint8_t* end() const { return data_ + size_; }
+
+    bool owned() const { return (bool) owned_; }
+    /** Copy referenced data so that it doesn't depend on the packet buffer anymore */
+    void own()
+    {
+        if (not owned_ and size_)
+            *this = BlobRef(Blob(begin(), end()));
+    }
+    Blob blob() const { return {begin(), end()}; }
+
+private:
+    std::shared_ptr<const Blob> owned_ {};
+    const uint8_t* data_ {nullptr};
+    size_t size_ {0};
+};
+
+/**
+ * Reference a binary or string msgpack object in place, or copy other encodings.
+ */
+BlobRef
+refBlob(const msgpack::object& o)
+{
+    switch (o.type) {
+    case msgpack::type::BIN:
+        return {(const uint8_t*) o.via.bin.ptr, o.via.bin.size};
+    case msgpack::type::STR:
+        return {(const uint8_t*) o.via.str.ptr, o.via.str.size};
+    default:
+        return unpackBlob(o);
+    }
+}
+
 struct ParsedMessage
 {
     MessageType type;
@@ -92,7 +153,7 @@ struct ParsedMessage
     /* time when value was first created */
     time_point created {time_point::max()};
     /* IPv4 nodes in response to a 'find' request */
-    Blob nodes4_raw, nodes6_raw;
+    BlobRef nodes4_raw, nodes6_raw;
     std::vector<Sp<Node>> nodes4, nodes6;
     /* values to store or retreive request */
     std::vector<Sp<Value>> values;
@@ -118,7 +179,7 @@ struct ParsedMessage
     };
     std::map<unsigned, PartialValue> value_parts;
     /** When part of partial value data: {index -> (offset, part_data)} */
-    std::map<unsigned, std::pair<size_t, Blob>> fragment_parts;
+    std::map<unsigned, std::pair<size_t, BlobRef>> fragment_parts;
     /* query describing a filter to apply on values. */
     Query query;
     /* states if ipv4 or ipv6 request */
@@ -129,10 +190,25 @@ struct ParsedMessage
     std::string ua;
     int version {0};
     SockAddr addr;
+
+    /** Parse a message; all data is copied from o */
     void msgpack_unpack(const msgpack::object& o);
 
+    /**
+     * Parse a message in place: node lists and value fragments reference buf,
+     * that must outlive the message, unless own() is called.
+     * Uses a msgpack zone reused by every call on the same thread.
+     */
+    void unpack(const uint8_t* buf, size_t buflen);
+
+    /** Copy data still referencing the packet buffer */
+    void own();
+
     bool append(const ParsedMessage& block);
     bool complete();
+
+private:
+    void parse(const msgpack::object& o);
 };
 
 bool
@@ -162,7 +238,7 @@ ParsedMessage::append(const ParsedMessage& block)
             if (prev->second.size() > offset - prev->first)
                 continue;
         }
-        pv.fragments.emplace(offset, data);
+        pv.fragments.emplace(offset, data.blob());
         pv.received_bytes += data.size();
         ret = true;
     }
@@ -187,6 +263,34 @@ ParsedMessage::complete()
 
 void
 ParsedMessage::msgpack_unpack(const msgpack::object& msg)
+{
+    parse(msg);
+    own();
+}
+
+void
+ParsedMessage::unpack(const uint8_t* buf, size_t buflen)
+{
+    // Keeps its first chunk between packets, so that parsing usually doesn't allocate
+    thread_local msgpack::zone zone;
+    zone.clear();
+    size_t offset = 0;
+    parse(msgpack::unpack(zone, (const char*) buf, buflen, offset, [](msgpack::type::object_type, size_t, void*) {
+        return true;
+    }));
+}
+
+void
+ParsedMessage::own()
+{
+    nodes4_raw.own();
+    nodes6_raw.own();
+    for (auto& part : fragment_parts)
+        part.second.second.own();
+}
+
+void
+ParsedMessage::parse(const msgpack::object& msg)
 {
     if (msg.type != msgpack::type::MAP)
         throw msgpack::type_error();
@@ -267,7 +371,7 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
             auto d = findMapValue(vdat.val, "d"sv);
             if (not o or not d)
                 continue;
-            fragment_parts.emplace(vdat.key.as<unsigned>(), std::pair<size_t, Blob>(o->as<size_t>(), unpackBlob(*d)));
+            fragment_parts.emplace(vdat.key.as<unsigned>(), std::pair<size_t, BlobRef>(o->as<size_t>(), refBlob(*d)));
         }
         return;
     }
@@ -310,9 +414,9 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         else if (key == KEY_REQ_VALUE_ID)
             value_id = o.val.as<Value::Id>();
         else if (key == KEY_REQ_NODES4)
-            nodes4_raw = unpackBlob(o.val);
+            nodes4_raw = refBlob(o.val);
         else if (key == KEY_REQ_NODES6)
-            nodes6_raw = unpackBlob(o.val);
+            nodes6_raw = refBlob(o.val);
         else if (key == KEY_REQ_ADDRESS)
             parsedReq.sa = &o.val;
         else if (key == KEY_REQ_CREATION)
@@ -125,10 +125,15 @@ struct Request
 
 private:
     static const constexpr size_t MAX_ATTEMPT_COUNT {3};
+    /* Min. time before a request, and its node, expire, whatever the retransmission timeout */
+    static const constexpr std::chrono::seconds MIN_EXPIRATION_TIME {5};
+
+    /* Time when the request expires once its attempts are over */
+    time_point expiration() const { return std::max(last_try + attempt_duration, start + MIN_EXPIRATION_TIME); }
 
     bool isExpired(time_point now) const
     {
-        return pending() and now > last_try + attempt_duration and attempt_count >= Request::MAX_ATTEMPT_COUNT;
+        return pending() and attempt_count >= Request::MAX_ATTEMPT_COUNT and now >= expiration();
     }
 
     void clear()
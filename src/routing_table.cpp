@@ -6,6 +6,7 @@
 #include "network_engine.h"
 #include "rng.h"
 
+#include <algorithm>
 #include <memory>
 
 namespace dht {
@@ -101,37 +102,36 @@ RoutingTable::findClosestNodes(const InfoHash id, time_point now, size_t count)
     if (bucket == end()) {
         return nodes;
     }
-    nodes.reserve(count);
+    nodes.reserve(count + TARGET_NODES);
 
-    auto sortedBucketInsert = [&](const Bucket& b) {
-        for (const auto& n : b.nodes) {
-            if (not n->isGood(now))
-                continue;
-
-            auto here = std::find_if(nodes.begin(), nodes.end(), [&id, &n](const Sp<Node>& node) {
-                return id.xorCmp(n->id, node->id) < 0;
-            });
-            nodes.insert(here, n);
-        }
+    auto addGoodNodes = [&](const Bucket& b) {
+        for (const auto& n : b.nodes)
+            if (n->isGood(now))
+                nodes.emplace_back(n);
     };
 
     auto itn = bucket;
     auto itp = (bucket == begin()) ? end() : std::prev(bucket);
     while (nodes.size() < count && (itn != end() || itp != end())) {
         if (itn != end()) {
-            sortedBucketInsert(*itn);
+            addGoodNodes(*itn);
             itn = std::next(itn);
         }
         if (itp != end()) {
-            sortedBucketInsert(*itp);
+            addGoodNodes(*itp);
             itp = (itp == begin()) ? end() : std::prev(itp);
         }
     }
 
-    // shrink to the count closest nodes.
+    // keep the count closest nodes, sorted by distance
+    auto closer = [&id](const Sp<Node>& a, const Sp<Node>& b) {
+        return id.xorCmp(a->id, b->id) < 0;
+    };
     if (nodes.size() > count) {
+        std::nth_element(nodes.begin(), nodes.begin() + count, nodes.end(), closer);
         nodes.resize(count);
     }
+    std::sort(nodes.begin(), nodes.end(), closer);
     return nodes;
 }
 
@@ -140,15 +140,11 @@ RoutingTable::findBucket(const InfoHash& id)
 {
     if (empty())
         return end();
-    auto b = begin();
-    while (true) {
-        auto next = std::next(b);
-        if (next == end())
-            return b;
-        if (InfoHash::cmp(id, next->first) < 0)
-            return b;
-        b = next;
-    }
+    // last bucket starting at or before id
+    auto b = std::upper_bound(begin(), end(), id, [](const InfoHash& id, const Bucket& b) {
+        return InfoHash::cmp(id, b.first) < 0;
+    });
+    return b == begin() ? b : std::prev(b);
 }
 
 RoutingTable::const_iterator
@@ -170,20 +166,15 @@ RoutingTable::split(const RoutingTable::iterator& b)
         return false;
     }
 
-    // Insert new bucket
-    insert(std::next(b), Bucket {b->af, new_id, b->time});
+    // Insert new bucket, invalidating b
+    auto nodes = std::move(b->nodes);
+    b->nodes.clear();
+    auto upper = insert(std::next(b), Bucket {b->af, new_id, b->time});
+    auto lower = std::prev(upper);
 
     // Re-assign nodes
-    std::list<Sp<Node>> nodes {};
-    nodes.splice(nodes.begin(), b->nodes);
-    while (!nodes.empty()) {
-        auto n = nodes.begin();
-        auto b = findBucket((*n)->id);
-        if (b == end())
-            nodes.erase(n);
-        else
-            b->nodes.splice(b->nodes.begin(), nodes, n);
-    }
+    for (auto& n : nodes)
+        (InfoHash::cmp(n->id, new_id) < 0 ? lower : upper)->nodes.emplace_back(std::move(n));
     return true;
 }
 
@@ -245,7 +236,7 @@ RoutingTable::onNewNode(
             b->cached = node;
     } else {
         /* Create a new node. */
-        b->nodes.emplace_front(node);
+        b->nodes.emplace(b->nodes.begin(), node);
     }
     return true;
 }
@@ -6,6 +6,7 @@
 
 #include "securedht.h"
 #include "rng.h"
+#include "thread_pool.h"
 
 #include "default_types.h"
 
@@ -19,6 +20,33 @@ extern "C" {
 
 namespace dht {
 
+constexpr size_t SecureDht::CHECK_BATCH;
+constexpr duration SecureDht::CHECK_POLL_PERIOD;
+
+struct SecureDht::PendingCheck
+{
+    std::vector<Sp<Value>> values;
+    /* values not checked before */
+    std::vector<bool> fresh;
+    /* values checked for this callback */
+    std::vector<Sp<Value>> claimed;
+    std::function<void(std::vector<Sp<Value>>&&)> deliver;
+    /* called instead of deliver if the check is dropped */
+    std::function<void()> abort;
+    time_point received;
+    bool submitted {false};
+    /* claimed values are checked on the thread pool */
+    bool background {false};
+    /* values of claimed still being checked on the thread pool */
+    std::atomic_size_t remaining {0};
+};
+
+struct SecureDht::CheckState
+{
+    std::mutex lock;
+    std::function<void()> onDone;
+};
+
 SecureDht::SecureDht(std::unique_ptr<DhtInterface> dht,
                      SecureDht::Config conf,
                      IdentityAnnouncedCb iacb,
@@ -27,7 +55,11 @@ SecureDht::SecureDht(std::unique_ptr<DhtInterface> dht,
     , dht_(std::move(dht))
     , key_(conf.id.first)
     , certificate_(conf.id.second)
+    , knownKeys_(conf.key_cache_size)
     , enableCache_(conf.cert_cache_all)
+    , asyncChecks_(conf.async_checks)
+    , maxPendingChecks_(std::max<size_t>(conf.max_pending_checks, 1))
+    , checkState_(std::make_shared<CheckState>())
 {
     if (!dht_)
         return;
@@ -52,9 +84,28 @@ SecureDht::SecureDht(std::unique_ptr<DhtInterface> dht,
 
 SecureDht::~SecureDht()
 {
+    {
+        std::lock_guard lk(checkState_->lock);
+        checkState_->onDone = {};
+    }
+    abortChecks();
     dht_.reset();
 }
 
+void
+SecureDht::shutdown(ShutdownCallback cb, bool stop)
+{
+    dht_->shutdown(cb, stop);
+    abortChecks();
+}
+
+void
+SecureDht::setOnChecksDone(std::function<void()> cb)
+{
+    std::lock_guard lk(checkState_->lock);
+    checkState_->onDone = std::move(cb);
+}
+
 ValueType
 SecureDht::secureType(ValueType&& type)
 {
@@ -84,7 +135,7 @@ SecureDht::secureType(ValueType&& type)
         if (o->seq == n->seq) {
             // If the data is exactly the same,
             // it can be reannounced, possibly by someone else.
-            if (o->getToSign() != n->getToSign()) {
+            if (*o->getToSignRef() != *n->getToSignRef()) {
                 if (l)
                     l->w("Edition forbidden: sequence number must be increasing.");
                 return false;
@@ -96,16 +147,52 @@ SecureDht::secureType(ValueType&& type)
     return type;
 }
 
+SecureDht::KnownKey*
+SecureDht::cacheKey(const PkId& id, const InfoHash& shortId)
+{
+    auto key = knownKeys_.get(id);
+    if (not key and not(key = knownKeys_.put(id, {})))
+        return nullptr;
+    // drop ids of evicted keys
+    if (knownKeyIds_.size() > 2 * knownKeys_.capacity() + 16) {
+        knownKeyIds_.clear();
+        knownKeys_.forEach([this](const PkId& longId, const KnownKey& k) {
+            if (k.publicKey)
+                knownKeyIds_.emplace(k.publicKey->getId(), longId);
+            else if (k.certificate)
+                knownKeyIds_.emplace(k.certificate->getId(), longId);
+        });
+    }
+    knownKeyIds_[shortId] = id;
+    return key;
+}
+
+void
+SecureDht::cachePublicKey(const Sp<crypto::PublicKey>& pk)
+{
+    if (auto key = cacheKey(pk->getLongId(), pk->getId()))
+        key->publicKey = pk;
+}
+
+const SecureDht::KnownKey*
+SecureDht::findKey(const InfoHash& node) const
+{
+    auto it = knownKeyIds_.find(node);
+    if (it == knownKeyIds_.end())
+        return nullptr;
+    auto key = knownKeys_.get(it->second);
+    if (not key)
+        knownKeyIds_.erase(it);
+    return key;
+}
+
 Sp<crypto::Certificate>
 SecureDht::getCertificate(const InfoHash& node) const
 {
     if (node == getId())
         return certificate_;
-    auto it = nodesCertificates_.find(node);
-    if (it == nodesCertificates_.end())
-        return nullptr;
-    else
-        return it->second;
+    auto key = findKey(node);
+    return key ? key->certificate : nullptr;
 }
 
 Sp<crypto::PublicKey>
@@ -113,11 +200,8 @@ SecureDht::getPublicKey(const InfoHash& node) const
 {
     if (node == getId())
         return certificate_->getSharedPublicKey();
-    auto it = nodesPubKeys_.find(node);
-    if (it == nodesPubKeys_.end())
-        return nullptr;
-    else
-        return it->second;
+    auto key = findKey(node);
+    return key ? key->publicKey : nullptr;
 }
 
 Sp<crypto::Certificate>
@@ -125,11 +209,8 @@ SecureDht::getCertificate(const PkId& node) const
 {
     if (node == getLongId())
         return certificate_;
-    auto it = nodesCertificatesLong_.find(node);
-    if (it == nodesCertificatesLong_.end())
-        return nullptr;
-    else
-        return it->second;
+    auto key = knownKeys_.get(node);
+    return key ? key->certificate : nullptr;
 }
 
 Sp<crypto::PublicKey>
@@ -137,11 +218,8 @@ SecureDht::getPublicKey(const PkId& node) const
 {
     if (node == getLongId())
         return certificate_->getSharedPublicKey();
-    auto it = nodesPubKeysLong_.find(node);
-    if (it == nodesPubKeysLong_.end())
-        return nullptr;
-    else
-        return it->second;
+    auto key = knownKeys_.get(node);
+    return key ? key->publicKey : nullptr;
 }
 
 Sp<crypto::Certificate>
@@ -190,10 +268,10 @@ SecureDht::registerCertificate(const PkId& node, const Blob& data)
 void
 SecureDht::registerCertificate(const Sp<crypto::Certificate>& cert)
 {
-    if (cert) {
-        nodesCertificates_[cert->getId()] = cert;
-        nodesCertificatesLong_[cert->getLongId()] = cert;
-    }
+    if (not cert)
+        return;
+    if (auto key = cacheKey(cert->getLongId(), cert->getId()))
+        key->certificate = cert;
 }
 
 void
@@ -212,8 +290,7 @@ SecureDht::findCertificate(const InfoHash& node, const std::function<void(const
         if (not res.empty()) {
             if (logger_)
                 logger_->debug("Registering certificate from local store for {}", node.toString());
-            nodesCertificates_.emplace(node, res.front());
-            nodesCertificatesLong_.emplace(res.front()->getLongId(), res.front());
+            registerCertificate(res.front());
             if (cb)
                 cb(res.front());
             return;
@@ -258,8 +335,7 @@ SecureDht::findPublicKey(const InfoHash& node, const std::function<void(const Sp
         if (crt && *crt) {
             auto pk = crt->getSharedPublicKey();
             if (*pk) {
-                nodesPubKeys_[pk->getId()] = pk;
-                nodesPubKeysLong_[pk->getLongId()] = pk;
+                cachePublicKey(pk);
                 if (cb)
                     cb(pk);
                 return;
@@ -287,8 +363,7 @@ SecureDht::findCertificate(const PkId& node, const std::function<void(const Sp<c
         if (not res.empty()) {
             if (logger_)
                 logger_->debug("Registering certificate from local store for {}", node.to_c_str());
-            nodesCertificates_.emplace(res.front()->getId(), res.front());
-            nodesCertificatesLong_.emplace(node, res.front());
+            registerCertificate(res.front());
             if (cb)
                 cb(res.front());
             return;
@@ -333,8 +408,7 @@ SecureDht::findPublicKey(const PkId& node, const std::function<void(const Sp<cry
         if (crt && *crt) {
             auto pk = crt->getSharedPublicKey();
             if (*pk) {
-                nodesPubKeys_[pk->getId()] = pk;
-                nodesPubKeysLong_[pk->getLongId()] = pk;
+                cachePublicKey(pk);
                 if (cb)
                     cb(pk);
                 return;
@@ -345,8 +419,36 @@ SecureDht::findPublicKey(const PkId& node, const std::function<void(const Sp<cry
     });
 }
 
+/* Check the signature of v or decrypt it, caching the result in the value. Safe for distinct values in parallel. */
+static void
+checkCrypto(Value& v, const crypto::PrivateKey* key, const Sp<Logger>& logger)
+{
+    try {
+        if (v.isEncrypted())
+            v.decrypt(*key);
+        else
+            v.checkSignature();
+    } catch (const std::exception& e) {
+        if (logger)
+            logger->warn("Could not decrypt value {} : {}", v.toString(), e.what());
+    }
+}
+
+/* Whether the result of checking v is cached in the value */
+static bool
+isChecked(const Value& v)
+{
+    return v.isEncrypted() ? v.isDecrypted() : (not v.isSigned() or v.isSignatureChecked());
+}
+
 Sp<Value>
 SecureDht::checkValue(const Sp<Value>& v)
+{
+    return checkValue(v, not isChecked(*v));
+}
+
+Sp<Value>
+SecureDht::checkValue(const Sp<Value>& v, bool fresh)
 {
     // Decrypt encrypted values
     if (v->isEncrypted()) {
@@ -358,13 +460,10 @@ SecureDht::checkValue(const Sp<Value>& v)
             return {};
         }
         try {
-            auto isDecrypted = v->isDecrypted();
             if (auto decrypted_val = v->decrypt(*key_)) {
-                auto cacheValue = not isDecrypted and decrypted_val->owner;
-                if (cacheValue) {
-                    nodesPubKeys_[decrypted_val->owner->getId()] = decrypted_val->owner;
-                    nodesPubKeysLong_[decrypted_val->owner->getLongId()] = decrypted_val->owner;
-                }
+                auto cacheValue = fresh and decrypted_val->owner;
+                if (cacheValue)
+                    cachePublicKey(decrypted_val->owner);
                 return decrypted_val;
             }
         } catch (const std::exception& e) {
@@ -374,12 +473,10 @@ SecureDht::checkValue(const Sp<Value>& v)
     }
     // Check signed values
     else if (v->isSigned()) {
-        auto cacheValue = not v->isSignatureChecked() and enableCache_ and v->owner;
+        auto cacheValue = fresh and enableCache_ and v->owner;
         if (v->checkSignature()) {
-            if (cacheValue) {
-                nodesPubKeys_[v->owner->getId()] = v->owner;
-                nodesPubKeysLong_[v->owner->getLongId()] = v->owner;
-            }
+            if (cacheValue)
+                cachePublicKey(v->owner);
             return v;
         } else if (logger_)
             logger_->warn("Signature verification failed for {}", v->toString());
@@ -391,9 +488,165 @@ SecureDht::checkValue(const Sp<Value>& v)
     return {};
 }
 
+void
+SecureDht::enqueueCheck(const std::vector<Sp<Value>>& values,
+                        std::function<void(std::vector<Sp<Value>>&&)>&& deliver,
+                        std::function<void()>&& abort)
+{
+    auto check = std::make_shared<PendingCheck>();
+    check->values = values;
+    check->fresh.reserve(values.size());
+    for (const auto& v : values) {
+        // Values already claimed by a previous callback are checked by then,
+        // they are read from the cache of the value when delivered.
+        auto fresh = not checking_.count(v.get()) and not isChecked(*v);
+        check->fresh.emplace_back(fresh);
+        if (fresh and (key_ or not v->isEncrypted())) {
+            checking_.emplace(v.get());
+            check->claimed.emplace_back(v);
+        }
+    }
+    check->deliver = std::move(deliver);
+    check->abort = std::move(abort);
+    check->received = clock::now();
+
+    // Backpressure: too many values are waiting, check them now
+    if (checksWaiting_ + check->claimed.size() > maxPendingChecks_) {
+        for (const auto& v : check->claimed)
+            checkCrypto(*v, key_.get(), logger_);
+        check->submitted = true;
+    } else
+        checksWaiting_ += check->claimed.size();
+
+    checkQueued_ += values.size();
+    checkQueueMax_ = std::max(checkQueueMax_, checkQueued_);
+    checks_.emplace_back(std::move(check));
+    submitChecks();
+    deliverChecked();
+}
+
+void
+SecureDht::submitChecks()
+{
+    for (; nextCheck_ < checks_.size(); nextCheck_++) {
+        const auto& check = checks_[nextCheck_];
+        if (check->submitted)
+            continue;
+        auto n = check->claimed.size();
+        if (checksRunning_ and checksRunning_ + n > maxPendingChecks_)
+            break;
+        check->submitted = true;
+        check->background = true;
+        check->remaining = n;
+        checksWaiting_ -= n;
+        checksRunning_ += n;
+        for (size_t b = 0; b < n; b += CHECK_BATCH) {
+            ThreadPool::computation().run(
+                [check, b, end = std::min(n, b + CHECK_BATCH), key = key_, state = checkState_, logger = logger_] {
+                    for (auto i = b; i < end; i++)
+                        checkCrypto(*check->claimed[i], key.get(), logger);
+                    if (check->remaining.fetch_sub(end - b, std::memory_order_acq_rel) == end - b) {
+                        std::lock_guard lk(state->lock);
+                        if (state->onDone)
+                            state->onDone();
+                    }
+                });
+        }
+    }
+}
+
+time_point
+SecureDht::deliverChecked()
+{
+    if (checks_.empty())
+        return time_point::max();
+    // Callbacks may receive values again, that are delivered by the outer call
+    if (delivering_)
+        return time_point::max();
+    delivering_ = true;
+    for (;;) {
+        submitChecks();
+        if (checks_.empty())
+            break;
+        auto check = checks_.front();
+        if (not check->submitted or check->remaining.load(std::memory_order_acquire))
+            break;
+        checks_.pop_front();
+        if (nextCheck_)
+            nextCheck_--;
+
+        auto now = clock::now();
+        if (check->background)
+            checksRunning_ -= check->claimed.size();
+        std::vector<Sp<Value>> checked;
+        checked.reserve(check->values.size());
+        for (size_t i = 0; i < check->values.size(); i++)
+            if (auto nv = checkValue(check->values[i], check->fresh[i]))
+                checked.emplace_back(std::move(nv));
+        for (const auto& v : check->claimed)
+            checking_.erase(v.get());
+        checkQueued_ -= check->values.size();
+        if (not check->claimed.empty()) {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - check->received).count();
+            checkedValues_ += check->claimed.size();
+            checkLatencyTotal_ += (uint64_t) latency * check->claimed.size();
+            checkLatencyMax_ = std::max(checkLatencyMax_, (uint64_t) latency);
+        }
+        check->deliver(std::move(checked));
+    }
+    delivering_ = false;
+    if (checks_.empty())
+        return time_point::max();
+    std::lock_guard lk(checkState_->lock);
+    return checkState_->onDone ? time_point::max() : clock::now() + CHECK_POLL_PERIOD;
+}
+
+void
+SecureDht::abortChecks()
+{
+    // values still checked on the thread pool only update their own cache
+    auto checks = std::move(checks_);
+    checks_.clear();
+    nextCheck_ = 0;
+    checksRunning_ = 0;
+    checksWaiting_ = 0;
+    checkQueued_ = 0;
+    checking_.clear();
+    for (const auto& check : checks)
+        if (check->abort)
+            check->abort();
+}
+
+/* Values passing filter */
+static std::vector<Sp<Value>>
+filterValues(std::vector<Sp<Value>>&& values, const Value::Filter& filter)
+{
+    if (filter)
+        values.erase(std::remove_if(values.begin(), values.end(), [&](const Sp<Value>& v) { return not filter(*v); }),
+                     values.end());
+    return std::move(values);
+}
+
 ValueCallback
-SecureDht::getCallbackFilter(const ValueCallback& cb, Value::Filter&& filter)
+SecureDht::getCallbackFilter(const ValueCallback& cb, Value::Filter&& filter, Sp<bool> stopped)
 {
+    if (asyncChecks_) {
+        // Callbacks can't stop the operation synchronously: it is stopped on the next values
+        if (not stopped)
+            stopped = std::make_shared<bool>(false);
+        return [this, cb, filter = std::move(filter), stopped](const std::vector<Sp<Value>>& values, bool expired) {
+            if (*stopped)
+                return false;
+            enqueueCheck(values, [cb, filter, stopped, expired](std::vector<Sp<Value>>&& checked) {
+                if (*stopped)
+                    return;
+                auto tmpvals = filterValues(std::move(checked), filter);
+                if (cb and not tmpvals.empty() and not cb(tmpvals, expired))
+                    *stopped = true;
+            });
+            return not *stopped;
+        };
+    }
     return [=](const std::vector<Sp<Value>>& values, bool expired) {
         std::vector<Sp<Value>> tmpvals {};
         if (not filter)
@@ -410,8 +663,24 @@ SecureDht::getCallbackFilter(const ValueCallback& cb, Value::Filter&& filter)
 }
 
 GetCallback
-SecureDht::getCallbackFilter(const GetCallback& cb, Value::Filter&& filter)
+SecureDht::getCallbackFilter(const GetCallback& cb, Value::Filter&& filter, Sp<bool> stopped)
 {
+    if (asyncChecks_) {
+        if (not stopped)
+            stopped = std::make_shared<bool>(false);
+        return [this, cb, filter = std::move(filter), stopped](const std::vector<Sp<Value>>& values) {
+            if (*stopped)
+                return false;
+            enqueueCheck(values, [cb, filter, stopped](std::vector<Sp<Value>>&& checked) {
+                if (*stopped)
+                    return;
+                auto tmpvals = filterValues(std::move(checked), filter);
+                if (cb and not tmpvals.empty() and not cb(tmpvals))
+                    *stopped = true;
+            });
+            return not *stopped;
+        };
+    }
     return [this, cb, filter = std::move(filter)](const std::vector<Sp<Value>>& values) {
         std::vector<Sp<Value>> tmpvals {};
         if (not filter)
@@ -430,19 +699,65 @@ SecureDht::getCallbackFilter(const GetCallback& cb, Value::Filter&& filter)
 void
 SecureDht::get(const InfoHash& id, GetCallback cb, DoneCallback donecb, Value::Filter&& f, Where&& w)
 {
+    if (asyncChecks_ and donecb) {
+        // Called once values received before are delivered
+        donecb = [this, donecb](bool ok, const std::vector<Sp<Node>>& nodes) {
+            enqueueCheck(
+                {},
+                [donecb, ok, nodes](std::vector<Sp<Value>>&&) { donecb(ok, nodes); },
+                [donecb] { donecb(false, {}); });
+        };
+    }
     dht_->get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), donecb, {}, std::forward<Where>(w));
 }
 
+Sp<bool>
+SecureDht::newListenStop()
+{
+    if (not asyncChecks_)
+        return {};
+    // listens stopped by their callback
+    for (auto it = listenStopped_.begin(); it != listenStopped_.end();)
+        it = *it->second ? listenStopped_.erase(it) : std::next(it);
+    return std::make_shared<bool>(false);
+}
+
 size_t
 SecureDht::listen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where w)
 {
-    return dht_->listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), {}, std::forward<Where>(w));
+    auto stopped = newListenStop();
+    auto token = dht_->listen(id,
+                              getCallbackFilter(cb, std::forward<Value::Filter>(f), stopped),
+                              {},
+                              std::forward<Where>(w));
+    if (stopped and token)
+        listenStopped_.emplace(token, std::move(stopped));
+    return token;
 }
 
 size_t
 SecureDht::listen(const InfoHash& id, GetCallback cb, Value::Filter f, Where w)
 {
-    return dht_->listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), {}, std::forward<Where>(w));
+    auto stopped = newListenStop();
+    auto token = dht_->listen(id,
+                              getCallbackFilter(cb, std::forward<Value::Filter>(f), stopped),
+                              {},
+                              std::forward<Where>(w));
+    if (stopped and token)
+        listenStopped_.emplace(token, std::move(stopped));
+    return token;
+}
+
+bool
+SecureDht::cancelListen(const InfoHash& h, size_t token)
+{
+    // values being checked are not delivered anymore
+    auto s = listenStopped_.find(token);
+    if (s != listenStopped_.end()) {
+        *s->second = true;
+        listenStopped_.erase(s);
+    }
+    return dht_->cancelListen(h, token);
 }
 
 void
@@ -597,7 +912,7 @@ SecureDht::decrypt(const Value& v)
 
     if (ret.recipient != getId())
         throw crypto::DecryptError("Recipient mismatch");
-    if (not ret.owner or not ret.owner->checkSignature(ret.getToSign(), ret.signature))
+    if (not ret.owner or not ret.owner->checkSignature(*ret.getToSignRef(), ret.signature))
         throw crypto::DecryptError("Signature mismatch");
 
     return ret;
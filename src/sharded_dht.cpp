@@ -0,0 +1,837 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "sharded_dht.h"
+#include "network_engine.h"
+#include "rng.h"
+
+#include <set>
+#include <tuple>
+
+namespace dht {
+
+constexpr std::chrono::seconds ShardedDht::NODE_SHARING_PERIOD;
+constexpr std::chrono::seconds ShardedDht::NODE_SHARING_PERIOD_CONNECTING;
+constexpr std::chrono::seconds ShardedDht::PARTIAL_TIMEOUT;
+constexpr size_t ShardedDht::PARTIAL_MAX;
+
+namespace {
+
+/**
+ * Socket of a core: sends with the socket of the node.
+ * Packets are received by the ShardedDht.
+ */
+class ShardSocket final : public net::DatagramSocket
+{
+public:
+    ShardSocket(net::DatagramSocket& sock)
+        : sock_(sock)
+    {}
+
+    int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override
+    {
+        return sock_.sendTo(dest, data, size, replied);
+    }
+    void flush() override { sock_.flush(); }
+    net::SocketStats getStats() const override { return sock_.getStats(); }
+    bool hasIPv4() const override { return sock_.hasIPv4(); }
+    bool hasIPv6() const override { return sock_.hasIPv6(); }
+    const SockAddr& getBoundRef(sa_family_t family = AF_UNSPEC) const override { return sock_.getBoundRef(family); }
+    std::vector<SockAddr> resolve(const std::string& host, const std::string& service = {}) override
+    {
+        return sock_.resolve(host, service);
+    }
+    /* the socket of the node is stopped by its owner */
+    void stop() override {}
+
+private:
+    net::DatagramSocket& sock_;
+};
+
+/** Share of limit for one of n cores, keeping 0 (default) and negative (unlimited) values */
+ssize_t
+splitLimit(ssize_t limit, size_t n)
+{
+    return limit > 0 ? std::max<ssize_t>(limit / n, 1) : limit;
+}
+
+} // namespace
+
+struct ShardedDht::Shard
+{
+    Shard(std::unique_ptr<Dht>&& d, size_t ringSize)
+        : dht(std::move(d))
+        , rcv(ringSize)
+    {}
+
+    std::unique_ptr<Dht> dht;
+    /* held while using dht */
+    mutable std::mutex lock;
+    std::thread thread;
+
+    std::condition_variable cv;
+    /* held by the thread of the core while checking for jobs and waiting on cv */
+    std::mutex wake_mtx;
+    /* true while the thread of the core is waiting on cv */
+    std::atomic_bool parked {false};
+    /* true if dht was used since the last call to periodic() */
+    std::atomic_bool wake {false};
+
+    net::PacketRing rcv;
+    std::atomic_size_t rcv_max {0};
+    std::atomic<uint64_t> rcv_dropped {0};
+    std::vector<net::ReceivedPacket> batch;
+
+    std::atomic<NodeStatus> status4 {NodeStatus::Disconnected};
+    std::atomic<NodeStatus> status6 {NodeStatus::Disconnected};
+};
+
+ShardedDht::ShardedDht(std::unique_ptr<net::DatagramSocket>&& sock,
+                       const Config& config,
+                       unsigned shards,
+                       std::function<void()> loopSignal,
+                       const Sp<Logger>& l,
+                       std::unique_ptr<std::mt19937_64>&& rd)
+    : DhtInterface(l)
+    , socket_(std::move(sock))
+    , loopSignal_(std::move(loopSignal))
+{
+    if (not socket_ or (not socket_->hasIPv4() and not socket_->hasIPv6()))
+        throw DhtException("Opened socket required");
+    if (config.storage_backend)
+        throw DhtException("Storage backends are not supported by sharded nodes");
+
+    size_t n = std::clamp(shards, 1u, Node::MAX_SHARDS);
+    auto rng = rd ? std::move(rd)
+                  : std::make_unique<std::mt19937_64>(crypto::getSeededRandomEngine<std::mt19937_64>());
+
+    auto conf = config;
+    if (not conf.node_id)
+        conf.node_id = InfoHash::getRandom(*rng);
+    myid_ = conf.node_id;
+    conf.max_store_size = splitLimit(conf.max_store_size ? conf.max_store_size : (ssize_t) STORAGE_LIMIT_DEFAULT, n);
+    conf.max_local_store_size = splitLimit(conf.max_local_store_size, n);
+    conf.max_store_keys = splitLimit(conf.max_store_keys, n);
+    conf.max_searches = splitLimit(conf.max_searches, n);
+    conf.max_req_per_sec = splitLimit(conf.max_req_per_sec, n);
+
+    auto ringSize = std::max<size_t>(net::RX_RING_SIZE / n, 1024);
+    shards_.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        conf.shard = i + 1;
+        if (not config.persist_path.empty())
+            conf.persist_path = config.persist_path + "." + std::to_string(i);
+        auto dht = std::make_unique<Dht>(std::make_unique<ShardSocket>(*socket_),
+                                         conf,
+                                         l,
+                                         std::make_unique<std::mt19937_64>((*rng)()));
+        shards_.emplace_back(std::make_unique<Shard>(std::move(dht), ringSize));
+    }
+
+    socket_->setOnReceive([this](net::PacketList&& pkts) { return onReceive(std::move(pkts)); });
+    for (auto& s : shards_)
+        s->thread = std::thread([this, &s = *s] { runShard(s); });
+    if (logger_)
+        logger_->debug("[node {}] running {} cores", myid_, n);
+}
+
+ShardedDht::~ShardedDht()
+{
+    socket_->setOnReceive({});
+    running_ = false;
+    for (auto& s : shards_)
+        wake(*s);
+    for (auto& s : shards_)
+        if (s->thread.joinable())
+            s->thread.join();
+}
+
+template<typename F>
+decltype(auto)
+ShardedDht::run(Shard& s, F&& f)
+{
+    struct Waker
+    {
+        Shard& s;
+        ~Waker() { wake(s); }
+    } waker {s};
+    std::lock_guard lk(s.lock);
+    return f(*s.dht);
+}
+
+template<typename F>
+decltype(auto)
+ShardedDht::call(const Shard& s, F&& f) const
+{
+    std::lock_guard lk(s.lock);
+    return f(static_cast<const Dht&>(*s.dht));
+}
+
+void
+ShardedDht::post(std::function<void()>&& cb)
+{
+    bool signal;
+    {
+        std::lock_guard lock(lockCallbacks_);
+        signal = callbacks_.empty();
+        callbacks_.emplace_back(std::move(cb));
+    }
+    if (signal and loopSignal_)
+        loopSignal_();
+}
+
+template<typename R, typename... Args>
+std::function<R(Args...)>
+ShardedDht::defer(std::function<R(Args...)>&& cb, Sp<OperationState> state)
+{
+    if (not cb)
+        return {};
+    auto f = std::make_shared<std::function<R(Args...)>>(std::move(cb));
+    return [this, f, state](Args... args) -> R {
+        if (state and state->stop) {
+            if constexpr (std::is_same_v<R, bool>)
+                return false;
+            else
+                return;
+        }
+        post([f, state, a = std::make_tuple(std::decay_t<Args>(args)...)]() mutable {
+            if (state and state->stop)
+                return;
+            if constexpr (std::is_same_v<R, bool>) {
+                if (not std::apply(*f, std::move(a)) and state)
+                    state->stop = true;
+            } else
+                std::apply(*f, std::move(a));
+        });
+        if constexpr (std::is_same_v<R, bool>)
+            return true;
+    };
+}
+
+size_t
+ShardedDht::getShard(const InfoHash& key) const
+{
+    return (((size_t) key[0] << 8 | key[1]) * shards_.size()) >> 16;
+}
+
+void
+ShardedDht::wake(Shard& s)
+{
+    s.wake = true;
+    // Only notify the core if it is waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (s.parked.load(std::memory_order_relaxed)) {
+        { std::lock_guard lk(s.wake_mtx); }
+        s.cv.notify_all();
+    }
+}
+
+void
+ShardedDht::runShard(Shard& s)
+{
+    while (running_) {
+        time_point wakeup;
+        bool statusChanged;
+        size_t dropped {0};
+        {
+            std::lock_guard lk(s.lock);
+            s.wake = false;
+            // Handle packets received so far as a batch, old packets are discarded
+            auto now = clock::now();
+            auto count = s.rcv.size();
+            s.batch.resize(count);
+            size_t n = 0;
+            for (size_t i = 0; i < count and s.rcv.pop(s.batch[n]); i++) {
+                if (now - s.batch[n].received > net::RX_QUEUE_MAX_DELAY) {
+                    s.batch[n].data.clear();
+                    dropped++;
+                } else
+                    n++;
+            }
+            s.batch.resize(n);
+            wakeup = s.dht->periodic(s.batch, now);
+            for (auto& pkt : s.batch)
+                pkt.data.clear();
+
+            auto status4 = s.dht->updateStatus(AF_INET);
+            auto status6 = s.dht->updateStatus(AF_INET6);
+            statusChanged = s.status4.exchange(status4) != status4;
+            statusChanged |= s.status6.exchange(status6) != status6;
+        }
+        if (dropped) {
+            s.rcv_dropped += dropped;
+            if (logger_)
+                logger_->error("[node {}] dropped {} packets with high delay", myid_, dropped);
+        }
+        // let the node update its status
+        if (statusChanged and loopSignal_)
+            loopSignal_();
+
+        auto hasJobToDo = [&] {
+            s.parked = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return not running_ or s.wake or not s.rcv.empty();
+        };
+        std::unique_lock lk(s.wake_mtx);
+        if (wakeup == time_point::max())
+            s.cv.wait(lk, hasJobToDo);
+        else
+            s.cv.wait_until(lk, wakeup, hasJobToDo);
+        s.parked = false;
+    }
+}
+
+size_t
+ShardedDht::dispatch(const net::ReceivedPacket& pkt)
+{
+    net::MessageHeader header;
+    if (not net::NetworkEngine::peekMessage(pkt.data.data(), pkt.data.size(), header))
+        return 0;
+
+    // requests go to the core of their key, or of the sender
+    if (header.request) {
+        auto shard = getShard(header.target ? header.target : header.id);
+        if (header.value_parts) {
+            std::lock_guard lk(lockPartials_);
+            auto key = std::make_pair(pkt.from, header.tid);
+            if (partials_.insert_or_assign(key, PartialRequest {shard, pkt.received}).second)
+                partialsOrder_.emplace_back(std::move(key));
+            while (not partialsOrder_.empty()) {
+                auto it = partials_.find(partialsOrder_.front());
+                if (it != partials_.end() and partials_.size() <= PARTIAL_MAX
+                    and pkt.received - it->second.start < PARTIAL_TIMEOUT)
+                    break;
+                if (it != partials_.end())
+                    partials_.erase(it);
+                partialsOrder_.pop_front();
+            }
+        }
+        return shard;
+    }
+
+    // data of values sent in parts after a request
+    if (header.value_data) {
+        std::lock_guard lk(lockPartials_);
+        auto it = partials_.find(std::make_pair(pkt.from, header.tid));
+        if (it != partials_.end())
+            return it->second.shard;
+    }
+
+    // replies go to the core that sent the request
+    auto shard = Node::getTidShard(header.tid);
+    if (shard > 0 and shard <= shards_.size())
+        return shard - 1;
+    return getShard(header.id);
+}
+
+net::PacketList
+ShardedDht::onReceive(net::PacketList&& pkts)
+{
+    std::vector<bool> received(shards_.size());
+    size_t dropped = 0;
+    for (auto& pkt : pkts) {
+        auto i = dispatch(pkt);
+        auto& s = *shards_[i];
+        if (s.rcv.push(pkt))
+            received[i] = true;
+        else {
+            s.rcv_dropped++;
+            dropped++;
+        }
+        pkt.data.clear();
+    }
+    for (size_t i = 0; i < shards_.size(); i++) {
+        if (not received[i])
+            continue;
+        auto& s = *shards_[i];
+        auto depth = s.rcv.size();
+        auto max = s.rcv_max.load(std::memory_order_relaxed);
+        while (depth > max and not s.rcv_max.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {}
+        wake(s);
+    }
+    if (dropped and logger_)
+        logger_->warn("[node {}] dropped {} packets: queue is full!", myid_, dropped);
+    // list nodes are recycled by the socket
+    return std::move(pkts);
+}
+
+ShardedDht::RxStats
+ShardedDht::getRxStats() const
+{
+    RxStats stats;
+    for (const auto& s : shards_) {
+        stats.depth += s->rcv.size();
+        stats.max += s->rcv_max;
+        stats.dropped += s->rcv_dropped;
+    }
+    return stats;
+}
+
+time_point
+ShardedDht::periodic(const uint8_t* buf, size_t buflen, SockAddr from, const time_point& now)
+{
+    if (buflen) {
+        net::PacketList pkts(1);
+        auto& pkt = pkts.front();
+        pkt.data.assign(buf, buf + buflen);
+        pkt.from = std::move(from);
+        pkt.received = now;
+        onReceive(std::move(pkts));
+    }
+    return loop(now);
+}
+
+time_point
+ShardedDht::periodic(const std::vector<net::ReceivedPacket>& packets, const time_point& now)
+{
+    if (not packets.empty()) {
+        net::PacketList pkts(packets.size());
+        auto it = pkts.begin();
+        for (const auto& p : packets) {
+            it->data.assign(p.data.data(), p.data.data() + p.data.size());
+            it->from = p.from;
+            it->received = p.received;
+            ++it;
+        }
+        onReceive(std::move(pkts));
+    }
+    return loop(now);
+}
+
+time_point
+ShardedDht::loop(const time_point& now)
+{
+    decltype(callbacks_) callbacks;
+    {
+        std::lock_guard lock(lockCallbacks_);
+        callbacks = std::move(callbacks_);
+    }
+    for (auto& callback : callbacks)
+        callback();
+
+    if (now >= nextNodeSharing_) {
+        shareNodes();
+        bool connected = std::all_of(shards_.begin(), shards_.end(), [](const auto& s) {
+            return s->status4 == NodeStatus::Connected or s->status6 == NodeStatus::Connected;
+        });
+        nextNodeSharing_ = now + (connected ? NODE_SHARING_PERIOD : NODE_SHARING_PERIOD_CONNECTING);
+    }
+    return nextNodeSharing_;
+}
+
+void
+ShardedDht::shareNodes()
+{
+    if (shards_.size() < 2)
+        return;
+    std::vector<std::vector<NodeExport>> nodes;
+    nodes.reserve(shards_.size());
+    for (const auto& s : shards_)
+        nodes.emplace_back(call(*s, [](const Dht& dht) { return dht.exportNodes(); }));
+    for (size_t i = 0; i < shards_.size(); i++) {
+        run(*shards_[i], [&](Dht& dht) {
+            for (size_t j = 0; j < nodes.size(); j++)
+                if (j != i)
+                    for (const auto& n : nodes[j])
+                        dht.insertNode(n);
+        });
+    }
+}
+
+void
+ShardedDht::setOnPublicAddressChanged(PublicAddressChangedCb cb)
+{
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.setOnPublicAddressChanged(defer(PublicAddressChangedCb(cb))); });
+}
+
+NodeStatus
+ShardedDht::updateStatus(sa_family_t af)
+{
+    auto status = getStatus(af);
+    if (status == NodeStatus::Connected and not onConnectCallbacks_.empty()) {
+        auto callbacks = std::move(onConnectCallbacks_);
+        while (not callbacks.empty()) {
+            callbacks.front()();
+            callbacks.pop();
+        }
+    }
+    return status;
+}
+
+NodeStatus
+ShardedDht::getStatus(sa_family_t af) const
+{
+    NodeStatus status {NodeStatus::Disconnected};
+    for (const auto& s : shards_)
+        status = std::max(status, af == AF_INET ? s->status4.load() : s->status6.load());
+    return status;
+}
+
+void
+ShardedDht::shutdown(ShutdownCallback cb, bool stop)
+{
+    auto remaining = std::make_shared<size_t>(shards_.size());
+    ShutdownCallback done = [remaining, cb = std::move(cb)] {
+        if (--*remaining == 0 and cb)
+            cb();
+    };
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.shutdown(defer(ShutdownCallback(done)), stop); });
+}
+
+bool
+ShardedDht::isRunning(sa_family_t af) const
+{
+    return call(*shards_.front(), [&](const Dht& dht) { return dht.isRunning(af); });
+}
+
+void
+ShardedDht::registerType(const ValueType& type)
+{
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.registerType(type); });
+}
+
+const ValueType&
+ShardedDht::getType(ValueType::Id type_id) const
+{
+    const auto& s = *shards_.front();
+    std::lock_guard lk(s.lock);
+    return s.dht->getType(type_id);
+}
+
+void
+ShardedDht::addBootstrap(const std::string& host, const std::string& service)
+{
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.addBootstrap(host, service); });
+}
+
+void
+ShardedDht::clearBootstrap()
+{
+    for (auto& s : shards_)
+        run(*s, [](Dht& dht) { dht.clearBootstrap(); });
+}
+
+void
+ShardedDht::insertNode(const InfoHash& id, const SockAddr& addr)
+{
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.insertNode(id, addr); });
+}
+
+void
+ShardedDht::pingNode(SockAddr sa, DoneCallbackSimple&& cb)
+{
+    auto remaining = std::make_shared<std::pair<size_t, bool>>(shards_.size(), false);
+    DoneCallbackSimple done = [remaining, cb = std::move(cb)](bool ok) {
+        remaining->second |= ok;
+        if (--remaining->first == 0 and cb)
+            cb(remaining->second);
+    };
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.pingNode(sa, defer(DoneCallbackSimple(done))); });
+}
+
+void
+ShardedDht::get(const InfoHash& key, GetCallback cb, DoneCallback donecb, Value::Filter&& f, Where&& w)
+{
+    auto state = std::make_shared<OperationState>();
+    run(shardOf(key), [&](Dht& dht) {
+        dht.get(key, defer(std::move(cb), state), defer(std::move(donecb)), std::move(f), std::move(w));
+    });
+}
+
+void
+ShardedDht::query(const InfoHash& key, QueryCallback cb, DoneCallback done_cb, Query&& q)
+{
+    auto state = std::make_shared<OperationState>();
+    run(shardOf(key),
+        [&](Dht& dht) { dht.query(key, defer(std::move(cb), state), defer(std::move(done_cb)), std::move(q)); });
+}
+
+std::vector<Sp<Value>>
+ShardedDht::getLocal(const InfoHash& key, const Value::Filter& f) const
+{
+    return call(shardOf(key), [&](const Dht& dht) { return dht.getLocal(key, f); });
+}
+
+Sp<Value>
+ShardedDht::getLocalById(const InfoHash& key, Value::Id vid) const
+{
+    return call(shardOf(key), [&](const Dht& dht) { return dht.getLocalById(key, vid); });
+}
+
+void
+ShardedDht::put(const InfoHash& key, Sp<Value> val, DoneCallback cb, time_point created, bool permanent)
+{
+    run(shardOf(key), [&](Dht& dht) { dht.put(key, std::move(val), defer(std::move(cb)), created, permanent); });
+}
+
+std::vector<Sp<Value>>
+ShardedDht::getPut(const InfoHash& key) const
+{
+    return call(shardOf(key), [&](const Dht& dht) { return dht.getPut(key); });
+}
+
+Sp<Value>
+ShardedDht::getPut(const InfoHash& key, const Value::Id& id) const
+{
+    return call(shardOf(key), [&](const Dht& dht) { return dht.getPut(key, id); });
+}
+
+bool
+ShardedDht::cancelPut(const InfoHash& key, const Value::Id& id)
+{
+    return run(shardOf(key), [&](Dht& dht) { return dht.cancelPut(key, id); });
+}
+
+size_t
+ShardedDht::listen(const InfoHash& key, ValueCallback cb, Value::Filter f, Where w)
+{
+    auto state = std::make_shared<OperationState>();
+    ValueCallback vcb = [this, key, state, cb = std::move(cb)](const std::vector<Sp<Value>>& values, bool expired) {
+        if (cb(values, expired))
+            return true;
+        listeners_.erase({key, state->token});
+        return false;
+    };
+    state->token = run(shardOf(key), [&](Dht& dht) {
+        return dht.listen(key, defer(std::move(vcb), state), std::move(f), std::move(w));
+    });
+    if (state->token)
+        listeners_.emplace(std::make_pair(key, state->token), state);
+    return state->token;
+}
+
+bool
+ShardedDht::cancelListen(const InfoHash& key, size_t token)
+{
+    auto it = listeners_.find({key, token});
+    if (it != listeners_.end()) {
+        it->second->stop = true;
+        listeners_.erase(it);
+    }
+    return run(shardOf(key), [&](Dht& dht) { return dht.cancelListen(key, token); });
+}
+
+void
+ShardedDht::connectivityChanged(sa_family_t af)
+{
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.connectivityChanged(af); });
+}
+
+std::vector<NodeExport>
+ShardedDht::exportNodes() const
+{
+    std::vector<NodeExport> nodes;
+    std::set<InfoHash> ids;
+    for (const auto& s : shards_) {
+        for (auto& n : call(*s, [](const Dht& dht) { return dht.exportNodes(); }))
+            if (ids.emplace(n.id).second)
+                nodes.emplace_back(std::move(n));
+    }
+    return nodes;
+}
+
+std::vector<ValuesExport>
+ShardedDht::exportValues() const
+{
+    std::vector<ValuesExport> values;
+    for (const auto& s : shards_) {
+        auto v = call(*s, [](const Dht& dht) { return dht.exportValues(); });
+        values.insert(values.end(), std::make_move_iterator(v.begin()), std::make_move_iterator(v.end()));
+    }
+    return values;
+}
+
+void
+ShardedDht::importValues(const std::vector<ValuesExport>& import)
+{
+    std::vector<std::vector<ValuesExport>> values(shards_.size());
+    for (const auto& v : import)
+        values[getShard(v.first)].emplace_back(v);
+    for (size_t i = 0; i < shards_.size(); i++)
+        if (not values[i].empty())
+            run(*shards_[i], [&](Dht& dht) { dht.importValues(values[i]); });
+}
+
+NodeStats
+ShardedDht::getNodesStats(sa_family_t af) const
+{
+    NodeStats stats {};
+    unsigned searches = 0;
+    for (const auto& s : shards_) {
+        auto st = call(*s, [&](const Dht& dht) { return dht.getNodesStats(af); });
+        searches += st.searches;
+        if (st.getKnownNodes() > stats.getKnownNodes())
+            stats = st;
+    }
+    stats.searches = searches;
+    return stats;
+}
+
+std::string
+ShardedDht::getStorageLog() const
+{
+    std::string log;
+    for (const auto& s : shards_)
+        log += call(*s, [](const Dht& dht) { return dht.getStorageLog(); });
+    return log;
+}
+
+std::string
+ShardedDht::getStorageLog(const InfoHash& h) const
+{
+    return call(shardOf(h), [&](const Dht& dht) { return dht.getStorageLog(h); });
+}
+
+std::string
+ShardedDht::getRoutingTablesLog(sa_family_t af) const
+{
+    std::string log;
+    for (size_t i = 0; i < shards_.size(); i++) {
+        log += "Core " + std::to_string(i) + ":\n";
+        log += call(*shards_[i], [&](const Dht& dht) { return dht.getRoutingTablesLog(af); });
+    }
+    return log;
+}
+
+std::string
+ShardedDht::getSearchesLog(sa_family_t af) const
+{
+    std::string log;
+    for (const auto& s : shards_)
+        log += call(*s, [&](const Dht& dht) { return dht.getSearchesLog(af); });
+    return log;
+}
+
+std::string
+ShardedDht::getSearchLog(const InfoHash& h, sa_family_t af) const
+{
+    return call(shardOf(h), [&](const Dht& dht) { return dht.getSearchLog(h, af); });
+}
+
+void
+ShardedDht::dumpTables() const
+{
+    for (const auto& s : shards_)
+        call(*s, [](const Dht& dht) { dht.dumpTables(); });
+}
+
+std::vector<unsigned>
+ShardedDht::getNodeMessageStats(bool in)
+{
+    std::vector<unsigned> stats;
+    for (auto& s : shards_) {
+        auto st = run(*s, [&](Dht& dht) { return dht.getNodeMessageStats(in); });
+        stats.resize(std::max(stats.size(), st.size()));
+        for (size_t i = 0; i < st.size(); i++)
+            stats[i] += st[i];
+    }
+    return stats;
+}
+
+void
+ShardedDht::setStorageLimit(size_t limit)
+{
+    if (limit == 0)
+        limit = STORAGE_LIMIT_DEFAULT;
+    if (limit != STORAGE_LIMIT_UNLIMITED)
+        limit = std::max<size_t>(limit / shards_.size(), 1);
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.setStorageLimit(limit); });
+}
+
+size_t
+ShardedDht::getStorageLimit() const
+{
+    size_t limit = 0;
+    for (const auto& s : shards_) {
+        auto l = call(*s, [](const Dht& dht) { return dht.getStorageLimit(); });
+        if (l == STORAGE_LIMIT_UNLIMITED)
+            return l;
+        limit += l;
+    }
+    return limit;
+}
+
+void
+ShardedDht::setLocalStorageLimit(size_t limit)
+{
+    if (limit != 0 and limit != STORAGE_LIMIT_UNLIMITED)
+        limit = std::max<size_t>(limit / shards_.size(), 1);
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.setLocalStorageLimit(limit); });
+}
+
+size_t
+ShardedDht::getLocalStorageLimit() const
+{
+    size_t limit = 0;
+    for (const auto& s : shards_) {
+        auto l = call(*s, [](const Dht& dht) { return dht.getLocalStorageLimit(); });
+        if (l == STORAGE_LIMIT_UNLIMITED)
+            return l;
+        limit += l;
+    }
+    return limit;
+}
+
+std::pair<size_t, size_t>
+ShardedDht::getStoreSize() const
+{
+    std::pair<size_t, size_t> size {0, 0};
+    for (const auto& s : shards_) {
+        auto st = call(*s, [](const Dht& dht) { return dht.getStoreSize(); });
+        size.first += st.first;
+        size.second += st.second;
+    }
+    return size;
+}
+
+std::pair<size_t, size_t>
+ShardedDht::getLocalStoreSize() const
+{
+    std::pair<size_t, size_t> size {0, 0};
+    for (const auto& s : shards_) {
+        auto st = call(*s, [](const Dht& dht) { return dht.getLocalStoreSize(); });
+        size.first += st.first;
+        size.second += st.second;
+    }
+    return size;
+}
+
+std::vector<SockAddr>
+ShardedDht::getPublicAddress(sa_family_t family)
+{
+    std::vector<SockAddr> addrs;
+    std::set<SockAddr> known;
+    for (auto& s : shards_) {
+        for (auto& addr : run(*s, [&](Dht& dht) { return dht.getPublicAddress(family); }))
+            if (known.emplace(addr).second)
+                addrs.emplace_back(std::move(addr));
+    }
+    return addrs;
+}
+
+void
+ShardedDht::setLogger(const Sp<Logger>& l)
+{
+    DhtInterface::setLogger(l);
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.setLogger(l); });
+}
+
+void
+ShardedDht::setLogFilter(const InfoHash& f)
+{
+    DhtInterface::setLogFilter(f);
+    for (auto& s : shards_)
+        run(*s, [&](Dht& dht) { dht.setLogFilter(f); });
+}
+
+} // namespace dht
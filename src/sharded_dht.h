@@ -0,0 +1,296 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "dht.h"
+#include "network_utils.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace dht {
+
+/**
+ * Runs several Dht cores behind one socket and one node ID, each core on its
+ * own thread. The keyspace is partitioned by InfoHash prefix: the values
+ * stored at a key, and the searches and listeners for it, belong to one core.
+ *
+ * Received packets are dispatched by the socket receive threads, after
+ * reading the header of the message (see NetworkEngine::peekMessage()):
+ * requests to the core of their target, replies and updates to the core
+ * that sent the request, tagged in the transaction id.
+ *
+ * Every core has its own routing table. Good nodes known by a core are
+ * regularly inserted in the tables of the others.
+ *
+ * Callbacks are called by the thread calling periodic(), that is signaled
+ * with loopSignal when some are waiting.
+ */
+class ShardedDht final : public DhtInterface
+{
+public:
+    ShardedDht(std::unique_ptr<net::DatagramSocket>&& sock,
+               const Config& config,
+               unsigned shards,
+               std::function<void()> loopSignal,
+               const Sp<Logger>& l = {},
+               std::unique_ptr<std::mt19937_64>&& rd = {});
+    ~ShardedDht();
+
+    /** Time between two exchanges of good nodes between the cores */
+    static constexpr std::chrono::seconds NODE_SHARING_PERIOD {30};
+    /** Same, while some cores are not connected */
+    static constexpr std::chrono::seconds NODE_SHARING_PERIOD_CONNECTING {2};
+
+    struct RxStats
+    {
+        size_t depth {0};
+        size_t max {0};
+        uint64_t dropped {0};
+    };
+    /** Counters of the queues of received packets of the cores */
+    RxStats getRxStats() const;
+
+    size_t getShardCount() const { return shards_.size(); }
+    /** Index of the core responsible for key */
+    size_t getShard(const InfoHash& key) const;
+
+    const InfoHash& getNodeId() const override { return myid_; }
+    void setOnPublicAddressChanged(PublicAddressChangedCb cb) override;
+
+    NodeStatus updateStatus(sa_family_t af) override;
+    NodeStatus getStatus(sa_family_t af) const override;
+    NodeStatus getStatus() const override { return std::max(getStatus(AF_INET), getStatus(AF_INET6)); }
+
+    net::DatagramSocket* getSocket() const override { return socket_.get(); }
+
+    void shutdown(ShutdownCallback cb, bool stop = false) override;
+    bool isRunning(sa_family_t af = 0) const override;
+
+    void registerType(const ValueType& type) override;
+    const ValueType& getType(ValueType::Id type_id) const override;
+
+    void addBootstrap(const std::string& host, const std::string& service) override;
+    void clearBootstrap() override;
+
+    void insertNode(const InfoHash& id, const SockAddr&) override;
+    void insertNode(const NodeExport& n) override { insertNode(n.id, n.addr); }
+    /** Ping from every core, succeeds if one of them got a reply */
+    void pingNode(SockAddr, DoneCallbackSimple&& cb = {}) override;
+
+    time_point periodic(const uint8_t* buf, size_t buflen, SockAddr, const time_point& now) override;
+    time_point periodic(
+        const uint8_t* buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now) override
+    {
+        return periodic(buf, buflen, SockAddr(from, fromlen), now);
+    }
+    time_point periodic(const std::vector<net::ReceivedPacket>& packets, const time_point& now) override;
+
+    void get(
+        const InfoHash& key, GetCallback cb, DoneCallback donecb = {}, Value::Filter&& f = {}, Where&& w = {}) override;
+    void get(const InfoHash& key,
+             GetCallback cb,
+             DoneCallbackSimple donecb = {},
+             Value::Filter&& f = {},
+             Where&& w = {}) override
+    {
+        get(key, cb, bindDoneCb(donecb), std::forward<Value::Filter>(f), std::forward<Where>(w));
+    }
+    void get(const InfoHash& key,
+             GetCallbackSimple cb,
+             DoneCallback donecb = {},
+             Value::Filter&& f = {},
+             Where&& w = {}) override
+    {
+        get(key, bindGetCb(cb), donecb, std::forward<Value::Filter>(f), std::forward<Where>(w));
+    }
+    void get(const InfoHash& key,
+             GetCallbackSimple cb,
+             DoneCallbackSimple donecb,
+             Value::Filter&& f = {},
+             Where&& w = {}) override
+    {
+        get(key, bindGetCb(cb), bindDoneCb(donecb), std::forward<Value::Filter>(f), std::forward<Where>(w));
+    }
+
+    void query(const InfoHash& key, QueryCallback cb, DoneCallback done_cb = {}, Query&& q = {}) override;
+    void query(const InfoHash& key, QueryCallback cb, DoneCallbackSimple done_cb = {}, Query&& q = {}) override
+    {
+        query(key, cb, bindDoneCb(done_cb), std::forward<Query>(q));
+    }
+
+    std::vector<Sp<Value>> getLocal(const InfoHash& key, const Value::Filter& f = {}) const override;
+    Sp<Value> getLocalById(const InfoHash& key, Value::Id vid) const override;
+
+    void put(const InfoHash& key,
+             Sp<Value>,
+             DoneCallback cb = nullptr,
+             time_point created = time_point::max(),
+             bool permanent = false) override;
+    void put(const InfoHash& key,
+             const Sp<Value>& v,
+             DoneCallbackSimple cb,
+             time_point created = time_point::max(),
+             bool permanent = false) override
+    {
+        put(key, v, bindDoneCb(cb), created, permanent);
+    }
+    void put(const InfoHash& key,
+             Value&& v,
+             DoneCallback cb = nullptr,
+             time_point created = time_point::max(),
+             bool permanent = false) override
+    {
+        put(key, std::make_shared<Value>(std::move(v)), cb, created, permanent);
+    }
+    void put(const InfoHash& key,
+             Value&& v,
+             DoneCallbackSimple cb,
+             time_point created = time_point::max(),
+             bool permanent = false) override
+    {
+        put(key, std::forward<Value>(v), bindDoneCb(cb), created, permanent);
+    }
+
+    std::vector<Sp<Value>> getPut(const InfoHash&) const override;
+    Sp<Value> getPut(const InfoHash&, const Value::Id&) const override;
+    bool cancelPut(const InfoHash&, const Value::Id&) override;
+
+    size_t listen(const InfoHash&, ValueCallback, Value::Filter = {}, Where = {}) override;
+    size_t listen(const InfoHash& key, GetCallback cb, Value::Filter f = {}, Where w = {}) override
+    {
+        return listen(
+            key,
+            [cb](const std::vector<Sp<Value>>& vals, bool expired) {
+                if (not expired)
+                    return cb(vals);
+                return true;
+            },
+            std::forward<Value::Filter>(f),
+            std::forward<Where>(w));
+    }
+    size_t listen(const InfoHash& key, GetCallbackSimple cb, Value::Filter f = {}, Where w = {}) override
+    {
+        return listen(key, bindGetCb(cb), std::forward<Value::Filter>(f), std::forward<Where>(w));
+    }
+    bool cancelListen(const InfoHash&, size_t token) override;
+
+    void connectivityChanged(sa_family_t) override;
+    void connectivityChanged() override
+    {
+        connectivityChanged(AF_INET);
+        connectivityChanged(AF_INET6);
+    }
+
+    std::vector<NodeExport> exportNodes() const override;
+    std::vector<ValuesExport> exportValues() const override;
+    void importValues(const std::vector<ValuesExport>&) override;
+
+    /** Stats of the routing table knowing the most nodes, with the searches of every core */
+    NodeStats getNodesStats(sa_family_t af) const override;
+
+    std::string getStorageLog() const override;
+    std::string getStorageLog(const InfoHash&) const override;
+    std::string getRoutingTablesLog(sa_family_t) const override;
+    std::string getSearchesLog(sa_family_t) const override;
+    std::string getSearchLog(const InfoHash&, sa_family_t af = AF_UNSPEC) const override;
+
+    void dumpTables() const override;
+    std::vector<unsigned> getNodeMessageStats(bool in = false) override;
+
+    /** Storage limits are divided between the cores */
+    void setStorageLimit(size_t limit = 0) override;
+    size_t getStorageLimit() const override;
+    void setLocalStorageLimit(size_t limit = 0) override;
+    size_t getLocalStorageLimit() const override;
+
+    std::pair<size_t, size_t> getStoreSize() const override;
+    std::pair<size_t, size_t> getLocalStoreSize() const override;
+
+    std::vector<SockAddr> getPublicAddress(sa_family_t family = 0) override;
+
+    void setLogger(const Sp<Logger>& l) override;
+    void setLogFilter(const InfoHash& f) override;
+
+    PushNotificationResult pushNotificationReceived(const std::map<std::string, std::string>&) override
+    {
+        return PushNotificationResult::IgnoredDisabled;
+    }
+
+private:
+    struct Shard;
+    struct OperationState
+    {
+        std::atomic_bool stop {false};
+        /* token of a listen operation */
+        size_t token {0};
+    };
+
+    /* Time after which the data of values sent in parts is not expected anymore */
+    static constexpr std::chrono::seconds PARTIAL_TIMEOUT {10};
+    static constexpr size_t PARTIAL_MAX {4096};
+
+    /** Runs core s until the node is destroyed */
+    void runShard(Shard& s);
+    static void wake(Shard& s);
+
+    /** Index of the core that handles a received packet */
+    size_t dispatch(const net::ReceivedPacket& pkt);
+    net::PacketList onReceive(net::PacketList&& pkts);
+
+    /** Call the queued callbacks and share nodes between the cores when due */
+    time_point loop(const time_point& now);
+    /** Insert the good nodes of every core in the routing tables of the others */
+    void shareNodes();
+
+    /** Queue a callback to be called by periodic() */
+    void post(std::function<void()>&& cb);
+
+    /**
+     * Bind a callback given to a core, to be called by periodic().
+     * If state is given, the callback is not called anymore once it returned false.
+     */
+    template<typename R, typename... Args>
+    std::function<R(Args...)> defer(std::function<R(Args...)>&& cb, Sp<OperationState> state = {});
+
+    Shard& shardOf(const InfoHash& key) const { return *shards_[getShard(key)]; }
+
+    /** Call f with the Dht of core s, then wake up the core */
+    template<typename F>
+    decltype(auto) run(Shard& s, F&& f);
+    /** Call f with the Dht of core s, for read-only operations */
+    template<typename F>
+    decltype(auto) call(const Shard& s, F&& f) const;
+
+    const std::unique_ptr<net::DatagramSocket> socket_;
+    InfoHash myid_ {};
+    std::function<void()> loopSignal_;
+
+    std::mutex lockCallbacks_;
+    std::vector<std::function<void()>> callbacks_;
+
+    /* States of the listen operations, by key and token */
+    std::map<std::pair<InfoHash, size_t>, Sp<OperationState>> listeners_;
+
+    /* Core of the requests with values sent in parts, by sender and tid */
+    struct PartialRequest
+    {
+        size_t shard;
+        time_point start;
+    };
+    std::mutex lockPartials_;
+    std::map<std::pair<SockAddr, Tid>, PartialRequest> partials_;
+    std::deque<std::pair<SockAddr, Tid>> partialsOrder_;
+
+    time_point nextNodeSharing_ {time_point::min()};
+
+    std::atomic_bool running_ {true};
+    /* destroyed first: the cores call back the members above */
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // namespace dht
@@ -6,14 +6,19 @@
 #include "listener.h"
 #include "sockaddr.h"
 #include "value.h"
+#include "flat_hash_map.h"
 
 #include <map>
 #include <utility>
 
 namespace dht {
 
+struct ValueStorage;
+
 /**
- * Tracks storage usage per IP or IP range
+ * Tracks storage usage per IP or IP range.
+ * Stored values are kept in a binary heap ordered by expiration time, each
+ * value knowing its position in the heap.
  */
 class StorageBucket
 {
@@ -22,51 +27,29 @@ public:
     explicit StorageBucket(SockAddr addr)
         : addr_(std::move(addr))
     {}
+    StorageBucket(const StorageBucket&) = delete;
+    StorageBucket& operator=(const StorageBucket&) = delete;
+
+    inline void insert(ValueStorage& vs);
+    inline void erase(ValueStorage& vs);
+    /** To be called when the expiration of a value changed */
+    inline void refresh(ValueStorage& vs);
 
-    void insert(const InfoHash& id, const Value& value, time_point expiration)
-    {
-        totalSize_ += value.size();
-        storedValues_.emplace(expiration, std::pair<InfoHash, Value::Id>(id, value.id));
-    }
-    void erase(const InfoHash& id, const Value& value, time_point expiration)
-    {
-        auto range = storedValues_.equal_range(expiration);
-        for (auto rit = range.first; rit != range.second;) {
-            if (rit->second.first == id && rit->second.second == value.id) {
-                totalSize_ -= value.size();
-                storedValues_.erase(rit);
-                return;
-            } else
-                ++rit;
-        }
-        // printf("StorageBucket::erase unable to find value %s %016" PRIx64 "\n", id.to_c_str(), value.id);
-    }
-    void refresh(const InfoHash& id, const Value& value, time_point old_expiration, time_point expiration)
-    {
-        auto range = storedValues_.equal_range(old_expiration);
-        for (auto rit = range.first; rit != range.second;) {
-            if (rit->second.first == id && rit->second.second == value.id) {
-                storedValues_.erase(rit);
-                storedValues_.emplace(expiration, std::pair<InfoHash, Value::Id>(id, value.id));
-                return;
-            } else
-                ++rit;
-        }
-        // printf("StorageBucket::refresh unable to find value %s %016" PRIx64 "\n", id.to_c_str(), value.id);
-        insert(id, value, expiration);
-    }
     size_t size() const { return totalSize_; }
-    size_t valueCount() const { return storedValues_.size(); }
-    bool empty() const { return storedValues_.empty(); }
-    std::pair<InfoHash, Value::Id> getOldest() const
-    {
-        return storedValues_.empty() ? std::pair<InfoHash, Value::Id> {} : storedValues_.begin()->second;
-    }
+    size_t valueCount() const { return heap_.size(); }
+    bool empty() const { return heap_.empty(); }
+    /** Key and id of the value expiring first */
+    inline std::pair<InfoHash, Value::Id> getOldest() const;
     const SockAddr& getAddr() const { return addr_; }
 
 private:
+    friend struct ValueStorage;
+    inline void siftUp(size_t i);
+    inline void siftDown(size_t i);
+    inline void place(ValueStorage& vs, size_t i);
+
     SockAddr addr_ {};
-    std::multimap<time_point, std::pair<InfoHash, Value::Id>> storedValues_;
+    std::vector<ValueStorage*> heap_ {};
     size_t totalSize_ {0};
 };
 
@@ -75,8 +58,9 @@ struct ValueStorage
     Sp<Value> data {};
     time_point created {};
     time_point expiration {};
-    Sp<Scheduler::Job> expiration_job {};
     StorageBucket* store_bucket {nullptr};
+    /* Key of the storage holding the value, set while in a bucket */
+    const InfoHash* key {nullptr};
 
     ValueStorage() {}
     ValueStorage(const Sp<Value>& v, time_point t, time_point e)
@@ -84,8 +68,120 @@ struct ValueStorage
         , created(t)
         , expiration(e)
     {}
+    // Values are moved inside their storage: keep the bucket pointing to them
+    ValueStorage(ValueStorage&& o) noexcept
+        : data(std::move(o.data))
+        , created(o.created)
+        , expiration(o.expiration)
+        , store_bucket(std::exchange(o.store_bucket, nullptr))
+        , key(o.key)
+        , bucket_pos(o.bucket_pos)
+    {
+        if (store_bucket)
+            store_bucket->heap_[bucket_pos] = this;
+    }
+    ValueStorage& operator=(ValueStorage&& o) noexcept
+    {
+        if (this != &o) {
+            if (store_bucket)
+                store_bucket->erase(*this);
+            data = std::move(o.data);
+            created = o.created;
+            expiration = o.expiration;
+            store_bucket = std::exchange(o.store_bucket, nullptr);
+            key = o.key;
+            bucket_pos = o.bucket_pos;
+            if (store_bucket)
+                store_bucket->heap_[bucket_pos] = this;
+        }
+        return *this;
+    }
+    ValueStorage(const ValueStorage&) = delete;
+    ValueStorage& operator=(const ValueStorage&) = delete;
+
+private:
+    friend class StorageBucket;
+    size_t bucket_pos {0};
 };
 
+void
+StorageBucket::insert(ValueStorage& vs)
+{
+    totalSize_ += vs.data->size();
+    vs.store_bucket = this;
+    heap_.emplace_back(&vs);
+    vs.bucket_pos = heap_.size() - 1;
+    siftUp(vs.bucket_pos);
+}
+
+void
+StorageBucket::erase(ValueStorage& vs)
+{
+    totalSize_ -= vs.data->size();
+    auto i = vs.bucket_pos;
+    vs.store_bucket = nullptr;
+    auto last = heap_.back();
+    heap_.pop_back();
+    if (last != &vs) {
+        place(*last, i);
+        siftUp(i);
+        siftDown(last->bucket_pos);
+    }
+}
+
+void
+StorageBucket::refresh(ValueStorage& vs)
+{
+    siftUp(vs.bucket_pos);
+    siftDown(vs.bucket_pos);
+}
+
+std::pair<InfoHash, Value::Id>
+StorageBucket::getOldest() const
+{
+    return heap_.empty() ? std::pair<InfoHash, Value::Id> {}
+                         : std::pair<InfoHash, Value::Id> {*heap_.front()->key, heap_.front()->data->id};
+}
+
+void
+StorageBucket::place(ValueStorage& vs, size_t i)
+{
+    heap_[i] = &vs;
+    vs.bucket_pos = i;
+}
+
+void
+StorageBucket::siftUp(size_t i)
+{
+    auto vs = heap_[i];
+    while (i > 0) {
+        auto parent = (i - 1) / 2;
+        if (not(vs->expiration < heap_[parent]->expiration))
+            break;
+        place(*heap_[parent], i);
+        i = parent;
+    }
+    place(*vs, i);
+}
+
+void
+StorageBucket::siftDown(size_t i)
+{
+    auto vs = heap_[i];
+    for (;;) {
+        auto child = 2 * i + 1;
+        if (child >= heap_.size())
+            break;
+        if (child + 1 < heap_.size() and heap_[child + 1]->expiration < heap_[child]->expiration)
+            child++;
+        if (not(heap_[child]->expiration < vs->expiration))
+            break;
+        place(*heap_[child], i);
+        i = child;
+    }
+    place(*vs, i);
+}
+
 struct Storage
 {
     time_point maintenance_time {};
@@ -120,7 +216,7 @@ struct Storage
 
     bool empty() const { return values.empty(); }
 
-    StoreDiff clear(const InfoHash& id);
+    StoreDiff clear();
 
     size_t valueCount() const { return values.size(); }
 
@@ -130,9 +226,8 @@ struct Storage
 
     Sp<Value> getById(Value::Id vid) const
     {
-        for (auto& v : values)
-            if (v.data->id == vid)
-                return v.data;
+        if (auto vs = findValue(vid))
+            return vs->data;
         return {};
     }
 
@@ -155,6 +250,7 @@ struct Storage
      *      storage: set if a change happened
      *      change_size: size difference
      *      change_value_num: change of value number (0 or 1)
+     * @param id  key of the storage, that must outlive stored values
      */
     std::pair<ValueStorage*, StoreDiff> store(
         const InfoHash& id, const Sp<Value>&, time_point created, time_point expiration, StorageBucket*);
@@ -166,41 +262,67 @@ struct Storage
      * @param vid  The value id
      * @return time of the next expiration, time_point::max() if no expiration
      */
-    std::pair<ValueStorage*, time_point> refresh(const InfoHash& id,
-                                                 const time_point& now,
+    std::pair<ValueStorage*, time_point> refresh(const time_point& now,
                                                  const Value::Id& vid,
                                                  const TypeStore& types)
     {
-        for (auto& vs : values)
-            if (vs.data->id == vid) {
-                vs.created = now;
-                auto oldExp = vs.expiration;
-                vs.expiration = std::max(oldExp, now + types.getType(vs.data->type).expiration);
-                if (vs.store_bucket)
-                    vs.store_bucket->refresh(id, *vs.data, oldExp, vs.expiration);
-                return {&vs, vs.expiration};
-            }
-        return {nullptr, time_point::max()};
+        auto vs = findValue(vid);
+        if (not vs)
+            return {nullptr, time_point::max()};
+        vs->created = now;
+        vs->expiration = std::max(vs->expiration, now + types.getType(vs->data->type).expiration);
+        if (vs->store_bucket)
+            vs->store_bucket->refresh(*vs);
+        return {vs, vs->expiration};
     }
 
     size_t listen(ValueCallback& cb, Value::Filter& f, const Sp<Query>& q);
 
     void cancelListen(size_t token) { local_listeners.erase(token); }
 
-    Sp<Value> remove(const InfoHash& id, Value::Id);
+    Sp<Value> remove(Value::Id);
 
     struct ExpireResult
     {
         ssize_t size_diff;
         std::vector<Sp<Value>> expired_values;
     };
-    ExpireResult expire(const InfoHash& id, time_point now);
+    ExpireResult expire(time_point now);
 
 private:
     Storage(const Storage&) = delete;
     Storage& operator=(const Storage&) = delete;
 
+    /* Values are indexed by id once there are more than INDEX_MIN_VALUES */
+    static constexpr size_t INDEX_MIN_VALUES {32};
+
+    const ValueStorage* findValue(Value::Id vid) const
+    {
+        if (not index.empty()) {
+            auto it = index.find(vid);
+            return it != index.end() ? &values[it->second] : nullptr;
+        }
+        for (const auto& v : values)
+            if (v.data->id == vid)
+                return &v;
+        return nullptr;
+    }
+    ValueStorage* findValue(Value::Id vid) { return const_cast<ValueStorage*>(std::as_const(*this).findValue(vid)); }
+    /** Rebuild the index, or drop it if there are few values */
+    void reindex()
+    {
+        index.clear();
+        if (values.size() <= INDEX_MIN_VALUES)
+            return;
+        index.reserve(values.size());
+        for (size_t i = 0; i < values.size(); i++)
+            index.emplace(values[i].data->id, (uint32_t) i);
+    }
+
+    /* Values are not ordered: removing a value moves the last one in its place */
     std::vector<ValueStorage> values {};
+    /* Position of values by id, empty when not used. Ids are chosen by peers: the hash is seeded. */
+    FlatHashMap<Value::Id, uint32_t, detail::SeededHash> index {};
     size_t total_size {};
 };
 
@@ -222,11 +344,9 @@ Storage::listen(ValueCallback& gcb, Value::Filter& filter, const Sp<Query>& quer
 std::pair<ValueStorage*, Storage::StoreDiff>
 Storage::store(const InfoHash& id, const Sp<Value>& value, time_point created, time_point expiration, StorageBucket* sb)
 {
-    auto it = std::find_if(values.begin(), values.end(), [&](const ValueStorage& vr) {
-        return vr.data == value || vr.data->id == value->id;
-    });
+    auto it = findValue(value->id);
     ssize_t size_new = value->size();
-    if (it != values.end()) {
+    if (it) {
         /* Already there, only need to refresh */
         it->created = created;
         if (it->data != value) {
@@ -235,24 +355,28 @@ Storage::store(const InfoHash& id, const Sp<Value>& value, time_point created, t
             // DHT_LOG.DEBUG("Updating %s -> %s", id.toString().c_str(), value->toString().c_str());
             //  clear quota for previous value
             if (it->store_bucket)
-                it->store_bucket->erase(id, *it->data, it->expiration);
+                it->store_bucket->erase(*it);
             it->expiration = expiration;
+            it->data = value;
             // update quota for new value
-            it->store_bucket = sb;
+            it->key = &id;
             if (sb)
-                sb->insert(id, *value, expiration);
-            it->data = value;
+                sb->insert(*it);
             total_size += size_diff;
-            return std::make_pair(&(*it), StoreDiff {size_diff, 0, 0, 1});
+            return std::make_pair(it, StoreDiff {size_diff, 0, 0, 1});
         }
     } else {
         // DHT_LOG.DEBUG("Storing %s -> %s", id.toString().c_str(), value->toString().c_str());
         if (values.size() < MAX_VALUES) {
             total_size += size_new;
-            values.emplace_back(value, created, expiration);
-            values.back().store_bucket = sb;
+            auto& vs = values.emplace_back(value, created, expiration);
+            vs.key = &id;
             if (sb)
-                sb->insert(id, *value, expiration);
+                sb->insert(vs);
+            if (not index.empty())
+                index.emplace(value->id, (uint32_t) (values.size() - 1));
+            else if (values.size() > INDEX_MIN_VALUES)
+                reindex();
             return std::make_pair(&values.back(), StoreDiff {size_new, 1, 0, 0});
         }
     }
@@ -260,40 +384,44 @@ Storage::store(const InfoHash& id, const Sp<Value>& value, time_point created, t
 }
 
 Sp<Value>
-Storage::remove(const InfoHash& id, Value::Id vid)
+Storage::remove(Value::Id vid)
 {
-    auto it = std::find_if(values.begin(), values.end(), [&](const ValueStorage& vr) { return vr.data->id == vid; });
-    if (it == values.end())
+    auto it = findValue(vid);
+    if (not it)
         return {};
     ssize_t size = it->data->size();
     if (it->store_bucket)
-        it->store_bucket->erase(id, *it->data, it->expiration);
-    if (it->expiration_job)
-        it->expiration_job->cancel();
+        it->store_bucket->erase(*it);
     total_size -= size;
-    auto value = it->data;
-    values.erase(it);
+    auto value = std::move(it->data);
+    if (not index.empty())
+        index.erase(vid);
+    if (it != &values.back()) {
+        *it = std::move(values.back());
+        if (not index.empty())
+            index[it->data->id] = (uint32_t) (it - values.data());
+    }
+    values.pop_back();
     return value;
 }
 
 Storage::StoreDiff
-Storage::clear(const InfoHash& id)
+Storage::clear()
 {
     ssize_t num_values = values.size();
     ssize_t tot_size = total_size;
     for (auto& v : values) {
         if (v.store_bucket)
-            v.store_bucket->erase(id, *v.data, v.expiration);
-        if (v.expiration_job)
-            v.expiration_job->cancel();
+            v.store_bucket->erase(v);
     }
     values.clear();
+    index.clear();
     total_size = 0;
     return {-tot_size, -num_values, 0, 0};
 }
 
 Storage::ExpireResult
-Storage::expire(const InfoHash& id, time_point now)
+Storage::expire(time_point now)
 {
     // expire listeners
     for (auto nl_it = listeners.begin(); nl_it != listeners.end();) {
@@ -316,16 +444,16 @@ Storage::expire(const InfoHash& id, time_point now)
     std::vector<Sp<Value>> ret;
     ret.reserve(std::distance(r, values.end()));
     ssize_t size_diff {0};
-    std::for_each(r, values.end(), [&](const ValueStorage& v) {
+    std::for_each(r, values.end(), [&](ValueStorage& v) {
         size_diff -= v.data->size();
         if (v.store_bucket)
-            v.store_bucket->erase(id, *v.data, v.expiration);
-        if (v.expiration_job)
-            v.expiration_job->cancel();
+            v.store_bucket->erase(v);
         ret.emplace_back(std::move(v.data));
     });
     total_size += size_diff;
     values.erase(r, values.end());
+    if (not ret.empty() and not index.empty())
+        reindex();
     return {size_diff, std::move(ret)};
 }
 
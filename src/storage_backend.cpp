@@ -0,0 +1,543 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "storage_backend.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+namespace dht {
+
+constexpr size_t LogStorageBackend::COMPACT_MIN_SIZE;
+
+/*
+ * Log layout: MAGIC, then records of
+ *   u32 body size, u32 checksum of the body, body
+ * the body starting with
+ *   u8 type, key, u64 value id
+ * followed for PUT by
+ *   i64 created, i64 expiration, u16 address size, address, packed value
+ * and for REFRESH by
+ *   i64 expiration
+ * Times are system times in milliseconds, in host byte order.
+ */
+static constexpr char MAGIC[8] {'O', 'D', 'H', 'T', 'L', 'O', 'G', '1'};
+static constexpr size_t RECORD_HEADER_SIZE {8};
+static constexpr size_t BODY_KEY_SIZE {1 + HASH_LEN + sizeof(Value::Id)};
+static constexpr size_t PUT_EXPIRATION_OFFSET {RECORD_HEADER_SIZE + BODY_KEY_SIZE + 8};
+static constexpr size_t PUT_MIN_SIZE {BODY_KEY_SIZE + 8 + 8 + 2};
+static constexpr size_t REFRESH_SIZE {BODY_KEY_SIZE + 8};
+static constexpr int64_t NO_EXPIRATION {std::numeric_limits<int64_t>::max()};
+/* The log is mapped beyond its end, so that appended records are read without remapping it */
+static constexpr size_t MAP_MIN_SIZE {16 * 1024 * 1024};
+/* Appended records are written together once they hold this many bytes */
+static constexpr size_t WRITE_BUFFER_SIZE {64 * 1024};
+
+enum class RecordType : uint8_t { Put = 1, Refresh, Erase };
+
+static uint32_t
+checksum(const uint8_t* data, size_t size)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+template<typename T>
+static T
+readInt(const uint8_t* p)
+{
+    T v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template<typename T>
+static void
+writeInt(std::vector<uint8_t>& b, T v)
+{
+    auto p = (const uint8_t*) &v;
+    b.insert(b.end(), p, p + sizeof(v));
+}
+
+static int64_t
+toSystemTime(time_point t)
+{
+    if (t == time_point::max())
+        return NO_EXPIRATION;
+    auto st = system_clock::now() + std::chrono::duration_cast<system_clock::duration>(t - clock::now());
+    return std::chrono::duration_cast<std::chrono::milliseconds>(st.time_since_epoch()).count();
+}
+
+static time_point
+fromSystemTime(int64_t t)
+{
+    if (t == NO_EXPIRATION)
+        return time_point::max();
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(system_clock::now().time_since_epoch()).count();
+    return clock::now() + std::chrono::milliseconds(t - now);
+}
+
+/* Cut the file at size, to drop a partially written record */
+static bool
+truncateFile(std::FILE* f, uint64_t size)
+{
+#ifndef _WIN32
+    return ::ftruncate(::fileno(f), size) == 0;
+#else
+    return ::_chsize_s(::_fileno(f), size) == 0;
+#endif
+}
+
+static void
+syncFile(std::FILE* f)
+{
+    if (std::fflush(f) != 0)
+        throw DhtException("Can't write storage log");
+#ifndef _WIN32
+    ::fsync(::fileno(f));
+#else
+    ::_commit(::_fileno(f));
+#endif
+}
+
+/**
+ * Read only mapping of the log.
+ * The mapping can be larger than the file: bytes appended to the file
+ * are readable in it after extend().
+ */
+class LogStorageBackend::MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path, [[maybe_unused]] size_t capacity = 0)
+    {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw DhtException("Can't open storage log " + path);
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 and st.st_size > 0) {
+            capacity_ = std::max(capacity, (size_t) st.st_size);
+            data = ::mmap(nullptr, capacity_, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED)
+            throw DhtException("Can't map storage log " + path);
+        data_ = (const uint8_t*) data;
+        size_ = st.st_size;
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (not file)
+            throw DhtException("Can't open storage log " + path);
+        buffer_.resize(file.tellg());
+        file.seekg(0);
+        file.read((char*) buffer_.data(), buffer_.size());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        capacity_ = size_;
+#endif
+    }
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (data_)
+            ::munmap((void*) data_, capacity_);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    /** Bytes of the file readable in the mapping */
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+
+    /** Make the first size bytes readable, the file being at least that large */
+    bool extend(size_t size)
+    {
+        if (size > capacity_)
+            return false;
+        size_ = std::max(size_, size);
+        return true;
+    }
+
+private:
+    const uint8_t* data_ {nullptr};
+    size_t size_ {0};
+    size_t capacity_ {0};
+#ifdef _WIN32
+    std::vector<uint8_t> buffer_;
+#endif
+};
+
+LogStorageBackend::LogStorageBackend(std::string path, size_t compact_min_size)
+    : path_(std::move(path))
+    , compact_min_size_(compact_min_size)
+{
+    open();
+    replay();
+}
+
+LogStorageBackend::~LogStorageBackend()
+{
+    if (file_) {
+        try {
+            writePending();
+            syncFile(file_);
+        } catch (const std::exception&) {
+        }
+        std::fclose(file_);
+    }
+}
+
+void
+LogStorageBackend::open()
+{
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (not file_)
+        throw DhtException("Can't open storage log " + path_);
+    // records are buffered by writePending(), that must know what reached the file
+    std::setvbuf(file_, nullptr, _IONBF, 0);
+    std::fseek(file_, 0, SEEK_END);
+    if (std::ftell(file_) == 0) {
+        if (std::fwrite(MAGIC, sizeof(MAGIC), 1, file_) != 1)
+            throw DhtException("Can't write storage log " + path_);
+        syncFile(file_);
+    }
+}
+
+void
+LogStorageBackend::replay()
+{
+    map_ = std::make_unique<MappedFile>(path_);
+    const auto* data = map_->data();
+    const auto size = map_->size();
+    if (size < sizeof(MAGIC) or std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+        throw DhtException("Not a storage log: " + path_);
+
+    // Returns false at the end of valid records
+    auto next = [&](size_t pos) {
+        if (pos + RECORD_HEADER_SIZE > size)
+            return false;
+        auto body_size = readInt<uint32_t>(data + pos);
+        const auto* body = data + pos + RECORD_HEADER_SIZE;
+        if (body_size < BODY_KEY_SIZE or body_size > size - pos - RECORD_HEADER_SIZE
+            or checksum(body, body_size) != readInt<uint32_t>(data + pos + 4))
+            return false;
+        ValueKey k {InfoHash(body + 1, HASH_LEN), readInt<Value::Id>(body + 1 + HASH_LEN)};
+        uint32_t record_size = RECORD_HEADER_SIZE + body_size;
+        switch ((RecordType) body[0]) {
+        case RecordType::Put: {
+            if (body_size < PUT_MIN_SIZE or PUT_MIN_SIZE + readInt<uint16_t>(body + PUT_MIN_SIZE - 2) > body_size)
+                return false;
+            Location loc {pos, record_size, readInt<int64_t>(body + BODY_KEY_SIZE + 8)};
+            auto it = index_.emplace(k, loc);
+            if (not it.second) {
+                dead_ += it.first->second.size;
+                it.first->second = loc;
+            }
+            break;
+        }
+        case RecordType::Refresh: {
+            if (body_size < REFRESH_SIZE)
+                return false;
+            auto it = index_.find(k);
+            if (it != index_.end())
+                it->second.expiration = readInt<int64_t>(body + BODY_KEY_SIZE);
+            dead_ += record_size;
+            break;
+        }
+        case RecordType::Erase: {
+            auto it = index_.find(k);
+            if (it != index_.end()) {
+                dead_ += it->second.size;
+                index_.erase(it);
+            }
+            dead_ += record_size;
+            break;
+        }
+        default:
+            return false;
+        }
+        return true;
+    };
+
+    size_t pos = sizeof(MAGIC);
+    while (next(pos))
+        pos += RECORD_HEADER_SIZE + readInt<uint32_t>(data + pos);
+    size_ = written_ = pos;
+
+    if (pos < size) {
+        // drop the partially written record
+        map_.reset();
+        std::fclose(file_);
+        file_ = nullptr;
+#ifndef _WIN32
+        int ret = ::truncate(path_.c_str(), pos);
+#else
+        int ret = -1;
+        if (auto f = std::fopen(path_.c_str(), "rb+")) {
+            ret = ::_chsize_s(::_fileno(f), pos);
+            std::fclose(f);
+        }
+#endif
+        if (ret != 0)
+            throw DhtException("Can't truncate storage log " + path_);
+        open();
+    }
+}
+
+void
+LogStorageBackend::append(const uint8_t* record, size_t size)
+{
+    if (not file_)
+        throw DhtException("Can't write storage log " + path_);
+    pending_.insert(pending_.end(), record, record + size);
+    size_ += size;
+}
+
+void
+LogStorageBackend::writePending(size_t min_size)
+{
+    if (pending_.empty() or pending_.size() < min_size)
+        return;
+    if (not file_)
+        throw DhtException("Can't write storage log " + path_);
+    if (std::fwrite(pending_.data(), 1, pending_.size(), file_) != pending_.size()) {
+        // Replay stops at the first invalid record: a partial record is cut,
+        // and the pending records are written again by the next call.
+        std::clearerr(file_);
+        if (not truncateFile(file_, written_)) {
+            // records appended after it would be lost
+            std::fclose(file_);
+            file_ = nullptr;
+        }
+        throw DhtException("Can't write storage log " + path_);
+    }
+    written_ += pending_.size();
+    pending_.clear();
+}
+
+const uint8_t*
+LogStorageBackend::map(uint64_t offset, size_t size)
+{
+    if (not map_ or offset + size > map_->size()) {
+        if (offset + size > written_)
+            writePending();
+        if (not map_ or not map_->extend(written_)) {
+            // the mapping grows geometrically
+            map_.reset();
+            map_ = std::make_unique<MappedFile>(path_, std::max(written_ * 2, MAP_MIN_SIZE));
+        }
+        if (offset + size > map_->size())
+            throw DhtException("Storage log is truncated: " + path_);
+    }
+    return map_->data() + offset;
+}
+
+/** Start a record in b, its header being written by endRecord */
+static void
+beginRecord(std::vector<uint8_t>& b, RecordType type, const InfoHash& key, Value::Id id)
+{
+    b.clear();
+    b.resize(RECORD_HEADER_SIZE);
+    b.emplace_back((uint8_t) type);
+    b.insert(b.end(), key.cbegin(), key.cend());
+    writeInt(b, id);
+}
+
+static void
+endRecord(std::vector<uint8_t>& b)
+{
+    uint32_t body_size = b.size() - RECORD_HEADER_SIZE;
+    uint32_t sum = checksum(b.data() + RECORD_HEADER_SIZE, body_size);
+    std::memcpy(b.data(), &body_size, sizeof(body_size));
+    std::memcpy(b.data() + 4, &sum, sizeof(sum));
+}
+
+void
+LogStorageBackend::put(
+    const InfoHash& key, const Value& value, time_point created, time_point expiration, const SockAddr& from)
+{
+    beginRecord(buffer_, RecordType::Put, key, value.id);
+    auto exp = toSystemTime(expiration);
+    writeInt(buffer_, toSystemTime(created));
+    writeInt(buffer_, exp);
+    writeInt(buffer_, (uint16_t) from.getLength());
+    if (from)
+        buffer_.insert(buffer_.end(), (const uint8_t*) from.get(), (const uint8_t*) from.get() + from.getLength());
+    auto packed = value.getPackedRef();
+    buffer_.insert(buffer_.end(), packed->begin(), packed->end());
+    endRecord(buffer_);
+
+    Location loc {size_, (uint32_t) buffer_.size(), exp};
+    append(buffer_.data(), buffer_.size());
+    auto it = index_.emplace(ValueKey {key, value.id}, loc);
+    if (not it.second) {
+        dead_ += it.first->second.size;
+        it.first->second = loc;
+    }
+    writePending(WRITE_BUFFER_SIZE);
+}
+
+void
+LogStorageBackend::refresh(const InfoHash& key, Value::Id id, time_point expiration)
+{
+    auto it = index_.find(ValueKey {key, id});
+    if (it == index_.end())
+        return;
+    auto exp = toSystemTime(expiration);
+    beginRecord(buffer_, RecordType::Refresh, key, id);
+    writeInt(buffer_, exp);
+    endRecord(buffer_);
+    append(buffer_.data(), buffer_.size());
+    it->second.expiration = exp;
+    dead_ += buffer_.size();
+    writePending(WRITE_BUFFER_SIZE);
+}
+
+void
+LogStorageBackend::erase(const InfoHash& key, Value::Id id)
+{
+    auto it = index_.find(ValueKey {key, id});
+    if (it == index_.end())
+        return;
+    beginRecord(buffer_, RecordType::Erase, key, id);
+    endRecord(buffer_);
+    append(buffer_.data(), buffer_.size());
+    dead_ += it->second.size + buffer_.size();
+    index_.erase(it);
+    writePending(WRITE_BUFFER_SIZE);
+}
+
+void
+LogStorageBackend::forEach(time_point now,
+                           const std::function<void(const ValueKey&, const Location&, const uint8_t*)>& cb)
+{
+    map(0, size_);
+    auto now_ms = toSystemTime(now);
+    for (const auto& v : index_)
+        if (v.second.expiration > now_ms)
+            cb(v.first, v.second, map_->data() + v.second.offset);
+}
+
+void
+LogStorageBackend::load(time_point now, const std::function<void(const StoredValue&)>& cb)
+{
+    forEach(now, [&](const ValueKey& k, const Location& loc, const uint8_t* record) {
+        const auto* body = record + RECORD_HEADER_SIZE;
+        auto addr_size = readInt<uint16_t>(body + PUT_MIN_SIZE - 2);
+        const auto* addr = body + PUT_MIN_SIZE;
+        const auto* packed = addr + addr_size;
+        cb(StoredValue {k.key,
+                        k.id,
+                        packed,
+                        (size_t) (record + loc.size - packed),
+                        fromSystemTime(readInt<int64_t>(body + BODY_KEY_SIZE)),
+                        fromSystemTime(loc.expiration),
+                        addr_size ? SockAddr((const sockaddr*) addr, addr_size) : SockAddr {}});
+    });
+}
+
+Blob
+LogStorageBackend::get(const InfoHash& key, Value::Id id)
+{
+    auto it = index_.find(ValueKey {key, id});
+    if (it == index_.end())
+        return {};
+    const auto* record = map(it->second.offset, it->second.size);
+    const auto* body = record + RECORD_HEADER_SIZE;
+    const auto* packed = body + PUT_MIN_SIZE + readInt<uint16_t>(body + PUT_MIN_SIZE - 2);
+    return {packed, record + it->second.size};
+}
+
+void
+LogStorageBackend::maintain(time_point now)
+{
+    auto now_ms = toSystemTime(now);
+    std::vector<ValueKey> expired;
+    for (const auto& v : index_)
+        if (v.second.expiration <= now_ms)
+            expired.emplace_back(v.first);
+    for (const auto& k : expired) {
+        auto it = index_.find(k);
+        dead_ += it->second.size;
+        index_.erase(it);
+    }
+    if (dead_ >= compact_min_size_ and dead_ * 2 >= size_)
+        compact(now);
+}
+
+void
+LogStorageBackend::compact(time_point now)
+{
+    if (not file_)
+        throw DhtException("Can't write storage log " + path_);
+    const auto tmp_path = path_ + ".compact";
+    auto out = std::fopen(tmp_path.c_str(), "wb");
+    if (not out)
+        throw DhtException("Can't open storage log " + tmp_path);
+    FlatHashMap<ValueKey, Location, ValueKeyHash> index(index_.size());
+    uint64_t pos = sizeof(MAGIC);
+    bool ok = std::fwrite(MAGIC, sizeof(MAGIC), 1, out) == 1;
+    try {
+        forEach(now, [&](const ValueKey& k, const Location& loc, const uint8_t* record) {
+            // refreshed expiration is written in the copied record
+            buffer_.assign(record, record + loc.size);
+            std::memcpy(buffer_.data() + PUT_EXPIRATION_OFFSET, &loc.expiration, sizeof(loc.expiration));
+            endRecord(buffer_);
+            ok = ok and std::fwrite(buffer_.data(), 1, buffer_.size(), out) == buffer_.size();
+            index.emplace(k, Location {pos, loc.size, loc.expiration});
+            pos += loc.size;
+        });
+        if (ok)
+            syncFile(out);
+    } catch (const std::exception&) {
+        ok = false;
+    }
+    std::fclose(out);
+    if (not ok) {
+        std::remove(tmp_path.c_str());
+        throw DhtException("Can't write storage log " + tmp_path);
+    }
+
+    map_.reset();
+    std::fclose(file_);
+    file_ = nullptr;
+#ifdef _WIN32
+    std::remove(path_.c_str());
+#endif
+    if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        open();
+        throw DhtException("Can't replace storage log " + path_);
+    }
+    open();
+    index_ = std::move(index);
+    size_ = written_ = pos;
+    dead_ = 0;
+}
+
+void
+LogStorageBackend::sync()
+{
+    if (not file_)
+        throw DhtException("Can't write storage log " + path_);
+    writePending();
+    syncFile(file_);
+}
+
+} // namespace dht
@@ -10,6 +10,10 @@
 #include "default_types.h"
 #include "securedht.h" // print certificate ID
 
+#include <array>
+#include <atomic>
+#include <mutex>
+
 #ifdef OPENDHT_JSONCPP
 #include "base64.h"
 #endif
@@ -82,6 +86,71 @@ ValueType::DEFAULT_STORE_POLICY(InfoHash, const std::shared_ptr<Value>& v, const
     return v->size() <= MAX_VALUE_SIZE;
 }
 
+static std::atomic<uint64_t> packedCacheHits {0};
+static std::atomic<uint64_t> packedCacheMisses {0};
+
+/* Locks of the packed encoding caches, shared by values */
+static std::array<std::mutex, 64> packedLocks;
+
+static std::mutex&
+packedLock(const Value* v)
+{
+    return packedLocks[((uintptr_t) v >> 4) % packedLocks.size()];
+}
+
+template<typename PackFunc>
+static std::shared_ptr<const Blob>
+getPackedCached(const Value* v, std::shared_ptr<const Blob>* cache, PackFunc&& pack)
+{
+    if (cache) {
+        std::lock_guard lk(packedLock(v));
+        if (*cache) {
+            packedCacheHits.fetch_add(1, std::memory_order_relaxed);
+            return *cache;
+        }
+    }
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pack(pk);
+    auto packed = std::make_shared<const Blob>(buffer.data(), buffer.data() + buffer.size());
+    if (cache) {
+        packedCacheMisses.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard lk(packedLock(v));
+        *cache = packed;
+    }
+    return packed;
+}
+
+std::shared_ptr<const Blob>
+Value::getPackedRef() const
+{
+    return getPackedCached(this, immutable_ ? &packed_ : nullptr, [this](msgpack::packer<msgpack::sbuffer>& pk) {
+        msgpack_pack(pk);
+    });
+}
+
+std::shared_ptr<const Blob>
+Value::getToSignRef() const
+{
+    return getPackedCached(this, immutable_ ? &packedToSign_ : nullptr, [this](msgpack::packer<msgpack::sbuffer>& pk) {
+        msgpack_pack_to_sign(pk);
+    });
+}
+
+void
+Value::invalidatePacked()
+{
+    std::lock_guard lk(packedLock(this));
+    packed_.reset();
+    packedToSign_.reset();
+}
+
+Value::PackedCacheStats
+Value::getPackedCacheStats()
+{
+    return {packedCacheHits.load(std::memory_order_relaxed), packedCacheMisses.load(std::memory_order_relaxed)};
+}
+
 size_t
 Value::size() const
 {
@@ -93,6 +162,7 @@ Value::msgpack_unpack(const msgpack::object& o)
 {
     if (o.type != msgpack::type::MAP or o.via.map.size < 2)
         throw msgpack::type_error();
+    invalidatePacked();
 
     if (auto rid = findMapValue(o, VALUE_KEY_ID)) {
         id = rid->as<Id>();
@@ -117,6 +187,7 @@ Value::msgpack_unpack(const msgpack::object& o)
 void
 Value::msgpack_unpack_body(const msgpack::object& o)
 {
+    invalidatePacked();
     owner = {};
     recipient = {};
     cypher.clear();
@@ -153,9 +224,7 @@ Value::msgpack_unpack_body(const msgpack::object& o)
                 seq = rseq->as<decltype(seq)>();
             else
                 throw msgpack::type_error();
-            crypto::PublicKey new_owner;
-            new_owner.msgpack_unpack(*rowner);
-            owner = std::make_shared<crypto::PublicKey>(std::move(new_owner));
+            owner = crypto::importPublicKey(*rowner);
             if (auto rrecipient = findMapValue(*rbody, VALUE_KEY_TO)) {
                 recipient = rrecipient->as<InfoHash>();
             }
@@ -254,7 +323,11 @@ Value::sign(const crypto::PrivateKey& key)
     if (isEncrypted())
         throw DhtException("Can't sign encrypted data.");
     owner = key.getSharedPublicKey();
-    signature = key.sign(getToSign());
+    invalidatePacked();
+    signature = key.sign(*getToSignRef());
+    // the signed part stays valid
+    std::lock_guard lk(packedLock(this));
+    packed_.reset();
 }
 
 Value
@@ -277,7 +350,7 @@ Value::checkSignature()
     if (!signatureChecked) {
         signatureChecked = true;
         if (isSigned()) {
-            signatureValid = owner and owner->checkSignature(getToSign(), signature);
+            signatureValid = owner and owner->checkSignature(*getToSignRef(), signature);
         } else {
             signatureValid = true;
         }
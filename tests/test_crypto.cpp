@@ -4,6 +4,10 @@
 #include "test_crypto.h"
 
 #include <opendht/crypto.h>
+#include <opendht/value.h>
+
+#include <chrono>
+#include <iostream>
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(CryptoTester);
@@ -59,6 +63,269 @@ CryptoTester::testSignatureEncryption()
     }
 }
 
+void
+CryptoTester::testSignatureCache()
+{
+    auto key = dht::crypto::PrivateKey::generate();
+    const auto& public_key = key.getPublicKey();
+    std::vector<uint8_t> data1 {5, 10};
+    std::vector<uint8_t> data2 {5, 10, 15};
+    auto signature1 = key.sign(data1);
+    auto signature2 = key.sign(data2);
+
+    auto stats = dht::crypto::getSignatureCacheStats();
+    CPPUNIT_ASSERT(public_key.checkSignature(data1, signature1));
+    // the same content is found from another instance of the key
+    dht::Blob packed;
+    public_key.pack(packed);
+    dht::crypto::PublicKey copy(packed);
+    CPPUNIT_ASSERT(copy.checkSignature(data1, signature1));
+    auto now = dht::crypto::getSignatureCacheStats();
+    CPPUNIT_ASSERT_EQUAL(stats.hits + 1, now.hits);
+    CPPUNIT_ASSERT_EQUAL(stats.misses + 1, now.misses);
+
+    // other data or invalid signatures are not found, and never cached
+    CPPUNIT_ASSERT(!public_key.checkSignature(data2, signature1));
+    CPPUNIT_ASSERT(!public_key.checkSignature(data2, signature1));
+    auto bad = signature1;
+    bad[7]++;
+    CPPUNIT_ASSERT(!public_key.checkSignature(data1, bad));
+    stats = now;
+    now = dht::crypto::getSignatureCacheStats();
+    CPPUNIT_ASSERT_EQUAL(stats.hits, now.hits);
+    CPPUNIT_ASSERT_EQUAL(stats.misses + 3, now.misses);
+    CPPUNIT_ASSERT_EQUAL(stats.size, now.size);
+
+    // least recently used entries are evicted, each shard keeping at most one
+    dht::crypto::setSignatureCacheSize(1);
+    CPPUNIT_ASSERT(dht::crypto::getSignatureCacheStats().size <= dht::crypto::SIGNATURE_CACHE_SHARDS);
+    for (uint8_t i = 0; i < 4 * dht::crypto::SIGNATURE_CACHE_SHARDS; i++) {
+        std::vector<uint8_t> data {i};
+        CPPUNIT_ASSERT(public_key.checkSignature(data, key.sign(data)));
+    }
+    CPPUNIT_ASSERT(dht::crypto::getSignatureCacheStats().size <= dht::crypto::SIGNATURE_CACHE_SHARDS);
+    CPPUNIT_ASSERT(public_key.checkSignature(data2, signature2));
+    stats = dht::crypto::getSignatureCacheStats();
+    CPPUNIT_ASSERT(public_key.checkSignature(data1, signature1));
+    CPPUNIT_ASSERT(public_key.checkSignature(data1, signature1));
+    now = dht::crypto::getSignatureCacheStats();
+    CPPUNIT_ASSERT_EQUAL(stats.hits + 1, now.hits);
+    CPPUNIT_ASSERT_EQUAL(stats.misses + 1, now.misses);
+    CPPUNIT_ASSERT(now.size <= dht::crypto::SIGNATURE_CACHE_SHARDS);
+
+    // disabled cache
+    dht::crypto::setSignatureCacheSize(0);
+    CPPUNIT_ASSERT(public_key.checkSignature(data1, signature1));
+    stats = dht::crypto::getSignatureCacheStats();
+    CPPUNIT_ASSERT_EQUAL(now.hits, stats.hits);
+    CPPUNIT_ASSERT_EQUAL(now.misses, stats.misses);
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, stats.size);
+    dht::crypto::setSignatureCacheSize(dht::crypto::SIGNATURE_CACHE_SIZE);
+}
+
+void
+CryptoTester::testBenchmarkSignatureCache()
+{
+    constexpr unsigned N {1000};
+    auto key = dht::crypto::PrivateKey::generate();
+    dht::Blob packed;
+    key.getPublicKey().pack(packed);
+    std::vector<uint8_t> data(1024, 10);
+    auto signature = key.sign(data);
+
+    // every check uses a new instance of the key, as for values received from the network
+    auto run = [&] {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < N; i++)
+            CPPUNIT_ASSERT(dht::crypto::PublicKey(packed).checkSignature(data, signature));
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / N;
+    };
+    dht::crypto::setSignatureCacheSize(0);
+    auto uncached = run();
+    dht::crypto::setSignatureCacheSize(dht::crypto::SIGNATURE_CACHE_SIZE);
+    auto cached = run();
+    std::cout << std::endl
+              << "signature check: " << uncached << " us without cache, " << cached << " us with cache" << std::endl;
+}
+
+void
+CryptoTester::testSignatureKeyTypes()
+{
+    std::vector<dht::crypto::PrivateKey> keys;
+    keys.emplace_back(dht::crypto::PrivateKey::generate(2048));
+    keys.emplace_back(dht::crypto::PrivateKey::generateEC());
+    keys.emplace_back(dht::crypto::PrivateKey::generateEd25519());
+    CPPUNIT_ASSERT_EQUAL(GNUTLS_PK_RSA, keys[0].getPublicKey().getAlgorithm());
+    CPPUNIT_ASSERT_EQUAL(GNUTLS_PK_ECDSA, keys[1].getPublicKey().getAlgorithm());
+    CPPUNIT_ASSERT_EQUAL(GNUTLS_PK_EDDSA_ED25519, keys[2].getPublicKey().getAlgorithm());
+
+    std::vector<uint8_t> data1 {5, 10};
+    std::vector<uint8_t> data2(64 * 1024, 10);
+    for (const auto& key : keys) {
+        auto signature = key.sign(data2);
+        // keys are identified by their type once serialized
+        dht::Blob packed;
+        key.getPublicKey().pack(packed);
+        dht::crypto::PublicKey public_key(packed);
+        CPPUNIT_ASSERT(public_key.checkSignature(data2, signature));
+        CPPUNIT_ASSERT(!public_key.checkSignature(data1, signature));
+        auto restored = dht::crypto::PrivateKey(key.serialize());
+        CPPUNIT_ASSERT(public_key.checkSignature(data1, restored.sign(data1)));
+
+        // signatures of other keys are invalid
+        for (const auto& other : keys) {
+            if (&other == &key)
+                continue;
+            bool valid = other.getPublicKey().checkSignature(data2, signature);
+            CPPUNIT_ASSERT(!valid);
+        }
+    }
+
+    // values signed by an Ed25519 key
+    auto value = std::make_shared<dht::Value>(data1);
+    value->sign(keys[2]);
+    dht::Value signed_value(dht::unpackMsg(value->getPacked()).get());
+    CPPUNIT_ASSERT(signed_value.owner);
+    CPPUNIT_ASSERT(signed_value.checkSignature());
+    dht::Value altered(dht::unpackMsg(value->getPacked()).get());
+    altered.data = data2;
+    CPPUNIT_ASSERT(!altered.checkSignature());
+}
+
+void
+CryptoTester::testEd25519Identity()
+{
+    auto ca = dht::crypto::generateIdentity("ca", {}, 2048, true);
+    auto account = dht::crypto::generateEd25519Identity("account", ca, true);
+    auto device = dht::crypto::generateEd25519Identity("device", account);
+    CPPUNIT_ASSERT_EQUAL(GNUTLS_PK_EDDSA_ED25519, account.second->getPublicKey().getAlgorithm());
+    CPPUNIT_ASSERT(device.second->issuer);
+    CPPUNIT_ASSERT(device.second->issuer->getId() == account.second->getId());
+
+    dht::crypto::TrustList list;
+    list.add(*ca.second);
+    auto v = list.verify(*account.second);
+    CPPUNIT_ASSERT_MESSAGE(v.toString(), v);
+    v = list.verify(*device.second);
+    CPPUNIT_ASSERT_MESSAGE(v.toString(), v);
+
+    // reloaded certificates keep their key
+    dht::crypto::Certificate cert(device.second->getPacked());
+    std::vector<uint8_t> data {5, 10};
+    CPPUNIT_ASSERT(cert.getPublicKey().checkSignature(data, device.first->sign(data)));
+
+    auto self = dht::crypto::generateEd25519Identity();
+    CPPUNIT_ASSERT(self.second->isCA());
+}
+
+void
+CryptoTester::testBenchmarkSignatureKeyTypes()
+{
+    constexpr unsigned N {200};
+    std::vector<std::pair<std::string, dht::crypto::PrivateKey>> keys;
+    keys.emplace_back("RSA-4096", dht::crypto::PrivateKey::generate());
+    keys.emplace_back("ECDSA", dht::crypto::PrivateKey::generateEC());
+    keys.emplace_back("Ed25519", dht::crypto::PrivateKey::generateEd25519());
+    std::vector<uint8_t> data(1024, 10);
+
+    dht::crypto::setSignatureCacheSize(0);
+    std::cout << std::endl;
+    for (const auto& k : keys) {
+        const auto& key = k.second;
+        dht::Blob packed;
+        key.getPublicKey().pack(packed);
+        dht::crypto::PublicKey public_key(packed);
+        std::vector<dht::Blob> signatures;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < N; i++)
+            signatures.emplace_back(key.sign(data));
+        auto signed_time = std::chrono::steady_clock::now();
+        for (const auto& signature : signatures)
+            CPPUNIT_ASSERT(public_key.checkSignature(data, signature));
+        auto end = std::chrono::steady_clock::now();
+
+        dht::Value value(data);
+        value.sign(key);
+        std::cout << k.first << ": sign " << std::chrono::duration<double, std::micro>(signed_time - start).count() / N
+                  << " us, check " << std::chrono::duration<double, std::micro>(end - signed_time).count() / N
+                  << " us, signature " << signatures.front().size() << " bytes, public key " << packed.size()
+                  << " bytes, signed value of " << data.size() << " bytes: " << value.getPacked().size() << " bytes"
+                  << std::endl;
+    }
+    dht::crypto::setSignatureCacheSize(dht::crypto::SIGNATURE_CACHE_SIZE);
+}
+
+void
+CryptoTester::testSealedEncryption()
+{
+    auto key = dht::crypto::PrivateKey::generateEd25519();
+    dht::Blob packed;
+    key.getPublicKey().pack(packed);
+    dht::crypto::PublicKey public_key(packed);
+
+    for (size_t size : {1, 32, 1024, 64 * 1024}) {
+        std::vector<uint8_t> data(size, 10);
+        auto encrypted = public_key.encrypt(data);
+        // ephemeral key, IV and tag
+        CPPUNIT_ASSERT_EQUAL(size + 32 + 12 + 16, encrypted.size());
+        CPPUNIT_ASSERT(key.decrypt(encrypted) == data);
+        // every encryption uses another ephemeral key
+        CPPUNIT_ASSERT(public_key.encrypt(data) != encrypted);
+
+        encrypted[size % 32] ^= 1;
+        CPPUNIT_ASSERT_THROW(key.decrypt(encrypted), dht::crypto::DecryptError);
+        encrypted[size % 32] ^= 1;
+        encrypted.back() ^= 1;
+        CPPUNIT_ASSERT_THROW(key.decrypt(encrypted), dht::crypto::DecryptError);
+    }
+
+    std::vector<uint8_t> data {5, 10};
+    auto other = dht::crypto::PrivateKey::generateEd25519();
+    CPPUNIT_ASSERT_THROW(other.decrypt(public_key.encrypt(data)), dht::crypto::DecryptError);
+    auto ec = dht::crypto::PrivateKey::generateEC();
+    CPPUNIT_ASSERT_THROW(ec.getPublicKey().encrypt(data), dht::crypto::CryptoException);
+
+    // values between RSA and Ed25519 identities
+    auto rsa = dht::crypto::PrivateKey::generate(2048);
+    for (const auto& keys : {std::make_pair(&rsa, &key), std::make_pair(&key, &rsa)}) {
+        dht::Value value(data);
+        auto encrypted = value.encrypt(*keys.first, keys.second->getPublicKey());
+        dht::Value received(dht::unpackMsg(encrypted.getPacked()).get());
+        auto decrypted = received.decrypt(*keys.second);
+        CPPUNIT_ASSERT(decrypted);
+        CPPUNIT_ASSERT(decrypted->data == data);
+        CPPUNIT_ASSERT(decrypted->owner->getId() == keys.first->getPublicKey().getId());
+    }
+}
+
+void
+CryptoTester::testBenchmarkEncryption()
+{
+    constexpr unsigned N {200};
+    std::vector<std::pair<std::string, dht::crypto::PrivateKey>> keys;
+    keys.emplace_back("RSA-4096", dht::crypto::PrivateKey::generate());
+    keys.emplace_back("Ed25519", dht::crypto::PrivateKey::generateEd25519());
+    std::vector<uint8_t> data(1024, 10);
+
+    std::cout << std::endl;
+    for (const auto& k : keys) {
+        const auto& key = k.second;
+        const auto& public_key = key.getPublicKey();
+        std::vector<dht::Blob> encrypted;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < N; i++)
+            encrypted.emplace_back(public_key.encrypt(data));
+        auto encrypted_time = std::chrono::steady_clock::now();
+        for (const auto& e : encrypted)
+            CPPUNIT_ASSERT(key.decrypt(e) == data);
+        auto end = std::chrono::steady_clock::now();
+        std::cout << k.first << ", 1 KiB values: "
+                  << N / std::chrono::duration<double>(encrypted_time - start).count() << " encryptions/s, "
+                  << N / std::chrono::duration<double>(end - encrypted_time).count() << " decryptions/s, "
+                  << encrypted.front().size() << " bytes" << std::endl;
+    }
+}
+
 void
 CryptoTester::testCertificateRevocation()
 {
@@ -12,6 +12,10 @@ class CryptoTester : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(CryptoTester);
     CPPUNIT_TEST(testSignatureEncryption);
+    CPPUNIT_TEST(testSignatureCache);
+    CPPUNIT_TEST(testSignatureKeyTypes);
+    CPPUNIT_TEST(testEd25519Identity);
+    CPPUNIT_TEST(testSealedEncryption);
     CPPUNIT_TEST(testCertificateRevocation);
     CPPUNIT_TEST(testCertificateRequest);
     CPPUNIT_TEST(testCertificateSerialNumber);
@@ -21,6 +25,11 @@ class CryptoTester : public CppUnit::TestFixture
     CPPUNIT_TEST(testOaep);
     CPPUNIT_TEST(testWebPushEncryption);
     CPPUNIT_TEST(testWebPushRFC8291);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkSignatureCache);
+    CPPUNIT_TEST(testBenchmarkSignatureKeyTypes);
+    CPPUNIT_TEST(testBenchmarkEncryption);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -36,6 +45,22 @@ public:
      * Test data signature, encryption and decryption
      */
     void testSignatureEncryption();
+    /**
+     * Test the process-wide cache of verified signatures
+     */
+    void testSignatureCache();
+    void testBenchmarkSignatureCache();
+    /**
+     * Test signatures of RSA, ECDSA and Ed25519 keys
+     */
+    void testSignatureKeyTypes();
+    void testEd25519Identity();
+    void testBenchmarkSignatureKeyTypes();
+    /**
+     * Test encryption to Ed25519 keys
+     */
+    void testSealedEncryption();
+    void testBenchmarkEncryption();
     /**
      * Test certificate generation, validation and revocation
      */
@@ -4,6 +4,9 @@
 #include "test_dhtrunner.h"
 
 #include <opendht/thread_pool.h>
+#ifdef OPENDHT_IO_URING
+#include <opendht/io_uring_socket.h>
+#endif
 
 #include <chrono>
 #include <future>
@@ -87,6 +90,248 @@ DhtRunnerTester::testGetPut()
     auto vals = getFutureValue(node1.get(key));
     CPPUNIT_ASSERT(not vals.empty());
     CPPUNIT_ASSERT(vals.front()->data == val_data);
+
+    auto info = node1.getNodeInfo();
+    CPPUNIT_ASSERT(info.rx_queue_max > 0);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 0, info.rx_queue_dropped);
+}
+
+void
+DhtRunnerTester::testGetPutBatchedSocket()
+{
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+    config.socket_config.tx_batch = true;
+
+    auto runNode = [&](dht::DhtRunner& node) {
+        dht::SockAddr bind4, bind6;
+        bind4.setFamily(AF_INET);
+        bind6.setFamily(AF_INET6);
+        dht::DhtRunner::Context context;
+        auto sock = new dht::net::UdpSocket(bind4, bind6, {}, config.socket_config);
+        context.sock.reset(sock);
+        node.run(config, std::move(context));
+        return sock;
+    };
+
+    dht::DhtRunner node_a, node_b;
+    auto sock_a = runNode(node_a);
+    runNode(node_b);
+    node_b.bootstrap("127.0.0.1", std::to_string(node_a.getBoundPort()));
+
+    auto key = dht::InfoHash::get("batched");
+    dht::Value val {"hey"};
+    auto val_data = val.data;
+    std::promise<bool> p;
+    auto future = p.get_future();
+    node_b.put(key, std::move(val), [&](bool ok) { p.set_value(ok); });
+    CPPUNIT_ASSERT(getFutureValue(std::move(future)));
+    auto vals = getFutureValue(node_a.get(key));
+    CPPUNIT_ASSERT(not vals.empty());
+    CPPUNIT_ASSERT(vals.front()->data == val_data);
+
+    auto stats = sock_a->getStats();
+    CPPUNIT_ASSERT(stats.rx_packets > 0);
+    CPPUNIT_ASSERT(stats.rx_batches > 0 and stats.rx_batches <= stats.rx_packets);
+    CPPUNIT_ASSERT(stats.tx_packets > 0);
+    CPPUNIT_ASSERT(stats.tx_batches > 0 and stats.tx_batches <= stats.tx_packets);
+
+    node_a.join();
+    node_b.join();
+}
+
+void
+DhtRunnerTester::testGetPutReusePort()
+{
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+    config.socket_config.reuseport_sockets = 4;
+    config.socket_config.pin_rx_threads = true;
+
+    dht::SockAddr bind4, bind6;
+    bind4.setFamily(AF_INET);
+    bind6.setFamily(AF_INET6);
+    dht::DhtRunner::Context context;
+    auto sock = new dht::net::UdpSocket(bind4, bind6, {}, config.socket_config);
+    context.sock.reset(sock);
+
+    dht::DhtRunner node_a;
+    node_a.run(config, std::move(context));
+    node1.bootstrap("127.0.0.1", std::to_string(node_a.getBoundPort()));
+    node2.bootstrap("127.0.0.1", std::to_string(node_a.getBoundPort()));
+
+    auto key = dht::InfoHash::get("reuseport");
+    dht::Value val {"hey"};
+    auto val_data = val.data;
+    std::promise<bool> p;
+    auto future = p.get_future();
+    node2.put(key, std::move(val), [&](bool ok) { p.set_value(ok); });
+    CPPUNIT_ASSERT(getFutureValue(std::move(future)));
+    auto vals = getFutureValue(node_a.get(key));
+    CPPUNIT_ASSERT(not vals.empty());
+    CPPUNIT_ASSERT(vals.front()->data == val_data);
+
+    auto stats = sock->getStats();
+    CPPUNIT_ASSERT(not stats.sockets.empty());
+    uint64_t packets = 0;
+    for (const auto& s : stats.sockets)
+        packets += s.packets;
+    CPPUNIT_ASSERT(packets > 0);
+    CPPUNIT_ASSERT(stats.rx_packets > 0);
+
+    node_a.join();
+}
+
+void
+DhtRunnerTester::testSharded()
+{
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+    config.shards = 4;
+
+    dht::DhtRunner node_a;
+    node_a.run(0, config);
+    node1.bootstrap("127.0.0.1", std::to_string(node_a.getBoundPort()));
+    node2.bootstrap("127.0.0.1", std::to_string(node_a.getBoundPort()));
+
+    // listen on the sharded node
+    auto listenKey = dht::InfoHash::get("sharded_listen");
+    std::promise<bool> listened;
+    auto token = node_a.listen(listenKey, [&](const std::vector<std::shared_ptr<dht::Value>>&) {
+        listened.set_value(true);
+        return false;
+    });
+
+    // keys are handled by every core of node_a
+    constexpr unsigned N = 32;
+    std::vector<std::future<bool>> puts;
+    for (unsigned i = 0; i < N; i++) {
+        auto p = std::make_shared<std::promise<bool>>();
+        puts.emplace_back(p->get_future());
+        node2.put(dht::InfoHash::get("sharded" + std::to_string(i)), dht::Value {"hey"}, [p](bool ok) {
+            p->set_value(ok);
+        });
+    }
+    for (auto& f : puts)
+        CPPUNIT_ASSERT(getFutureValue(std::move(f)));
+    for (unsigned i = 0; i < N; i++) {
+        auto key = dht::InfoHash::get("sharded" + std::to_string(i));
+        auto vals = getFutureValue(node_a.get(key));
+        CPPUNIT_ASSERT(not vals.empty());
+        CPPUNIT_ASSERT(vals.front()->data == dht::Value {"hey"}.data);
+    }
+
+    // values put by the sharded node
+    auto key = dht::InfoHash::get("sharded_put");
+    std::promise<bool> p;
+    auto future = p.get_future();
+    node_a.put(key, dht::Value {"hello"}, [&](bool ok) { p.set_value(ok); });
+    CPPUNIT_ASSERT(getFutureValue(std::move(future)));
+    auto vals = getFutureValue(node1.get(key));
+    CPPUNIT_ASSERT(not vals.empty());
+
+    node1.put(listenKey, dht::Value {"listen"});
+    CPPUNIT_ASSERT(getFutureValue(listened.get_future()));
+    node_a.cancelListen(listenKey, std::move(token));
+
+    auto info = node_a.getNodeInfo();
+    CPPUNIT_ASSERT(info.storage_values >= N);
+    node_a.join();
+}
+
+#ifdef OPENDHT_IO_URING
+void
+DhtRunnerTester::testGetPutIoUring()
+{
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+
+    dht::SockAddr bind4, bind6;
+    bind4.setFamily(AF_INET);
+    bind6.setFamily(AF_INET6);
+    std::unique_ptr<dht::net::IoUringUdpSocket> sock_a, sock_b;
+    try {
+        sock_a = std::make_unique<dht::net::IoUringUdpSocket>(bind4, bind6);
+        sock_b = std::make_unique<dht::net::IoUringUdpSocket>(bind4, bind6);
+    } catch (const dht::DhtException&) {
+        // io_uring not supported by the running kernel
+        return;
+    }
+    auto stats_a = sock_a.get();
+
+    dht::DhtRunner node_a, node_b;
+    dht::DhtRunner::Context context_a, context_b;
+    context_a.sock = std::move(sock_a);
+    context_b.sock = std::move(sock_b);
+    node_a.run(config, std::move(context_a));
+    node_b.run(config, std::move(context_b));
+    node_b.bootstrap("127.0.0.1", std::to_string(node_a.getBoundPort()));
+
+    auto key = dht::InfoHash::get("io_uring");
+    dht::Value val {"hey"};
+    auto val_data = val.data;
+    std::promise<bool> p;
+    auto future = p.get_future();
+    node_b.put(key, std::move(val), [&](bool ok) { p.set_value(ok); });
+    CPPUNIT_ASSERT(getFutureValue(std::move(future)));
+    auto vals = getFutureValue(node_a.get(key));
+    CPPUNIT_ASSERT(not vals.empty());
+    CPPUNIT_ASSERT(vals.front()->data == val_data);
+
+    auto stats = stats_a->getStats();
+    CPPUNIT_ASSERT(stats.rx_packets > 0);
+    CPPUNIT_ASSERT(stats.tx_packets > 0);
+
+    node_a.join();
+    node_b.join();
+}
+#endif
+
+void
+DhtRunnerTester::testLargeDatagram()
+{
+    auto check = [](dht::net::DatagramSocket& rx, dht::net::DatagramSocket& tx) {
+        std::promise<dht::Blob> p;
+        auto future = p.get_future();
+        bool received = false;
+        rx.setOnReceive([&](dht::net::PacketList&& pkts) {
+            if (not received) {
+                received = true;
+                auto& data = pkts.front().data;
+                p.set_value(dht::Blob(data.data(), data.data() + data.size()));
+            }
+            return std::move(pkts);
+        });
+        dht::Blob data(3 * dht::net::PACKET_BUFFER_SIZE);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (uint8_t) i;
+        auto dest = rx.getBound(AF_INET);
+        dest.setLoopback();
+        CPPUNIT_ASSERT_EQUAL(0, tx.sendTo(dest, data.data(), data.size(), false));
+        tx.flush();
+        CPPUNIT_ASSERT(getFutureValue(std::move(future)) == data);
+        rx.setOnReceive({});
+    };
+
+    dht::SockAddr bind4, bind6;
+    bind4.setFamily(AF_INET);
+    bind6.setFamily(AF_INET6);
+    dht::net::UdpSocket rx(bind4, bind6), tx(bind4, bind6);
+    check(rx, tx);
+#ifdef OPENDHT_IO_URING
+    std::unique_ptr<dht::net::IoUringUdpSocket> rx_uring;
+    try {
+        rx_uring = std::make_unique<dht::net::IoUringUdpSocket>(bind4, bind6);
+    } catch (const dht::DhtException&) {
+        // io_uring not supported by the running kernel
+        return;
+    }
+    check(*rx_uring, tx);
+#endif
 }
 
 void
@@ -463,6 +708,45 @@ DhtRunnerTester::testShutdownCompletesWithPendingPut()
     clientNode.join();
 }
 
+void
+DhtRunnerTester::testPutGetMany()
+{
+    constexpr unsigned N {32};
+    std::vector<std::pair<dht::InfoHash, std::shared_ptr<dht::Value>>> values;
+    std::vector<dht::InfoHash> keys;
+    for (unsigned i = 0; i < N; i++) {
+        auto key = dht::InfoHash::get("many" + std::to_string(i));
+        keys.emplace_back(key);
+        values.emplace_back(key, std::make_shared<dht::Value>("value" + std::to_string(i)));
+    }
+    // two values at the same key
+    values.emplace_back(keys[0], std::make_shared<dht::Value>("other"));
+
+    std::atomic_uint calls {0};
+    std::promise<bool> p;
+    auto future = p.get_future();
+    node2.putMany(values, [&](bool ok) {
+        calls++;
+        p.set_value(ok);
+    });
+    CPPUNIT_ASSERT(getFutureValue(std::move(future)));
+    CPPUNIT_ASSERT_EQUAL(1u, calls.load());
+
+    auto found = getFutureValue(node1.getMany(keys));
+    CPPUNIT_ASSERT_EQUAL((size_t) N, found.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, found[keys[0]].size());
+    for (unsigned i = 1; i < N; i++) {
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, found[keys[i]].size());
+        CPPUNIT_ASSERT(found[keys[i]].front()->data == values[i].second->data);
+    }
+
+    // empty batches complete at once
+    std::promise<bool> pempty;
+    auto fempty = pempty.get_future();
+    node2.putMany({}, [&](bool ok) { pempty.set_value(ok); });
+    CPPUNIT_ASSERT(getFutureValue(std::move(fempty)));
+}
+
 void
 DhtRunnerTester::testListen()
 {
@@ -721,6 +1005,92 @@ DhtRunnerTester::testIdOps()
     CPPUNIT_ASSERT(cv.wait_for(lk, 20s, [&] { return valueCountEdit == 4u; }));
 }
 
+void
+DhtRunnerTester::testAsyncChecks()
+{
+    constexpr unsigned N {64};
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+    config.dht_config.async_checks = true;
+    config.dht_config.max_pending_checks = 8;
+
+    dht::DhtRunner node_a, node_b;
+    config.dht_config.id = dht::crypto::generateIdentity();
+    node_a.run(0, config);
+    config.dht_config.id = dht::crypto::generateIdentity();
+    node_b.run(0, config);
+    auto bound = node_a.getBound();
+    if (bound.isUnspecified())
+        bound.setLoopback();
+    node_b.bootstrap(bound);
+
+    auto key = dht::InfoHash::get("async_checks");
+    std::vector<std::future<bool>> puts;
+    for (unsigned i = 0; i < N; i++) {
+        auto p = std::make_shared<std::promise<bool>>();
+        puts.emplace_back(p->get_future());
+        node_a.putSigned(key, std::make_shared<dht::Value>("signed" + std::to_string(i)), [p](bool ok) {
+            p->set_value(ok);
+        });
+    }
+    auto p = std::make_shared<std::promise<bool>>();
+    puts.emplace_back(p->get_future());
+    node_a.putEncrypted(key, node_b.getPublicKey(), std::make_shared<dht::Value>("encrypted"), [p](bool ok) {
+        p->set_value(ok);
+    });
+    for (auto& f : puts)
+        CPPUNIT_ASSERT(getFutureValue(std::move(f)));
+
+    // values are delivered before the operation completes
+    std::mutex mutex;
+    std::vector<std::shared_ptr<dht::Value>> values;
+    bool doneAfterValues {false};
+    std::promise<bool> done;
+    node_b.get(
+        key,
+        [&](const std::vector<std::shared_ptr<dht::Value>>& vals) {
+            std::lock_guard lk(mutex);
+            values.insert(values.end(), vals.begin(), vals.end());
+            return true;
+        },
+        [&](bool ok) {
+            std::lock_guard lk(mutex);
+            doneAfterValues = values.size() == N + 1;
+            done.set_value(ok);
+        });
+    CPPUNIT_ASSERT(getFutureValue(done.get_future()));
+    CPPUNIT_ASSERT(doneAfterValues);
+    unsigned encrypted = 0;
+    for (const auto& v : values) {
+        CPPUNIT_ASSERT(v->owner and v->owner->getLongId() == node_a.getPublicKey()->getLongId());
+        encrypted += v->recipient == node_b.getPublicKey()->getId();
+    }
+    CPPUNIT_ASSERT_EQUAL(1u, encrypted);
+
+    auto info = node_b.getNodeInfo();
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, info.check_queue_depth);
+    CPPUNIT_ASSERT(info.check_queue_max > 0);
+    CPPUNIT_ASSERT(info.checked_values > 0);
+    CPPUNIT_ASSERT(info.check_latency_max >= info.check_latency_mean);
+
+    // a callback returning false stops delivering values
+    unsigned calls = 0;
+    std::promise<bool> stopped;
+    node_b.get(
+        key,
+        [&](const std::vector<std::shared_ptr<dht::Value>>&) {
+            calls++;
+            return false;
+        },
+        [&](bool) { stopped.set_value(true); });
+    CPPUNIT_ASSERT(getFutureValue(stopped.get_future()));
+    CPPUNIT_ASSERT_EQUAL(1u, calls);
+
+    node_a.join();
+    node_b.join();
+}
+
 void
 DhtRunnerTester::testListenLotOfBytes()
 {
@@ -15,11 +15,20 @@ class DhtRunnerTester : public CppUnit::TestFixture
     CPPUNIT_TEST_SUITE(DhtRunnerTester);
     CPPUNIT_TEST(testConstructors);
     CPPUNIT_TEST(testGetPut);
+    CPPUNIT_TEST(testGetPutBatchedSocket);
+    CPPUNIT_TEST(testGetPutReusePort);
+    CPPUNIT_TEST(testSharded);
+#ifdef OPENDHT_IO_URING
+    CPPUNIT_TEST(testGetPutIoUring);
+#endif
+    CPPUNIT_TEST(testLargeDatagram);
     CPPUNIT_TEST(testPutDuplicate);
     CPPUNIT_TEST(testPutOverride);
+    CPPUNIT_TEST(testPutGetMany);
     CPPUNIT_TEST(testListen);
     CPPUNIT_TEST(testListenLotOfBytes);
     CPPUNIT_TEST(testIdOps);
+    CPPUNIT_TEST(testAsyncChecks);
     CPPUNIT_TEST(testImportValuesPreservesRemoteQuota);
     CPPUNIT_TEST(testImportValuesPreservesStoredExpiration);
     CPPUNIT_TEST(testBootstrapSetsConnectingState);
@@ -48,6 +57,28 @@ public:
      * Test get and put methods
      */
     void testGetPut();
+    /**
+     * Test get and put over sockets batching datagrams
+     */
+    void testGetPutBatchedSocket();
+    /**
+     * Test get and put with several receiving sockets per family
+     */
+    void testGetPutReusePort();
+    /**
+     * Test get, put and listen with a node running several cores
+     */
+    void testSharded();
+#ifdef OPENDHT_IO_URING
+    /**
+     * Test get and put over io_uring sockets
+     */
+    void testGetPutIoUring();
+#endif
+    /**
+     * Test receiving datagrams larger than the pooled buffers
+     */
+    void testLargeDatagram();
     /**
      * Test get and multiple put
      */
@@ -56,6 +87,10 @@ public:
      * Test get and multiple put with changing value
      */
     void testPutOverride();
+    /**
+     * Test putMany and getMany
+     */
+    void testPutGetMany();
     /**
      * Test listen method
      */
@@ -64,6 +99,10 @@ public:
      * Test methods requiring a node identity
      */
     void testIdOps();
+    /**
+     * Test checking signed and encrypted values on the thread pool
+     */
+    void testAsyncChecks();
     void testImportValuesPreservesRemoteQuota();
     void testImportValuesPreservesStoredExpiration();
     void testBootstrapSetsConnectingState();
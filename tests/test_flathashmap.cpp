@@ -0,0 +1,230 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "test_flathashmap.h"
+
+#include "opendht/flat_hash_map.h"
+#include "opendht/sockaddr.h"
+#include "opendht/object_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(FlatHashMapTester);
+
+using namespace dht;
+
+void
+FlatHashMapTester::setUp()
+{}
+
+void
+FlatHashMapTester::testInsertFind()
+{
+    FlatHashMap<uint32_t, std::string> map;
+    CPPUNIT_ASSERT(map.empty());
+    CPPUNIT_ASSERT(map.find(42) == map.end());
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        auto r = map.emplace(i, std::to_string(i));
+        CPPUNIT_ASSERT(r.second);
+        CPPUNIT_ASSERT_EQUAL(i, r.first->first);
+    }
+    CPPUNIT_ASSERT_EQUAL((size_t) 1000, map.size());
+    CPPUNIT_ASSERT(map.size() * 4 <= map.capacity() * 3);
+
+    // existing entries are not replaced
+    auto r = map.emplace(7u, "seven");
+    CPPUNIT_ASSERT(not r.second);
+    CPPUNIT_ASSERT_EQUAL(std::string("7"), r.first->second);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        auto it = map.find(i);
+        CPPUNIT_ASSERT(it != map.end());
+        CPPUNIT_ASSERT_EQUAL(std::to_string(i), it->second);
+    }
+    CPPUNIT_ASSERT(not map.count(1000));
+
+    map[1000] = "1000";
+    CPPUNIT_ASSERT_EQUAL(std::string("1000"), map.find(1000)->second);
+    CPPUNIT_ASSERT(map[1001].empty());
+    CPPUNIT_ASSERT_EQUAL((size_t) 1002, map.size());
+
+    size_t n = 0;
+    for (const auto& e : map) {
+        CPPUNIT_ASSERT(e.first <= 1001);
+        n++;
+    }
+    CPPUNIT_ASSERT_EQUAL(map.size(), n);
+
+    auto moved = std::move(map);
+    CPPUNIT_ASSERT_EQUAL((size_t) 1002, moved.size());
+    CPPUNIT_ASSERT(map.empty());
+    CPPUNIT_ASSERT(map.find(5) == map.end());
+    map.emplace(5u, "five");
+    CPPUNIT_ASSERT_EQUAL(std::string("five"), map.find(5)->second);
+
+    moved.clear();
+    CPPUNIT_ASSERT(moved.empty());
+    CPPUNIT_ASSERT(moved.begin() == moved.end());
+}
+
+void
+FlatHashMapTester::testErase()
+{
+    FlatHashMap<uint32_t, uint32_t> map;
+    for (uint32_t i = 0; i < 100; i++)
+        map.emplace(i, i * 2);
+    for (uint32_t i = 0; i < 100; i += 2)
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, map.erase(i));
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, map.erase(0));
+    CPPUNIT_ASSERT_EQUAL((size_t) 50, map.size());
+    for (uint32_t i = 0; i < 100; i++) {
+        auto it = map.find(i);
+        if (i % 2)
+            CPPUNIT_ASSERT(it != map.end() and it->second == i * 2);
+        else
+            CPPUNIT_ASSERT(it == map.end());
+    }
+
+    map.erase(map.find(1));
+    CPPUNIT_ASSERT(not map.count(1));
+    CPPUNIT_ASSERT_EQUAL((size_t) 49, map.size());
+}
+
+void
+FlatHashMapTester::testRandomized()
+{
+    std::mt19937 rd(42);
+    // small key range to have many collisions and probe sequences to shift back
+    std::uniform_int_distribution<uint32_t> keys(0, 2000);
+    FlatHashMap<uint32_t, uint32_t> map;
+    std::map<uint32_t, uint32_t> ref;
+    for (unsigned i = 0; i < 100000; i++) {
+        auto k = keys(rd);
+        if (rd() % 3) {
+            auto v = (uint32_t) rd();
+            CPPUNIT_ASSERT_EQUAL(ref.emplace(k, v).second, map.emplace(k, v).second);
+        } else
+            CPPUNIT_ASSERT_EQUAL(ref.erase(k), map.erase(k));
+    }
+    CPPUNIT_ASSERT_EQUAL(ref.size(), map.size());
+    for (const auto& e : ref) {
+        auto it = map.find(e.first);
+        CPPUNIT_ASSERT(it != map.end());
+        CPPUNIT_ASSERT_EQUAL(e.second, it->second);
+    }
+}
+
+static SockAddr
+makeAddr(uint32_t ip, in_port_t port)
+{
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(ip);
+    sin.sin_port = htons(port);
+    return SockAddr((const sockaddr*) &sin, sizeof(sin));
+}
+
+void
+FlatHashMapTester::testSockAddrKey()
+{
+    std::hash<SockAddr> hash;
+    CPPUNIT_ASSERT_EQUAL(hash(makeAddr(0x0A000001, 4222)), hash(makeAddr(0x0A000001, 4222)));
+    CPPUNIT_ASSERT(hash(makeAddr(0x0A000001, 4222)) != hash(makeAddr(0x0A000001, 4223)));
+    CPPUNIT_ASSERT(hash(makeAddr(0x0A000001, 4222)) != hash(makeAddr(0x0A000002, 4222)));
+
+    FlatHashMap<SockAddr, unsigned> map;
+    for (uint32_t i = 0; i < 256; i++)
+        map.emplace(makeAddr(0x0A000000 + i, 4222), i);
+    for (uint32_t i = 0; i < 256; i++) {
+        CPPUNIT_ASSERT_EQUAL(i, map.find(makeAddr(0x0A000000 + i, 4222))->second);
+        CPPUNIT_ASSERT(not map.count(makeAddr(0x0A000000 + i, 4223)));
+    }
+}
+
+void
+FlatHashMapTester::testPoolAllocator()
+{
+    struct Obj
+    {
+        uint64_t a, b;
+        std::string s;
+    };
+    PoolAllocator<Obj> alloc;
+    auto o = std::allocate_shared<Obj>(alloc, Obj {1, 2, "test"});
+    const void* p = o.get();
+    o.reset();
+    // memory of the released object is reused
+    o = std::allocate_shared<Obj>(alloc, Obj {3, 4, "test"});
+    CPPUNIT_ASSERT_EQUAL(p, (const void*) o.get());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 3, o->a);
+
+    // released by another thread
+    std::thread([o = std::move(o)]() mutable { o.reset(); }).join();
+    std::vector<std::shared_ptr<Obj>> objs;
+    for (unsigned i = 0; i < 2 * PoolAllocator<Obj>::CAPACITY; i++)
+        objs.emplace_back(std::allocate_shared<Obj>(alloc, Obj {i, i, {}}));
+    for (unsigned i = 0; i < objs.size(); i++)
+        CPPUNIT_ASSERT_EQUAL((uint64_t) i, objs[i]->a);
+    objs.clear();
+}
+
+template<typename Map>
+static double
+benchReplyMatching(const std::vector<uint32_t>& tids, const std::vector<uint32_t>& replies, size_t& matched)
+{
+    auto start = std::chrono::steady_clock::now();
+    Map requests;
+    for (auto tid : tids)
+        requests.emplace(tid, std::make_shared<uint32_t>(tid));
+    for (auto tid : replies) {
+        auto it = requests.find(tid);
+        if (it != requests.end()) {
+            matched += *it->second == tid;
+            requests.erase(it);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (tids.size() + replies.size());
+}
+
+void
+FlatHashMapTester::testBenchmarkReplyMatching()
+{
+    constexpr size_t OUTSTANDING {100 * 1000};
+    std::mt19937 rd(42);
+    std::vector<uint32_t> tids;
+    tids.reserve(OUTSTANDING);
+    // transaction ids are sequential per node
+    for (uint32_t node = 0; node < OUTSTANDING / 100; node++) {
+        uint32_t tid = rd();
+        for (unsigned i = 0; i < 100; i++)
+            tids.emplace_back(tid++);
+    }
+    std::vector<uint32_t> replies(tids);
+    std::shuffle(replies.begin(), replies.end(), rd);
+    // some replies are unexpected
+    for (unsigned i = 0; i < OUTSTANDING / 10; i++)
+        replies[i] = rd();
+
+    size_t matched_map {0}, matched_flat {0};
+    auto map_ns = benchReplyMatching<std::map<uint32_t, std::shared_ptr<uint32_t>>>(tids, replies, matched_map);
+    auto flat_ns = benchReplyMatching<FlatHashMap<uint32_t, std::shared_ptr<uint32_t>>>(tids, replies, matched_flat);
+    std::cout << std::endl
+              << "Reply matching, " << OUTSTANDING << " outstanding requests: std::map " << map_ns
+              << " ns/op, FlatHashMap " << flat_ns << " ns/op" << std::endl;
+    CPPUNIT_ASSERT_EQUAL(matched_map, matched_flat);
+    CPPUNIT_ASSERT(matched_flat >= OUTSTANDING * 9 / 10);
+}
+
+void
+FlatHashMapTester::tearDown()
+{}
+
+} // namespace test
@@ -0,0 +1,48 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class FlatHashMapTester : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(FlatHashMapTester);
+    CPPUNIT_TEST(testInsertFind);
+    CPPUNIT_TEST(testErase);
+    CPPUNIT_TEST(testRandomized);
+    CPPUNIT_TEST(testSockAddrKey);
+    CPPUNIT_TEST(testPoolAllocator);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkReplyMatching);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    void testInsertFind();
+    void testErase();
+    /**
+     * Compare with std::map under random insertions and erasures
+     */
+    void testRandomized();
+    void testSockAddrKey();
+    void testPoolAllocator();
+    /**
+     * Compare with std::map matching replies to 100k outstanding requests
+     */
+    void testBenchmarkReplyMatching();
+};
+
+} // namespace test
@@ -4,9 +4,12 @@
 #include "test_infohash.h"
 
 // std
+#include <chrono>
 #include <iostream>
+#include <random>
 #include <string>
 #include <string_view>
+#include <unordered_set>
 
 // opendht
 #include "opendht/infohash.h"
@@ -157,6 +160,178 @@ InfoHashTester::testHex()
     CPPUNIT_ASSERT_EQUAL(std::string_view(TEST_HASH_STR), hexArrayView);
 }
 
+/* Byte by byte versions of the primitives */
+template<size_t N>
+static int
+scalarXorCmp(const dht::Hash<N>& h, const dht::Hash<N>& id1, const dht::Hash<N>& id2)
+{
+    for (unsigned i = 0; i < N; i++) {
+        if (id1[i] == id2[i])
+            continue;
+        return (uint8_t) (id1[i] ^ h[i]) < (uint8_t) (id2[i] ^ h[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+template<size_t N>
+static unsigned
+scalarCommonBits(const dht::Hash<N>& id1, const dht::Hash<N>& id2)
+{
+    for (unsigned i = 0; i < 8 * N; i++)
+        if (id1.getBit(i) != id2.getBit(i))
+            return i;
+    return 8 * N;
+}
+
+template<size_t N>
+static std::string
+scalarHex(const dht::Hash<N>& h)
+{
+    static constexpr const char* digits = "0123456789abcdef";
+    std::string ret;
+    for (size_t i = 0; i < N; i++) {
+        ret += digits[h[i] >> 4];
+        ret += digits[h[i] & 0x0F];
+    }
+    return ret;
+}
+
+template<size_t N>
+static dht::Hash<N>
+randomHash(std::mt19937_64& rd)
+{
+    std::uniform_int_distribution<unsigned> rand_byte(0, 255);
+    dht::Hash<N> h;
+    for (auto& b : h)
+        b = rand_byte(rd);
+    return h;
+}
+
+/* Compare hashes sharing a prefix of every length */
+template<size_t N>
+static void
+checkVectorized(std::mt19937_64& rd)
+{
+    using H = dht::Hash<N>;
+    for (unsigned prefix = 0; prefix <= 8 * N; prefix++) {
+        for (unsigned t = 0; t < 4; t++) {
+            auto target = randomHash<N>(rd);
+            auto id1 = randomHash<N>(rd);
+            auto id2 = id1;
+            if (prefix < 8 * N) {
+                // id2 differs from id1 at bit prefix, and randomly after
+                auto other = randomHash<N>(rd);
+                for (unsigned b = prefix + 1; b < 8 * N; b++)
+                    id2.setBit(b, other.getBit(b));
+                id2.setBit(prefix, not id1.getBit(prefix));
+            }
+            CPPUNIT_ASSERT_EQUAL(prefix, H::commonBits(id1, id2));
+            CPPUNIT_ASSERT_EQUAL(scalarCommonBits(id1, id2), H::commonBits(id1, id2));
+            CPPUNIT_ASSERT_EQUAL(scalarXorCmp(target, id1, id2), target.xorCmp(id1, id2));
+            CPPUNIT_ASSERT_EQUAL(scalarXorCmp(target, id2, id1), target.xorCmp(id2, id1));
+            CPPUNIT_ASSERT_EQUAL(scalarHex(id2), id2.toString());
+            CPPUNIT_ASSERT_EQUAL(scalarHex(id2), dht::toHex(id2.data(), id2.size()));
+            CPPUNIT_ASSERT(H(id2.toString()) == id2);
+        }
+    }
+}
+
+void
+InfoHashTester::testVectorized()
+{
+    std::mt19937_64 rd(20);
+    checkVectorized<5>(rd);
+    checkVectorized<20>(rd);
+    checkVectorized<32>(rd);
+    checkVectorized<36>(rd);
+    checkVectorized<64>(rd);
+}
+
+void
+InfoHashTester::testStdHash()
+{
+    constexpr size_t COUNT {100 * 1000};
+    std::mt19937_64 rd(21);
+    std::hash<dht::InfoHash> hasher;
+    std::unordered_set<size_t> hashes;
+    std::unordered_set<dht::InfoHash> ids;
+    size_t lowBits[256] {};
+    for (size_t i = 0; i < COUNT; i++) {
+        auto id = dht::InfoHash::getRandom(rd);
+        CPPUNIT_ASSERT_EQUAL(hasher(id), hasher(dht::InfoHash(id)));
+        hashes.emplace(hasher(id));
+        ids.emplace(id);
+        lowBits[hasher(id) & 0xFF]++;
+    }
+    CPPUNIT_ASSERT_EQUAL(COUNT, ids.size());
+    CPPUNIT_ASSERT(hashes.size() > COUNT - 10);
+    // low bits, used by unordered containers, are evenly spread
+    for (auto n : lowBits)
+        CPPUNIT_ASSERT(n > COUNT / 256 / 2 and n < COUNT / 256 * 2);
+
+    // ids differing by a single bit, as chosen by a peer, don't collide
+    hashes.clear();
+    auto base = dht::InfoHash::getRandom(rd);
+    for (unsigned b = 0; b < 8 * HASH_LEN; b++) {
+        auto id = base;
+        id.setBit(b, not id.getBit(b));
+        hashes.emplace(hasher(id));
+    }
+    CPPUNIT_ASSERT_EQUAL((size_t) 8 * HASH_LEN, hashes.size());
+
+    // value ids sharing their low bits, as chosen by a peer, are spread as well
+    dht::detail::SeededHash idHasher;
+    size_t idLowBits[256] {};
+    for (uint64_t i = 0; i < COUNT; i++)
+        idLowBits[idHasher(i << 40) & 0xFF]++;
+    for (auto n : idLowBits)
+        CPPUNIT_ASSERT(n > COUNT / 256 / 2 and n < COUNT / 256 * 2);
+}
+
+void
+InfoHashTester::testBenchmarkPrimitives()
+{
+    constexpr size_t COUNT {4096};
+    constexpr unsigned ROUNDS {256};
+    std::mt19937_64 rd(22);
+    // ids of a neighbourhood: sharing their first bytes, as when sorting nodes close to a target
+    auto target = dht::InfoHash::getRandom(rd);
+    std::vector<dht::InfoHash> ids;
+    for (size_t i = 0; i < COUNT; i++) {
+        auto id = dht::InfoHash::getRandom(rd);
+        std::copy_n(target.cbegin(), i % 12, id.begin());
+        ids.emplace_back(id);
+    }
+
+    size_t acc = 0;
+    auto time = [&](auto&& op) {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < ROUNDS; r++)
+            for (size_t i = 0; i < COUNT; i++)
+                acc += op(ids[i], ids[(i + r + 1) % COUNT]);
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+               / (COUNT * ROUNDS);
+    };
+    auto xorScalar = time([&](const auto& a, const auto& b) { return scalarXorCmp(target, a, b) + 1; });
+    auto xorCmp = time([&](const auto& a, const auto& b) { return target.xorCmp(a, b) + 1; });
+    auto commonScalar = time([&](const auto& a, const auto& b) {
+        unsigned i = 0;
+        while (i < HASH_LEN and a[i] == b[i])
+            i++;
+        return i;
+    });
+    auto common = time([&](const auto& a, const auto& b) { return dht::InfoHash::commonBits(a, b); });
+    auto hexScalar = time([&](const auto& a, const auto&) { return scalarHex(a).size(); });
+    auto hex = time([&](const auto& a, const auto&) { return a.to_view().size(); });
+    std::hash<dht::InfoHash> hasher;
+    auto hash = time([&](const auto& a, const auto&) { return hasher(a); });
+    CPPUNIT_ASSERT(acc > 0);
+    std::cout << std::endl
+              << "InfoHash (ns/op): xorCmp " << xorScalar << " byte by byte, " << xorCmp << " vectorized; commonBits "
+              << commonScalar << " byte by byte, " << common << " vectorized; hex " << hexScalar << " byte by byte, "
+              << hex << " vectorized; std::hash " << hash << std::endl;
+}
+
 void
 InfoHashTester::tearDown()
 {}
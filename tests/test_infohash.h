@@ -17,6 +17,11 @@ class InfoHashTester : public CppUnit::TestFixture
     CPPUNIT_TEST(testCommonBits);
     CPPUNIT_TEST(testXorCmp);
     CPPUNIT_TEST(testHex);
+    CPPUNIT_TEST(testVectorized);
+    CPPUNIT_TEST(testStdHash);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkPrimitives);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -53,6 +58,15 @@ public:
      * Test hex conversion
      */
     void testHex();
+    /**
+     * Test vectorized primitives against byte by byte versions
+     */
+    void testVectorized();
+    /**
+     * Test std::hash specialisation
+     */
+    void testStdHash();
+    void testBenchmarkPrimitives();
 };
 
 } // namespace test
@@ -0,0 +1,135 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "test_lrucache.h"
+
+#include "opendht/lru_cache.h"
+
+#include <algorithm>
+#include <list>
+#include <random>
+#include <string>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(LruCacheTester);
+
+using namespace dht;
+
+void
+LruCacheTester::setUp()
+{}
+
+void
+LruCacheTester::testEviction()
+{
+    LruCache<uint32_t, std::string> cache(3);
+    CPPUNIT_ASSERT(cache.empty());
+    CPPUNIT_ASSERT(not cache.get(1));
+
+    for (uint32_t i = 0; i < 3; i++)
+        CPPUNIT_ASSERT_EQUAL(std::to_string(i), *cache.put(i, std::to_string(i)));
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, cache.size());
+
+    // 0 is used again: 1 is the least recently used
+    CPPUNIT_ASSERT_EQUAL(std::string("0"), *cache.get(0));
+    cache.put(3, "3");
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, cache.size());
+    CPPUNIT_ASSERT(not cache.contains(1));
+    CPPUNIT_ASSERT(cache.contains(0) and cache.contains(2) and cache.contains(3));
+
+    // peek doesn't change the order of use
+    CPPUNIT_ASSERT_EQUAL(std::string("2"), *cache.peek(2));
+    cache.put(4, "4");
+    CPPUNIT_ASSERT(not cache.contains(2));
+
+    // replacing an entry uses it
+    cache.put(0, "zero");
+    cache.put(5, "5");
+    CPPUNIT_ASSERT(not cache.contains(3));
+    CPPUNIT_ASSERT_EQUAL(std::string("zero"), *cache.get(0));
+
+    std::vector<uint32_t> order;
+    cache.forEach([&](uint32_t k, const std::string&) { order.emplace_back(k); });
+    CPPUNIT_ASSERT((order == std::vector<uint32_t> {0, 5, 4}));
+
+    CPPUNIT_ASSERT(cache.erase(5));
+    CPPUNIT_ASSERT(not cache.erase(5));
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, cache.size());
+    cache.clear();
+    CPPUNIT_ASSERT(cache.empty());
+    CPPUNIT_ASSERT(not cache.get(0));
+}
+
+void
+LruCacheTester::testCapacity()
+{
+    LruCache<uint32_t, uint32_t> cache(100);
+    for (uint32_t i = 0; i < 100; i++)
+        cache.put(i, i);
+    cache.setCapacity(10);
+    CPPUNIT_ASSERT_EQUAL((size_t) 10, cache.size());
+    for (uint32_t i = 90; i < 100; i++)
+        CPPUNIT_ASSERT(cache.contains(i));
+
+    // a cache of capacity 0 holds nothing
+    cache.setCapacity(0);
+    CPPUNIT_ASSERT(cache.empty());
+    CPPUNIT_ASSERT(not cache.put(1, 1));
+    CPPUNIT_ASSERT(cache.empty());
+}
+
+void
+LruCacheTester::testRandomized()
+{
+    constexpr size_t CAPACITY {64};
+    LruCache<uint32_t, uint32_t> cache(CAPACITY);
+    // reference: most recently used first
+    std::list<std::pair<uint32_t, uint32_t>> ref;
+    auto refFind = [&](uint32_t k) {
+        return std::find_if(ref.begin(), ref.end(), [&](const auto& e) { return e.first == k; });
+    };
+
+    std::mt19937 rd(42);
+    std::uniform_int_distribution<uint32_t> keyDist(0, 4 * CAPACITY);
+    for (unsigned i = 0; i < 100000; i++) {
+        auto k = keyDist(rd);
+        auto it = refFind(k);
+        bool found = it != ref.end();
+        switch (rd() % 3) {
+        case 0: {
+            auto v = cache.get(k);
+            CPPUNIT_ASSERT_EQUAL(found, (bool) v);
+            if (v) {
+                CPPUNIT_ASSERT_EQUAL(it->second, *v);
+                ref.splice(ref.begin(), ref, it);
+            }
+            break;
+        }
+        case 1:
+            cache.put(k, i);
+            if (found)
+                ref.erase(it);
+            ref.emplace_front(k, i);
+            if (ref.size() > CAPACITY)
+                ref.pop_back();
+            break;
+        default:
+            CPPUNIT_ASSERT_EQUAL(found, cache.erase(k));
+            if (found)
+                ref.erase(it);
+        }
+        CPPUNIT_ASSERT_EQUAL(ref.size(), cache.size());
+    }
+    auto it = ref.begin();
+    cache.forEach([&](uint32_t k, uint32_t v) {
+        CPPUNIT_ASSERT_EQUAL(it->first, k);
+        CPPUNIT_ASSERT_EQUAL(it->second, v);
+        ++it;
+    });
+}
+
+void
+LruCacheTester::tearDown()
+{}
+
+} // namespace test
@@ -0,0 +1,37 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class LruCacheTester : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(LruCacheTester);
+    CPPUNIT_TEST(testEviction);
+    CPPUNIT_TEST(testCapacity);
+    CPPUNIT_TEST(testRandomized);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    void testEviction();
+    void testCapacity();
+    /**
+     * Compare with a reference implementation under random accesses
+     */
+    void testRandomized();
+};
+
+} // namespace test
@@ -27,7 +27,10 @@ NetworkEngineTester::testDisabledOnMsvc()
 #else
 
 #include <any>
+#include <iostream>
 #include <mutex>
+#include <set>
+#include <thread>
 
 #ifdef _WIN32
 #ifdef opendht_EXPORTS
@@ -56,6 +59,7 @@ NetworkEngineTester::testDisabledOnMsvc()
 #elif defined(__GNUC__)
 #pragma GCC diagnostic pop
 #endif
+#include "opendht/securedht.h"
 
 #include "../src/parsed_message.h"
 #include "../src/search.h"
@@ -197,6 +201,109 @@ makeListenPacketBlob(const InfoHash& id, const InfoHash& hash, Tid tid, Tid sock
     return {buffer.data(), buffer.data() + buffer.size()};
 }
 
+static Blob
+makePingReplyPacketBlob(const InfoHash& id, Tid tid)
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+    pk.pack_map(3);
+    pk.pack(KEY_R);
+    pk.pack_map(1);
+    pk.pack(KEY_REQ_ID);
+    pk.pack(id);
+    pk.pack(KEY_TID);
+    pk.pack(tid);
+    pk.pack(KEY_Y);
+    pk.pack(KEY_R);
+
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+static Blob
+makePingPacketBlob(const InfoHash& id, Tid tid)
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+    pk.pack_map(4);
+    pk.pack(KEY_A);
+    pk.pack_map(1);
+    pk.pack(KEY_REQ_ID);
+    pk.pack(id);
+    pk.pack(KEY_Q);
+    pk.pack(QUERY_PING);
+    pk.pack(KEY_TID);
+    pk.pack(tid);
+    pk.pack(KEY_Y);
+    pk.pack(KEY_Q);
+
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+static Blob
+makePutPacketBlob(const InfoHash& id, const InfoHash& hash, Tid tid, const Value& value)
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+    pk.pack_map(4);
+    pk.pack(KEY_A);
+    pk.pack_map(4);
+    pk.pack(KEY_REQ_ID);
+    pk.pack(id);
+    pk.pack(KEY_REQ_H);
+    pk.pack(hash);
+    pk.pack(KEY_REQ_VALUES);
+    pk.pack_array(1);
+    pk.pack(value);
+    pk.pack(KEY_REQ_TOKEN);
+    packToken(pk, Blob(32, 1));
+    pk.pack(KEY_Q);
+    pk.pack(QUERY_PUT);
+    pk.pack(KEY_TID);
+    pk.pack(tid);
+    pk.pack(KEY_Y);
+    pk.pack(KEY_Q);
+
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+static Blob
+makeGetPacketBlob(const InfoHash& id, const InfoHash& hash, Tid tid, const Query& query = {})
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+
+    pk.pack_map(4);
+    pk.pack(KEY_A);
+    pk.pack_map(3);
+    pk.pack(KEY_REQ_ID);
+    pk.pack(id);
+    pk.pack(KEY_REQ_H);
+    pk.pack(hash);
+    pk.pack(KEY_REQ_QUERY);
+    pk.pack(query);
+    pk.pack(KEY_Q);
+    pk.pack(QUERY_GET);
+    pk.pack(KEY_TID);
+    pk.pack(tid);
+    pk.pack(KEY_Y);
+    pk.pack(KEY_Q);
+
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+static ReceivedPacket
+makeReceivedPacket(const Blob& data, const SockAddr& from)
+{
+    ReceivedPacket pkt;
+    pkt.data.assign(data.data(), data.data() + data.size());
+    pkt.from = from;
+    pkt.received = clock::now();
+    return pkt;
+}
+
 static SockAddr
 makeIPv4(const char* ip, in_port_t port)
 {
@@ -212,11 +319,12 @@ makeEngine(std::unique_ptr<TestDatagramSocket>&& socket,
            Scheduler& scheduler,
            InfoHash& myid,
            std::mt19937_64& rd,
-           int& onNewNodeCalls)
+           int& onNewNodeCalls,
+           const net::NetworkConfig& config = {})
 {
     return net::NetworkEngine(
         myid,
-        {},
+        config,
         std::move(socket),
         {},
         rd,
@@ -546,6 +654,1153 @@ NetworkEngineTester::testUnauthorizedListenFlushClearsListenState()
     CPPUNIT_ASSERT(!listenStatusIt->second.refresh);
 }
 
+void
+NetworkEngineTester::testAdaptiveRequestTimeout()
+{
+    Scheduler scheduler;
+    std::mt19937_64 rd(7);
+    InfoHash myid = InfoHash::getRandom(rd);
+    InfoHash remoteId = InfoHash::getRandom(rd);
+    int onNewNodeCalls = 0;
+    auto socket = std::make_unique<TestDatagramSocket>();
+    auto* socketPtr = socket.get();
+    auto engine = makeEngine(std::move(socket), scheduler, myid, rd, onNewNodeCalls);
+
+    auto from = makeIPv4("127.0.0.2", 5007);
+    auto node = engine.insertNode(remoteId, from);
+    CPPUNIT_ASSERT(node);
+    CPPUNIT_ASSERT(node->getRto() == Node::MAX_RESPONSE_TIME);
+
+    node->rttSample(100ms);
+    CPPUNIT_ASSERT(node->getSrtt() == 100ms);
+    CPPUNIT_ASSERT(node->getRttVar() == 50ms);
+    CPPUNIT_ASSERT(node->getRto() == 300ms);
+
+    // the first attempt waits for the node retransmission timeout
+    bool done = false;
+    auto start = scheduler.time();
+    auto req = engine.sendPing(node, [&](const net::Request&, net::RequestAnswer&&) { done = true; }, {});
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, socketPtr->sends.size());
+    scheduler.syncTime(start + 299ms);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, socketPtr->sends.size());
+    scheduler.syncTime(start + 300ms);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, socketPtr->sends.size());
+    CPPUNIT_ASSERT(not done);
+
+    // replies to retransmitted requests are not measured
+    auto packet = makePingReplyPacketBlob(remoteId, req->getTid());
+    engine.processMessage(packet.data(), packet.size(), from);
+    CPPUNIT_ASSERT(done);
+    CPPUNIT_ASSERT(node->getSrtt() == 100ms);
+
+    done = false;
+    start = scheduler.time();
+    req = engine.sendPing(node, [&](const net::Request&, net::RequestAnswer&&) { done = true; }, {});
+    scheduler.syncTime(start + 20ms);
+    packet = makePingReplyPacketBlob(remoteId, req->getTid());
+    engine.processMessage(packet.data(), packet.size(), from);
+    CPPUNIT_ASSERT(done);
+    CPPUNIT_ASSERT(node->getSrtt() == 90ms);
+    CPPUNIT_ASSERT(node->getRttVar() == 57500us);
+
+    // fast nodes are bounded by the minimum timeout
+    for (unsigned i = 0; i < 100; i++)
+        node->rttSample(1ms);
+    CPPUNIT_ASSERT(node->getRto() == Node::MIN_RTO);
+
+    // without reply, the node expires after the last attempt, but no sooner than the minimum time
+    auto sends = socketPtr->sends.size();
+    start = scheduler.time();
+    engine.sendPing(node, {}, {});
+    auto runUntil = [&](duration d) {
+        for (auto t = scheduler.time(); t < start + d; t += 10ms) {
+            scheduler.syncTime(t);
+            scheduler.run();
+        }
+        scheduler.syncTime(start + d);
+        scheduler.run();
+    };
+    runUntil(4900ms);
+    CPPUNIT_ASSERT_EQUAL(sends + 3, socketPtr->sends.size());
+    CPPUNIT_ASSERT(not node->isExpired());
+    runUntil(5s);
+    CPPUNIT_ASSERT_EQUAL(sends + 3, socketPtr->sends.size());
+    CPPUNIT_ASSERT(node->isExpired());
+}
+
+static Sp<Value>
+makeStoredValue(Value::Id id, size_t size = 16)
+{
+    auto v = std::make_shared<Value>(std::string(size, 'x'));
+    v->id = id;
+    return v;
+}
+
+void
+NetworkEngineTester::testBatchedValueExpiration()
+{
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    auto rd = std::make_unique<std::mt19937_64>(8);
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::move(rd));
+    auto& scheduler = localDht.scheduler;
+    auto now = scheduler.syncTime();
+
+    auto keyA = InfoHash::get("a");
+    auto keyB = InfoHash::get("b");
+    auto addr = makeIPv4("127.0.0.2", 5008);
+    auto exp = now + 1min;
+    CPPUNIT_ASSERT(localDht.storageStore(keyA, makeStoredValue(1), now, addr, false, exp));
+    CPPUNIT_ASSERT(localDht.storageStore(keyA, makeStoredValue(2), now, addr, false, exp + 1ms));
+    CPPUNIT_ASSERT(localDht.storageStore(keyB, makeStoredValue(3), now, addr, false, exp + 2ms));
+    CPPUNIT_ASSERT(localDht.storageStore(keyB, makeStoredValue(4), now, addr, false, exp + 5min));
+    CPPUNIT_ASSERT(localDht.storageStore(keyB, makeStoredValue(5), now, {}, true));
+    CPPUNIT_ASSERT_EQUAL((size_t) 5, localDht.total_values);
+    // at most one slice for values expiring together, and none for permanent values
+    CPPUNIT_ASSERT(localDht.storage_expirations.size() <= 3);
+
+    scheduler.syncTime(exp + Dht::EXPIRATION_SLICE + 2ms);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, localDht.total_values);
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, localDht.store.at(keyA).valueCount());
+    CPPUNIT_ASSERT(localDht.store.at(keyB).getById(4));
+
+    // refreshed values expire later
+    CPPUNIT_ASSERT(localDht.storageRefresh(keyB, 4));
+    scheduler.syncTime(exp + 5min + Dht::EXPIRATION_SLICE);
+    scheduler.run();
+    CPPUNIT_ASSERT(localDht.store.at(keyB).getById(4));
+    scheduler.syncTime(exp + 12min);
+    scheduler.run();
+    CPPUNIT_ASSERT(not localDht.store.at(keyB).getById(4));
+    CPPUNIT_ASSERT(localDht.store.at(keyB).getById(5));
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.total_values);
+    CPPUNIT_ASSERT(localDht.storage_expirations.empty());
+}
+
+void
+NetworkEngineTester::testStorageQuotaOrder()
+{
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    auto rd = std::make_unique<std::mt19937_64>(9);
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::move(rd));
+    auto now = localDht.scheduler.syncTime();
+
+    auto addr = makeIPv4("127.0.0.2", 5009);
+    std::vector<InfoHash> keys;
+    for (unsigned i = 0; i < 8; i++)
+        keys.emplace_back(InfoHash::get("key" + std::to_string(i)));
+    // many values under few keys: storages reallocate and move their values
+    for (unsigned i = 0; i < 200; i++)
+        CPPUNIT_ASSERT(localDht.storageStore(keys[i % keys.size()],
+                                             makeStoredValue(i + 1),
+                                             now,
+                                             addr,
+                                             false,
+                                             now + std::chrono::seconds(1 + (i * 37) % 200)));
+    auto& bucket = localDht.store_quota.at(addr);
+    CPPUNIT_ASSERT_EQUAL((size_t) 200, bucket.valueCount());
+    CPPUNIT_ASSERT_EQUAL((size_t) 200 * 16, bucket.size());
+
+    // values are evicted in expiration order
+    auto previous = time_point::min();
+    for (unsigned i = 0; i < 100; i++) {
+        auto oldest = bucket.getOldest();
+        auto& st = localDht.store.at(oldest.first);
+        const ValueStorage* vs = nullptr;
+        for (const auto& v : st.getValues())
+            if (v.data->id == oldest.second)
+                vs = &v;
+        CPPUNIT_ASSERT(vs);
+        CPPUNIT_ASSERT(vs->expiration >= previous);
+        previous = vs->expiration;
+        CPPUNIT_ASSERT(st.remove(oldest.second));
+    }
+    CPPUNIT_ASSERT_EQUAL((size_t) 100, bucket.valueCount());
+
+    // refreshing moves values to the end
+    auto oldest = bucket.getOldest();
+    CPPUNIT_ASSERT(localDht.storageRefresh(oldest.first, oldest.second));
+    CPPUNIT_ASSERT(bucket.getOldest() != oldest);
+
+    for (const auto& key : keys)
+        localDht.store.at(key).clear();
+    CPPUNIT_ASSERT(bucket.empty());
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, bucket.size());
+}
+
+void
+NetworkEngineTester::testBenchmarkValueExpiration()
+{
+    constexpr size_t VALUES {200 * 1000};
+    constexpr size_t KEYS {1000};
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.max_store_size = -1;
+    auto rd = std::make_unique<std::mt19937_64>(10);
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::move(rd));
+    auto& scheduler = localDht.scheduler;
+    auto start = scheduler.syncTime();
+
+    std::vector<InfoHash> keys;
+    for (size_t i = 0; i < KEYS; i++)
+        keys.emplace_back(InfoHash::get("key" + std::to_string(i)));
+    std::mt19937_64 vrd(10);
+    std::uniform_int_distribution<int64_t> expiration(1, 10 * 60 * 1000);
+    std::vector<Sp<Value>> values;
+    for (size_t i = 0; i < VALUES; i++)
+        values.emplace_back(makeStoredValue(i + 1));
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < VALUES; i++)
+        localDht.storageStore(keys[i % KEYS],
+                              values[i],
+                              start,
+                              makeIPv4("127.0.0.2", 5010 + i % 16),
+                              false,
+                              start + std::chrono::milliseconds(expiration(vrd)));
+    auto t1 = std::chrono::steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL(VALUES, localDht.total_values);
+    auto jobs = localDht.storage_expirations.size();
+    for (auto now = start; now <= start + 11min; now += 100ms) {
+        scheduler.syncTime(now);
+        scheduler.run();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, localDht.total_values);
+
+    std::cout << std::endl
+              << VALUES << " stored values: store " << std::chrono::duration<double, std::nano>(t1 - t0).count() / VALUES
+              << " ns/value, expire " << std::chrono::duration<double, std::nano>(t2 - t1).count() / VALUES
+              << " ns/value, " << jobs << " expiration jobs, " << sizeof(ValueStorage) << " bytes per ValueStorage"
+              << std::endl;
+}
+
+void
+NetworkEngineTester::testStorageValueIndex()
+{
+    Storage st;
+    StorageBucket bucket;
+    auto key = InfoHash::get("hot");
+    auto now = clock::now();
+    constexpr Value::Id VALUES {200};
+    for (Value::Id i = 1; i <= VALUES; i++)
+        CPPUNIT_ASSERT(st.store(key, makeStoredValue(i), now, now + std::chrono::seconds(i), &bucket).first);
+    // already stored values are only refreshed
+    CPPUNIT_ASSERT(not st.store(key, st.getById(7), now, now + 1h, &bucket).first);
+    CPPUNIT_ASSERT_EQUAL((size_t) VALUES, st.valueCount());
+
+    // removing moves other values: they must still be found
+    for (Value::Id i = 1; i <= VALUES; i += 3)
+        CPPUNIT_ASSERT(st.remove(i));
+    CPPUNIT_ASSERT(not st.remove(1));
+    CPPUNIT_ASSERT_EQUAL(bucket.valueCount(), st.valueCount());
+    for (Value::Id i = 1; i <= VALUES; i++) {
+        auto v = st.getById(i);
+        bool removed = i % 3 == 1;
+        CPPUNIT_ASSERT(removed != (bool) v);
+        if (v)
+            CPPUNIT_ASSERT_EQUAL(i, v->id);
+    }
+
+    // replacing a value keeps its id
+    auto replacement = makeStoredValue(2, 32);
+    CPPUNIT_ASSERT(st.store(key, replacement, now, now + 1h, &bucket).first);
+    CPPUNIT_ASSERT(st.getById(2) == replacement);
+
+    TypeStore types;
+    auto refreshed = st.refresh(now, 3, types);
+    CPPUNIT_ASSERT(refreshed.first and refreshed.first->data->id == 3);
+    CPPUNIT_ASSERT(not st.refresh(now, 4, types).first);
+
+    // expiring reorders values
+    auto res = st.expire(now + std::chrono::seconds(VALUES / 2));
+    CPPUNIT_ASSERT(not res.expired_values.empty());
+    for (const auto& v : st.getValues())
+        CPPUNIT_ASSERT(st.getById(v.data->id) == v.data);
+    for (const auto& v : res.expired_values)
+        CPPUNIT_ASSERT(not st.getById(v->id));
+    CPPUNIT_ASSERT_EQUAL(bucket.valueCount(), st.valueCount());
+
+    st.clear();
+    CPPUNIT_ASSERT(not st.getById(3));
+    CPPUNIT_ASSERT(bucket.empty());
+}
+
+void
+NetworkEngineTester::testBenchmarkStorageLookup()
+{
+    using std::chrono::steady_clock;
+    constexpr size_t KEYS {1000 * 1000};
+    struct Payload
+    {
+        time_point t {};
+        size_t n {0};
+    };
+    std::mt19937_64 krd(13);
+    std::vector<InfoHash> keys;
+    keys.reserve(KEYS);
+    for (size_t i = 0; i < KEYS; i++)
+        keys.emplace_back(InfoHash::getRandom(krd));
+    std::vector<InfoHash> lookups(keys);
+    std::shuffle(lookups.begin(), lookups.end(), krd);
+
+    auto bench = [&](auto& table) {
+        for (const auto& k : keys)
+            table.emplace(k, Payload {});
+        size_t found = 0;
+        auto t0 = steady_clock::now();
+        for (const auto& k : lookups)
+            found += table.find(k)->second.n + 1;
+        auto t1 = steady_clock::now();
+        CPPUNIT_ASSERT_EQUAL(KEYS, found);
+        return std::chrono::duration<double, std::nano>(t1 - t0).count() / KEYS;
+    };
+    std::map<InfoHash, Payload> ordered;
+    std::unordered_map<InfoHash, Payload> hashed;
+    auto orderedNs = bench(ordered);
+    auto hashedNs = bench(hashed);
+
+    // a hot key with many values
+    constexpr Value::Id VALUES {10 * 1000};
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.max_store_size = -1;
+    auto rd = std::make_unique<std::mt19937_64>(13);
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::move(rd));
+    auto now = localDht.scheduler.syncTime();
+    auto hot = keys.front();
+    auto addr = makeIPv4("127.0.0.2", 5013);
+    std::vector<Value::Id> ids;
+    for (Value::Id i = 1; i <= VALUES; i++)
+        ids.emplace_back(i);
+    std::shuffle(ids.begin(), ids.end(), krd);
+
+    auto t0 = steady_clock::now();
+    for (auto id : ids)
+        localDht.storageStore(hot, makeStoredValue(id), now, addr, false, now + 10min);
+    auto t1 = steady_clock::now();
+    for (auto id : ids)
+        CPPUNIT_ASSERT(localDht.storageRefresh(hot, id));
+    auto t2 = steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL((size_t) VALUES, localDht.total_values);
+
+    // previous lookup: linear search of the values
+    const auto& st = localDht.store.at(hot);
+    size_t found = 0;
+    auto t3 = steady_clock::now();
+    for (auto id : ids) {
+        const auto& values = st.getValues();
+        found += std::find_if(values.begin(), values.end(), [&](const ValueStorage& v) { return v.data->id == id; })
+                 != values.end();
+    }
+    auto t4 = steady_clock::now();
+    for (auto id : ids)
+        found += (bool) st.getById(id);
+    auto t5 = steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL((size_t) 2 * VALUES, found);
+
+    auto ns = [](auto d, size_t n) {
+        return std::chrono::duration<double, std::nano>(d).count() / n;
+    };
+    std::cout << std::endl
+              << KEYS << " keys lookup: std::map " << orderedNs << " ns, std::unordered_map " << hashedNs << " ns"
+              << std::endl
+              << VALUES << " values under a key: store " << ns(t1 - t0, VALUES) << " ns, refresh "
+              << ns(t2 - t1, VALUES) << " ns, linear lookup " << ns(t4 - t3, VALUES) << " ns, indexed lookup "
+              << ns(t5 - t4, VALUES) << " ns" << std::endl;
+}
+
+void
+NetworkEngineTester::testStorageBackendRestore()
+{
+    const std::string path {"test_networkengine_storage.log"};
+    std::remove(path.c_str());
+    auto keyA = InfoHash::get("a");
+    auto keyB = InfoHash::get("b");
+    auto addr = makeIPv4("127.0.0.2", 5014);
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    {
+        config.storage_backend = std::make_shared<LogStorageBackend>(path);
+        Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(14));
+        auto now = localDht.scheduler.syncTime();
+        CPPUNIT_ASSERT(localDht.storageStore(keyA, makeStoredValue(1), now, addr, false, now + 10min));
+        CPPUNIT_ASSERT(localDht.storageStore(keyA, makeStoredValue(2), now, addr, false, now + 10min));
+        CPPUNIT_ASSERT(localDht.storageStore(keyB, makeStoredValue(3), now, {}, true));
+        localDht.store.at(keyA).remove(2);
+        localDht.persistStorage([&](StorageBackend& backend) { backend.erase(keyA, 2); });
+        localDht.shutdown({}, false);
+    }
+
+    // values are restored with their expiration and quota
+    config.storage_backend = std::make_shared<LogStorageBackend>(path);
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(14));
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, localDht.total_values);
+    CPPUNIT_ASSERT(localDht.store.at(keyA).getById(1));
+    CPPUNIT_ASSERT(not localDht.store.at(keyA).getById(2));
+    CPPUNIT_ASSERT(localDht.store.at(keyB).getById(3));
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.store_quota.at(addr).valueCount());
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.local_store_quota->valueCount());
+    // restoring doesn't record values again
+    auto backend = std::static_pointer_cast<LogStorageBackend>(config.storage_backend);
+    auto size = backend->size();
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, backend->valueCount());
+
+    localDht.scheduler.syncTime(localDht.scheduler.time() + 11min);
+    localDht.scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.total_values);
+    // maintenance runs in the background
+    localDht.flushStorage(true);
+    CPPUNIT_ASSERT_EQUAL(size, backend->size());
+    backend.reset();
+    config.storage_backend.reset();
+    std::remove(path.c_str());
+}
+
+void
+NetworkEngineTester::testStateIncrementalLoad()
+{
+    constexpr size_t KEYS {Dht::STATE_IMPORT_BATCH * 2 + 10};
+    const std::string path {"test_networkengine_state"};
+    std::remove(path.c_str());
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.persist_path = path;
+    {
+        Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+        auto now = localDht.scheduler.syncTime();
+        for (size_t i = 0; i < KEYS; i++) {
+            auto key = InfoHash::get("key" + std::to_string(i));
+            CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2 * i + 1), now));
+            CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2 * i + 2), now));
+        }
+        localDht.shutdown({}, false);
+    }
+
+    // the first batch is imported when starting, the next ones by the scheduler
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+    CPPUNIT_ASSERT(localDht.state_loader);
+    CPPUNIT_ASSERT_EQUAL(Dht::STATE_IMPORT_BATCH * 2, localDht.total_values);
+    unsigned batches = 1;
+    while (localDht.state_loader) {
+        localDht.scheduler.syncTime(localDht.scheduler.time() + 1ms);
+        localDht.scheduler.run();
+        batches++;
+    }
+    CPPUNIT_ASSERT_EQUAL(3u, batches);
+    CPPUNIT_ASSERT_EQUAL(KEYS * 2, localDht.total_values);
+    for (size_t i = 0; i < KEYS; i += 97) {
+        const auto& st = localDht.store.at(InfoHash::get("key" + std::to_string(i)));
+        CPPUNIT_ASSERT(st.getById(2 * i + 1) and st.getById(2 * i + 2));
+    }
+    std::remove(path.c_str());
+}
+
+void
+NetworkEngineTester::testStateImportStale()
+{
+    constexpr size_t KEYS {Dht::STATE_IMPORT_BATCH * 2};
+    const std::string path {"test_networkengine_state"};
+    std::remove(path.c_str());
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.persist_path = path;
+    {
+        Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+        auto now = localDht.scheduler.syncTime();
+        for (size_t i = 0; i < KEYS; i++) {
+            auto key = InfoHash::get("key" + std::to_string(i));
+            CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2 * i + 1), now));
+            CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2 * i + 2), now));
+        }
+        localDht.shutdown({}, false);
+    }
+
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+    CPPUNIT_ASSERT(localDht.state_loader);
+    size_t i = 0;
+    while (localDht.store.count(InfoHash::get("key" + std::to_string(i))))
+        i++;
+    CPPUNIT_ASSERT(i < KEYS);
+    // values announced or removed since startup are newer than the state file
+    auto key = InfoHash::get("key" + std::to_string(i));
+    auto now = localDht.scheduler.time();
+    CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2 * i + 1, 64), now));
+    CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2 * i + 2), now));
+    CPPUNIT_ASSERT(localDht.storageRemove(key, localDht.store.at(key), 2 * i + 2));
+    localDht.finishStateImport();
+    CPPUNIT_ASSERT_EQUAL(KEYS * 2 - 1, localDht.total_values);
+    const auto& st = localDht.store.at(key);
+    CPPUNIT_ASSERT_EQUAL((size_t) 64, st.getById(2 * i + 1)->data.size());
+    CPPUNIT_ASSERT(not st.getById(2 * i + 2));
+    std::remove(path.c_str());
+}
+
+void
+NetworkEngineTester::testAsyncChecksCancel()
+{
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    SecureDht::Config secureConfig {};
+    secureConfig.node_config = config;
+    secureConfig.async_checks = true;
+    auto dht = std::make_unique<Dht>(std::make_unique<TestDatagramSocket>(),
+                                     config,
+                                     Sp<Logger> {},
+                                     std::make_unique<std::mt19937_64>(15));
+    auto& localDht = *dht;
+    SecureDht secureDht(std::move(dht), secureConfig);
+
+    auto identity = crypto::generateEd25519Identity();
+    auto key = InfoHash::get("async_checks");
+    // values received from the network, not checked yet
+    auto receive = [&](const std::string& data) {
+        Value value(data);
+        value.sign(*identity.first);
+        auto received = std::make_shared<Value>(unpackMsg(value.getPacked()).get());
+        CPPUNIT_ASSERT(localDht.storageStore(key, received, localDht.scheduler.time()));
+    };
+    auto waitChecks = [&] {
+        for (unsigned i = 0; i < 1000 and secureDht.getNodeInfo().check_queue_depth; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            secureDht.periodic(nullptr, 0, SockAddr {}, localDht.scheduler.time());
+        }
+        CPPUNIT_ASSERT_EQUAL((size_t) 0, secureDht.getNodeInfo().check_queue_depth);
+    };
+
+    // values being checked are not delivered once the listen is cancelled
+    unsigned cancelledValues = 0, keptValues = 0;
+    auto cancelled = secureDht.listen(key, [&](const std::vector<Sp<Value>>& values) {
+        cancelledValues += values.size();
+        return true;
+    });
+    secureDht.listen(key, [&](const std::vector<Sp<Value>>& values) {
+        keptValues += values.size();
+        return true;
+    });
+    receive("value 1");
+    CPPUNIT_ASSERT(secureDht.cancelListen(key, cancelled));
+    waitChecks();
+    CPPUNIT_ASSERT_EQUAL(0u, cancelledValues);
+    CPPUNIT_ASSERT_EQUAL(1u, keptValues);
+
+    // gets waiting for their values fail when stopping
+    unsigned doneCalls = 0;
+    bool doneOk = true;
+    receive("value 2");
+    secureDht.get(
+        key,
+        [](const std::vector<Sp<Value>>&) { return true; },
+        [&](bool ok, const std::vector<Sp<Node>>&) {
+            doneCalls++;
+            doneOk = ok;
+        });
+    secureDht.shutdown({}, true);
+    CPPUNIT_ASSERT_EQUAL(1u, doneCalls);
+    CPPUNIT_ASSERT(not doneOk);
+}
+
+void
+NetworkEngineTester::testStateDeltaSave()
+{
+    const std::string path {"test_networkengine_state"};
+    std::remove(path.c_str());
+    auto keyA = InfoHash::get("a");
+    auto keyB = InfoHash::get("b");
+    auto keyC = InfoHash::get("c");
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.persist_path = path;
+    config.persist_period = std::chrono::seconds(60);
+    size_t fullSize, deltaSize;
+    {
+        Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+        CPPUNIT_ASSERT(localDht.persist_job);
+        auto now = localDht.scheduler.syncTime();
+        CPPUNIT_ASSERT(localDht.storageStore(keyA, makeStoredValue(1), now));
+        CPPUNIT_ASSERT(localDht.storageStore(keyA, makeStoredValue(2), now));
+        CPPUNIT_ASSERT(localDht.storageStore(keyB, makeStoredValue(3), now));
+        // the first save writes the whole state
+        localDht.persistState();
+        localDht.persist_task.wait();
+        CPPUNIT_ASSERT_EQUAL(0u, localDht.persist_deltas);
+        fullSize = std::ifstream(path, std::ios::binary | std::ios::ate).tellg();
+
+        CPPUNIT_ASSERT(localDht.storageRemove(keyA, localDht.store.at(keyA), 2));
+        CPPUNIT_ASSERT(localDht.storageStore(keyC, makeStoredValue(4), now));
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.persist_removed.size());
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.persist_changed.size());
+        localDht.persistState();
+        localDht.persist_task.wait();
+        CPPUNIT_ASSERT_EQUAL(1u, localDht.persist_deltas);
+        CPPUNIT_ASSERT(localDht.persist_changed.empty() and localDht.persist_removed.empty());
+        deltaSize = std::ifstream(path, std::ios::binary | std::ios::ate).tellg();
+        CPPUNIT_ASSERT(deltaSize > fullSize);
+
+        // nothing changed: nothing is written
+        localDht.persistState();
+        localDht.persist_task.wait();
+        CPPUNIT_ASSERT_EQUAL(1u, localDht.persist_deltas);
+        // stopped without saving the state
+    }
+    CPPUNIT_ASSERT_EQUAL(deltaSize, (size_t) std::ifstream(path, std::ios::binary | std::ios::ate).tellg());
+
+    config.persist_period = {};
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+    localDht.finishStateImport();
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, localDht.total_values);
+    CPPUNIT_ASSERT(localDht.store.at(keyA).getById(1));
+    CPPUNIT_ASSERT(not localDht.store.at(keyA).getById(2));
+    CPPUNIT_ASSERT(localDht.store.at(keyB).getById(3));
+    CPPUNIT_ASSERT(localDht.store.at(keyC).getById(4));
+    std::remove(path.c_str());
+}
+
+void
+NetworkEngineTester::testBenchmarkStateSave()
+{
+    constexpr size_t KEYS {2000};
+    constexpr size_t VALUES_PER_KEY {10};
+    constexpr size_t VALUES {KEYS * VALUES_PER_KEY};
+    const std::string path {"test_networkengine_state"};
+    const std::string oldPath {"test_networkengine_state_v1"};
+    std::remove(path.c_str());
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.persist_period = std::chrono::seconds(60);
+    config.persist_path = path;
+    Dht localDht(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(15));
+    auto now = localDht.scheduler.syncTime();
+    for (size_t k = 0; k < KEYS; k++) {
+        auto key = InfoHash::get("key" + std::to_string(k));
+        for (size_t i = 0; i < VALUES_PER_KEY; i++)
+            localDht.storageStore(key, makeStoredValue(k * VALUES_PER_KEY + i + 1, 128), now);
+    }
+    CPPUNIT_ASSERT_EQUAL(VALUES, localDht.total_values);
+
+    using std::chrono::steady_clock;
+    // previous format: the state is a single msgpack object, read at once
+    auto t0 = steady_clock::now();
+    {
+        DhtState state;
+        state.v = 1;
+        state.id = localDht.myid;
+        state.nodes = localDht.exportNodes();
+        state.values = localDht.exportValues();
+        std::ofstream file(oldPath, std::ios::binary);
+        msgpack::pack(file, state);
+    }
+    auto t1 = steady_clock::now();
+    localDht.saveState(path);
+    auto t2 = steady_clock::now();
+    // periodic save: the node only takes a snapshot
+    localDht.persistState();
+    auto t3 = steady_clock::now();
+    localDht.persist_task.wait();
+
+    config.persist_period = {};
+    config.persist_path = {};
+    auto t4 = steady_clock::now();
+    {
+        Dht loader(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(16));
+        std::ifstream file(oldPath, std::ios::binary | std::ios::ate);
+        auto size = file.tellg();
+        file.seekg(0, std::ios::beg);
+        msgpack::unpacker pac;
+        pac.reserve_buffer(size);
+        file.read(pac.buffer(), size);
+        pac.buffer_consumed(size);
+        msgpack::object_handle oh;
+        CPPUNIT_ASSERT(pac.next(oh));
+        loader.importValues(oh.get().as<DhtState>().values);
+        CPPUNIT_ASSERT_EQUAL(VALUES, loader.total_values);
+    }
+    auto t5 = steady_clock::now();
+    {
+        Dht loader(std::make_unique<TestDatagramSocket>(), config, {}, std::make_unique<std::mt19937_64>(16));
+        loader.loadState(path);
+        loader.finishStateImport();
+        CPPUNIT_ASSERT_EQUAL(VALUES, loader.total_values);
+    }
+    auto t6 = steady_clock::now();
+
+    auto ms = [](auto d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    std::cout << std::endl
+              << VALUES << " values: single object save " << ms(t1 - t0) << " ms, load " << ms(t5 - t4)
+              << " ms; record stream save " << ms(t2 - t1) << " ms, load " << ms(t6 - t5)
+              << " ms; periodic save snapshot " << ms(t3 - t2) << " ms" << std::endl;
+    std::remove(path.c_str());
+    std::remove(oldPath.c_str());
+}
+
+void
+NetworkEngineTester::testParallelDecode()
+{
+    constexpr unsigned PINGS {64};
+    Scheduler scheduler;
+    std::mt19937_64 rd(3);
+    InfoHash myid = InfoHash::getRandom(rd);
+    InfoHash remoteId = InfoHash::getRandom(rd);
+    int onNewNodeCalls = 0;
+    net::NetworkConfig config;
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    config.decode_threads = 4;
+    auto socket = std::make_unique<TestDatagramSocket>();
+    auto sock = socket.get();
+    auto engine = makeEngine(std::move(socket), scheduler, myid, rd, onNewNodeCalls, config);
+
+    // pings from distinct nodes, invalid packets, and a fragmented value whose
+    // parts can only be processed after its header
+    std::string data(TEST_MTU * 2 + 64, 'z');
+    auto serialized = serializeValue(data);
+    auto from = makeIPv4("127.0.0.2", 5003);
+    std::vector<ReceivedPacket> packets;
+    std::vector<SockAddr> pinging;
+    for (unsigned i = 0; i < PINGS; i++) {
+        if (i == PINGS / 2) {
+            auto header = makeReplyHeaderPacketBlob(remoteId, 13, {serialized.size()});
+            packets.emplace_back(makeReceivedPacket(header, from));
+            for (size_t offset = 0; offset < serialized.size(); offset += TEST_MTU) {
+                auto end = std::min(offset + TEST_MTU, serialized.size());
+                Blob fragment(serialized.begin() + offset, serialized.begin() + end);
+                packets.emplace_back(makeReceivedPacket(makeValueDataPacketBlob(13, 0, offset, fragment), from));
+            }
+        }
+        pinging.emplace_back(makeIPv4("127.0.1.1", 6000 + i));
+        packets.emplace_back(makeReceivedPacket(makePingPacketBlob(InfoHash::getRandom(rd), i), pinging.back()));
+        packets.emplace_back(makeReceivedPacket(Blob(16, 0xc1), pinging.back()));
+        // rejected before being parsed
+        if (i % 8 == 0)
+            packets.emplace_back(makeReceivedPacket(makePingPacketBlob(remoteId, i), makeIPv4("127.0.1.2", 0)));
+    }
+    // enough packets to be decoded in parallel
+    CPPUNIT_ASSERT(packets.size() > 100);
+
+    engine.processMessages(packets);
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, engine.getPartialCount());
+    CPPUNIT_ASSERT(onNewNodeCalls > 0);
+    // replies are sent in the order of the requests
+    CPPUNIT_ASSERT_EQUAL((size_t) PINGS, sock->sends.size());
+    for (unsigned i = 0; i < PINGS; i++)
+        CPPUNIT_ASSERT(sock->sends[i].dest == pinging[i]);
+}
+
+void
+NetworkEngineTester::testPeekMessage()
+{
+    std::mt19937_64 rd(5);
+    auto id = InfoHash::getRandom(rd);
+    auto hash = InfoHash::getRandom(rd);
+    net::MessageHeader header;
+
+    auto ping = makePingPacketBlob(id, 3);
+    CPPUNIT_ASSERT(net::NetworkEngine::peekMessage(ping.data(), ping.size(), header));
+    CPPUNIT_ASSERT(header.request and not header.value_data and not header.value_parts);
+    CPPUNIT_ASSERT_EQUAL((Tid) 3, header.tid);
+    CPPUNIT_ASSERT(header.id == id and not header.target);
+
+    auto get = makeGetPacketBlob(id, hash, 4);
+    CPPUNIT_ASSERT(net::NetworkEngine::peekMessage(get.data(), get.size(), header));
+    CPPUNIT_ASSERT(header.request and header.target == hash);
+
+    auto put = makePutPacketBlob(id, hash, 5, Value("hey"));
+    CPPUNIT_ASSERT(net::NetworkEngine::peekMessage(put.data(), put.size(), header));
+    CPPUNIT_ASSERT(header.request and not header.value_parts and header.target == hash);
+
+    auto reply = makeReplyHeaderPacketBlob(id, 6, {1024});
+    CPPUNIT_ASSERT(net::NetworkEngine::peekMessage(reply.data(), reply.size(), header));
+    CPPUNIT_ASSERT(not header.request and header.value_parts and header.id == id);
+    CPPUNIT_ASSERT_EQUAL((Tid) 6, header.tid);
+
+    auto data = makeValueDataPacketBlob(6, 0, 0, Blob(64, 'a'));
+    CPPUNIT_ASSERT(net::NetworkEngine::peekMessage(data.data(), data.size(), header));
+    CPPUNIT_ASSERT(header.value_data and not header.request);
+    CPPUNIT_ASSERT_EQUAL((Tid) 6, header.tid);
+
+    Blob invalid(16, 0xc1);
+    CPPUNIT_ASSERT(not net::NetworkEngine::peekMessage(invalid.data(), invalid.size(), header));
+    CPPUNIT_ASSERT(not net::NetworkEngine::peekMessage(ping.data(), ping.size() / 2, header));
+
+    // transaction ids carry the shard of the node that sent the request
+    Node node(id, makeIPv4("127.0.0.2", 5003), rd, false, 3);
+    for (unsigned i = 0; i < 1024; i++)
+        CPPUNIT_ASSERT_EQUAL(3u, Node::getTidShard(node.getNewTid()));
+}
+
+void
+NetworkEngineTester::testBlacklistExpiration()
+{
+    Scheduler scheduler;
+    std::mt19937_64 rd(4);
+    InfoHash myid = InfoHash::getRandom(rd);
+    int onNewNodeCalls = 0;
+    net::NetworkConfig config;
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    auto socket = std::make_unique<TestDatagramSocket>();
+    auto sock = socket.get();
+    auto engine = makeEngine(std::move(socket), scheduler, myid, rd, onNewNodeCalls, config);
+    auto start = scheduler.syncTime();
+    // a ping is answered unless the node is blacklisted
+    auto answers = [&](const Sp<Node>& node) {
+        auto sent = sock->sends.size();
+        auto ping = makePingPacketBlob(node->id, 1);
+        engine.processMessage(ping.data(), ping.size(), node->getAddr());
+        return sock->sends.size() > sent;
+    };
+
+    std::vector<Sp<Node>> nodes;
+    for (unsigned i = 0; i <= net::NetworkEngine::BLACKLISTED_MAX; i++) {
+        nodes.emplace_back(std::make_shared<Node>(InfoHash::getRandom(rd), makeIPv4("127.0.2.1", 7000 + i), rd));
+        scheduler.syncTime(start + std::chrono::seconds(i));
+        engine.blacklistNode(nodes.back());
+    }
+    // the oldest entry made room for the last one
+    CPPUNIT_ASSERT_EQUAL((size_t) net::NetworkEngine::BLACKLISTED_MAX, engine.getBlacklistSize());
+    CPPUNIT_ASSERT(answers(nodes.front()));
+    CPPUNIT_ASSERT(not answers(nodes.back()));
+
+    // entries expire, and are removed when another node is blacklisted
+    scheduler.syncTime(start + net::NetworkEngine::BLACKLIST_EXPIRATION + std::chrono::minutes(1));
+    CPPUNIT_ASSERT(answers(nodes.back()));
+    engine.blacklistNode(nodes.front());
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, engine.getBlacklistSize());
+    CPPUNIT_ASSERT(not answers(nodes.front()));
+}
+
+void
+NetworkEngineTester::testBenchmarkParallelDecode()
+{
+    constexpr size_t PACKETS {8192};
+    constexpr unsigned ROUNDS {4};
+    Scheduler scheduler;
+    std::mt19937_64 rd(4);
+    InfoHash myid = InfoHash::getRandom(rd);
+    int onNewNodeCalls = 0;
+    net::NetworkConfig config;
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+
+    std::vector<ReceivedPacket> packets;
+    packets.reserve(PACKETS);
+    for (size_t i = 0; i < PACKETS; i++) {
+        Value value(std::string(500, 'a' + i % 26));
+        value.id = i + 1;
+        auto blob = makePutPacketBlob(InfoHash::getRandom(rd), InfoHash::getRandom(rd), i, value);
+        packets.emplace_back(makeReceivedPacket(blob, makeIPv4("127.0.1.1", 6000 + i % 1000)));
+    }
+
+    std::cout << std::endl << PACKETS << " put requests:";
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        config.decode_threads = threads;
+        auto engine = makeEngine(std::make_unique<TestDatagramSocket>(), scheduler, myid, rd, onNewNodeCalls, config);
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < ROUNDS; r++)
+            engine.processMessages(packets);
+        auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << " " << threads << " thread(s) " << ns / (PACKETS * ROUNDS) << " ns/packet;";
+    }
+    std::cout << std::endl;
+}
+
+/* Let a node join the routing table of dht by replying to a ping */
+static void
+addGoodNode(Dht& dht, const InfoHash& id, const SockAddr& addr)
+{
+    auto node = dht.network_engine.insertNode(id, addr);
+    auto req = dht.network_engine.sendPing(node, {}, {});
+    std::vector<ReceivedPacket> packets;
+    packets.emplace_back(makeReceivedPacket(makePingReplyPacketBlob(id, req->getTid()), addr));
+    dht.periodic(packets, dht.scheduler.time());
+    CPPUNIT_ASSERT(node->isGood(dht.scheduler.time()));
+}
+
+void
+NetworkEngineTester::testReplyCache()
+{
+    auto key = InfoHash::get("hot");
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    auto socket = std::make_unique<TestDatagramSocket>();
+    auto sock = socket.get();
+    Dht localDht(std::move(socket), config, {}, std::make_unique<std::mt19937_64>(16));
+    std::mt19937_64 rd(16);
+    auto now = localDht.scheduler.syncTime();
+    CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(1), now));
+
+    Tid tid = 1;
+    auto get = [&](const SockAddr& from, const Query& query = {}) {
+        auto t = tid++;
+        std::vector<ReceivedPacket> packets;
+        packets.emplace_back(makeReceivedPacket(makeGetPacketBlob(InfoHash::getRandom(rd), key, t, query), from));
+        sock->sends.clear();
+        localDht.periodic(packets, localDht.scheduler.time());
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, sock->sends.size());
+        CPPUNIT_ASSERT(sock->sends[0].dest == from);
+        ParsedMessage msg;
+        msg.msgpack_unpack(unpackMsg(sock->sends[0].data).get());
+        CPPUNIT_ASSERT(msg.type == MessageType::Reply);
+        CPPUNIT_ASSERT_EQUAL(t, msg.tid);
+        CPPUNIT_ASSERT(msg.addr == from);
+        CPPUNIT_ASSERT(msg.token == localDht.makeToken(from, false));
+        return msg;
+    };
+    auto addrA = makeIPv4("127.0.1.1", 6001);
+    auto addrB = makeIPv4("127.0.1.2", 6002);
+
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, get(addrA).values.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.getReplyCacheStats().misses);
+    // the same reply is sent to another requester, with its own address and token
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, get(addrB).values.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.getReplyCacheStats().hits);
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.getReplyCacheStats().entries);
+
+    // another query is another reply
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, get(addrA, Query {Select {}.field(Value::Field::Id)}).fields.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, localDht.getReplyCacheStats().misses);
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, localDht.getReplyCacheStats().entries);
+
+    // changing the storage invalidates replies
+    CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(2), now));
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, localDht.getReplyCacheStats().entries);
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, get(addrB).values.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, localDht.getReplyCacheStats().misses);
+    CPPUNIT_ASSERT(localDht.storageRemove(key, localDht.store.at(key), 1));
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, get(addrA).values.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 4, localDht.getReplyCacheStats().misses);
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, get(addrB).values.size());
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, localDht.getReplyCacheStats().hits);
+
+    // so does a good node joining the routing table
+    addGoodNode(localDht, InfoHash::getRandom(rd), makeIPv4("127.0.2.1", 7000));
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, localDht.getReplyCacheStats().entries);
+    CPPUNIT_ASSERT(not get(addrA).nodes4_raw.empty());
+    CPPUNIT_ASSERT_EQUAL((size_t) 5, localDht.getReplyCacheStats().misses);
+
+    // replies expire
+    localDht.scheduler.syncTime(localDht.scheduler.time() + Dht::REPLY_CACHE_TTL);
+    get(addrB);
+    CPPUNIT_ASSERT_EQUAL((size_t) 6, localDht.getReplyCacheStats().misses);
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, localDht.getReplyCacheStats().entries);
+}
+
+void
+NetworkEngineTester::testBenchmarkReplyCache()
+{
+    constexpr size_t VALUES {20};
+    constexpr size_t REQUESTS {20000};
+    auto key = InfoHash::get("hot");
+    Config config {};
+    config.max_req_per_sec = -1;
+    config.max_peer_req_per_sec = -1;
+    auto socket = std::make_unique<TestDatagramSocket>();
+    auto sock = socket.get();
+    Dht localDht(std::move(socket), config, {}, std::make_unique<std::mt19937_64>(17));
+    std::mt19937_64 rd(17);
+    auto now = localDht.scheduler.syncTime();
+    for (size_t i = 0; i < VALUES; i++)
+        CPPUNIT_ASSERT(localDht.storageStore(key, makeStoredValue(i + 1, 64), now));
+    for (unsigned i = 0; i < 64; i++)
+        addGoodNode(localDht, InfoHash::getRandom(rd), makeIPv4("127.0.2.1", 7000 + i));
+
+    std::vector<std::vector<ReceivedPacket>> requests(REQUESTS);
+    for (size_t i = 0; i < REQUESTS; i++) {
+        auto blob = makeGetPacketBlob(InfoHash::getRandom(rd), key, i);
+        requests[i].emplace_back(makeReceivedPacket(blob, makeIPv4("127.0.1.1", 6000 + i % 1000)));
+    }
+
+    auto run = [&](bool cached) {
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& r : requests) {
+            if (not cached)
+                localDht.clearReplyCache();
+            localDht.periodic(r, now);
+            if (sock->sends.size() > 1024)
+                sock->sends.clear();
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / REQUESTS;
+    };
+    auto uncached = run(false);
+    auto cached = run(true);
+    auto stats = localDht.getReplyCacheStats();
+    CPPUNIT_ASSERT(stats.hits > REQUESTS / 2);
+    std::cout << std::endl
+              << REQUESTS << " 'get' requests for a key with " << VALUES << " values: encoded each time " << uncached
+              << " ns/request, cached " << cached << " ns/request (" << stats.hits << " hits, " << stats.misses
+              << " misses)" << std::endl;
+}
+
+/* Routing table split down to the maximum depth towards myid, with up to
+   TARGET_NODES nodes per bucket. Every fifth node is not good. */
+static RoutingTable
+makeFullTable(net::NetworkEngine& engine, const InfoHash& myid, std::mt19937_64& rd, time_point now)
+{
+    RoutingTable table {Bucket {AF_INET}};
+    while (table.split(table.findBucket(myid))) {}
+    std::set<InfoHash> ids;
+    in_port_t port = 1024;
+    for (auto b = table.begin(); b != table.end(); ++b) {
+        for (unsigned i = 0; i < TARGET_NODES; i++) {
+            auto id = table.randomId(b, rd);
+            if (id == myid or not ids.emplace(id).second)
+                continue;
+            auto node = engine.insertNode(id, makeIPv4("127.0.3.1", port++));
+            if (port % 5)
+                node->received(now, engine.sendPing(node, {}, {}));
+            b->nodes.emplace_back(node);
+        }
+    }
+    return table;
+}
+
+/* Bucket lookup and closest nodes selection of a linked list routing table */
+static RoutingTable::const_iterator
+linearFindBucket(const RoutingTable& table, const InfoHash& id)
+{
+    auto b = table.begin();
+    while (std::next(b) != table.end() and InfoHash::cmp(id, std::next(b)->first) >= 0)
+        ++b;
+    return b;
+}
+
+static std::vector<Sp<Node>>
+linearClosestNodes(const RoutingTable& table, const InfoHash& id, time_point now, size_t count)
+{
+    std::vector<Sp<Node>> nodes;
+    auto bucket = linearFindBucket(table, id);
+    auto sortedBucketInsert = [&](const Bucket& b) {
+        for (const auto& n : b.nodes) {
+            if (not n->isGood(now))
+                continue;
+            auto here = std::find_if(nodes.begin(), nodes.end(), [&id, &n](const Sp<Node>& node) {
+                return id.xorCmp(n->id, node->id) < 0;
+            });
+            nodes.insert(here, n);
+        }
+    };
+    auto itn = bucket;
+    auto itp = (bucket == table.begin()) ? table.end() : std::prev(bucket);
+    while (nodes.size() < count && (itn != table.end() || itp != table.end())) {
+        if (itn != table.end()) {
+            sortedBucketInsert(*itn);
+            itn = std::next(itn);
+        }
+        if (itp != table.end()) {
+            sortedBucketInsert(*itp);
+            itp = (itp == table.begin()) ? table.end() : std::prev(itp);
+        }
+    }
+    if (nodes.size() > count)
+        nodes.resize(count);
+    return nodes;
+}
+
+void
+NetworkEngineTester::testRoutingTableLookup()
+{
+    Scheduler scheduler;
+    std::mt19937_64 rd(18);
+    InfoHash myid = InfoHash::getRandom(rd);
+    int onNewNodeCalls = 0;
+    auto engine = makeEngine(std::make_unique<TestDatagramSocket>(), scheduler, myid, rd, onNewNodeCalls);
+    auto now = scheduler.time();
+    auto table = makeFullTable(engine, myid, rd, now);
+    CPPUNIT_ASSERT_EQUAL((size_t) 8 * HASH_LEN + 1, table.size());
+    CPPUNIT_ASSERT(std::is_sorted(table.begin(), table.end(), [](const Bucket& a, const Bucket& b) {
+        return a.first < b.first;
+    }));
+
+    // random targets, and targets in the deepest buckets
+    std::vector<InfoHash> targets;
+    for (unsigned i = 0; i < 500; i++)
+        targets.emplace_back(InfoHash::getRandom(rd));
+    for (auto b = table.begin(); b != table.end(); ++b)
+        targets.emplace_back(table.randomId(b, rd));
+    targets.emplace_back(myid);
+    for (const auto& target : targets) {
+        auto b = table.findBucket(target);
+        CPPUNIT_ASSERT(b == linearFindBucket(table, target));
+        CPPUNIT_ASSERT(table.contains(b, target));
+        for (size_t count : {1, 8, 14, 100}) {
+            auto nodes = table.findClosestNodes(target, now, count);
+            CPPUNIT_ASSERT(nodes == linearClosestNodes(table, target, now, count));
+            for (const auto& n : nodes)
+                CPPUNIT_ASSERT(n->isGood(now));
+        }
+    }
+
+    // nodes follow their bucket when it is split
+    RoutingTable small {Bucket {AF_INET}};
+    for (const auto& b : table)
+        for (const auto& n : b.nodes)
+            small.front().nodes.emplace_back(n);
+    CPPUNIT_ASSERT(small.split(small.begin()));
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, small.size());
+    for (auto b = small.begin(); b != small.end(); ++b)
+        for (const auto& n : b->nodes)
+            CPPUNIT_ASSERT(small.contains(b, n->id));
+}
+
+void
+NetworkEngineTester::testBenchmarkRoutingTable()
+{
+    constexpr size_t LOOKUPS {100 * 1000};
+    Scheduler scheduler;
+    std::mt19937_64 rd(19);
+    InfoHash myid = InfoHash::getRandom(rd);
+    int onNewNodeCalls = 0;
+    auto engine = makeEngine(std::make_unique<TestDatagramSocket>(), scheduler, myid, rd, onNewNodeCalls);
+    auto now = scheduler.time();
+    const auto table = makeFullTable(engine, myid, rd, now);
+
+    // lookups near our id reach the end of the table
+    std::vector<InfoHash> targets;
+    targets.reserve(LOOKUPS);
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        auto target = InfoHash::getRandom(rd);
+        if (i % 2)
+            std::copy_n(myid.cbegin(), HASH_LEN - 4, target.begin());
+        targets.emplace_back(target);
+    }
+
+    size_t found = 0;
+    auto time = [&](auto&& lookup) {
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& t : targets)
+            found += lookup(t);
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / LOOKUPS;
+    };
+    auto linearBucket = time([&](const InfoHash& t) { return linearFindBucket(table, t)->nodes.size(); });
+    auto bucket = time([&](const InfoHash& t) { return table.findBucket(t)->nodes.size(); });
+    auto linearClosest = time([&](const InfoHash& t) {
+        return linearClosestNodes(table, t, now, TARGET_NODES).size();
+    });
+    auto closest = time([&](const InfoHash& t) { return table.findClosestNodes(t, now, TARGET_NODES).size(); });
+    CPPUNIT_ASSERT(found > 0);
+    std::cout << std::endl
+              << table.size() << " buckets: find bucket linear " << linearBucket << " ns, binary search " << bucket
+              << " ns; " << TARGET_NODES << " closest nodes with insertion sort " << linearClosest
+              << " ns, nth_element " << closest << " ns" << std::endl;
+}
+
 } // namespace test
 
 #endif
\ No newline at end of file
@@ -20,6 +20,28 @@ class NetworkEngineTester : public CppUnit::TestFixture
     CPPUNIT_TEST(testListenConfirmationUpdatesSearchNodeToken);
     CPPUNIT_TEST(testListenReopensSocketAfterNodeExpiration);
     CPPUNIT_TEST(testUnauthorizedListenFlushClearsListenState);
+    CPPUNIT_TEST(testAdaptiveRequestTimeout);
+    CPPUNIT_TEST(testBatchedValueExpiration);
+    CPPUNIT_TEST(testStorageQuotaOrder);
+    CPPUNIT_TEST(testStorageValueIndex);
+    CPPUNIT_TEST(testStorageBackendRestore);
+    CPPUNIT_TEST(testStateIncrementalLoad);
+    CPPUNIT_TEST(testStateImportStale);
+    CPPUNIT_TEST(testAsyncChecksCancel);
+    CPPUNIT_TEST(testStateDeltaSave);
+    CPPUNIT_TEST(testParallelDecode);
+    CPPUNIT_TEST(testPeekMessage);
+    CPPUNIT_TEST(testBlacklistExpiration);
+    CPPUNIT_TEST(testReplyCache);
+    CPPUNIT_TEST(testRoutingTableLookup);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkValueExpiration);
+    CPPUNIT_TEST(testBenchmarkStorageLookup);
+    CPPUNIT_TEST(testBenchmarkStateSave);
+    CPPUNIT_TEST(testBenchmarkParallelDecode);
+    CPPUNIT_TEST(testBenchmarkReplyCache);
+    CPPUNIT_TEST(testBenchmarkRoutingTable);
+#endif
 #endif
     CPPUNIT_TEST_SUITE_END();
 
@@ -37,6 +59,26 @@ public:
     void testListenConfirmationUpdatesSearchNodeToken();
     void testListenReopensSocketAfterNodeExpiration();
     void testUnauthorizedListenFlushClearsListenState();
+    void testAdaptiveRequestTimeout();
+    void testBatchedValueExpiration();
+    void testStorageQuotaOrder();
+    void testBenchmarkValueExpiration();
+    void testStorageValueIndex();
+    void testBenchmarkStorageLookup();
+    void testStorageBackendRestore();
+    void testStateIncrementalLoad();
+    void testStateImportStale();
+    void testAsyncChecksCancel();
+    void testStateDeltaSave();
+    void testBenchmarkStateSave();
+    void testParallelDecode();
+    void testPeekMessage();
+    void testBlacklistExpiration();
+    void testBenchmarkParallelDecode();
+    void testReplyCache();
+    void testBenchmarkReplyCache();
+    void testRoutingTableLookup();
+    void testBenchmarkRoutingTable();
 #endif
 };
 
@@ -9,6 +9,7 @@
 
 #include "../src/parsed_message.h"
 
+#include <chrono>
 #include <iostream>
 #include <limits>
 #include <string>
@@ -101,6 +102,41 @@ makeValueDataPacket(Tid tid, unsigned index, size_t offset, const Blob& data)
     return parsePackedMessage(buffer);
 }
 
+// Helper: pack a reply to a 'get' request, with nodes, a token and values
+static msgpack::sbuffer
+makeGetReplyBuffer(size_t nodes, size_t values)
+{
+    Blob nodes4(nodes * (HASH_LEN + sizeof(in_addr) + sizeof(in_port_t)), 4);
+    Blob nodes6(nodes * (HASH_LEN + sizeof(in6_addr) + sizeof(in_port_t)), 6);
+    Blob token(32, 't');
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_map(3);
+    pk.pack(KEY_R);
+    pk.pack_map(5);
+    pk.pack(KEY_REQ_ID);
+    pk.pack(InfoHash::get("node"));
+    pk.pack(KEY_REQ_NODES4);
+    pk.pack_bin(nodes4.size());
+    pk.pack_bin_body((const char*) nodes4.data(), nodes4.size());
+    pk.pack(KEY_REQ_NODES6);
+    pk.pack_bin(nodes6.size());
+    pk.pack_bin_body((const char*) nodes6.data(), nodes6.size());
+    pk.pack(KEY_REQ_TOKEN);
+    pk.pack_bin(token.size());
+    pk.pack_bin_body((const char*) token.data(), token.size());
+    pk.pack(KEY_REQ_VALUES);
+    pk.pack_array(values);
+    for (size_t i = 0; i < values; i++)
+        pk.pack(Value(std::string(128, 'v')));
+    pk.pack(KEY_TID);
+    pk.pack(42u);
+    pk.pack(KEY_Y);
+    pk.pack(KEY_R);
+    return buffer;
+}
+
 void
 ParsedMessageTester::setUp()
 {}
@@ -537,4 +573,117 @@ ParsedMessageTester::testReceiveLargeFragmentedValueOutOfOrder()
     CPPUNIT_ASSERT_EQUAL(data, recovered);
 }
 
+// --- in place parsing ---
+
+void
+ParsedMessageTester::testUnpackInPlace()
+{
+    auto buffer = makeGetReplyBuffer(8, 3);
+    Blob packet(buffer.data(), buffer.data() + buffer.size());
+    auto inPacket = [&](const BlobRef& b) {
+        return b.data() >= packet.data() and b.end() <= packet.data() + packet.size();
+    };
+
+    ParsedMessage copied = parsePackedMessage(buffer);
+    ParsedMessage parsed;
+    parsed.unpack(packet.data(), packet.size());
+
+    CPPUNIT_ASSERT(parsed.type == MessageType::Reply);
+    CPPUNIT_ASSERT_EQUAL(copied.tid, parsed.tid);
+    CPPUNIT_ASSERT_EQUAL(copied.id, parsed.id);
+    CPPUNIT_ASSERT(copied.token == parsed.token);
+    CPPUNIT_ASSERT(copied.nodes4_raw.blob() == parsed.nodes4_raw.blob());
+    CPPUNIT_ASSERT(copied.nodes6_raw.blob() == parsed.nodes6_raw.blob());
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, parsed.values.size());
+    CPPUNIT_ASSERT(*copied.values[0] == *parsed.values[0]);
+
+    CPPUNIT_ASSERT(copied.nodes4_raw.owned() and not inPacket(copied.nodes4_raw));
+    CPPUNIT_ASSERT(not parsed.nodes4_raw.owned() and inPacket(parsed.nodes4_raw));
+    CPPUNIT_ASSERT(not parsed.nodes6_raw.owned() and inPacket(parsed.nodes6_raw));
+
+    parsed.own();
+    CPPUNIT_ASSERT(parsed.nodes4_raw.owned() and not inPacket(parsed.nodes4_raw));
+    CPPUNIT_ASSERT(parsed.nodes6_raw.owned() and not inPacket(parsed.nodes6_raw));
+    std::fill(packet.begin(), packet.end(), 0);
+    CPPUNIT_ASSERT(copied.nodes4_raw.blob() == parsed.nodes4_raw.blob());
+    CPPUNIT_ASSERT(copied.nodes6_raw.blob() == parsed.nodes6_raw.blob());
+}
+
+void
+ParsedMessageTester::testUnpackInPlaceValueData()
+{
+    auto serialized = serializeValue(std::string(TEST_MTU * 2, 'z'));
+    auto msg = makeReplyHeaderPacket(3, {serialized.size()});
+
+    for (size_t offset = 0; offset < serialized.size(); offset += TEST_MTU) {
+        auto end = std::min(offset + TEST_MTU, serialized.size());
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        pk.pack_map(3);
+        pk.pack(KEY_Y);
+        pk.pack(KEY_V);
+        pk.pack(KEY_TID);
+        pk.pack(3u);
+        pk.pack(KEY_V);
+        pk.pack_map(1);
+        pk.pack(0u);
+        pk.pack_map(2);
+        pk.pack("o");
+        pk.pack(offset);
+        pk.pack("d");
+        pk.pack_bin(end - offset);
+        pk.pack_bin_body((const char*) serialized.data() + offset, end - offset);
+
+        ParsedMessage packet;
+        packet.unpack((const uint8_t*) buffer.data(), buffer.size());
+        CPPUNIT_ASSERT(packet.type == MessageType::ValueData);
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, packet.fragment_parts.size());
+        CPPUNIT_ASSERT(not packet.fragment_parts[0].second.owned());
+        // the fragment is copied when appended
+        CPPUNIT_ASSERT(msg.append(packet));
+    }
+
+    CPPUNIT_ASSERT(msg.complete());
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, msg.values.size());
+    CPPUNIT_ASSERT_EQUAL(std::string(TEST_MTU * 2, 'z'),
+                         std::string(msg.values[0]->data.begin(), msg.values[0]->data.end()));
+}
+
+void
+ParsedMessageTester::testBenchmarkUnpack()
+{
+    using clock = std::chrono::steady_clock;
+    constexpr unsigned ITERATIONS {20000};
+    constexpr size_t NODE4_LEN {HASH_LEN + sizeof(in_addr) + sizeof(in_port_t)};
+
+    for (auto [nodes, values] : {std::pair<size_t, size_t> {0, 0}, {8, 0}, {8, 4}}) {
+        auto buffer = makeGetReplyBuffer(nodes, values);
+        const auto* data = (const uint8_t*) buffer.data();
+
+        auto start = clock::now();
+        for (unsigned i = 0; i < ITERATIONS; i++) {
+            auto msg = std::make_unique<ParsedMessage>();
+            msg->msgpack_unpack(msgpack::unpack(buffer.data(), buffer.size()).get());
+            CPPUNIT_ASSERT_EQUAL(nodes * NODE4_LEN, msg->nodes4_raw.size());
+        }
+        auto copyTime = clock::now() - start;
+
+        start = clock::now();
+        for (unsigned i = 0; i < ITERATIONS; i++) {
+            auto msg = std::make_unique<ParsedMessage>();
+            msg->unpack(data, buffer.size());
+            CPPUNIT_ASSERT_EQUAL(nodes * NODE4_LEN, msg->nodes4_raw.size());
+        }
+        auto inPlaceTime = clock::now() - start;
+
+        auto ns = [&](clock::duration d) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / ITERATIONS;
+        };
+        std::cout << std::endl
+                  << "Unpack " << buffer.size() << " bytes (" << nodes << " nodes, " << values
+                  << " values): copy " << ns(copyTime) << " ns, in place " << ns(inPlaceTime) << " ns";
+    }
+    std::cout << std::endl;
+}
+
 } // namespace test
@@ -34,6 +34,11 @@ class ParsedMessageTester : public CppUnit::TestFixture
     CPPUNIT_TEST(testAppendMultipleValuesOutOfOrder);
     CPPUNIT_TEST(testReceiveLargeFragmentedValue);
     CPPUNIT_TEST(testReceiveLargeFragmentedValueOutOfOrder);
+    CPPUNIT_TEST(testUnpackInPlace);
+    CPPUNIT_TEST(testUnpackInPlaceValueData);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkUnpack);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -63,6 +68,9 @@ public:
     void testAppendMultipleValuesOutOfOrder();
     void testReceiveLargeFragmentedValue();
     void testReceiveLargeFragmentedValueOutOfOrder();
+    void testUnpackInPlace();
+    void testUnpackInPlaceValueData();
+    void testBenchmarkUnpack();
 };
 
 } // namespace test
@@ -0,0 +1,275 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "test_ratelimiter.h"
+
+#include "opendht/rate_limiter.h"
+
+#include <iostream>
+#include <map>
+#include <queue>
+#include <random>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(RateLimiterTester);
+
+using namespace dht;
+using namespace std::chrono_literals;
+
+static SockAddr
+makeIPv4(uint32_t ip)
+{
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(ip);
+    sin.sin_port = htons(4222);
+    return SockAddr((const sockaddr*) &sin, sizeof(sin));
+}
+
+static SockAddr
+makeIPv6(uint64_t prefix, uint64_t iface)
+{
+    sockaddr_in6 sin6 {};
+    sin6.sin6_family = AF_INET6;
+    std::memcpy(&sin6.sin6_addr, &prefix, sizeof(prefix));
+    std::memcpy((uint8_t*) &sin6.sin6_addr + sizeof(prefix), &iface, sizeof(iface));
+    sin6.sin6_port = htons(4222);
+    return SockAddr((const sockaddr*) &sin6, sizeof(sin6));
+}
+
+void
+RateLimiterTester::setUp()
+{}
+
+void
+RateLimiterTester::tearDown()
+{}
+
+void
+RateLimiterTester::testQuota()
+{
+    auto now = clock::now();
+    RateLimiter limiter(10);
+    CPPUNIT_ASSERT(limiter.empty());
+    for (unsigned i = 0; i < 10; i++)
+        CPPUNIT_ASSERT(limiter.limit(now));
+    CPPUNIT_ASSERT(not limiter.limit(now));
+    CPPUNIT_ASSERT_EQUAL((size_t) 10, limiter.maintain(now));
+    CPPUNIT_ASSERT(not limiter.empty());
+
+    RateLimiter closed(0);
+    CPPUNIT_ASSERT(not closed.limit(now));
+}
+
+void
+RateLimiterTester::testRefill()
+{
+    auto now = clock::now();
+    RateLimiter limiter(10);
+    for (unsigned i = 0; i < 10; i++)
+        CPPUNIT_ASSERT(limiter.limit(now));
+
+    // one request every 100ms
+    now += 50ms;
+    CPPUNIT_ASSERT(not limiter.limit(now));
+    now += 50ms;
+    CPPUNIT_ASSERT(limiter.limit(now));
+    CPPUNIT_ASSERT(not limiter.limit(now));
+    CPPUNIT_ASSERT_EQUAL((size_t) 10, limiter.maintain(now));
+
+    now += 500ms;
+    CPPUNIT_ASSERT_EQUAL((size_t) 5, limiter.maintain(now));
+
+    now += 1s;
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, limiter.maintain(now));
+    CPPUNIT_ASSERT(limiter.empty());
+    for (unsigned i = 0; i < 10; i++)
+        CPPUNIT_ASSERT(limiter.limit(now));
+    CPPUNIT_ASSERT(not limiter.limit(now));
+}
+
+void
+RateLimiterTester::testUnlimited()
+{
+    auto now = clock::now();
+    RateLimiter limiter(std::numeric_limits<size_t>::max());
+    for (unsigned i = 0; i < 100000; i++)
+        CPPUNIT_ASSERT(limiter.limit(now));
+
+    // larger than what can be accounted for
+    RateLimiter huge((size_t) std::numeric_limits<int64_t>::max() / 2);
+    for (unsigned i = 0; i < 1000; i++)
+        CPPUNIT_ASSERT(huge.limit(now));
+}
+
+void
+RateLimiterTester::testIpLimiter()
+{
+    auto now = clock::now();
+    IpRateLimiter limiter(4);
+
+    auto a = makeIPv4(0x0a000001);
+    auto b = makeIPv4(0x0a000002);
+    for (unsigned i = 0; i < 4; i++)
+        CPPUNIT_ASSERT(limiter.limit(a, now));
+    CPPUNIT_ASSERT(not limiter.limit(a, now));
+    // the port is not considered
+    auto a2 = a;
+    a2.setPort(1234);
+    CPPUNIT_ASSERT(not limiter.limit(a2, now));
+    CPPUNIT_ASSERT(limiter.limit(b, now));
+
+    // addresses in the same /64 share a limiter
+    auto c1 = makeIPv6(0x20010db800000001ull, 1);
+    auto c2 = makeIPv6(0x20010db800000001ull, 2);
+    auto d = makeIPv6(0x20010db800000002ull, 1);
+    for (unsigned i = 0; i < 4; i++)
+        CPPUNIT_ASSERT(limiter.limit(i % 2 ? c1 : c2, now));
+    CPPUNIT_ASSERT(not limiter.limit(c1, now));
+    CPPUNIT_ASSERT(limiter.limit(d, now));
+    CPPUNIT_ASSERT_EQUAL((size_t) 4, limiter.size());
+
+    // idle limiters are dropped
+    now += 2s;
+    CPPUNIT_ASSERT_EQUAL((size_t) 0, limiter.maintain(now));
+    CPPUNIT_ASSERT(limiter.limit(a, now));
+}
+
+void
+RateLimiterTester::testIpLimiterBoundedSize()
+{
+    auto now = clock::now();
+    IpRateLimiter limiter(4, 256, 1s, 4);
+    for (uint32_t i = 0; i < 100000; i++)
+        CPPUNIT_ASSERT(limiter.limit(makeIPv4(0x0b000000 + i), now));
+    CPPUNIT_ASSERT(limiter.size() <= 256);
+
+    // the most recently used limiters are kept
+    auto last = makeIPv4(0x0b000000 + 99999);
+    for (unsigned i = 0; i < 3; i++)
+        CPPUNIT_ASSERT(limiter.limit(last, now));
+    CPPUNIT_ASSERT(not limiter.limit(last, now));
+}
+
+namespace {
+
+/* Previous implementation: one timestamp per accepted request */
+class QueueRateLimiter
+{
+public:
+    QueueRateLimiter(size_t quota, const duration& period = std::chrono::seconds(1))
+        : quota_(quota)
+        , period_(period)
+    {}
+    size_t maintain(const time_point& now)
+    {
+        auto limit = now - period_;
+        while (not records.empty() and records.front() < limit)
+            records.pop();
+        return records.size();
+    }
+    bool limit(const time_point& now)
+    {
+        if (maintain(now) >= quota_)
+            return false;
+        records.emplace(now);
+        return true;
+    }
+
+private:
+    const size_t quota_;
+    const duration period_;
+    std::queue<time_point> records {};
+};
+
+/* Previous per IP table, as used by NetworkEngine */
+struct QueueIpRateLimiter
+{
+    QueueIpRateLimiter(size_t quota)
+        : quota(quota)
+    {}
+    bool limit(const SockAddr& addr, const time_point& now)
+    {
+        if (maintenance++ == quota) {
+            for (auto it = limiters.begin(); it != limiters.end();) {
+                if (it->second.maintain(now) == 0)
+                    limiters.erase(it++);
+                else
+                    ++it;
+            }
+            maintenance = 0;
+        }
+        return limiters.emplace(addr, quota).first->second.limit(now);
+    }
+    size_t quota;
+    size_t maintenance {0};
+    std::map<SockAddr, QueueRateLimiter, SockAddr::ipCmp> limiters;
+};
+
+} // namespace
+
+void
+RateLimiterTester::testBenchmarkSpoofedFlood()
+{
+    using bench_clock = std::chrono::steady_clock;
+    constexpr unsigned PACKETS {200000};
+    constexpr unsigned RATE {100000}; // packets per second
+    // default quotas
+    constexpr size_t GLOBAL_QUOTA {8 * 1024};
+    constexpr size_t PEER_QUOTA {GLOBAL_QUOTA / 8};
+
+    // Sources are random, with a fraction of packets from a few real peers
+    std::mt19937 rd(42);
+    std::vector<SockAddr> sources;
+    sources.reserve(PACKETS);
+    for (unsigned i = 0; i < PACKETS; i++)
+        sources.emplace_back(makeIPv4(i % 8 ? rd() : 0x0a000000 + i % 64));
+    const auto start_time = clock::now();
+    auto packetTime = [&](unsigned i) {
+        return start_time + std::chrono::nanoseconds((uint64_t) i * 1000000000 / RATE);
+    };
+
+    size_t queueAccepted = 0, queuePeak = 0;
+    auto start = bench_clock::now();
+    {
+        QueueIpRateLimiter peers(PEER_QUOTA);
+        QueueRateLimiter global(GLOBAL_QUOTA);
+        for (unsigned i = 0; i < PACKETS; i++) {
+            auto now = packetTime(i);
+            if (peers.limit(sources[i], now) and global.limit(now))
+                queueAccepted++;
+            queuePeak = std::max(queuePeak, peers.limiters.size());
+        }
+    }
+    auto queueTime = bench_clock::now() - start;
+
+    size_t bucketAccepted = 0, bucketPeak = 0;
+    start = bench_clock::now();
+    {
+        IpRateLimiter peers(PEER_QUOTA);
+        RateLimiter global(GLOBAL_QUOTA);
+        for (unsigned i = 0; i < PACKETS; i++) {
+            auto now = packetTime(i);
+            if (peers.limit(sources[i], now) and global.limit(now))
+                bucketAccepted++;
+            if (i % 1024 == 0)
+                bucketPeak = std::max(bucketPeak, peers.size());
+        }
+    }
+    auto bucketTime = bench_clock::now() - start;
+
+    auto ns = [&](bench_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / PACKETS;
+    };
+    std::cout << std::endl
+              << "Spoofed flood, " << PACKETS << " packets:" << std::endl
+              << "  timestamp queues: " << ns(queueTime) << " ns/packet, " << queueAccepted << " accepted, "
+              << queuePeak << " limiters" << std::endl
+              << "  token buckets:    " << ns(bucketTime) << " ns/packet, " << bucketAccepted << " accepted, "
+              << bucketPeak << " limiters" << std::endl;
+
+    CPPUNIT_ASSERT(bucketPeak <= IpRateLimiter::MAX_SIZE);
+    CPPUNIT_ASSERT(bucketAccepted <= PACKETS);
+}
+
+} // namespace test
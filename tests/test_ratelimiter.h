@@ -0,0 +1,46 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class RateLimiterTester : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(RateLimiterTester);
+    CPPUNIT_TEST(testQuota);
+    CPPUNIT_TEST(testRefill);
+    CPPUNIT_TEST(testUnlimited);
+    CPPUNIT_TEST(testIpLimiter);
+    CPPUNIT_TEST(testIpLimiterBoundedSize);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkSpoofedFlood);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    void testQuota();
+    void testRefill();
+    void testUnlimited();
+    void testIpLimiter();
+    void testIpLimiterBoundedSize();
+    /**
+     * Compare with the previous timestamp queue limiters under a flood of
+     * requests from spoofed source addresses
+     */
+    void testBenchmarkSpoofedFlood();
+};
+
+} // namespace test
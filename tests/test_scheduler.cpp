@@ -0,0 +1,301 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "test_scheduler.h"
+
+#include "opendht/scheduler.h"
+
+#include <iostream>
+#include <map>
+#include <random>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(SchedulerTester);
+
+using namespace dht;
+using namespace std::chrono_literals;
+
+/* Previous implementation, for comparison */
+class LegacyScheduler
+{
+public:
+    struct Job
+    {
+        Job(std::function<void()>&& f, time_point t)
+            : do_(std::move(f))
+            , t_(t)
+        {}
+        std::function<void()> do_;
+        const time_point t_;
+        void cancel() { do_ = {}; }
+    };
+
+    Sp<Job> add(time_point t, std::function<void()>&& job_func)
+    {
+        auto job = std::make_shared<Job>(std::move(job_func), t);
+        if (t != time_point::max())
+            timers.emplace(std::move(t), job);
+        return job;
+    }
+
+    void edit(Sp<Job>& job, time_point t)
+    {
+        if (not job)
+            return;
+        auto task = std::move(job->do_);
+        cancel(job);
+        job = add(t, std::move(task));
+    }
+
+    bool cancel(Sp<Job>& job)
+    {
+        if (job) {
+            job->cancel();
+            for (auto r = timers.equal_range(job->t_); r.first != r.second; ++r.first) {
+                if (r.first->second == job) {
+                    timers.erase(r.first);
+                    job.reset();
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    time_point run()
+    {
+        while (not timers.empty()) {
+            auto timer = timers.begin();
+            if (timer->first > now)
+                break;
+            auto job = std::move(timer->second);
+            timers.erase(timer);
+            if (job->do_)
+                job->do_();
+        }
+        return getNextJobTime();
+    }
+
+    time_point getNextJobTime() const { return timers.empty() ? time_point::max() : timers.begin()->first; }
+    const time_point& time() const { return now; }
+    void syncTime(const time_point& n) { now = n; }
+
+private:
+    time_point now {clock::now()};
+    std::multimap<time_point, Sp<Job>> timers {};
+};
+
+void
+SchedulerTester::setUp()
+{}
+
+void
+SchedulerTester::testOrder()
+{
+    Scheduler scheduler;
+    auto start = scheduler.time();
+    std::vector<int> order;
+    scheduler.add(start + 2h, [&] { order.emplace_back(5); });
+    scheduler.add(start + 10ms, [&] { order.emplace_back(3); });
+    scheduler.add(start + 1us, [&] { order.emplace_back(1); });
+    scheduler.add(start + 1us, [&] { order.emplace_back(2); });
+    scheduler.add(start - 1h, [&] { order.emplace_back(0); });
+    scheduler.add(start + 3s, [&] { order.emplace_back(4); });
+    scheduler.add(time_point::max(), [&] { order.emplace_back(-1); });
+
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 1, order.size());
+    CPPUNIT_ASSERT_EQUAL(0, order[0]);
+
+    scheduler.syncTime(start + 1h);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 5, order.size());
+    for (int i = 0; i < 5; i++)
+        CPPUNIT_ASSERT_EQUAL(i, order[i]);
+
+    scheduler.syncTime(start + 100 * 24h);
+    CPPUNIT_ASSERT(scheduler.run() == time_point::max());
+    CPPUNIT_ASSERT_EQUAL((size_t) 6, order.size());
+    CPPUNIT_ASSERT_EQUAL(5, order[5]);
+}
+
+void
+SchedulerTester::testCancelEdit()
+{
+    Scheduler scheduler;
+    auto start = scheduler.time();
+    unsigned a = 0, b = 0;
+    auto jobA = scheduler.add(start + 1s, [&] { a++; });
+    auto jobB = scheduler.add(start + 1s, [&] { b++; });
+
+    CPPUNIT_ASSERT(scheduler.cancel(jobA));
+    CPPUNIT_ASSERT(not jobA);
+    CPPUNIT_ASSERT(not scheduler.cancel(jobA));
+
+    scheduler.edit(jobB, start + 1min);
+    CPPUNIT_ASSERT(jobB);
+    CPPUNIT_ASSERT(jobB->t_ == start + 1min);
+
+    scheduler.syncTime(start + 2s);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL(0u, a);
+    CPPUNIT_ASSERT_EQUAL(0u, b);
+
+    scheduler.syncTime(start + 1min);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL(1u, b);
+    // already run
+    CPPUNIT_ASSERT(not scheduler.cancel(jobB));
+
+    // jobs dropped by the caller still run
+    scheduler.add(start + 2min, [&] { a++; });
+    scheduler.syncTime(start + 3min);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL(1u, a);
+}
+
+void
+SchedulerTester::testReschedule()
+{
+    Scheduler scheduler;
+    auto start = scheduler.time();
+    std::vector<int> order;
+    Sp<Scheduler::Job> other;
+    scheduler.add(start, [&] {
+        order.emplace_back(0);
+        // scheduled for now: runs before run() returns
+        scheduler.add(scheduler.time(), [&] { order.emplace_back(1); });
+        scheduler.add(scheduler.time() + 1ms, [&] { order.emplace_back(3); });
+        scheduler.cancel(other);
+    });
+    other = scheduler.add(start, [&] { order.emplace_back(2); });
+
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, order.size());
+    CPPUNIT_ASSERT_EQUAL(1, order[1]);
+
+    scheduler.syncTime(start + 1ms);
+    scheduler.run();
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, order.size());
+    CPPUNIT_ASSERT_EQUAL(3, order[2]);
+}
+
+void
+SchedulerTester::testNextJobTime()
+{
+    Scheduler scheduler;
+    auto start = scheduler.time();
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == time_point::max());
+
+    auto job = scheduler.add(start + 300ms, [] {});
+    auto next = scheduler.getNextJobTime();
+    CPPUNIT_ASSERT(next <= start + 300ms);
+
+    // following the returned times reaches the job without busy looping
+    unsigned wakeups = 0;
+    while (next != time_point::max()) {
+        CPPUNIT_ASSERT(next > scheduler.time());
+        scheduler.syncTime(next);
+        next = scheduler.run();
+        wakeups++;
+    }
+    CPPUNIT_ASSERT(scheduler.time() == start + 300ms);
+    CPPUNIT_ASSERT(wakeups <= 3);
+
+    scheduler.add(start + 305ms, [] {});
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start + 305ms);
+}
+
+void
+SchedulerTester::testRandomized()
+{
+    std::mt19937_64 rd(42);
+    std::uniform_int_distribution<int64_t> delay(-1000, 20 * 60 * 1000 * 1000ll);
+    Scheduler scheduler;
+    LegacyScheduler legacy;
+    auto start = scheduler.time();
+    legacy.syncTime(start);
+
+    std::vector<unsigned> ran, legacyRan;
+    std::vector<Sp<Scheduler::Job>> jobs;
+    std::vector<Sp<LegacyScheduler::Job>> legacyJobs;
+    auto now = start;
+    for (unsigned i = 0; i < 20000; i++) {
+        auto op = rd() % 8;
+        if (op < 5 or jobs.empty()) {
+            auto t = now + std::chrono::microseconds(delay(rd) >> (rd() % 24));
+            jobs.emplace_back(scheduler.add(t, [&ran, i] { ran.emplace_back(i); }));
+            legacyJobs.emplace_back(legacy.add(t, [&legacyRan, i] { legacyRan.emplace_back(i); }));
+        } else if (op == 5) {
+            auto j = rd() % jobs.size();
+            CPPUNIT_ASSERT_EQUAL(legacy.cancel(legacyJobs[j]), scheduler.cancel(jobs[j]));
+        } else if (op == 6) {
+            auto j = rd() % jobs.size();
+            auto t = now + std::chrono::microseconds(delay(rd) >> (rd() % 24));
+            scheduler.edit(jobs[j], t);
+            legacy.edit(legacyJobs[j], t);
+        } else {
+            now += std::chrono::microseconds(delay(rd) >> (8 + rd() % 16));
+            scheduler.syncTime(now);
+            legacy.syncTime(now);
+            auto next = scheduler.run();
+            auto legacyNext = legacy.run();
+            CPPUNIT_ASSERT(next <= legacyNext);
+            CPPUNIT_ASSERT(next > now);
+            CPPUNIT_ASSERT(ran == legacyRan);
+        }
+    }
+    now += 24h;
+    scheduler.syncTime(now);
+    legacy.syncTime(now);
+    scheduler.run();
+    legacy.run();
+    CPPUNIT_ASSERT(ran == legacyRan);
+}
+
+template<typename S>
+static double
+benchExpirations(size_t count, size_t& ran)
+{
+    std::mt19937_64 rd(42);
+    S scheduler;
+    auto start = scheduler.time();
+    std::uniform_int_distribution<int64_t> expiration(0, 10 * 60 * 1000);
+    std::vector<Sp<typename S::Job>> jobs;
+    jobs.reserve(count);
+
+    auto begin = std::chrono::steady_clock::now();
+    // values stored and their expiration scheduled
+    for (size_t i = 0; i < count; i++)
+        jobs.emplace_back(scheduler.add(start + std::chrono::milliseconds(expiration(rd)), [&ran] { ran++; }));
+    // half of the values are refreshed before they expire
+    for (size_t i = 0; i < count; i += 2)
+        scheduler.edit(jobs[i], jobs[i]->t_ + 10min);
+    // time passes
+    for (auto now = start; now < start + 21min; now += 100ms) {
+        scheduler.syncTime(now);
+        scheduler.run();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / count;
+}
+
+void
+SchedulerTester::testBenchmarkExpirations()
+{
+    constexpr size_t VALUES {1000 * 1000};
+    size_t ran {0}, legacyRan {0};
+    auto legacy_ns = benchExpirations<LegacyScheduler>(VALUES, legacyRan);
+    auto wheel_ns = benchExpirations<Scheduler>(VALUES, ran);
+    std::cout << std::endl
+              << VALUES << " value expirations: multimap " << legacy_ns << " ns/value, timing wheel " << wheel_ns
+              << " ns/value" << std::endl;
+    CPPUNIT_ASSERT_EQUAL(VALUES, legacyRan);
+    CPPUNIT_ASSERT_EQUAL(VALUES, ran);
+}
+
+void
+SchedulerTester::tearDown()
+{}
+
+} // namespace test
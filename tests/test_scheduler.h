@@ -0,0 +1,52 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class SchedulerTester : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SchedulerTester);
+    CPPUNIT_TEST(testOrder);
+    CPPUNIT_TEST(testCancelEdit);
+    CPPUNIT_TEST(testReschedule);
+    CPPUNIT_TEST(testNextJobTime);
+    CPPUNIT_TEST(testRandomized);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkExpirations);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    void testOrder();
+    void testCancelEdit();
+    /**
+     * Jobs scheduled by running jobs
+     */
+    void testReschedule();
+    void testNextJobTime();
+    /**
+     * Compare with the previous multimap scheduler under random operations
+     */
+    void testRandomized();
+    /**
+     * Compare with the previous multimap scheduler with a million pending
+     * value expirations
+     */
+    void testBenchmarkExpirations();
+};
+
+} // namespace test
@@ -0,0 +1,259 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+
+#include "test_storagebackend.h"
+
+#include "opendht/storage_backend.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(StorageBackendTester);
+
+using namespace dht;
+using namespace std::chrono_literals;
+
+static const std::string LOG_PATH {"test_storage_backend.log"};
+
+static Sp<Value>
+makeValue(Value::Id id, size_t size = 64)
+{
+    auto v = std::make_shared<Value>(std::string(size, 'a' + id % 26));
+    v->id = id;
+    return v;
+}
+
+static SockAddr
+makeIPv4(uint32_t ip)
+{
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(ip);
+    sin.sin_port = htons(4222);
+    return SockAddr((const sockaddr*) &sin, sizeof(sin));
+}
+
+static std::map<Value::Id, StorageBackend::StoredValue>
+loadAll(StorageBackend& backend, time_point now, std::map<Value::Id, Blob>& data)
+{
+    std::map<Value::Id, StorageBackend::StoredValue> ret;
+    backend.load(now, [&](const StorageBackend::StoredValue& v) {
+        data[v.id] = Blob(v.data, v.data + v.size);
+        ret.emplace(v.id, v);
+    });
+    return ret;
+}
+
+void
+StorageBackendTester::setUp()
+{
+    std::remove(LOG_PATH.c_str());
+}
+
+void
+StorageBackendTester::tearDown()
+{
+    std::remove(LOG_PATH.c_str());
+    std::remove((LOG_PATH + ".compact").c_str());
+}
+
+void
+StorageBackendTester::testReload()
+{
+    auto keyA = InfoHash::get("a");
+    auto keyB = InfoHash::get("b");
+    auto addr = makeIPv4(0x7f000002);
+    auto now = clock::now();
+    {
+        LogStorageBackend backend(LOG_PATH);
+        backend.put(keyA, *makeValue(1), now, now + 10min, addr);
+        backend.put(keyA, *makeValue(2), now, now + 10min, {});
+        backend.put(keyB, *makeValue(3), now, time_point::max(), addr);
+        backend.put(keyB, *makeValue(4), now, now + 10min, addr);
+        // replaced
+        backend.put(keyA, *makeValue(1, 128), now, now + 10min, addr);
+        backend.refresh(keyB, 4, now + 1h);
+        backend.erase(keyA, 2);
+        CPPUNIT_ASSERT_EQUAL((size_t) 3, backend.valueCount());
+        CPPUNIT_ASSERT(backend.get(keyA, 1) == makeValue(1, 128)->getPacked());
+        CPPUNIT_ASSERT(backend.get(keyA, 2).empty());
+        // not at this key
+        CPPUNIT_ASSERT(backend.get(keyA, 3).empty());
+    }
+
+    LogStorageBackend backend(LOG_PATH);
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, backend.valueCount());
+    std::map<Value::Id, Blob> data;
+    auto values = loadAll(backend, now, data);
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, values.size());
+    CPPUNIT_ASSERT(values.at(1).key == keyA);
+    CPPUNIT_ASSERT(data.at(1) == makeValue(1, 128)->getPacked());
+    CPPUNIT_ASSERT(values.at(1).from == addr);
+    CPPUNIT_ASSERT(values.at(3).expiration == time_point::max());
+    CPPUNIT_ASSERT(values.at(3).key == keyB);
+    // times are kept at the millisecond
+    CPPUNIT_ASSERT(values.at(4).expiration > now + 1h - 5ms and values.at(4).expiration < now + 1h + 5ms);
+    CPPUNIT_ASSERT(values.at(4).created > now - 5ms and values.at(4).created < now + 5ms);
+
+    // expired values are not loaded
+    values = loadAll(backend, now + 30min, data);
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, values.size());
+    CPPUNIT_ASSERT(values.count(3) and values.count(4));
+}
+
+void
+StorageBackendTester::testPartialRecord()
+{
+    auto key = InfoHash::get("key");
+    auto now = clock::now();
+    size_t size;
+    {
+        LogStorageBackend backend(LOG_PATH);
+        backend.put(key, *makeValue(1), now, now + 10min, {});
+        backend.put(key, *makeValue(2), now, now + 10min, {});
+        backend.sync();
+        size = backend.size();
+    }
+    {
+        // append the beginning of a record
+        LogStorageBackend backend(LOG_PATH);
+        backend.put(key, *makeValue(3), now, now + 10min, {});
+    }
+    {
+        std::ifstream in(LOG_PATH, std::ios::binary);
+        std::vector<char> content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        content.resize(size + (content.size() - size) / 2);
+        std::ofstream out(LOG_PATH, std::ios::binary | std::ios::trunc);
+        out.write(content.data(), content.size());
+    }
+
+    LogStorageBackend backend(LOG_PATH);
+    CPPUNIT_ASSERT_EQUAL((size_t) 2, backend.valueCount());
+    CPPUNIT_ASSERT_EQUAL(size, backend.size());
+    backend.put(key, *makeValue(4), now, now + 10min, {});
+    CPPUNIT_ASSERT(backend.get(key, 4) == makeValue(4)->getPacked());
+
+    LogStorageBackend reopened(LOG_PATH);
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, reopened.valueCount());
+    CPPUNIT_ASSERT(reopened.get(key, 2) == makeValue(2)->getPacked());
+    CPPUNIT_ASSERT(reopened.get(key, 3).empty());
+}
+
+void
+StorageBackendTester::testCompaction()
+{
+    constexpr size_t VALUES {2000};
+    auto now = clock::now();
+    std::vector<InfoHash> keys;
+    for (unsigned i = 0; i < 10; i++)
+        keys.emplace_back(InfoHash::get("key" + std::to_string(i)));
+    {
+        LogStorageBackend backend(LOG_PATH, 64 * 1024);
+        for (size_t i = 0; i < VALUES; i++)
+            backend.put(keys[i % keys.size()], *makeValue(i), now, now + (i % 2 ? 1min : 1h), {});
+        for (size_t i = 0; i < VALUES; i += 4)
+            backend.refresh(keys[i % keys.size()], i, now + 2h);
+        for (size_t i = 2; i < VALUES; i += 4)
+            backend.erase(keys[i % keys.size()], i);
+        auto size = backend.size();
+        CPPUNIT_ASSERT_EQUAL(VALUES / 4, backend.valueCount() - VALUES / 2);
+
+        // half of the values expired, a quarter was removed
+        backend.maintain(now + 10min);
+        CPPUNIT_ASSERT_EQUAL(VALUES / 4, backend.valueCount());
+        CPPUNIT_ASSERT_EQUAL((size_t) 0, backend.deadSize());
+        CPPUNIT_ASSERT(backend.size() < size / 3);
+        for (size_t i = 0; i < VALUES; i++) {
+            bool live = i % 4 == 0;
+            CPPUNIT_ASSERT_EQUAL(live, not backend.get(keys[i % keys.size()], i).empty());
+        }
+
+        // the log is still appended after compaction
+        backend.put(keys[0], *makeValue(VALUES), now, now + 1h, {});
+    }
+
+    LogStorageBackend backend(LOG_PATH);
+    CPPUNIT_ASSERT_EQUAL(VALUES / 4 + 1, backend.valueCount());
+    std::map<Value::Id, Blob> data;
+    auto values = loadAll(backend, now + 90min, data);
+    // refreshed expiration is kept
+    CPPUNIT_ASSERT_EQUAL(VALUES / 4, values.size());
+    for (const auto& v : values) {
+        CPPUNIT_ASSERT(v.second.key == keys[v.first % keys.size()]);
+        CPPUNIT_ASSERT(data.at(v.first) == makeValue(v.first)->getPacked());
+    }
+}
+
+void
+StorageBackendTester::testBenchmarkRestart()
+{
+    constexpr size_t VALUES {100 * 1000};
+    constexpr size_t KEYS {1000};
+    auto now = clock::now();
+    auto addr = makeIPv4(0x7f000002);
+    std::vector<InfoHash> keys;
+    for (size_t i = 0; i < KEYS; i++)
+        keys.emplace_back(InfoHash::get("key" + std::to_string(i)));
+
+    // state saved as a single msgpack blob, like Dht::saveState
+    msgpack::sbuffer state;
+    {
+        msgpack::packer<msgpack::sbuffer> pk(&state);
+        pk.pack_array(VALUES);
+        for (size_t i = 0; i < VALUES; i++) {
+            pk.pack_array(5);
+            pk.pack(keys[i % KEYS]);
+            pk.pack(now.time_since_epoch().count());
+            auto packed = makeValue(i)->getPacked();
+            state.write((const char*) packed.data(), packed.size());
+            pk.pack_bin(addr.getLength());
+            pk.pack_bin_body((const char*) addr.get(), addr.getLength());
+            pk.pack((now + 1h).time_since_epoch().count());
+        }
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        LogStorageBackend backend(LOG_PATH);
+        for (size_t i = 0; i < VALUES; i++)
+            backend.put(keys[i % KEYS], *makeValue(i), now, now + 1h, addr);
+        backend.sync();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    size_t loaded = 0;
+    {
+        LogStorageBackend backend(LOG_PATH);
+        backend.load(now, [&](const StorageBackend::StoredValue& v) {
+            msgpack::unpacked msg;
+            msgpack::unpack(msg, (const char*) v.data, v.size);
+            Value value(msg.get());
+            loaded += value.id == v.id;
+        });
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    size_t imported = 0;
+    {
+        msgpack::unpacked msg;
+        msgpack::unpack(msg, state.data(), state.size());
+        const auto& arr = msg.get().via.array;
+        for (unsigned i = 0; i < arr.size; i++) {
+            Value value(arr.ptr[i].via.array.ptr[2]);
+            imported += value.id == i;
+        }
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL(VALUES, loaded);
+    CPPUNIT_ASSERT_EQUAL(VALUES, imported);
+
+    auto ns = [](auto d) {
+        return std::chrono::duration<double, std::nano>(d).count() / VALUES;
+    };
+    std::cout << std::endl
+              << VALUES << " values: log write " << ns(t1 - t0) << " ns/value, log open and load " << ns(t2 - t1)
+              << " ns/value, msgpack state import " << ns(t3 - t2) << " ns/value (file not read)" << std::endl;
+}
+
+} // namespace test
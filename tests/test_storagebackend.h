@@ -0,0 +1,44 @@
+// Copyright (c) 2014-2026 Savoir-faire Linux Inc.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class StorageBackendTester : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(StorageBackendTester);
+    CPPUNIT_TEST(testReload);
+    CPPUNIT_TEST(testPartialRecord);
+    CPPUNIT_TEST(testCompaction);
+#ifdef OPENDHT_BENCHMARKS
+    CPPUNIT_TEST(testBenchmarkRestart);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    void testReload();
+    /**
+     * A record partially written when the process stopped is dropped
+     */
+    void testPartialRecord();
+    void testCompaction();
+    /**
+     * Compare restarting from the log with importing a msgpack state
+     */
+    void testBenchmarkRestart();
+};
+
+} // namespace test
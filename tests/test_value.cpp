@@ -137,4 +137,92 @@ ValueTester::testPushTypePreservedAfterEncrypt()
     CPPUNIT_ASSERT(encrypted.isEncrypted());
 }
 
+void
+ValueTester::testPackedCache()
+{
+    auto packValue = [](const dht::Value& v) {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        v.msgpack_pack(pk);
+        return dht::Blob(buffer.data(), buffer.data() + buffer.size());
+    };
+
+    dht::Value value {(const uint8_t*) "data", 4};
+    value.id = 7;
+    // checks the signature without caching the result
+    const auto& constValue = value;
+
+    // values that may still be modified are packed on each call
+    auto first = value.getPackedRef();
+    value.seq++;
+    CPPUNIT_ASSERT(*value.getPackedRef() == packValue(value));
+    CPPUNIT_ASSERT(*value.getPackedRef() != *first);
+    CPPUNIT_ASSERT(value.getPackedRef() != value.getPackedRef());
+
+    value.setImmutable();
+    auto stats = dht::Value::getPackedCacheStats();
+    auto packed = value.getPackedRef();
+    CPPUNIT_ASSERT(*packed == packValue(value));
+    CPPUNIT_ASSERT(value.getPackedRef() == packed);
+    CPPUNIT_ASSERT(value.getPacked() == *packed);
+    auto after = dht::Value::getPackedCacheStats();
+    CPPUNIT_ASSERT(after.misses >= stats.misses + 1);
+    CPPUNIT_ASSERT(after.hits >= stats.hits + 2);
+
+    // modifying methods drop the cache
+    auto key = dht::crypto::PrivateKey::generate();
+    value.sign(key);
+    CPPUNIT_ASSERT(constValue.checkSignature());
+    auto signedPacked = value.getPackedRef();
+    CPPUNIT_ASSERT(signedPacked != packed);
+    CPPUNIT_ASSERT(*signedPacked == packValue(value));
+
+    value.seq++;
+    value.invalidatePacked();
+    CPPUNIT_ASSERT(*value.getPackedRef() == packValue(value));
+    CPPUNIT_ASSERT(not constValue.checkSignature());
+
+    msgpack::unpacked msg;
+    msgpack::unpack(msg, (const char*) packed->data(), packed->size());
+    value.msgpack_unpack(msg.get());
+    CPPUNIT_ASSERT(*value.getPackedRef() == *packed);
+    CPPUNIT_ASSERT(not value.isSigned());
+
+    // moved values keep their cache
+    auto cached = value.getPackedRef();
+    dht::Value moved(std::move(value));
+    CPPUNIT_ASSERT(moved.isImmutable());
+    CPPUNIT_ASSERT(moved.getPackedRef() == cached);
+}
+
+void
+ValueTester::testSharedOwner()
+{
+    auto key = dht::crypto::PrivateKey::generate();
+    dht::Value value {(const uint8_t*) "data", 4};
+    value.sign(key);
+    auto packed = value.getPacked();
+
+    auto stats = dht::crypto::getPublicKeyCacheStats();
+    auto unpack = [&] {
+        msgpack::unpacked msg;
+        msgpack::unpack(msg, (const char*) packed.data(), packed.size());
+        return dht::Value(msg.get());
+    };
+    auto v1 = unpack();
+    auto v2 = unpack();
+    CPPUNIT_ASSERT(v1.owner and v1.owner == v2.owner);
+    CPPUNIT_ASSERT(v1.owner->getLongId() == key.getPublicKey().getLongId());
+    CPPUNIT_ASSERT(v1.checkSignature() and v2.checkSignature());
+    auto after = dht::crypto::getPublicKeyCacheStats();
+    CPPUNIT_ASSERT(after.hits >= stats.hits + 1);
+
+    // without cache, every value imports its owner
+    dht::crypto::setPublicKeyCacheSize(0);
+    auto v3 = unpack();
+    CPPUNIT_ASSERT(v3.owner != v1.owner and *v3.owner == *v1.owner);
+    CPPUNIT_ASSERT(v3.checkSignature());
+    dht::crypto::setPublicKeyCacheSize(dht::crypto::PUBLIC_KEY_CACHE_SIZE);
+}
+
 } // namespace test
@@ -16,6 +16,8 @@ class ValueTester : public CppUnit::TestFixture
     CPPUNIT_TEST(testPushTypeMsgpackRoundTrip);
     CPPUNIT_TEST(testPushTypeAbsentAfterUnpack);
     CPPUNIT_TEST(testPushTypePreservedAfterEncrypt);
+    CPPUNIT_TEST(testPackedCache);
+    CPPUNIT_TEST(testSharedOwner);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -38,6 +40,14 @@ public:
     void testPushTypeMsgpackRoundTrip();
     void testPushTypeAbsentAfterUnpack();
     void testPushTypePreservedAfterEncrypt();
+    /**
+     * Test that the packed encoding is reused until the value is modified
+     */
+    void testPackedCache();
+    /**
+     * Test that values unpacked with the same owner share its public key
+     */
+    void testSharedOwner();
 };
 
 } // namespace test
@@ -144,6 +144,7 @@ struct dht_params
     std::string devicekey {};
     std::string bundle_id {};
     std::string persist_path {};
+    std::string storage_path {};
     dht::crypto::Identity id {};
     dht::crypto::Identity proxy_id {};
     std::string privkey_pwd {};
@@ -169,6 +170,8 @@ getDhtConfig(dht_params& params)
     config.dht_config.node_config.network = params.network;
     config.dht_config.node_config.maintain_storage = false;
     config.dht_config.node_config.persist_path = params.persist_path;
+    if (not params.storage_path.empty())
+        config.dht_config.node_config.storage_backend = std::make_shared<dht::LogStorageBackend>(params.storage_path);
     config.dht_config.node_config.public_stable = params.public_stable;
     config.dht_config.id = params.id;
     config.dht_config.cert_cache_all = static_cast<bool>(params.id.first);
@@ -240,6 +243,7 @@ static const constexpr struct option long_options[] = {
     {"no-rate-limit",          no_argument,       nullptr, 'U'},
     {"public-stable",          no_argument,       nullptr, 'P'},
     {"persist",                required_argument, nullptr, 'f'},
+    {"storage",                required_argument, nullptr, 'T'},
     {"logfile",                required_argument, nullptr, 'l'},
     {"syslog",                 no_argument,       nullptr, 'L'},
     {"proxyserver",            required_argument, nullptr, 'S'},
@@ -304,6 +308,9 @@ parseArgs(int argc, char** argv)
         case 'f':
             params.persist_path = optarg;
             break;
+        case 'T':
+            params.storage_path = optarg;
+            break;
         case 'n':
             params.network = strtoul(optarg, nullptr, 0);
             break;